@@ -0,0 +1,44 @@
+import gzip
+import os
+import sys
+import time
+
+# Size and time for each gzip level over a directory of pipeline caches
+# Use it alongside PSO.Upload.CompressionReport in the game to pick a level per platform
+
+if len(sys.argv) != 2:
+    print("Incorrect number of args: <PipelineDirectory>")
+    exit(-1)
+
+PipelineDirectory = sys.argv[1]
+
+contents = []
+for r, d, p in os.walk(PipelineDirectory):
+    for f in p:
+        fname, fext = os.path.splitext(f)
+        if fext == ".shk" or fext == ".upipelinecache":
+            with open(os.path.join(r, f), "rb") as fh:
+                contents.append(fh.read())
+
+totalSize = sum(len(c) for c in contents)
+if totalSize == 0:
+    print("No Files")
+    exit(0)
+
+totalMB = totalSize / (1024 * 1024)
+print("{} files, {:.2f} MB".format(len(contents), totalMB))
+print("Level  Size MB  Ratio  Compress MB/s  Decompress MB/s")
+
+for level in range(1, 10):
+    start = time.time()
+    compressed = [gzip.compress(c, compresslevel=level) for c in contents]
+    compressTime = max(time.time() - start, 1e-6)
+
+    start = time.time()
+    for c in compressed:
+        gzip.decompress(c)
+    decompressTime = max(time.time() - start, 1e-6)
+
+    size = sum(len(c) for c in compressed)
+    print("{:5}  {:7.2f}  {:4.1f}%  {:12.1f}  {:15.1f}".format(
+        level, size / (1024 * 1024), 100.0 * size / totalSize, totalMB / compressTime, totalMB / decompressTime))
@@ -1,3 +1,4 @@
+import hashlib
 import os
 import sys
 import shutil
@@ -8,8 +9,8 @@ PlatformConversion = {
     "PCD3D_SM6" : "Windows"
 }
 
-if len(sys.argv) != 6:
-    print("Incorrect number of args: <ExePath> <ProjectName> <Platform> <PipelineDirectory> <OutDirectory>")
+if len(sys.argv) != 6 and len(sys.argv) != 7:
+    print("Incorrect number of args: <ExePath> <ProjectName> <Platform> <PipelineDirectory> <OutDirectory> [<MergeTool>]")
 
 ExePath = sys.argv[1]
 ProjectName = sys.argv[2]
@@ -17,6 +18,26 @@ Platform = sys.argv[3]
 PipelineDirectory = sys.argv[4]
 OutDirectory = sys.argv[5]
 
+# Optional PSOCacheMerge from BuildScripts/PSOCacheTools
+# Dedupes everything the fleet sent before Expand sees it, so Expand only parses each PSO and key file once
+MergeTool = sys.argv[6] if len(sys.argv) == 7 else None
+
+# Same window PullData.py pulls. Older files and the PSOs only they had drop out of the merge
+MaxAgeDays = 14
+
+
+def Fingerprint(paths):
+    """Everything Expand's result depends on, by path, size and write time"""
+    digest = hashlib.sha256()
+    for path in paths:
+        if os.path.exists(path):
+            stat = os.stat(path)
+            digest.update("{}|{}|{}\n".format(os.path.abspath(path), stat.st_size, stat.st_mtime_ns).encode("utf-8"))
+        else:
+            digest.update("{}|missing\n".format(os.path.abspath(path)).encode("utf-8"))
+    return digest.hexdigest()
+
+
 ProjectDeviceProfile = Platform
 
 if Platform in PlatformConversion:
@@ -44,6 +65,20 @@ if os.path.exists(FullPath):
         if not os.path.exists(SpecificPipelineDirectory):
             os.makedirs(SpecificPipelineDirectory)
 
+        if MergeTool:
+            MergedDirectory = os.path.join(os.path.join(OutDirectory, "Intermediate"), "PSOMerge")
+            # Kept between builds. Only files pulled since the last build get read
+            MergeCommand = [os.path.abspath(MergeTool), PipelineDirectory, MergedDirectory, "--name", ProjectName, "--platform", Platform, "--incremental", "--max-age-days", str(MaxAgeDays)]
+            print("Executing '{}'".format(' '.join(MergeCommand)))
+
+            mergeVal = subprocess.run(MergeCommand)
+            if mergeVal.returncode != 0:
+                exit(mergeVal.returncode)
+
+            SpecificPipelineDirectory = os.path.join(MergedDirectory, Platform)
+            if not os.path.exists(SpecificPipelineDirectory):
+                os.makedirs(SpecificPipelineDirectory)
+
         # For the pipeline cache
         # confirm we *actually* have files
         psoFiles = []
@@ -64,6 +99,24 @@ if os.path.exists(FullPath):
             ResultFilename = "{}_{}.spc".format(ProjectName, Platform)
             ResultName = os.path.join(WritebackLocation, ResultFilename)
 
+            # Nothing new since the last build. Inputs, and the tools and project version that turned them into the .spc
+            # Engine/Binaries/<Platform>/<Exe> -> Engine/Build/Build.version
+            EngineVersionFile = os.path.join(os.path.dirname(os.path.dirname(os.path.dirname(FullPath))), "Build", "Build.version")
+            ProjectVersionFile = os.path.join(OutDirectory, "Config", "DefaultGame.ini")
+            toolFiles = [FullPath, EngineVersionFile, ProjectFile, ProjectVersionFile] + ([os.path.abspath(MergeTool)] if MergeTool else [])
+
+            fingerprint = Fingerprint(sorted(psoFiles + shkFiles) + toolFiles)
+            # Kept out of the staged PipelineCaches directory
+            FingerprintDirectory = os.path.join(OutDirectory, "Intermediate")
+            if not os.path.exists(FingerprintDirectory):
+                os.makedirs(FingerprintDirectory)
+            FingerprintName = os.path.join(FingerprintDirectory, ResultFilename + ".fingerprint")
+            if os.path.exists(ResultName) and os.path.exists(FingerprintName):
+                with open(FingerprintName, "r") as f:
+                    if f.read().strip() == fingerprint:
+                        print("{} is up to date".format(ResultName))
+                        exit(0)
+
             Command.append(os.path.join(SpecificPipelineDirectory, "*.upipelinecache"))
             Command.append(os.path.join(SpecificPipelineDirectory, "*.shk"))
             Command.append(ResultName)
@@ -73,6 +126,12 @@ if os.path.exists(FullPath):
 
             # DANGER
             retVal = subprocess.run(Command)
+
+            # Only once Expand has succeeded, so a failed build is tried again
+            if retVal.returncode == 0:
+                with open(FingerprintName, "w") as f:
+                    f.write(fingerprint)
+
             exit(retVal.returncode)
             #os.system(CommandString)
 
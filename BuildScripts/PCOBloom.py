@@ -0,0 +1,89 @@
+import math
+import struct
+import time
+
+# Known-PSO filter served by /api/pco/known/ as application/x-pco-bloom
+# Matches FPSOKnownFilter in Source/UnrealPSOPlugin/Public/PSOKnownFilter.h
+#
+# Keys are the uint32 PSO hashes from the .upipelinecache table of contents. From
+# version 2 each PSO also has a key per bit set in its usage mask, so clients
+# still send PSOs the server has only seen in other levels or zones
+#
+# The seed is taken from an epoch that changes with every build. A fixed seed
+# would give every client the same false positives, and those PSOs would
+# never be uploaded by anyone
+
+ContentType = "application/x-pco-bloom"
+
+Magic = b"PCBF"
+Version = 2
+
+Mask64 = (1 << 64) - 1
+
+
+def SplitMix64(value):
+    value = (value + 0x9E3779B97F4A7C15) & Mask64
+    value = ((value ^ (value >> 30)) * 0xBF58476D1CE4E5B9) & Mask64
+    value = ((value ^ (value >> 27)) * 0x94D049BB133111EB) & Mask64
+    return value ^ (value >> 31)
+
+
+def UsageKeys(usageMask):
+    """0 for the PSO itself, then mask bit + 1 for every bit set"""
+    yield 0
+    for bit in range(64):
+        if usageMask & (1 << bit):
+            yield bit + 1
+
+
+def Probes(key, usageKey, seed, numHashes, numBits):
+    x = SplitMix64((((seed << 32) | (key & 0xFFFFFFFF)) ^ (usageKey << 56)) & Mask64)
+    h1 = x & 0xFFFFFFFF
+    h2 = (x >> 32) | 1
+    for i in range(numHashes):
+        yield ((h1 + i * h2) & Mask64) % numBits
+
+
+def SeedForEpoch(epoch):
+    return SplitMix64(epoch & Mask64) & 0xFFFFFFFF
+
+
+def Build(psos, falsePositiveRate=0.01, epoch=None):
+    """Build a filter for psos, (PSO hash, usage mask) pairs. Returns the serialised filter
+
+    Masks for the same PSO should be ORed together first, as the merged caches do
+    epoch should change every build, e.g. the build time or a counter. Defaults to the time in nanoseconds
+    """
+    if epoch is None:
+        epoch = time.time_ns()
+    seed = SeedForEpoch(epoch)
+
+    keys = [(key, usageKey) for key, usageMask in psos for usageKey in UsageKeys(usageMask)]
+    count = max(len(keys), 1)
+
+    numBits = max(64, int(math.ceil(-count * math.log(falsePositiveRate) / (math.log(2) ** 2))))
+    numHashes = max(1, min(255, int(round(numBits / count * math.log(2)))))
+
+    bits = bytearray((numBits + 7) // 8)
+    for key, usageKey in keys:
+        for bit in Probes(key, usageKey, seed, numHashes, numBits):
+            bits[bit >> 3] |= 1 << (bit & 7)
+
+    return Magic + struct.pack("<HBBIQ", Version, numHashes, 0, seed, numBits) + bytes(bits)
+
+
+def MayContain(data, key, usageMask=0):
+    """Whether key was added with every bit in usageMask"""
+    if data[:4] != Magic:
+        raise ValueError("Not a PCO bloom filter")
+
+    version, numHashes, reserved, seed, numBits = struct.unpack_from("<HBBIQ", data, 4)
+    if version < 2 and usageMask:
+        return False
+
+    bits = data[20:]
+    return all(
+        bits[bit >> 3] & (1 << (bit & 7))
+        for usageKey in UsageKeys(usageMask)
+        for bit in Probes(key, usageKey, seed, numHashes, numBits)
+    )
@@ -0,0 +1,81 @@
+import gzip
+import struct
+
+# Binary envelope used by /api/pco/ as application/x-pco-binary
+# Matches PSOUploadEnvelope in Source/UnrealPSOPlugin/Public/PSOUploadQueue.h
+#
+#   char[4] Magic ("PCOB")
+#   uint16  Version
+#   uint16  Flags (FlagGzip: payload is a gzip stream)
+#   6 x { uint16 Length, UTF-8 bytes } machine, project, version, shadertype, platform, shadermodel
+#   uint64  PayloadLength
+#   uint8   Payload[PayloadLength]
+
+ContentType = "application/x-pco-binary"
+
+Magic = b"PCOB"
+Version = 1
+
+FlagGzip = 0x1
+
+Fields = ["machine", "project", "version", "shadertype", "platform", "shadermodel"]
+
+
+def _ReadExact(stream, size):
+    data = stream.read(size)
+    if len(data) != size:
+        raise EOFError("Truncated PCO envelope")
+    return data
+
+
+def Encode(fields, payload, flags=0):
+    out = bytearray(Magic)
+    out += struct.pack("<HH", Version, flags)
+
+    for name in Fields:
+        value = fields.get(name, "").encode("utf-8")
+        out += struct.pack("<H", len(value))
+        out += value
+
+    out += struct.pack("<Q", len(payload))
+    out += payload
+    return bytes(out)
+
+
+def ReadHeader(stream):
+    """Read one envelope header. Returns (fields, flags, payloadLength) or None at end of stream"""
+    magic = stream.read(4)
+    if len(magic) == 0:
+        return None
+    if magic != Magic:
+        raise ValueError("Not a PCO envelope")
+
+    version, flags = struct.unpack("<HH", _ReadExact(stream, 4))
+    if version > Version:
+        raise ValueError("Unsupported PCO envelope version {}".format(version))
+
+    fields = {}
+    for name in Fields:
+        (length,) = struct.unpack("<H", _ReadExact(stream, 2))
+        fields[name] = _ReadExact(stream, length).decode("utf-8")
+
+    (payloadLength,) = struct.unpack("<Q", _ReadExact(stream, 8))
+    return fields, flags, payloadLength
+
+
+def UnpackPayload(flags, payload):
+    """Undo any per-payload encoding named in flags"""
+    if flags & FlagGzip:
+        return gzip.decompress(payload)
+    return payload
+
+
+def Decode(stream):
+    """Yield (fields, flags, payload) for each envelope in a stream"""
+    while True:
+        header = ReadHeader(stream)
+        if header is None:
+            return
+
+        fields, flags, payloadLength = header
+        yield fields, flags, _ReadExact(stream, payloadLength)
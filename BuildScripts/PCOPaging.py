@@ -0,0 +1,23 @@
+# Paging for /api/pco/date/after/
+#
+# The request body gains three optional fields:
+#   "before"   Upper bound on upload date. Leave out on the first page and the server picks one,
+#              then send it back with every other page so they all come from the same snapshot
+#   "page"     Zero based page to return
+#   "pagesize" Items per page. The server may use less
+#
+# The body of each page is the same as an unpaged reply, a JSON list or a stream of PCO envelopes.
+# Paging details come back in headers, so servers that don't page just return everything at once:
+#   X-PCO-Before    The snapshot this page was taken from
+#   X-PCO-Pages     Pages in the snapshot
+#   X-PCO-PageSize  Items per page the server actually used
+
+HeaderBefore = "X-PCO-Before"
+HeaderPages = "X-PCO-Pages"
+HeaderPageSize = "X-PCO-PageSize"
+
+DefaultPageSize = 64
+
+
+def PageCount(numItems, pageSize):
+    return max(1, (numItems + pageSize - 1) // pageSize)
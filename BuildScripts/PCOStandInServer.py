@@ -0,0 +1,191 @@
+import base64
+import datetime
+import gzip
+import http.server
+import json
+import os
+import sys
+import threading
+
+import PCOEnvelope
+import PCOPaging
+
+# Local stand-in for /api/pco/date/after/, for trying PullData.py without the real server
+#
+#   PCOStandInServer.py <DataDirectory> [--port <N>] [--json] [--no-paging] [--max-page-size <N>]
+#                       [--truncate-every <N>] [--stop-after <N>]
+#
+# DataDirectory holds pipelinecache/, shk/ and hitchlist/, one file per upload. A file's modification time is its
+# upload date
+#
+#   --json               Reply with the JSON list even when the client accepts PCO envelopes
+#   --no-paging          Ignore paging and send everything at once, like an older server
+#   --truncate-every N   Cut every Nth page short, to exercise retries
+#   --stop-after N       Exit after N pages, to exercise resuming
+#
+# Then: PullData.py <Platform> <ShaderModel> <OutDirectory> <MachineCreds> <ProjectCreds> http://127.0.0.1:<port>
+
+Version = ("1", "0", "0", "0")
+
+# Field each type's data is sent in by the JSON reply
+JsonFields = {
+    "pipelinecache": "pipelinecachedata",
+    "shk": "stablekeyinfodata",
+    "hitchlist": "hitchlistdata"
+}
+
+Options = {
+    "port": 8000,
+    "json": False,
+    "paging": True,
+    "maxpagesize": 1024,
+    "truncateevery": 0,
+    "stopafter": 0
+}
+
+requestCount = 0
+requestLock = threading.Lock()
+
+
+def Uploads(dataType, after, before):
+    """(date, path) for each upload of dataType in (after, before], oldest first"""
+    directory = os.path.join(DataDirectory, dataType)
+    if not os.path.isdir(directory):
+        return []
+
+    uploads = []
+    for name in sorted(os.listdir(directory)):
+        path = os.path.join(directory, name)
+        date = str(datetime.datetime.fromtimestamp(os.path.getmtime(path)))
+        if after < date <= before:
+            uploads.append((date, path))
+
+    uploads.sort()
+    return uploads
+
+
+def EncodeJson(dataType, request, paths):
+    items = []
+    for path in paths:
+        with open(path, "rb") as f:
+            data = f.read()
+
+        item = {
+            "versionmajor": Version[0],
+            "versionminor": Version[1],
+            "versionrevision": Version[2],
+            "versionbuild": Version[3],
+        }
+        item[JsonFields[dataType]] = base64.b64encode(data).decode("ascii")
+        items.append(item)
+
+    return json.dumps(items).encode("utf-8")
+
+
+def EncodeEnvelopes(dataType, request, paths):
+    out = bytearray()
+    for path in paths:
+        with open(path, "rb") as f:
+            data = f.read()
+
+        fields = {
+            "machine": "",
+            "project": request.get("project", ""),
+            "version": ".".join(Version),
+            "shadertype": dataType,
+            "platform": request.get("platform", ""),
+            "shadermodel": request.get("shadermodel", "")
+        }
+        out += PCOEnvelope.Encode(fields, data)
+
+    return bytes(out)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def do_POST(self):
+        global requestCount
+
+        if self.path.rstrip("/") != "/api/pco/date/after":
+            self.send_error(404)
+            return
+
+        length = int(self.headers.get("Content-Length", "0"))
+        request = json.loads(self.rfile.read(length) or b"{}")
+
+        dataType = request.get("type", "")
+        if dataType not in JsonFields:
+            self.send_error(400)
+            return
+
+        before = request.get("before") or str(datetime.datetime.now())
+        uploads = [path for date, path in Uploads(dataType, request.get("date", ""), before)]
+
+        headers = {}
+        if Options["paging"] and "page" in request:
+            pageSize = max(1, min(int(request.get("pagesize", PCOPaging.DefaultPageSize)), Options["maxpagesize"]))
+            page = int(request["page"])
+
+            headers[PCOPaging.HeaderBefore] = before
+            headers[PCOPaging.HeaderPages] = str(PCOPaging.PageCount(len(uploads), pageSize))
+            headers[PCOPaging.HeaderPageSize] = str(pageSize)
+            uploads = uploads[page * pageSize:(page + 1) * pageSize]
+
+        accept = self.headers.get("Accept", "")
+        if PCOEnvelope.ContentType in accept and not Options["json"]:
+            contentType = PCOEnvelope.ContentType
+            body = EncodeEnvelopes(dataType, request, uploads)
+        else:
+            contentType = "application/json"
+            body = EncodeJson(dataType, request, uploads)
+
+        if "gzip" in self.headers.get("Accept-Encoding", ""):
+            body = gzip.compress(body)
+            headers["Content-Encoding"] = "gzip"
+
+        with requestLock:
+            requestCount += 1
+            count = requestCount
+
+        self.send_response(200)
+        self.send_header("Content-Type", contentType)
+        self.send_header("Content-Length", str(len(body)))
+        for name, value in headers.items():
+            self.send_header(name, value)
+        self.end_headers()
+
+        if Options["truncateevery"] > 0 and count % Options["truncateevery"] == 0:
+            print("Truncating request {}".format(count))
+            self.wfile.write(body[:len(body) // 2])
+            self.close_connection = True
+            return
+
+        self.wfile.write(body)
+
+        if Options["stopafter"] > 0 and count >= Options["stopafter"]:
+            print("Stopping after {} requests".format(count))
+            self.wfile.flush()
+            os._exit(0)
+
+
+if len(sys.argv) < 2:
+    print("Incorrect number of args: <DataDirectory> [--port <N>] [--json] [--no-paging] [--max-page-size <N>] [--truncate-every <N>] [--stop-after <N>]")
+    exit(-1)
+
+DataDirectory = sys.argv[1]
+
+args = sys.argv[2:]
+while args:
+    arg = args.pop(0)
+    if arg == "--json":
+        Options["json"] = True
+    elif arg == "--no-paging":
+        Options["paging"] = False
+    elif arg in ("--port", "--max-page-size", "--truncate-every", "--stop-after") and args:
+        Options[arg.lstrip("-").replace("-", "")] = int(args.pop(0))
+    else:
+        print("Unknown argument {}".format(arg))
+        exit(-1)
+
+server = http.server.ThreadingHTTPServer(("127.0.0.1", Options["port"]), Handler)
+print("Serving {} on http://127.0.0.1:{}".format(DataDirectory, Options["port"]))
+server.serve_forever()
@@ -0,0 +1,116 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+// Print what's in pipeline cache and stable key files, without an engine
+//
+//   PSOCacheDump [--entries] <file> [<file> ...]
+
+#include "PSOCacheReader.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using namespace PSOCacheTools;
+
+namespace
+{
+bool EndsWith(const std::string &Value, const char *Suffix)
+{
+    const size_t Length = std::strlen(Suffix);
+    return Value.size() >= Length && 0 == Value.compare(Value.size() - Length, Length, Suffix);
+}
+
+bool DumpPipelineCache(const std::string &Path, bool bEntries)
+{
+    const auto Start = std::chrono::steady_clock::now();
+
+    FPipelineCacheReader Reader;
+    if (!Reader.Open(Path))
+    {
+        std::fprintf(stderr, "%s: %s\n", Path.c_str(), Reader.GetError().c_str());
+        return false;
+    }
+
+    const auto &Header = Reader.GetHeader();
+    std::printf("%s\n", Path.c_str());
+    std::printf("  version %u, game version %u, platform %u, guid %s\n", Header.Version, Header.GameVersion,
+                Header.ShaderPlatform, Header.Guid.ToString().c_str());
+    std::printf("  %d entries, sort order %u, %zu bytes\n", Reader.GetNumEntries(), Reader.GetSortedOrder(),
+                Reader.GetSize());
+
+    int64_t TotalCreates = 0;
+    int64_t NumUsed = 0;
+    uint64_t TotalShaders = 0;
+    uint64_t UsageUnion = 0;
+
+    FPipelineCacheEntry Entry;
+    for (auto It = Reader.CreateIterator(); It.Next(Entry);)
+    {
+        TotalCreates += Entry.Stats.CreateCount;
+        NumUsed += Entry.Stats.FirstFrameUsed >= 0 ? 1 : 0;
+        TotalShaders += Entry.NumShaders;
+        UsageUnion |= Entry.UsageMask;
+
+        if (bEntries)
+        {
+            std::printf("  %08X mask %016" PRIx64 " first %" PRId64 " count %" PRId64 " shaders %u\n", Entry.PSOHash,
+                        Entry.UsageMask, Entry.Stats.FirstFrameUsed, Entry.Stats.CreateCount, Entry.NumShaders);
+        }
+    }
+
+    if (!Reader.GetError().empty())
+    {
+        std::fprintf(stderr, "%s: %s\n", Path.c_str(), Reader.GetError().c_str());
+        return false;
+    }
+
+    const double Ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+    std::printf("  %" PRId64 " used, %" PRId64 " creates, %" PRIu64 " shader refs, usage mask union %016" PRIx64 "\n",
+                NumUsed, TotalCreates, TotalShaders, UsageUnion);
+    std::printf("  read in %.2f ms\n", Ms);
+    return true;
+}
+
+bool DumpStableKeys(const std::string &Path)
+{
+    FStableKeysReader Reader;
+    if (!Reader.Open(Path))
+    {
+        std::fprintf(stderr, "%s\n", Reader.GetError().c_str());
+        return false;
+    }
+
+    std::printf("%s\n  %zu bytes, hash %016" PRIx64 "\n", Path.c_str(), Reader.GetSize(), Reader.Hash());
+    return true;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    bool bEntries = false;
+    bool bSuccess = true;
+    int NumFiles = 0;
+
+    for (int Index = 1; Index < argc; ++Index)
+    {
+        const std::string Arg = argv[Index];
+        if ("--entries" == Arg)
+        {
+            bEntries = true;
+            continue;
+        }
+
+        ++NumFiles;
+        bSuccess &= EndsWith(Arg, ".shk") ? DumpStableKeys(Arg) : DumpPipelineCache(Arg, bEntries);
+    }
+
+    if (0 == NumFiles)
+    {
+        std::fprintf(stderr, "Usage: %s [--entries] <file.upipelinecache|file.shk> ...\n", argv[0]);
+        return 2;
+    }
+
+    return bSuccess ? 0 : 1;
+}
@@ -0,0 +1,282 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+// Merge fleet-collected caches ahead of ShaderPipelineCacheTools Expand
+//
+//   PSOCacheMerge <InDir> <OutDir> [--name <Project>] [--platform <Platform>]... [--threads <N>] [--incremental]
+//                 [--max-age-days <N>]
+//   PSOCacheMerge --bench [--dir <ScratchDir>] [--threads <N>] [--max-entries <N>]
+//
+// InDir is laid out as PullData.py leaves it, one directory per platform. PSOs named in its hitch lists go first
+// --incremental keeps OutDir between runs and only reads inputs it hasn't merged before
+// --max-age-days leaves out inputs written more than N days ago, and the PSOs only they had
+
+#include "PSOCacheMerger.h"
+#include "PSOCacheReader.h"
+#include "PSOCacheWriter.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace PSOCacheTools;
+
+namespace
+{
+void PrintStats(const FMergeStats &Stats)
+{
+    std::printf("  caches   %zu in (%zu skipped), %zu PSOs in, %zu PSOs out\n", Stats.NumCaches,
+                Stats.NumCachesSkipped, Stats.NumEntriesIn, Stats.NumEntriesOut);
+    std::printf("  keys     %zu in, %zu out\n", Stats.NumKeyFilesIn, Stats.NumKeyFilesOut);
+    std::printf("  hitches  %zu lists, %zu PSOs put first\n", Stats.NumHitchListsIn, Stats.NumEntriesPrioritised);
+    std::printf("  skipped  %zu inputs already merged, %zu platforms up to date, %zu platforms rebuilt\n",
+                Stats.NumInputsAlreadyMerged, Stats.NumPlatformsUpToDate, Stats.NumPlatformsRebuilt);
+    std::printf("  expired  %zu inputs, %zu PSOs\n", Stats.NumInputsExpired, Stats.NumEntriesExpired);
+    std::printf("  bytes    %.1f MB in, %.1f MB out\n", static_cast<double>(Stats.BytesIn) / 1048576.0,
+                static_cast<double>(Stats.BytesOut) / 1048576.0);
+    std::printf("  time     read %.1f ms, merge %.1f ms, write %.1f ms\n", Stats.ReadSeconds * 1000.0,
+                Stats.MergeSeconds * 1000.0, Stats.WriteSeconds * 1000.0);
+}
+
+//
+// Benchmark
+//
+
+constexpr int BenchPlatforms = 2;
+constexpr int BenchFilesPerPlatform = 8;
+constexpr size_t BenchDescriptorSize = 128;
+constexpr uint32_t BenchShadersPerPSO = 3;
+
+/**
+ * Write one synthetic cache. Half of each file's PSOs come from a pool every
+ * file shares, like the common PSOs every machine records
+ */
+bool WriteSyntheticCache(const std::string &Path, uint32_t Seed, size_t NumEntries)
+{
+    constexpr size_t ShaderBytes = BenchShadersPerPSO * PipelineCacheFormat::ShaderHashSize;
+
+    std::mt19937 Random(Seed);
+    std::vector<uint8_t> Descriptor(BenchDescriptorSize);
+
+    // The writer reads shader hashes at Close, so they all have to stay around until then
+    std::vector<uint8_t> Shaders(NumEntries * ShaderBytes);
+    for (auto &Byte : Shaders)
+    {
+        Byte = static_cast<uint8_t>(Random());
+    }
+
+    FPipelineCacheHeader Header;
+    Header.Version = PipelineCacheFormat::Latest;
+    Header.GameVersion = 1;
+    Header.Guid = {Seed, 1, 2, 3};
+
+    FPipelineCacheWriter Writer;
+    if (!Writer.Open(Path, Header))
+    {
+        std::fprintf(stderr, "%s\n", Writer.GetError().c_str());
+        return false;
+    }
+
+    for (size_t Index = 0; Index < NumEntries; ++Index)
+    {
+        // Shared pool keys count up from 0. Per-file keys are random, so the two rarely meet
+        const bool bShared = Index % 2 == 0;
+        const uint32_t Key =
+            bShared ? static_cast<uint32_t>(Index / 2) : (static_cast<uint32_t>(Random()) | 0x80000000u);
+
+        for (size_t Byte = 0; Byte < Descriptor.size(); ++Byte)
+        {
+            Descriptor[Byte] = static_cast<uint8_t>(Key * 31 + Byte);
+        }
+
+        FPipelineCacheEntry Entry;
+        Entry.PSOHash = Key;
+        Entry.FileSize = Descriptor.size();
+        Entry.Descriptor = Descriptor.data();
+        Entry.Stats.FirstFrameUsed = static_cast<int64_t>(Random() % 100000);
+        Entry.Stats.LastFrameUsed = Entry.Stats.FirstFrameUsed + 10;
+        Entry.Stats.CreateCount = 1;
+        Entry.Stats.PSOHash = Key;
+        Entry.UsageMask = uint64_t(1) << (Random() % 64);
+        Entry.ShaderHashes = Shaders.data() + Index * ShaderBytes;
+        Entry.NumShaders = BenchShadersPerPSO;
+
+        if (!Writer.AddEntry(Entry))
+        {
+            std::fprintf(stderr, "%s\n", Writer.GetError().c_str());
+            return false;
+        }
+    }
+
+    if (!Writer.Close(0))
+    {
+        std::fprintf(stderr, "%s\n", Writer.GetError().c_str());
+        return false;
+    }
+    return true;
+}
+
+int RunBenchmark(const std::string &ScratchDir, unsigned Threads, size_t MaxEntries)
+{
+    const fs::path Root = fs::path(ScratchDir) / "PSOCacheMergeBench";
+
+    std::printf("%d platforms x %d caches each, half of every cache shared\n\n", BenchPlatforms,
+                BenchFilesPerPlatform);
+    std::printf("%12s %12s %12s %10s %8s %12s %12s %10s\n", "PSOs/cache", "PSOs in", "PSOs out", "MB in", "threads",
+                "total ms", "PSOs/s", "speedup");
+
+    for (size_t NumEntries = 1000; NumEntries <= MaxEntries; NumEntries *= 10)
+    {
+        std::error_code ErrorCode;
+        fs::remove_all(Root, ErrorCode);
+
+        for (int Platform = 0; Platform < BenchPlatforms; ++Platform)
+        {
+            const fs::path PlatformDir = Root / "In" / ("SP_BENCH_" + std::to_string(Platform));
+            fs::create_directories(PlatformDir);
+
+            for (int File = 0; File < BenchFilesPerPlatform; ++File)
+            {
+                const auto Path = PlatformDir / ("Machine" + std::to_string(File) + ".rec.upipelinecache");
+                if (!WriteSyntheticCache(Path.string(), uint32_t(Platform * 1000 + File), NumEntries))
+                {
+                    return 1;
+                }
+            }
+        }
+
+        const auto Inputs = FPSOCacheMerger::FindInputs((Root / "In").string(), {});
+
+        double SerialSeconds = 0.0;
+        for (const unsigned RunThreads : {1u, Threads})
+        {
+            FPSOCacheMerger Merger(RunThreads);
+            FMergeStats Stats;
+            if (!Merger.Merge(Inputs, (Root / "Out").string(), "Bench", Stats))
+            {
+                std::fprintf(stderr, "%s\n", Merger.GetError().c_str());
+                return 1;
+            }
+
+            const double Seconds = Stats.ReadSeconds + Stats.MergeSeconds + Stats.WriteSeconds;
+            if (1u == RunThreads)
+            {
+                SerialSeconds = Seconds;
+            }
+
+            std::printf("%12zu %12zu %12zu %10.1f %8u %12.1f %12.0f %9.2fx\n", NumEntries, Stats.NumEntriesIn,
+                        Stats.NumEntriesOut, static_cast<double>(Stats.BytesIn) / 1048576.0, Merger.GetThreads(),
+                        Seconds * 1000.0, static_cast<double>(Stats.NumEntriesIn) / Seconds, SerialSeconds / Seconds);
+
+            if (RunThreads == Threads)
+            {
+                break;
+            }
+        }
+    }
+
+    std::error_code ErrorCode;
+    fs::remove_all(Root, ErrorCode);
+    return 0;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> Positional;
+    std::vector<std::string> Platforms;
+    std::string Name = "Merged";
+    std::string ScratchDir = fs::temp_directory_path().string();
+    unsigned Threads = 0;
+    size_t MaxEntries = 100000;
+    bool bBench = false;
+    bool bIncremental = false;
+    unsigned MaxAgeDays = 0;
+
+    for (int Index = 1; Index < argc; ++Index)
+    {
+        const std::string Arg = argv[Index];
+        const bool bHasValue = Index + 1 < argc;
+
+        if ("--bench" == Arg)
+        {
+            bBench = true;
+        }
+        else if ("--incremental" == Arg)
+        {
+            bIncremental = true;
+        }
+        else if ("--name" == Arg && bHasValue)
+        {
+            Name = argv[++Index];
+        }
+        else if ("--platform" == Arg && bHasValue)
+        {
+            Platforms.push_back(argv[++Index]);
+        }
+        else if ("--threads" == Arg && bHasValue)
+        {
+            Threads = static_cast<unsigned>(std::strtoul(argv[++Index], nullptr, 10));
+        }
+        else if ("--max-age-days" == Arg && bHasValue)
+        {
+            MaxAgeDays = static_cast<unsigned>(std::strtoul(argv[++Index], nullptr, 10));
+        }
+        else if ("--dir" == Arg && bHasValue)
+        {
+            ScratchDir = argv[++Index];
+        }
+        else if ("--max-entries" == Arg && bHasValue)
+        {
+            MaxEntries = static_cast<size_t>(std::strtoull(argv[++Index], nullptr, 10));
+        }
+        else
+        {
+            Positional.push_back(Arg);
+        }
+    }
+
+    if (bBench)
+    {
+        return RunBenchmark(ScratchDir, FPSOCacheMerger(Threads).GetThreads(), MaxEntries);
+    }
+
+    if (Positional.size() != 2)
+    {
+        std::fprintf(stderr,
+                     "Usage: %s <InDir> <OutDir> [--name <Project>] [--platform <Platform>]... [--threads <N>] [--incremental]\n"
+                     "       %*s [--max-age-days <N>]\n"
+                     "       %s --bench [--dir <ScratchDir>] [--threads <N>] [--max-entries <N>]\n",
+                     argv[0], static_cast<int>(std::strlen(argv[0])), "", argv[0]);
+        return 2;
+    }
+
+    const auto Inputs = FPSOCacheMerger::FindInputs(Positional[0], Platforms);
+    if (Inputs.empty())
+    {
+        std::printf("No Files\n");
+        return 0;
+    }
+
+    FPSOCacheMerger Merger(Threads);
+    Merger.SetIncremental(bIncremental);
+    Merger.SetMaxAge(std::chrono::hours(24) * MaxAgeDays);
+
+    FMergeStats Stats;
+    const bool bMerged = Merger.Merge(Inputs, Positional[1], Name, Stats);
+
+    std::printf("Merged %zu platforms on %u threads\n", Inputs.size(), Merger.GetThreads());
+    PrintStats(Stats);
+
+    if (!bMerged)
+    {
+        std::fprintf(stderr, "%s\n", Merger.GetError().c_str());
+        return 1;
+    }
+    return 0;
+}
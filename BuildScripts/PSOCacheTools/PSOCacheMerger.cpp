@@ -0,0 +1,855 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCacheMerger.h"
+
+#include "PSOCacheReader.h"
+#include "PSOCacheWriter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+namespace PSOCacheTools
+{
+
+namespace
+{
+// FPipelineFileCacheManager::PSOOrder::FirstToLatestUsed
+constexpr uint32_t FirstToLatestUsed = 1;
+
+using FClock = std::chrono::steady_clock;
+
+double SecondsSince(FClock::time_point Start)
+{
+    return std::chrono::duration<double>(FClock::now() - Start).count();
+}
+
+/** Run Body(0..Count-1) on up to Threads workers, including this one */
+template <typename FBody>
+void ParallelFor(size_t Count, unsigned Threads, const FBody &Body)
+{
+    std::atomic<size_t> Next{0};
+    auto Worker = [&Next, Count, &Body]() {
+        for (size_t Index; (Index = Next.fetch_add(1, std::memory_order_relaxed)) < Count;)
+        {
+            Body(Index);
+        }
+    };
+
+    const size_t NumWorkers = std::min<size_t>(Threads, Count);
+    std::vector<std::thread> Pool;
+    for (size_t Index = 1; Index < NumWorkers; ++Index)
+    {
+        Pool.emplace_back(Worker);
+    }
+
+    Worker();
+    for (auto &Thread : Pool)
+    {
+        Thread.join();
+    }
+}
+
+struct FCacheInput
+{
+    size_t Platform = 0;
+    std::string Path;
+    FPipelineCacheReader Reader;
+
+    // Entries in file order, already split by ShardOf so each merge worker only sees its own
+    std::vector<std::vector<FPipelineCacheEntry>> Shards;
+    size_t NumEntries = 0;
+    bool bRead = false;
+
+    // The last incremental output, rather than something pulled from the fleet
+    bool bPrevious = false;
+};
+
+struct FKeyFileInput
+{
+    size_t Platform = 0;
+    std::string Path;
+    uint64_t Hash = 0;
+    uint64_t Size = 0;
+    bool bRead = false;
+};
+
+struct FPlatformMerge
+{
+    uint32_t Version = 0;
+    FPipelineCacheHeader Header;
+    std::vector<FCacheInput *> Caches;
+
+    // Deduplicated entries, one list per shard
+    std::vector<std::vector<FPipelineCacheEntry>> Shards;
+};
+
+void Combine(FPipelineCacheEntry &Into, const FPipelineCacheEntry &From)
+{
+    auto &Stats = Into.Stats;
+    if (From.Stats.FirstFrameUsed >= 0 && (Stats.FirstFrameUsed < 0 || From.Stats.FirstFrameUsed < Stats.FirstFrameUsed))
+    {
+        Stats.FirstFrameUsed = From.Stats.FirstFrameUsed;
+    }
+    Stats.LastFrameUsed = std::max(Stats.LastFrameUsed, From.Stats.LastFrameUsed);
+    Stats.CreateCount += From.Stats.CreateCount;
+    Stats.TotalBindCount += From.Stats.TotalBindCount;
+
+    Into.UsageMask |= From.UsageMask;
+    Into.LastUsedUnixTime = std::max(Into.LastUsedUnixTime, From.LastUsedUnixTime);
+}
+
+/**
+ * One input an incremental merge has already folded in
+ *
+ * Stored one per line as "<Size> <WriteTime> <Path>"
+ */
+struct FManifestRecord
+{
+    uint64_t Size = 0;
+    int64_t WriteTime = 0;
+    std::string Path;
+};
+
+bool StatFile(const std::string &Path, FManifestRecord &OutRecord)
+{
+    std::error_code ErrorCode;
+    OutRecord.Path = Path;
+    OutRecord.Size = fs::file_size(Path, ErrorCode);
+    if (ErrorCode)
+    {
+        return false;
+    }
+
+    OutRecord.WriteTime = static_cast<int64_t>(fs::last_write_time(Path, ErrorCode).time_since_epoch().count());
+    return !ErrorCode;
+}
+
+std::unordered_map<std::string, FManifestRecord> LoadManifest(const fs::path &Path)
+{
+    std::unordered_map<std::string, FManifestRecord> Records;
+
+    std::ifstream Stream(Path);
+    for (std::string Line; std::getline(Stream, Line);)
+    {
+        std::istringstream Fields(Line);
+        FManifestRecord Record;
+        if (Fields >> Record.Size >> Record.WriteTime && std::getline(Fields >> std::ws, Record.Path))
+        {
+            Records.emplace(Record.Path, Record);
+        }
+    }
+    return Records;
+}
+
+bool SaveManifest(const fs::path &Path, const std::vector<FManifestRecord> &Records)
+{
+    const fs::path TempPath = Path.string() + ".tmp";
+    {
+        std::ofstream Stream(TempPath, std::ios::trunc);
+        for (const auto &Record : Records)
+        {
+            Stream << Record.Size << ' ' << Record.WriteTime << ' ' << Record.Path << '\n';
+        }
+        if (!Stream.flush())
+        {
+            return false;
+        }
+    }
+
+    std::error_code ErrorCode;
+    fs::rename(TempPath, Path, ErrorCode);
+    return !ErrorCode;
+}
+
+/** Seconds since 1970 of a file time. file_time_type has no fixed epoch before C++20 */
+int64_t ToUnixTime(fs::file_time_type Time)
+{
+    const auto SystemTime =
+        std::chrono::system_clock::now() +
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(Time - fs::file_time_type::clock::now());
+    return std::chrono::duration_cast<std::chrono::seconds>(SystemTime.time_since_epoch()).count();
+}
+
+/** End of the JSON object opening at Open, stepping over strings. npos if it never closes */
+size_t ObjectEnd(const std::string &Text, size_t Open)
+{
+    bool bInString = false;
+    for (size_t At = Open + 1; At < Text.size(); ++At)
+    {
+        const char Char = Text[At];
+        if (bInString)
+        {
+            At += '\\' == Char ? 1 : 0;
+            bInString = '"' != Char;
+        }
+        else if ('"' == Char)
+        {
+            bInString = true;
+        }
+        else if ('}' == Char)
+        {
+            return At;
+        }
+    }
+    return std::string::npos;
+}
+
+/** Number field Key of a flat JSON object. A key only counts if a colon follows it, so values can't match */
+bool FindNumber(const std::string &Object, const char *Key, double &OutValue)
+{
+    const std::string Quoted = std::string("\"") + Key + "\"";
+    for (auto At = Object.find(Quoted); std::string::npos != At; At = Object.find(Quoted, At + 1))
+    {
+        const auto Colon = Object.find_first_not_of(" \t\r\n", At + Quoted.size());
+        if (std::string::npos != Colon && ':' == Object[Colon])
+        {
+            const char *Start = Object.c_str() + Colon + 1;
+            char *End = nullptr;
+            OutValue = std::strtod(Start, &End);
+            return End != Start;
+        }
+    }
+    return false;
+}
+
+/**
+ * Add each PSO's hitch time from a list FPSOHitchDetector wrote
+ *
+ * [{"pso": hash, ..., "totalms": ms}, ...]. Only those two fields are read. Returns the PSOs read
+ */
+size_t LoadHitchList(const std::string &Path, std::unordered_map<uint32_t, double> &InOutHitchMs)
+{
+    std::ifstream Stream(Path, std::ios::binary);
+    const std::string Text((std::istreambuf_iterator<char>(Stream)), std::istreambuf_iterator<char>());
+
+    size_t NumRead = 0;
+    for (auto Open = Text.find('{'); std::string::npos != Open; Open = Text.find('{', Open + 1))
+    {
+        const auto Close = ObjectEnd(Text, Open);
+        if (std::string::npos == Close)
+        {
+            break;
+        }
+
+        const auto Object = Text.substr(Open, Close - Open);
+        double Hash = 0.0;
+        double HitchMs = 0.0;
+        if (FindNumber(Object, "pso", Hash) && FindNumber(Object, "totalms", HitchMs) && Hash >= 0.0 &&
+            Hash <= std::numeric_limits<uint32_t>::max())
+        {
+            InOutHitchMs[static_cast<uint32_t>(Hash)] += HitchMs;
+            NumRead++;
+        }
+        Open = Close;
+    }
+    return NumRead;
+}
+
+size_t ShardOf(uint32_t PSOHash, size_t NumShards)
+{
+    // The TOC key is already a hash, but low bits of nearby PSOs can cluster
+    return static_cast<size_t>((uint64_t(PSOHash) * 0x9E3779B97F4A7C15ull) >> 32) % NumShards;
+}
+} // namespace
+
+FPSOCacheMerger::FPSOCacheMerger(unsigned InThreads)
+    : Threads(InThreads > 0 ? InThreads : std::max(1u, std::thread::hardware_concurrency()))
+{
+}
+
+std::vector<FMergeInput> FPSOCacheMerger::FindInputs(const std::string &Dir, const std::vector<std::string> &Platforms)
+{
+    std::vector<FMergeInput> Inputs;
+
+    std::error_code ErrorCode;
+    for (const auto &PlatformDir : fs::directory_iterator(Dir, ErrorCode))
+    {
+        if (!PlatformDir.is_directory())
+        {
+            continue;
+        }
+
+        FMergeInput Input;
+        Input.Platform = PlatformDir.path().filename().string();
+        if (!Platforms.empty() && std::find(Platforms.begin(), Platforms.end(), Input.Platform) == Platforms.end())
+        {
+            continue;
+        }
+
+        for (const auto &File : fs::recursive_directory_iterator(PlatformDir.path(), ErrorCode))
+        {
+            if (!File.is_regular_file())
+            {
+                continue;
+            }
+
+            const auto Extension = File.path().extension();
+            if (".upipelinecache" == Extension)
+            {
+                Input.Caches.push_back(File.path().string());
+            }
+            else if (".shk" == Extension)
+            {
+                Input.KeyFiles.push_back(File.path().string());
+            }
+            else if (".hitchlist" == Extension)
+            {
+                Input.HitchLists.push_back(File.path().string());
+            }
+        }
+
+        // First seen wins on ties. Keep that independent of directory order
+        std::sort(Input.Caches.begin(), Input.Caches.end());
+        std::sort(Input.KeyFiles.begin(), Input.KeyFiles.end());
+        std::sort(Input.HitchLists.begin(), Input.HitchLists.end());
+
+        if (!Input.Caches.empty() || !Input.KeyFiles.empty())
+        {
+            Inputs.push_back(std::move(Input));
+        }
+    }
+
+    std::sort(Inputs.begin(), Inputs.end(),
+              [](const FMergeInput &A, const FMergeInput &B) { return A.Platform < B.Platform; });
+    return Inputs;
+}
+
+bool FPSOCacheMerger::Merge(const std::vector<FMergeInput> &AllInputs, const std::string &OutDir,
+                            const std::string &Name, FMergeStats &OutStats)
+{
+    OutStats = FMergeStats();
+    Error.clear();
+
+    //
+    // Expiry. Inputs older than MaxAge aren't read, and neither are the PSOs only they had
+    //
+    const bool bExpire = MaxAge.count() > 0;
+    const int64_t CutoffWriteTime = (fs::file_time_type::clock::now() - MaxAge).time_since_epoch().count();
+    const int64_t CutoffUnixTime = ToUnixTime(fs::file_time_type::clock::now() - MaxAge);
+
+    std::vector<FMergeInput> Inputs = AllInputs;
+    std::vector<std::vector<FManifestRecord>> Consumed(Inputs.size());
+
+    for (size_t Index = 0; Index < Inputs.size(); ++Index)
+    {
+        auto KeepRecent = [&](std::vector<std::string> &Paths) {
+            std::vector<std::string> Recent;
+            for (const auto &Path : Paths)
+            {
+                FManifestRecord Record;
+                if (!StatFile(Path, Record))
+                {
+                    continue;
+                }
+
+                if (bExpire && Record.WriteTime < CutoffWriteTime)
+                {
+                    OutStats.NumInputsExpired++;
+                    continue;
+                }
+
+                Consumed[Index].push_back(Record);
+                Recent.push_back(Path);
+            }
+            Paths = std::move(Recent);
+        };
+        KeepRecent(Inputs[Index].Caches);
+        KeepRecent(Inputs[Index].KeyFiles);
+        KeepRecent(Inputs[Index].HitchLists);
+    }
+
+    //
+    // Incremental. Only read what the manifest hasn't seen, on top of the last output
+    //
+    std::vector<char> Changed(Inputs.size(), 1);
+    std::vector<char> RebuildKeys(Inputs.size(), 0);
+    std::vector<std::string> PreviousCaches(Inputs.size());
+
+    for (size_t Index = 0; bIncremental && Index < Inputs.size(); ++Index)
+    {
+        auto &Input = Inputs[Index];
+        const fs::path PlatformOut = fs::path(OutDir) / Input.Platform;
+        const auto Merged = LoadManifest(PlatformOut / ManifestName);
+
+        // Anything merged before that isn't an input any more has aged out or been deleted
+        std::unordered_map<std::string, const FManifestRecord *> Current;
+        for (const auto &Record : Consumed[Index])
+        {
+            Current.emplace(Record.Path, &Record);
+        }
+
+        bool bForgot = false;
+        for (const auto &Record : Merged)
+        {
+            bForgot = bForgot || 0 == Current.count(Record.first);
+        }
+
+        size_t NumNew = 0;
+        auto KeepNew = [&](std::vector<std::string> &Paths) {
+            std::vector<std::string> New;
+            for (const auto &Path : Paths)
+            {
+                const auto &Record = *Current[Path];
+                const auto Found = Merged.find(Path);
+                if (Found != Merged.end() && Found->second.Size == Record.Size &&
+                    Found->second.WriteTime == Record.WriteTime)
+                {
+                    OutStats.NumInputsAlreadyMerged++;
+                    continue;
+                }
+                New.push_back(Path);
+            }
+
+            NumNew += New.size();
+            Paths = std::move(New);
+        };
+
+        // Saved before KeepNew, in case the previous output can't be built on
+        const auto AllCaches = Input.Caches;
+        const auto AllKeyFiles = Input.KeyFiles;
+        KeepNew(Input.Caches);
+        KeepNew(Input.KeyFiles);
+
+        // A new list reorders everything, and the order comes from every list, not just the new ones
+        const auto AllHitchLists = Input.HitchLists;
+        KeepNew(Input.HitchLists);
+        Input.HitchLists = AllHitchLists;
+
+        if (0 == NumNew && !bForgot)
+        {
+            Changed[Index] = 0;
+            OutStats.NumPlatformsUpToDate++;
+            continue;
+        }
+
+        // Last run's output goes first, so it wins ties just as the inputs it came from did
+        std::error_code ErrorCode;
+        const auto Previous = PlatformOut / (Name + "_" + Input.Platform + ".upipelinecache");
+
+        // Its PSOs expire one by one if it records when they were last used. Otherwise start again
+        FPipelineCacheReader PreviousReader;
+        if (bForgot && PreviousReader.Open(Previous.string()) &&
+            PreviousReader.GetHeader().Version < PipelineCacheFormat::LastUsedTime)
+        {
+            OutStats.NumPlatformsRebuilt++;
+            OutStats.NumInputsAlreadyMerged -= AllCaches.size() - Input.Caches.size();
+            Input.Caches = AllCaches;
+        }
+        else if (fs::exists(Previous, ErrorCode))
+        {
+            Input.Caches.insert(Input.Caches.begin(), Previous.string());
+            PreviousCaches[Index] = Previous.string();
+        }
+
+        // Key files are only deduped whole, so there's no telling which a forgotten input brought. Start again
+        if (bForgot)
+        {
+            OutStats.NumInputsAlreadyMerged -= AllKeyFiles.size() - Input.KeyFiles.size();
+            Input.KeyFiles = AllKeyFiles;
+            RebuildKeys[Index] = 1;
+            continue;
+        }
+
+        std::vector<std::string> PreviousKeys;
+        for (const auto &File : fs::directory_iterator(PlatformOut, ErrorCode))
+        {
+            if (File.is_regular_file() && ".shk" == File.path().extension())
+            {
+                PreviousKeys.push_back(File.path().string());
+            }
+        }
+        std::sort(PreviousKeys.begin(), PreviousKeys.end());
+        Input.KeyFiles.insert(Input.KeyFiles.begin(), PreviousKeys.begin(), PreviousKeys.end());
+    }
+
+    //
+    // Read. Every file of every platform in one pool
+    //
+    auto Start = FClock::now();
+
+    std::vector<std::unique_ptr<FCacheInput>> Caches;
+    std::vector<FKeyFileInput> KeyFiles;
+    for (size_t Platform = 0; Platform < Inputs.size(); ++Platform)
+    {
+        if (!Changed[Platform])
+        {
+            continue;
+        }
+
+        for (const auto &Path : Inputs[Platform].Caches)
+        {
+            Caches.push_back(std::make_unique<FCacheInput>());
+            Caches.back()->Platform = Platform;
+            Caches.back()->Path = Path;
+            Caches.back()->bPrevious = Path == PreviousCaches[Platform];
+        }
+        for (const auto &Path : Inputs[Platform].KeyFiles)
+        {
+            KeyFiles.push_back({Platform, Path});
+        }
+    }
+
+    const size_t NumShards = Threads;
+    ParallelFor(Caches.size() + KeyFiles.size(), Threads, [&Caches, &KeyFiles, NumShards](size_t Index) {
+        if (Index >= Caches.size())
+        {
+            auto &KeyFile = KeyFiles[Index - Caches.size()];
+
+            FStableKeysReader Reader;
+            if (!Reader.Open(KeyFile.Path))
+            {
+                std::fprintf(stderr, "Skipping %s\n", Reader.GetError().c_str());
+                return;
+            }
+
+            KeyFile.Hash = Reader.Hash();
+            KeyFile.Size = Reader.GetSize();
+            KeyFile.bRead = true;
+            return;
+        }
+
+        auto &Cache = *Caches[Index];
+        if (!Cache.Reader.Open(Cache.Path))
+        {
+            std::fprintf(stderr, "Skipping %s: %s\n", Cache.Path.c_str(), Cache.Reader.GetError().c_str());
+            return;
+        }
+
+        // When a PSO was last seen, for expiring it. A fleet file's own write time counts as seeing everything in it.
+        // Last run's output already has that in every PSO, unless the format can't hold it. Then it's never
+        // built on once anything expires, so nothing in it is too old
+        int64_t SeenUnixTime = Cache.Reader.GetHeader().Version < PipelineCacheFormat::LastUsedTime
+                                   ? std::numeric_limits<int64_t>::max()
+                                   : 0;
+        std::error_code ErrorCode;
+        if (!Cache.bPrevious)
+        {
+            SeenUnixTime = ToUnixTime(fs::last_write_time(Cache.Path, ErrorCode));
+        }
+
+        // Bucketed once here, so the merge does N work in total rather than N per shard
+        Cache.Shards.resize(NumShards);
+        for (auto &Shard : Cache.Shards)
+        {
+            Shard.reserve(static_cast<size_t>(Cache.Reader.GetNumEntries()) / NumShards + 1);
+        }
+
+        FPipelineCacheEntry Entry;
+        for (auto It = Cache.Reader.CreateIterator(); It.Next(Entry);)
+        {
+            if (Entry.Descriptor)
+            {
+                Entry.LastUsedUnixTime = std::max(Entry.LastUsedUnixTime, SeenUnixTime);
+                Cache.Shards[ShardOf(Entry.PSOHash, NumShards)].push_back(Entry);
+                Cache.NumEntries++;
+            }
+        }
+
+        if (!Cache.Reader.GetError().empty())
+        {
+            std::fprintf(stderr, "Skipping %s: %s\n", Cache.Path.c_str(), Cache.Reader.GetError().c_str());
+            Cache.Shards.clear();
+            Cache.NumEntries = 0;
+            return;
+        }
+
+        Cache.bRead = true;
+    });
+
+    OutStats.ReadSeconds = SecondsSince(Start);
+
+    //
+    // Merge. Each platform's PSOs are split into shards by hash, so every worker owns its own table
+    //
+    Start = FClock::now();
+
+    std::vector<FPlatformMerge> Platforms(Inputs.size());
+    for (auto &Cache : Caches)
+    {
+        OutStats.NumCaches++;
+        if (!Cache->bRead)
+        {
+            OutStats.NumCachesSkipped++;
+            continue;
+        }
+
+        OutStats.BytesIn += Cache->Reader.GetSize();
+        auto &Platform = Platforms[Cache->Platform];
+        if (Cache->Reader.GetHeader().Version > Platform.Version)
+        {
+            Platform.Version = Cache->Reader.GetHeader().Version;
+            Platform.Header = Cache->Reader.GetHeader();
+        }
+        Platform.Caches.push_back(Cache.get());
+    }
+
+    // Expand only takes one format version at a time. The newest is what the current build writes
+    for (size_t Index = 0; Index < Platforms.size(); ++Index)
+    {
+        auto &Platform = Platforms[Index];
+        auto Removed = std::remove_if(Platform.Caches.begin(), Platform.Caches.end(), [&Platform](FCacheInput *Cache) {
+            if (Cache->Reader.GetHeader().Version == Platform.Version)
+            {
+                return false;
+            }
+
+            std::fprintf(stderr, "Skipping %s: version %u, not %u\n", Cache->Path.c_str(),
+                         Cache->Reader.GetHeader().Version, Platform.Version);
+            return true;
+        });
+        OutStats.NumCachesSkipped += static_cast<size_t>(Platform.Caches.end() - Removed);
+        Platform.Caches.erase(Removed, Platform.Caches.end());
+
+        for (const auto *Cache : Platform.Caches)
+        {
+            OutStats.NumEntriesIn += Cache->NumEntries;
+        }
+        Platform.Shards.resize(NumShards);
+    }
+
+    ParallelFor(Platforms.size() * NumShards, Threads, [&Platforms, NumShards](size_t Index) {
+        auto &Platform = Platforms[Index / NumShards];
+        const size_t Shard = Index % NumShards;
+        auto &Merged = Platform.Shards[Shard];
+
+        std::unordered_map<uint32_t, size_t> Lookup;
+        for (const auto *Cache : Platform.Caches)
+        {
+            for (const auto &Entry : Cache->Shards[Shard])
+            {
+                const auto Found = Lookup.emplace(Entry.PSOHash, Merged.size());
+                if (Found.second)
+                {
+                    Merged.push_back(Entry);
+                }
+                else
+                {
+                    Combine(Merged[Found.first->second], Entry);
+                }
+            }
+        }
+    });
+
+    OutStats.MergeSeconds = SecondsSince(Start);
+
+    //
+    // Write. One platform per worker
+    //
+    Start = FClock::now();
+
+    std::vector<std::string> Errors(Platforms.size());
+    std::vector<FMergeStats> PlatformStats(Platforms.size());
+
+    ParallelFor(Platforms.size(), Threads, [&](size_t Index) {
+        if (!Changed[Index])
+        {
+            return;
+        }
+
+        const auto &Input = Inputs[Index];
+        auto &Platform = Platforms[Index];
+        auto &Stats = PlatformStats[Index];
+
+        const fs::path PlatformOut = fs::path(OutDir) / Input.Platform;
+        std::error_code ErrorCode;
+        fs::create_directories(PlatformOut, ErrorCode);
+
+        // Anything here is ours from a previous run. Expand globs the directory, so clear it out.
+        // Incremental runs build on it, except for key files when they're being rebuilt
+        for (const auto &File : fs::directory_iterator(PlatformOut, ErrorCode))
+        {
+            const auto Extension = File.path().extension();
+            const bool bKeys = ".shk" == Extension;
+            if (File.is_regular_file() && ((!bIncremental && (".upipelinecache" == Extension ||
+                                                              File.path().filename() == ManifestName)) ||
+                                           (bKeys && (!bIncremental || RebuildKeys[Index]))))
+            {
+                fs::remove(File.path(), ErrorCode);
+            }
+        }
+
+        const auto OutPath = PlatformOut / (Name + "_" + Input.Platform + ".upipelinecache");
+
+        // Everything this platform had has aged out
+        if (Platform.Caches.empty())
+        {
+            fs::remove(OutPath, ErrorCode);
+        }
+        else
+        {
+            std::vector<FPipelineCacheEntry> Merged;
+            for (auto &Shard : Platform.Shards)
+            {
+                for (const auto &Entry : Shard)
+                {
+                    if (!bExpire || Entry.LastUsedUnixTime >= CutoffUnixTime)
+                    {
+                        Merged.push_back(Entry);
+                    }
+                    else
+                    {
+                        Stats.NumEntriesExpired++;
+                    }
+                }
+                Shard = std::vector<FPipelineCacheEntry>();
+            }
+
+            std::unordered_map<uint32_t, double> HitchMs;
+            for (const auto &HitchList : Input.HitchLists)
+            {
+                if (LoadHitchList(HitchList, HitchMs) > 0)
+                {
+                    Stats.NumHitchListsIn++;
+                }
+            }
+
+            // Unlisted PSOs sort after every listed one, even those that never hitched
+            auto HitchMsOf = [&HitchMs](const FPipelineCacheEntry &Entry) {
+                const auto Found = HitchMs.find(Entry.PSOHash);
+                return HitchMs.end() == Found ? -1.0 : Found->second;
+            };
+
+            // Worst hitches first, then earliest used, as the engine would sort it. Unused at the end
+            std::sort(Merged.begin(), Merged.end(),
+                      [&HitchMsOf](const FPipelineCacheEntry &A, const FPipelineCacheEntry &B) {
+                          const double HitchA = HitchMsOf(A);
+                          const double HitchB = HitchMsOf(B);
+                          if (HitchA != HitchB)
+                          {
+                              return HitchA > HitchB;
+                          }
+
+                          const uint64_t FirstA = static_cast<uint64_t>(A.Stats.FirstFrameUsed);
+                          const uint64_t FirstB = static_cast<uint64_t>(B.Stats.FirstFrameUsed);
+                          return FirstA != FirstB ? FirstA < FirstB : A.PSOHash < B.PSOHash;
+                      });
+
+            for (const auto &Entry : Merged)
+            {
+                Stats.NumEntriesPrioritised += HitchMsOf(Entry) >= 0.0 ? 1 : 0;
+            }
+
+            // The previous output may be one of the inputs. Only replace it once the new one is complete
+            const auto TempPath = OutPath.string() + ".tmp";
+
+            FPipelineCacheWriter Writer;
+            bool bOk = Writer.Open(TempPath, Platform.Header);
+            for (size_t Entry = 0; bOk && Entry < Merged.size(); ++Entry)
+            {
+                bOk = Writer.AddEntry(Merged[Entry]);
+            }
+            // Claimed as FirstToLatestUsed, the engine's default, so it keeps the hitch order instead of sorting again
+            bOk = bOk && Writer.Close(FirstToLatestUsed);
+
+            if (!bOk)
+            {
+                Errors[Index] = Writer.GetError();
+                return;
+            }
+
+            // Can't replace a mapped file on Windows
+            for (auto *Cache : Platform.Caches)
+            {
+                Cache->Reader.Close();
+            }
+
+            fs::rename(TempPath, OutPath, ErrorCode);
+            if (ErrorCode)
+            {
+                Errors[Index] = OutPath.string() + ": rename failed (" + ErrorCode.message() + ")";
+                return;
+            }
+
+            Stats.NumEntriesOut = Merged.size();
+            Stats.BytesOut += Writer.GetBytesWritten();
+        }
+
+        // Identical key files are common. Every machine on a build gets the same ones
+        std::unordered_map<uint64_t, const FKeyFileInput *> Distinct;
+        for (const auto &KeyFile : KeyFiles)
+        {
+            if (KeyFile.Platform != Index || !KeyFile.bRead)
+            {
+                continue;
+            }
+
+            Stats.NumKeyFilesIn++;
+            if (!Distinct.emplace(KeyFile.Hash, &KeyFile).second)
+            {
+                continue;
+            }
+
+            Stats.NumKeyFilesOut++;
+            Stats.BytesOut += KeyFile.Size;
+
+            // Already there from an earlier incremental run
+            if (fs::equivalent(fs::path(KeyFile.Path).parent_path(), PlatformOut, ErrorCode))
+            {
+                continue;
+            }
+
+            // Same name, different contents. Keep both
+            auto Target = PlatformOut / fs::path(KeyFile.Path).filename();
+            if (fs::exists(Target, ErrorCode))
+            {
+                char Prefix[18];
+                std::snprintf(Prefix, sizeof(Prefix), "%016llx-", static_cast<unsigned long long>(KeyFile.Hash));
+                Target = PlatformOut / (Prefix + fs::path(KeyFile.Path).filename().string());
+            }
+
+            if (!fs::copy_file(KeyFile.Path, Target, fs::copy_options::overwrite_existing, ErrorCode))
+            {
+                Errors[Index] = KeyFile.Path + ": copy failed (" + ErrorCode.message() + ")";
+                return;
+            }
+        }
+
+        // Only once everything is written. A failed run is simply redone next time
+        if (bIncremental && !SaveManifest(PlatformOut / ManifestName, Consumed[Index]))
+        {
+            Errors[Index] = (PlatformOut / ManifestName).string() + ": could not write manifest";
+        }
+    });
+
+    for (const auto &Stats : PlatformStats)
+    {
+        OutStats.NumEntriesOut += Stats.NumEntriesOut;
+        OutStats.NumEntriesExpired += Stats.NumEntriesExpired;
+        OutStats.NumKeyFilesIn += Stats.NumKeyFilesIn;
+        OutStats.NumKeyFilesOut += Stats.NumKeyFilesOut;
+        OutStats.NumHitchListsIn += Stats.NumHitchListsIn;
+        OutStats.NumEntriesPrioritised += Stats.NumEntriesPrioritised;
+        OutStats.BytesOut += Stats.BytesOut;
+    }
+    for (const auto &KeyFile : KeyFiles)
+    {
+        OutStats.BytesIn += KeyFile.Size;
+    }
+
+    OutStats.WriteSeconds = SecondsSince(Start);
+
+    for (const auto &PlatformError : Errors)
+    {
+        if (!PlatformError.empty())
+        {
+            Error = PlatformError;
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace PSOCacheTools
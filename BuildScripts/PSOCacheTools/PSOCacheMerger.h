@@ -0,0 +1,141 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace PSOCacheTools
+{
+
+/**
+ * Everything collected for one shader platform
+ */
+struct FMergeInput
+{
+    std::string Platform;
+    std::vector<std::string> Caches;
+    std::vector<std::string> KeyFiles;
+
+    // FPSOHitchDetector lists of PSOs that were created on demand, as uploaded by the plugin
+    std::vector<std::string> HitchLists;
+};
+
+struct FMergeStats
+{
+    size_t NumCaches = 0;
+    size_t NumCachesSkipped = 0;
+    size_t NumEntriesIn = 0;
+    size_t NumEntriesOut = 0;
+
+    size_t NumKeyFilesIn = 0;
+    size_t NumKeyFilesOut = 0;
+
+    // Hitch lists read, and PSOs put first because one of them named it
+    size_t NumHitchListsIn = 0;
+    size_t NumEntriesPrioritised = 0;
+
+    // Incremental only. Inputs already folded in by an earlier run, and platforms with nothing new
+    size_t NumInputsAlreadyMerged = 0;
+    size_t NumPlatformsUpToDate = 0;
+
+    // Incremental only. Platforms read again from scratch because their previous output couldn't expire PSOs
+    size_t NumPlatformsRebuilt = 0;
+
+    // Older than the max age. Inputs left unread, and PSOs no recent input had
+    size_t NumInputsExpired = 0;
+    size_t NumEntriesExpired = 0;
+
+    uint64_t BytesIn = 0;
+    uint64_t BytesOut = 0;
+
+    double ReadSeconds = 0.0;
+    double MergeSeconds = 0.0;
+    double WriteSeconds = 0.0;
+};
+
+/**
+ * Merges fleet-collected caches down to what ShaderPipelineCacheTools Expand needs
+ *
+ * PSOs are deduplicated by the key the engine's table of contents uses, with
+ * their usage stats combined: earliest first frame, latest last frame, summed
+ * counts and the union of usage masks. Stable key files are deduplicated by
+ * content. The result per platform is one .upipelinecache plus the distinct
+ * .shk files, so Expand parses each PSO and key once however big the fleet is.
+ *
+ * Reading, merging and writing are all spread over Threads workers. Inputs are
+ * memory-mapped and descriptors are copied straight from the mappings.
+ *
+ * Incremental merges keep the output as a persistent intermediate. Each
+ * platform's output directory gets a manifest of the inputs already merged
+ * (path, size and write time), and the next merge only reads inputs that
+ * aren't in it, on top of the previous output. A platform with no new inputs
+ * isn't touched at all.
+ *
+ * A max age bounds what's kept. Inputs written longer ago than that aren't
+ * read, and a PSO is dropped once no input that has it is recent enough. Each
+ * PSO's LastUsedUnixTime carries the newest write time of the inputs that had
+ * it, so incremental merges can drop PSOs from their previous output. Formats
+ * too old to hold it, and key files, are read again from scratch whenever an
+ * input ages out.
+ *
+ * PSOs named in hitch lists go first, those that cost players the most hitch
+ * time across every list ahead of the rest, then everything else earliest used
+ * first. The output is marked as sorted, so the engine precompiles in that
+ * order rather than sorting it again. Hitch lists age out like any input.
+ */
+class FPSOCacheMerger
+{
+public:
+    /** @param InThreads Workers to use. 0 for one per core */
+    explicit FPSOCacheMerger(unsigned InThreads = 0);
+
+    /** Leave out inputs older than this, and PSOs only they had. 0 keeps everything */
+    void SetMaxAge(std::chrono::seconds InMaxAge)
+    {
+        MaxAge = InMaxAge;
+    }
+
+    /** Name of the manifest of merged inputs kept next to each platform's output */
+    static constexpr const char *ManifestName = "PSOMergeManifest.txt";
+
+    /** Fold new inputs into the previous output rather than starting again */
+    void SetIncremental(bool bInIncremental)
+    {
+        bIncremental = bInIncremental;
+    }
+
+    /**
+     * Find .upipelinecache, .shk and .hitchlist files under Dir/<Platform>/, as PullData.py downloads them
+     *
+     * @param Platforms Only these. Empty for every platform found
+     */
+    static std::vector<FMergeInput> FindInputs(const std::string &Dir, const std::vector<std::string> &Platforms);
+
+    /**
+     * Merge every input. Each platform ends up in OutDir/<Platform>/ as
+     * <Name>_<Platform>.upipelinecache and its distinct .shk files
+     */
+    bool Merge(const std::vector<FMergeInput> &Inputs, const std::string &OutDir, const std::string &Name,
+               FMergeStats &OutStats);
+
+    unsigned GetThreads() const
+    {
+        return Threads;
+    }
+
+    const std::string &GetError() const
+    {
+        return Error;
+    }
+
+private:
+    unsigned Threads;
+    bool bIncremental = false;
+    std::chrono::seconds MaxAge{0};
+    std::string Error;
+};
+
+} // namespace PSOCacheTools
@@ -0,0 +1,354 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+// Merge tests against small caches in a scratch directory. Run through ctest, or directly
+//
+//   PSOCacheMergerTests [<ScratchDir>]
+
+#include "PSOCacheMerger.h"
+#include "PSOCacheReader.h"
+#include "PSOCacheWriter.h"
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace PSOCacheTools;
+
+namespace
+{
+int NumFailed = 0;
+fs::path Scratch;
+
+#define CHECK(Condition)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(Condition))                                                                                              \
+        {                                                                                                              \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #Condition);                         \
+            ++NumFailed;                                                                                               \
+        }                                                                                                              \
+    } while (0)
+
+/** Write a cache holding Keys, each first used on frame FirstFrame + its key */
+bool WriteCache(const fs::path &Path, const std::vector<uint32_t> &Keys, int64_t FirstFrame,
+                uint32_t Version = PipelineCacheFormat::Latest)
+{
+    std::vector<uint8_t> Descriptors(Keys.size() * 16);
+    std::vector<uint8_t> Shaders(Keys.size() * PipelineCacheFormat::ShaderHashSize);
+
+    FPipelineCacheHeader Header;
+    Header.Version = Version;
+    Header.GameVersion = 1;
+
+    FPipelineCacheWriter Writer;
+    bool bOk = Writer.Open(Path.string(), Header);
+    for (size_t Index = 0; bOk && Index < Keys.size(); ++Index)
+    {
+        std::memset(&Descriptors[Index * 16], static_cast<int>(Keys[Index]), 16);
+
+        FPipelineCacheEntry Entry;
+        Entry.PSOHash = Keys[Index];
+        Entry.FileSize = 16;
+        Entry.Descriptor = &Descriptors[Index * 16];
+        Entry.Stats.FirstFrameUsed = FirstFrame + Keys[Index];
+        Entry.Stats.LastFrameUsed = FirstFrame + Keys[Index] + 1;
+        Entry.Stats.CreateCount = 1;
+        Entry.UsageMask = uint64_t(1) << (Keys[Index] % 64);
+        Entry.ShaderHashes = &Shaders[Index * PipelineCacheFormat::ShaderHashSize];
+        Entry.NumShaders = 1;
+        bOk = Writer.AddEntry(Entry);
+    }
+    bOk = bOk && Writer.Close(0);
+
+    if (!bOk)
+    {
+        std::fprintf(stderr, "%s\n", Writer.GetError().c_str());
+    }
+    return bOk;
+}
+
+std::vector<uint8_t> ReadFile(const fs::path &Path)
+{
+    std::ifstream Stream(Path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(Stream), std::istreambuf_iterator<char>());
+}
+
+void WriteFile(const fs::path &Path, const std::vector<uint8_t> &Bytes)
+{
+    std::ofstream Stream(Path, std::ios::binary | std::ios::trunc);
+    Stream.write(reinterpret_cast<const char *>(Bytes.data()), static_cast<std::streamsize>(Bytes.size()));
+}
+
+std::map<uint32_t, FPipelineCacheEntry> ReadEntries(FPipelineCacheReader &Reader, const fs::path &Path)
+{
+    std::map<uint32_t, FPipelineCacheEntry> Entries;
+    if (!Reader.Open(Path.string()))
+    {
+        return Entries;
+    }
+
+    FPipelineCacheEntry Entry;
+    for (auto It = Reader.CreateIterator(); It.Next(Entry);)
+    {
+        Entries[Entry.PSOHash] = Entry;
+    }
+    return Entries;
+}
+
+void TestCorruptInputIsSkipped()
+{
+    const fs::path Root = Scratch / "CorruptInput";
+    const fs::path In = Root / "In" / "SP_TEST";
+    fs::remove_all(Root);
+    fs::create_directories(In);
+
+    CHECK(WriteCache(In / "A.upipelinecache", {1, 2, 3}, 100));
+    CHECK(WriteCache(In / "B.upipelinecache", {3, 4}, 10));
+    CHECK(WriteCache(In / "C.upipelinecache", {5}, 0));
+
+    // A fleet upload claiming 2^31 - 1 entries. Used to take the whole merge down with bad_alloc
+    auto Bytes = ReadFile(In / "C.upipelinecache");
+    uint64_t TableOffset = 0;
+    std::memcpy(&TableOffset, &Bytes[33], sizeof(TableOffset));
+    const int32_t NumEntries = 0x7FFFFFFF;
+    std::memcpy(&Bytes[TableOffset + 12], &NumEntries, sizeof(NumEntries));
+    WriteFile(In / "C.upipelinecache", Bytes);
+
+    FPSOCacheMerger Merger(2);
+    FMergeStats Stats;
+    CHECK(Merger.Merge(FPSOCacheMerger::FindInputs((Root / "In").string(), {}), (Root / "Out").string(), "Test",
+                       Stats));
+    CHECK(3 == Stats.NumCaches);
+    CHECK(1 == Stats.NumCachesSkipped);
+    CHECK(5 == Stats.NumEntriesIn);
+    CHECK(4 == Stats.NumEntriesOut);
+
+    FPipelineCacheReader Reader;
+    auto Entries = ReadEntries(Reader, Root / "Out" / "SP_TEST" / "Test_SP_TEST.upipelinecache");
+    CHECK(4 == Entries.size());
+    CHECK(0 == Entries.count(5));
+
+    // Seen by both. Earliest first frame, latest last frame, summed counts
+    CHECK(13 == Entries[3].Stats.FirstFrameUsed);
+    CHECK(104 == Entries[3].Stats.LastFrameUsed);
+    CHECK(2 == Entries[3].Stats.CreateCount);
+
+    fs::remove_all(Root);
+}
+
+/** Pretend Path was pulled Days ago */
+void Age(const fs::path &Path, int Days)
+{
+    fs::last_write_time(Path, fs::file_time_type::clock::now() - std::chrono::hours(24) * Days);
+}
+
+std::vector<uint32_t> Keys(FPipelineCacheReader &Reader, const fs::path &Path)
+{
+    std::vector<uint32_t> Result;
+    for (const auto &Entry : ReadEntries(Reader, Path))
+    {
+        Result.push_back(Entry.first);
+    }
+    return Result;
+}
+
+void TestExpiry(uint32_t Version)
+{
+    const fs::path Root = Scratch / ("Expiry" + std::to_string(Version));
+    const fs::path In = Root / "In" / "SP_TEST";
+    fs::remove_all(Root);
+    fs::create_directories(In);
+
+    const fs::path Output = Root / "Out" / "SP_TEST" / "Test_SP_TEST.upipelinecache";
+    // Time passing is a shorter max age, since files don't get older on their own
+    auto Run = [&](bool bIncremental, int MaxAgeDays, const fs::path &Out, FMergeStats &Stats) {
+        FPSOCacheMerger Merger(2);
+        Merger.SetIncremental(bIncremental);
+        Merger.SetMaxAge(std::chrono::hours(24) * MaxAgeDays);
+        CHECK(Merger.Merge(FPSOCacheMerger::FindInputs((Root / "In").string(), {}), Out.string(), "Test", Stats));
+    };
+
+    // A was pulled long ago and never read. B and C are recent
+    CHECK(WriteCache(In / "A.upipelinecache", {1, 9}, 0, Version));
+    CHECK(WriteCache(In / "B.upipelinecache", {1, 2}, 0, Version));
+    CHECK(WriteCache(In / "C.upipelinecache", {2, 3}, 0, Version));
+    std::ofstream(In / "B.shk") << "B";
+    std::ofstream(In / "C.shk") << "C";
+    Age(In / "A.upipelinecache", 30);
+    Age(In / "B.upipelinecache", 10);
+    Age(In / "B.shk", 10);
+
+    FMergeStats Stats;
+    Run(true, 14, Root / "Out", Stats);
+    CHECK(1 == Stats.NumInputsExpired);
+
+    FPipelineCacheReader Reader;
+    CHECK((std::vector<uint32_t>{1, 2, 3}) == Keys(Reader, Output));
+    Reader.Close();
+
+    // B ages out. Key 1 only it has left goes, 2 is still in C
+    Run(true, 5, Root / "Out", Stats);
+    CHECK(0 == Stats.NumPlatformsUpToDate);
+    CHECK(3 == Stats.NumInputsExpired);
+    CHECK((std::vector<uint32_t>{2, 3}) == Keys(Reader, Output));
+    CHECK((Version < PipelineCacheFormat::LastUsedTime ? 1u : 0u) == Stats.NumPlatformsRebuilt);
+    CHECK((Version < PipelineCacheFormat::LastUsedTime ? 0u : 1u) == Stats.NumEntriesExpired);
+    CHECK(!fs::exists(Root / "Out" / "SP_TEST" / "B.shk"));
+    CHECK(fs::exists(Root / "Out" / "SP_TEST" / "C.shk"));
+    Reader.Close();
+
+    // Same PSOs as merging what's left from scratch. Summed counts still include what B added, there's no
+    // taking them back out
+    Run(false, 5, Root / "Full", Stats);
+    FPipelineCacheReader FullReader;
+    CHECK(Keys(FullReader, Root / "Full" / "SP_TEST" / "Test_SP_TEST.upipelinecache") == Keys(Reader, Output));
+    Reader.Close();
+
+    // Nothing new, nothing else aged out
+    Run(true, 5, Root / "Out", Stats);
+    CHECK(1 == Stats.NumPlatformsUpToDate);
+
+    fs::remove_all(Root);
+}
+
+/** Keys in the order they were written */
+std::vector<uint32_t> KeysInFileOrder(const fs::path &Path)
+{
+    std::vector<uint32_t> Result;
+    FPipelineCacheReader Reader;
+    if (Reader.Open(Path.string()))
+    {
+        FPipelineCacheEntry Entry;
+        for (auto It = Reader.CreateIterator(); It.Next(Entry);)
+        {
+            Result.push_back(Entry.PSOHash);
+        }
+    }
+    return Result;
+}
+
+void TestHitchListsGoFirst()
+{
+    const fs::path Root = Scratch / "HitchLists";
+    const fs::path In = Root / "In" / "SP_TEST";
+    fs::remove_all(Root);
+    fs::create_directories(In);
+
+    const fs::path Output = Root / "Out" / "SP_TEST" / "Test_SP_TEST.upipelinecache";
+    auto Run = [&](FMergeStats &Stats) {
+        FPSOCacheMerger Merger(2);
+        Merger.SetIncremental(true);
+        CHECK(Merger.Merge(FPSOCacheMerger::FindInputs((Root / "In").string(), {}), (Root / "Out").string(), "Test",
+                           Stats));
+    };
+
+    // First used in key order without any lists
+    CHECK(WriteCache(In / "A.upipelinecache", {1, 2, 3, 4, 5}, 0));
+
+    FMergeStats Stats;
+    Run(Stats);
+    CHECK((std::vector<uint32_t>{1, 2, 3, 4, 5}) == KeysInFileOrder(Output));
+
+    // As FPSOHitchDetector writes them. Hitch time adds up across lists, so 4 beats 3. 5 never hitched but
+    // was still a miss
+    std::ofstream(In / "A.hitchlist") << R"([{"pso": 3, "mask": "0", "level": "{\"pso\": 7}", "totalms": 40.5},)"
+                                      << R"( {"pso": 4, "totalms": 30}, {"pso": 5, "totalms": 0}])";
+    std::ofstream(In / "B.hitchlist") << R"([{"pso": 4, "hitches": 2, "totalms": 20}, {"pso": 99, "totalms": 9}])";
+
+    // A new list on its own is enough to reorder
+    Run(Stats);
+    CHECK(0 == Stats.NumPlatformsUpToDate);
+    CHECK(2 == Stats.NumHitchListsIn);
+    CHECK(3 == Stats.NumEntriesPrioritised);
+    CHECK((std::vector<uint32_t>{4, 3, 5, 1, 2}) == KeysInFileOrder(Output));
+
+    // Lists age out like anything else
+    Age(In / "B.hitchlist", 30);
+    FPSOCacheMerger Merger(2);
+    Merger.SetIncremental(true);
+    Merger.SetMaxAge(std::chrono::hours(24) * 14);
+    CHECK(Merger.Merge(FPSOCacheMerger::FindInputs((Root / "In").string(), {}), (Root / "Out").string(), "Test",
+                       Stats));
+    CHECK((std::vector<uint32_t>{3, 4, 5, 1, 2}) == KeysInFileOrder(Output));
+
+    fs::remove_all(Root);
+}
+
+void TestThreadsAgree()
+{
+    const fs::path Root = Scratch / "ThreadsAgree";
+    fs::remove_all(Root);
+
+    // Overlapping key ranges, so plenty of PSOs are combined in every shard
+    for (int Platform = 0; Platform < 2; ++Platform)
+    {
+        const fs::path In = Root / "In" / ("SP_TEST_" + std::to_string(Platform));
+        fs::create_directories(In);
+
+        for (uint32_t File = 0; File < 4; ++File)
+        {
+            std::vector<uint32_t> Keys;
+            for (uint32_t Key = File * 100; Key < File * 100 + 300; ++Key)
+            {
+                Keys.push_back(Key * 2654435761u);
+            }
+            CHECK(WriteCache(In / ("Machine" + std::to_string(File) + ".upipelinecache"), Keys, File));
+        }
+    }
+
+    const auto Inputs = FPSOCacheMerger::FindInputs((Root / "In").string(), {});
+
+    std::vector<std::vector<uint8_t>> Outputs;
+    for (const unsigned Threads : {1u, 3u, 8u})
+    {
+        const fs::path Out = Root / ("Out" + std::to_string(Threads));
+
+        FPSOCacheMerger Merger(Threads);
+        FMergeStats Stats;
+        CHECK(Merger.Merge(Inputs, Out.string(), "Test", Stats));
+        CHECK(2 * 4 * 300 == Stats.NumEntriesIn);
+        CHECK(2 * 600 == Stats.NumEntriesOut);
+
+        Outputs.push_back(ReadFile(Out / "SP_TEST_1" / "Test_SP_TEST_1.upipelinecache"));
+    }
+
+    // Sharding is an implementation detail. The output doesn't depend on it
+    CHECK(!Outputs[0].empty());
+    CHECK(Outputs[0] == Outputs[1]);
+    CHECK(Outputs[0] == Outputs[2]);
+
+    fs::remove_all(Root);
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Scratch = (argc > 1 ? fs::path(argv[1]) : fs::temp_directory_path()) / "PSOCacheMergerScratch";
+
+    const std::vector<std::pair<const char *, std::function<void()>>> Tests = {
+        {"CorruptInputIsSkipped", TestCorruptInputIsSkipped},
+        {"ThreadsAgree", TestThreadsAgree},
+        {"HitchListsGoFirst", TestHitchListsGoFirst},
+        {"Expiry", [] { TestExpiry(PipelineCacheFormat::Latest); }},
+        {"ExpiryWithoutLastUsedTime", [] { TestExpiry(PipelineCacheFormat::PSOUsageFrequency); }},
+    };
+
+    for (const auto &Test : Tests)
+    {
+        const int Before = NumFailed;
+        Test.second();
+        std::printf("%s %s\n", NumFailed == Before ? "PASS" : "FAIL", Test.first);
+    }
+
+    std::error_code ErrorCode;
+    fs::remove_all(Scratch, ErrorCode);
+    return NumFailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,467 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCacheReader.h"
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace PSOCacheTools
+{
+
+namespace
+{
+// Bounds-checked little-endian reads. Every supported host is little-endian
+template <typename T>
+bool ReadValue(const uint8_t *Data, size_t Size, size_t &Offset, T &Out)
+{
+    if (Size < sizeof(T) || Offset > Size - sizeof(T))
+    {
+        return false;
+    }
+
+    std::memcpy(&Out, Data + Offset, sizeof(T));
+    Offset += sizeof(T);
+    return true;
+}
+
+bool ReadGuid(const uint8_t *Data, size_t Size, size_t &Offset, FGuid &Out)
+{
+    return ReadValue(Data, Size, Offset, Out.A) && ReadValue(Data, Size, Offset, Out.B) &&
+           ReadValue(Data, Size, Offset, Out.C) && ReadValue(Data, Size, Offset, Out.D);
+}
+
+bool Skip(size_t Size, size_t &Offset, uint64_t Bytes)
+{
+    if (Offset > Size || Bytes > Size - Offset)
+    {
+        return false;
+    }
+
+    Offset += static_cast<size_t>(Bytes);
+    return true;
+}
+
+/** Smallest a table of contents entry can be in Version. No shaders or library ids */
+size_t MinEntrySize(uint32_t Version)
+{
+    using namespace PipelineCacheFormat;
+
+    // PSOHash, FileOffset, FileSize, FileGuid, then four int64 stats and their PSOHash
+    size_t Size = sizeof(uint32_t) + 2 * sizeof(uint64_t) + sizeof(FGuid) + 4 * sizeof(int64_t) + sizeof(uint32_t);
+    if (LibraryID == Version || Version >= ShaderMetaData)
+    {
+        Size += sizeof(int32_t);
+    }
+    if (Version >= PSOUsageFrequency)
+    {
+        Size += sizeof(uint64_t);
+    }
+    if (Version >= EngineFlags)
+    {
+        Size += sizeof(uint16_t);
+    }
+    if (Version >= LastUsedTime)
+    {
+        Size += sizeof(int64_t);
+    }
+    return Size;
+}
+} // namespace
+
+std::string FGuid::ToString() const
+{
+    char Buffer[33];
+    std::snprintf(Buffer, sizeof(Buffer), "%08X%08X%08X%08X", A, B, C, D);
+    return Buffer;
+}
+
+//
+// FMappedFile
+//
+
+FMappedFile::~FMappedFile()
+{
+    Close();
+}
+
+#if defined(_WIN32)
+
+bool FMappedFile::Open(const std::string &Path, std::string *OutError)
+{
+    Close();
+
+    auto Failed = [this, &Path, OutError](const char *What) {
+        if (OutError)
+        {
+            *OutError = Path + ": " + What + " failed (" + std::to_string(GetLastError()) + ")";
+        }
+        Close();
+        return false;
+    };
+
+    FileHandle = CreateFileA(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (INVALID_HANDLE_VALUE == FileHandle)
+    {
+        FileHandle = nullptr;
+        return Failed("CreateFile");
+    }
+
+    LARGE_INTEGER FileSize;
+    if (!GetFileSizeEx(FileHandle, &FileSize))
+    {
+        return Failed("GetFileSizeEx");
+    }
+
+    // Nothing to map. Still a valid, empty file
+    Size = static_cast<size_t>(FileSize.QuadPart);
+    if (0 == Size)
+    {
+        return true;
+    }
+
+    MappingHandle = CreateFileMappingA(FileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!MappingHandle)
+    {
+        return Failed("CreateFileMapping");
+    }
+
+    Data = static_cast<const uint8_t *>(MapViewOfFile(MappingHandle, FILE_MAP_READ, 0, 0, 0));
+    if (!Data)
+    {
+        return Failed("MapViewOfFile");
+    }
+
+    return true;
+}
+
+void FMappedFile::Close()
+{
+    if (Data)
+    {
+        UnmapViewOfFile(Data);
+    }
+    if (MappingHandle)
+    {
+        CloseHandle(MappingHandle);
+    }
+    if (FileHandle)
+    {
+        CloseHandle(FileHandle);
+    }
+
+    Data = nullptr;
+    Size = 0;
+    MappingHandle = nullptr;
+    FileHandle = nullptr;
+}
+
+#else
+
+bool FMappedFile::Open(const std::string &Path, std::string *OutError)
+{
+    Close();
+
+    auto Failed = [this, &Path, OutError](const char *What) {
+        if (OutError)
+        {
+            *OutError = Path + ": " + What + " failed (" + std::strerror(errno) + ")";
+        }
+        Close();
+        return false;
+    };
+
+    FileDescriptor = open(Path.c_str(), O_RDONLY);
+    if (FileDescriptor < 0)
+    {
+        return Failed("open");
+    }
+
+    struct stat Stat;
+    if (fstat(FileDescriptor, &Stat) != 0)
+    {
+        return Failed("fstat");
+    }
+
+    Size = static_cast<size_t>(Stat.st_size);
+    if (0 == Size)
+    {
+        return true;
+    }
+
+    void *Mapping = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, FileDescriptor, 0);
+    if (MAP_FAILED == Mapping)
+    {
+        return Failed("mmap");
+    }
+    Data = static_cast<const uint8_t *>(Mapping);
+
+    // Entries are walked front to back
+    madvise(Mapping, Size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void FMappedFile::Close()
+{
+    if (Data)
+    {
+        munmap(const_cast<uint8_t *>(Data), Size);
+    }
+    if (FileDescriptor >= 0)
+    {
+        close(FileDescriptor);
+    }
+
+    Data = nullptr;
+    Size = 0;
+    FileDescriptor = -1;
+}
+
+#endif
+
+//
+// FPipelineCacheReader
+//
+
+bool FPipelineCacheReader::Open(const std::string &Path)
+{
+    Error.clear();
+    if (!File.Open(Path, &Error))
+    {
+        return false;
+    }
+
+    Data = File.GetData();
+    Size = File.GetSize();
+    return Parse();
+}
+
+bool FPipelineCacheReader::OpenMemory(const uint8_t *InData, size_t InSize)
+{
+    Error.clear();
+    File.Close();
+
+    Data = InData;
+    Size = InSize;
+    return Parse();
+}
+
+void FPipelineCacheReader::Close()
+{
+    File.Close();
+    Data = nullptr;
+    Size = 0;
+    NumEntries = 0;
+    EntriesOffset = 0;
+    EntriesEnd = 0;
+}
+
+bool FPipelineCacheReader::Fail(const std::string &Message) const
+{
+    Error = Message;
+    return false;
+}
+
+bool FPipelineCacheReader::Parse()
+{
+    using namespace PipelineCacheFormat;
+
+    Header = FPipelineCacheHeader();
+    SortedOrder = 0;
+    NumEntries = 0;
+
+    size_t Offset = 0;
+    if (!ReadValue(Data, Size, Offset, Header.Magic) || Magic != Header.Magic)
+    {
+        return Fail("Not a pipeline cache");
+    }
+
+    if (!ReadValue(Data, Size, Offset, Header.Version) || !ReadValue(Data, Size, Offset, Header.GameVersion) ||
+        !ReadValue(Data, Size, Offset, Header.ShaderPlatform) || !ReadGuid(Data, Size, Offset, Header.Guid) ||
+        !ReadValue(Data, Size, Offset, Header.TableOffset))
+    {
+        return Fail("Truncated header");
+    }
+
+    if (Header.Version < FirstWorking || Header.Version > Latest)
+    {
+        return Fail("Unsupported pipeline cache version " + std::to_string(Header.Version));
+    }
+
+    if (Header.Version >= LastUsedTime && !ReadValue(Data, Size, Offset, Header.LastGCUnixTime))
+    {
+        return Fail("Truncated header");
+    }
+
+    if (Header.TableOffset < Offset || Header.TableOffset >= Size)
+    {
+        return Fail("Table of contents is outside the file");
+    }
+
+    Offset = static_cast<size_t>(Header.TableOffset);
+    EntriesEnd = Size;
+
+    if (Header.Version >= TOCMagicGuard)
+    {
+        uint64_t Value = 0;
+        if (!ReadValue(Data, Size, Offset, Value) || TOCMagic != Value)
+        {
+            return Fail("Bad table of contents magic");
+        }
+
+        size_t EOFOffset = Size - sizeof(uint64_t);
+        if (!ReadValue(Data, Size, EOFOffset, Value) || EOFMagic != Value)
+        {
+            return Fail("Bad end of file magic. Was the file truncated?");
+        }
+        EntriesEnd = Size - sizeof(uint64_t);
+    }
+
+    if (!ReadValue(Data, Size, Offset, SortedOrder) || !ReadValue(Data, Size, Offset, NumEntries) || NumEntries < 0)
+    {
+        return Fail("Truncated table of contents");
+    }
+
+    // The count comes from whoever wrote the file. Don't let callers size anything from more than could fit
+    if (static_cast<uint64_t>(NumEntries) > (EntriesEnd - Offset) / MinEntrySize(Header.Version))
+    {
+        const int32_t Claimed = NumEntries;
+        NumEntries = 0;
+        return Fail("Table of contents claims " + std::to_string(Claimed) + " entries, more than the file holds");
+    }
+
+    EntriesOffset = Offset;
+    return true;
+}
+
+FPipelineCacheReader::FIterator::FIterator(const FPipelineCacheReader &InReader)
+    : Reader(InReader), Offset(InReader.EntriesOffset), Remaining(InReader.NumEntries)
+{
+}
+
+bool FPipelineCacheReader::FIterator::Next(FPipelineCacheEntry &OutEntry)
+{
+    using namespace PipelineCacheFormat;
+
+    if (Remaining <= 0)
+    {
+        return false;
+    }
+    --Remaining;
+
+    const uint8_t *Data = Reader.Data;
+    const size_t Size = Reader.EntriesEnd;
+    const uint32_t Version = Reader.Header.Version;
+
+    OutEntry = FPipelineCacheEntry();
+
+    auto &Stats = OutEntry.Stats;
+    if (!ReadValue(Data, Size, Offset, OutEntry.PSOHash) || !ReadValue(Data, Size, Offset, OutEntry.FileOffset) ||
+        !ReadValue(Data, Size, Offset, OutEntry.FileSize) || !ReadGuid(Data, Size, Offset, OutEntry.FileGuid) ||
+        !ReadValue(Data, Size, Offset, Stats.FirstFrameUsed) || !ReadValue(Data, Size, Offset, Stats.LastFrameUsed) ||
+        !ReadValue(Data, Size, Offset, Stats.CreateCount) || !ReadValue(Data, Size, Offset, Stats.TotalBindCount) ||
+        !ReadValue(Data, Size, Offset, Stats.PSOHash))
+    {
+        Remaining = 0;
+        return Reader.Fail("Truncated table of contents entry");
+    }
+
+    int32_t Num = 0;
+    if (LibraryID == Version)
+    {
+        if (!ReadValue(Data, Size, Offset, Num) || Num < 0 || !Skip(Size, Offset, uint64_t(Num) * sizeof(uint32_t)))
+        {
+            Remaining = 0;
+            return Reader.Fail("Truncated library ids");
+        }
+    }
+    else if (Version >= ShaderMetaData)
+    {
+        if (!ReadValue(Data, Size, Offset, Num) || Num < 0)
+        {
+            Remaining = 0;
+            return Reader.Fail("Truncated shader hashes");
+        }
+
+        OutEntry.ShaderHashes = Data + Offset;
+        OutEntry.NumShaders = static_cast<uint32_t>(Num);
+        if (!Skip(Size, Offset, uint64_t(Num) * ShaderHashSize))
+        {
+            Remaining = 0;
+            return Reader.Fail("Truncated shader hashes");
+        }
+    }
+
+    if ((Version >= PSOUsageFrequency && !ReadValue(Data, Size, Offset, OutEntry.UsageMask)) ||
+        (Version >= EngineFlags && !ReadValue(Data, Size, Offset, OutEntry.EngineFlags)) ||
+        (Version >= LastUsedTime && !ReadValue(Data, Size, Offset, OutEntry.LastUsedUnixTime)))
+    {
+        Remaining = 0;
+        return Reader.Fail("Truncated table of contents entry");
+    }
+
+    // Descriptors live between the header and the table of contents
+    if (OutEntry.FileOffset <= Reader.Header.TableOffset &&
+        OutEntry.FileSize <= Reader.Header.TableOffset - OutEntry.FileOffset)
+    {
+        OutEntry.Descriptor = Data + OutEntry.FileOffset;
+    }
+
+    return true;
+}
+
+//
+// FStableKeysReader
+//
+
+bool FStableKeysReader::Open(const std::string &Path)
+{
+    Error.clear();
+    return File.Open(Path, &Error);
+}
+
+uint64_t FStableKeysReader::Hash() const
+{
+    return HashBytes(File.GetData(), File.GetSize());
+}
+
+uint64_t HashBytes(const uint8_t *Data, size_t Size)
+{
+    constexpr uint64_t Prime = 0x100000001B3;
+    uint64_t Hash = 0xCBF29CE484222325 ^ Size;
+
+    size_t Offset = 0;
+    for (; Offset + sizeof(uint64_t) <= Size; Offset += sizeof(uint64_t))
+    {
+        uint64_t Word;
+        std::memcpy(&Word, Data + Offset, sizeof(Word));
+        Hash = (Hash ^ Word) * Prime;
+    }
+
+    for (; Offset < Size; ++Offset)
+    {
+        Hash = (Hash ^ Data[Offset]) * Prime;
+    }
+
+    // Words only mix downwards. Finish with a murmur finaliser so every bit counts
+    Hash ^= Hash >> 33;
+    Hash *= 0xFF51AFD7ED558CCD;
+    Hash ^= Hash >> 33;
+    Hash *= 0xC4CEB9FE1A85EC53;
+    Hash ^= Hash >> 33;
+    return Hash;
+}
+
+} // namespace PSOCacheTools
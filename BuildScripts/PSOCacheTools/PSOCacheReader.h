@@ -0,0 +1,295 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Engine-independent readers for pipeline cache files
+ *
+ * Everything here works straight off a read-only memory map, so opening a
+ * multi-GB merged cache costs a header read and walking it costs one pass over
+ * the table of contents. Nothing is copied. Entries point into the mapping and
+ * are only valid while their reader is alive.
+ *
+ * Used by the build scripts and CI, where no engine is running.
+ */
+namespace PSOCacheTools
+{
+
+/**
+ * Layout of .upipelinecache, as written by FPipelineFileCacheManager
+ *
+ * All values little-endian:
+ *   Header
+ *     uint64 Magic ("PIPECACH")
+ *     uint32 Version (EPipelineCacheFileFormatVersions)
+ *     uint32 GameVersion
+ *     uint8  ShaderPlatform
+ *     FGuid  Guid
+ *     uint64 TableOffset
+ *     int64  LastGCUnixTime (Version >= LastUsedTime)
+ *   PSO descriptors, each addressed by an entry in the table of contents
+ *   Table of contents, at TableOffset
+ *     uint64 Magic ("TOCSTAR2") (Version >= TOCMagicGuard)
+ *     uint32 SortedOrder
+ *     int32  NumEntries
+ *     NumEntries x { uint32 PSOHash, MetaData }
+ *   uint64 Magic ("EOF-MARK") (Version >= TOCMagicGuard)
+ *
+ * MetaData:
+ *   uint64 FileOffset, uint64 FileSize, FGuid FileGuid
+ *   int64 FirstFrameUsed, int64 LastFrameUsed, int64 CreateCount, int64 TotalBindCount, uint32 PSOHash
+ *   int32 Num, uint32 LibraryIds[Num] (Version == LibraryID)
+ *   int32 Num, uint8 ShaderHashes[Num][20] (Version >= ShaderMetaData)
+ *   uint64 UsageMask (Version >= PSOUsageFrequency)
+ *   uint16 EngineFlags (Version >= EngineFlags)
+ *   int64  LastUsedUnixTime (Version >= LastUsedTime)
+ */
+namespace PipelineCacheFormat
+{
+constexpr uint64_t Magic = 0x5049504543414348;
+constexpr uint64_t TOCMagic = 0x544F435354415232;
+constexpr uint64_t EOFMagic = 0x454F462D4D41524B;
+
+// EPipelineCacheFileFormatVersions. Only the ones that change what we read
+constexpr uint32_t FirstWorking = 7;
+constexpr uint32_t LibraryID = 9;
+constexpr uint32_t ShaderMetaData = 10;
+constexpr uint32_t TOCMagicGuard = 12;
+constexpr uint32_t PSOUsageFrequency = 13;
+constexpr uint32_t LastUsedTime = 20;
+constexpr uint32_t EngineFlags = 21;
+
+// Newest version we know the layout of
+constexpr uint32_t Latest = EngineFlags;
+
+constexpr size_t ShaderHashSize = 20;
+} // namespace PipelineCacheFormat
+
+struct FGuid
+{
+    uint32_t A = 0;
+    uint32_t B = 0;
+    uint32_t C = 0;
+    uint32_t D = 0;
+
+    std::string ToString() const;
+};
+
+/**
+ * Read-only memory map of a whole file
+ */
+class FMappedFile
+{
+public:
+    FMappedFile() = default;
+    ~FMappedFile();
+
+    FMappedFile(const FMappedFile &) = delete;
+    FMappedFile &operator=(const FMappedFile &) = delete;
+
+    bool Open(const std::string &Path, std::string *OutError = nullptr);
+    void Close();
+
+    const uint8_t *GetData() const
+    {
+        return Data;
+    }
+
+    size_t GetSize() const
+    {
+        return Size;
+    }
+
+private:
+    const uint8_t *Data = nullptr;
+    size_t Size = 0;
+
+#if defined(_WIN32)
+    void *FileHandle = nullptr;
+    void *MappingHandle = nullptr;
+#else
+    int FileDescriptor = -1;
+#endif
+};
+
+struct FPipelineCacheHeader
+{
+    uint64_t Magic = 0;
+    uint32_t Version = 0;
+    uint32_t GameVersion = 0;
+    uint8_t ShaderPlatform = 0;
+    FGuid Guid;
+    uint64_t TableOffset = 0;
+    int64_t LastGCUnixTime = 0;
+};
+
+struct FPipelineStateStats
+{
+    int64_t FirstFrameUsed = -1;
+    int64_t LastFrameUsed = -1;
+    int64_t CreateCount = 0;
+    int64_t TotalBindCount = 0;
+    uint32_t PSOHash = 0;
+};
+
+/**
+ * One table of contents entry. Pointers are into the mapping
+ */
+struct FPipelineCacheEntry
+{
+    // Key the engine dedupes PSOs by
+    uint32_t PSOHash = 0;
+
+    uint64_t FileOffset = 0;
+    uint64_t FileSize = 0;
+    FGuid FileGuid;
+    FPipelineStateStats Stats;
+
+    uint64_t UsageMask = 0;
+    uint16_t EngineFlags = 0;
+    int64_t LastUsedUnixTime = 0;
+
+    // NumShaders x 20 byte SHA hashes
+    const uint8_t *ShaderHashes = nullptr;
+    uint32_t NumShaders = 0;
+
+    // Serialised PSO descriptor. Null if the entry points outside the file
+    const uint8_t *Descriptor = nullptr;
+};
+
+/**
+ * Reader for .upipelinecache
+ *
+ * Open validates the header and the magic around the table of contents.
+ * Entries are then walked in file order:
+ *
+ *   FPipelineCacheEntry Entry;
+ *   for (auto It = Reader.CreateIterator(); It.Next(Entry);) { ... }
+ *   if (!Reader.GetError().empty()) { ... }
+ */
+class FPipelineCacheReader
+{
+public:
+    class FIterator
+    {
+    public:
+        /** Read the next entry. False at the end, or on a malformed entry (see GetError) */
+        bool Next(FPipelineCacheEntry &OutEntry);
+
+    private:
+        friend class FPipelineCacheReader;
+        explicit FIterator(const FPipelineCacheReader &InReader);
+
+        const FPipelineCacheReader &Reader;
+        size_t Offset;
+        int32_t Remaining;
+    };
+
+    /** Map and validate Path */
+    bool Open(const std::string &Path);
+
+    /** Read from memory owned by the caller, e.g. in tests. Must outlive the reader */
+    bool OpenMemory(const uint8_t *Data, size_t Size);
+
+    /** Unmap the file. Entries read from it are no longer valid */
+    void Close();
+
+    const FPipelineCacheHeader &GetHeader() const
+    {
+        return Header;
+    }
+
+    uint32_t GetSortedOrder() const
+    {
+        return SortedOrder;
+    }
+
+    int32_t GetNumEntries() const
+    {
+        return NumEntries;
+    }
+
+    const uint8_t *GetData() const
+    {
+        return Data;
+    }
+
+    size_t GetSize() const
+    {
+        return Size;
+    }
+
+    /** Why the last Open or Next failed. Empty if nothing has */
+    const std::string &GetError() const
+    {
+        return Error;
+    }
+
+    FIterator CreateIterator() const
+    {
+        return FIterator(*this);
+    }
+
+private:
+    bool Parse();
+    bool Fail(const std::string &Message) const;
+
+    FMappedFile File;
+    const uint8_t *Data = nullptr;
+    size_t Size = 0;
+
+    FPipelineCacheHeader Header;
+    uint32_t SortedOrder = 0;
+    int32_t NumEntries = 0;
+
+    // First byte after the table of contents' entry count
+    size_t EntriesOffset = 0;
+
+    // Where the entries must end. The EOF magic, if there is one
+    size_t EntriesEnd = 0;
+
+    mutable std::string Error;
+};
+
+/**
+ * Reader for stable shader key files (ShaderStableInfo-*.shk)
+ *
+ * Entries are serialised against the engine's name table, so the contents are
+ * only exposed as a whole. Enough for whole-file dedupe and sizing.
+ */
+class FStableKeysReader
+{
+public:
+    bool Open(const std::string &Path);
+
+    const uint8_t *GetData() const
+    {
+        return File.GetData();
+    }
+
+    size_t GetSize() const
+    {
+        return File.GetSize();
+    }
+
+    /** 64 bit content hash, FNV-1a over 8 byte words */
+    uint64_t Hash() const;
+
+    const std::string &GetError() const
+    {
+        return Error;
+    }
+
+private:
+    FMappedFile File;
+    std::string Error;
+};
+
+/** 64 bit content hash, FNV-1a over 8 byte words. Fast enough to hash GBs while they're mapped */
+uint64_t HashBytes(const uint8_t *Data, size_t Size);
+
+} // namespace PSOCacheTools
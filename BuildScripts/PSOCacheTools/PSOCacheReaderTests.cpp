@@ -0,0 +1,351 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+// Reader tests against in-memory caches. Run through ctest, or directly
+//
+//   PSOCacheReaderTests
+
+#include "PSOCacheReader.h"
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace PSOCacheTools;
+
+namespace
+{
+int NumFailed = 0;
+
+#define CHECK(Condition)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(Condition))                                                                                              \
+        {                                                                                                              \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #Condition);                         \
+            ++NumFailed;                                                                                               \
+        }                                                                                                              \
+    } while (0)
+
+/**
+ * Builds a cache the way FPipelineFileCacheManager lays it out, with every
+ * field the given version has. Entries are two shaders and a 16 byte descriptor
+ */
+struct FCacheBuilder
+{
+    std::vector<uint8_t> Bytes;
+    uint32_t Version = PipelineCacheFormat::Latest;
+
+    // Filled in by Build, for corrupting afterwards
+    size_t TableOffsetAt = 0;
+    size_t TableOffset = 0;
+    size_t NumEntriesAt = 0;
+
+    template <typename T>
+    void Put(const T &Value)
+    {
+        const auto *Data = reinterpret_cast<const uint8_t *>(&Value);
+        Bytes.insert(Bytes.end(), Data, Data + sizeof(T));
+    }
+
+    template <typename T>
+    void PutAt(size_t Offset, const T &Value)
+    {
+        std::memcpy(Bytes.data() + Offset, &Value, sizeof(T));
+    }
+
+    void Build(int32_t NumEntries)
+    {
+        using namespace PipelineCacheFormat;
+
+        Bytes.clear();
+        Put(Magic);
+        Put(Version);
+        Put(uint32_t(7));
+        Put(uint8_t(3));
+        Put(FGuid{1, 2, 3, 4});
+        TableOffsetAt = Bytes.size();
+        Put(uint64_t(0));
+        if (Version >= LastUsedTime)
+        {
+            Put(int64_t(1000));
+        }
+
+        std::vector<uint64_t> Offsets;
+        for (int32_t Index = 0; Index < NumEntries; ++Index)
+        {
+            Offsets.push_back(Bytes.size());
+            Bytes.insert(Bytes.end(), 16, static_cast<uint8_t>(Index));
+        }
+
+        TableOffset = Bytes.size();
+        PutAt(TableOffsetAt, uint64_t(TableOffset));
+
+        if (Version >= TOCMagicGuard)
+        {
+            Put(TOCMagic);
+        }
+        Put(uint32_t(0));
+        NumEntriesAt = Bytes.size();
+        Put(NumEntries);
+
+        for (int32_t Index = 0; Index < NumEntries; ++Index)
+        {
+            Put(uint32_t(0x1000 + Index));
+            Put(Offsets[Index]);
+            Put(uint64_t(16));
+            Put(FGuid{1, 2, 3, 4});
+            Put(int64_t(Index));
+            Put(int64_t(Index + 10));
+            Put(int64_t(1));
+            Put(int64_t(2));
+            Put(uint32_t(0x1000 + Index));
+
+            if (LibraryID == Version)
+            {
+                Put(int32_t(1));
+                Put(uint32_t(9));
+            }
+            else if (Version >= ShaderMetaData)
+            {
+                Put(int32_t(2));
+                Bytes.insert(Bytes.end(), 2 * ShaderHashSize, 0xAB);
+            }
+
+            if (Version >= PSOUsageFrequency)
+            {
+                Put(uint64_t(0xF0 + Index));
+            }
+            if (Version >= EngineFlags)
+            {
+                Put(uint16_t(5));
+            }
+            if (Version >= LastUsedTime)
+            {
+                Put(int64_t(2000 + Index));
+            }
+        }
+
+        if (Version >= TOCMagicGuard)
+        {
+            Put(EOFMagic);
+        }
+    }
+};
+
+std::vector<FPipelineCacheEntry> ReadAll(const FPipelineCacheReader &Reader)
+{
+    std::vector<FPipelineCacheEntry> Entries;
+    FPipelineCacheEntry Entry;
+    for (auto It = Reader.CreateIterator(); It.Next(Entry);)
+    {
+        Entries.push_back(Entry);
+    }
+    return Entries;
+}
+
+void TestRoundTrip()
+{
+    FCacheBuilder Builder;
+    Builder.Build(3);
+
+    FPipelineCacheReader Reader;
+    CHECK(Reader.OpenMemory(Builder.Bytes.data(), Builder.Bytes.size()));
+    CHECK(PipelineCacheFormat::Latest == Reader.GetHeader().Version);
+    CHECK(7 == Reader.GetHeader().GameVersion);
+    CHECK(3 == Reader.GetHeader().ShaderPlatform);
+    CHECK(1000 == Reader.GetHeader().LastGCUnixTime);
+    CHECK(3 == Reader.GetNumEntries());
+
+    const auto Entries = ReadAll(Reader);
+    CHECK(Reader.GetError().empty());
+    CHECK(3 == Entries.size());
+    if (3 == Entries.size())
+    {
+        CHECK(0x1002 == Entries[2].PSOHash);
+        CHECK(2 == Entries[2].Stats.FirstFrameUsed);
+        CHECK(12 == Entries[2].Stats.LastFrameUsed);
+        CHECK(2 == Entries[2].NumShaders);
+        CHECK(0xAB == Entries[2].ShaderHashes[0]);
+        CHECK(0xF2 == Entries[2].UsageMask);
+        CHECK(5 == Entries[2].EngineFlags);
+        CHECK(2002 == Entries[2].LastUsedUnixTime);
+        CHECK(Entries[2].Descriptor && 2 == Entries[2].Descriptor[0]);
+    }
+}
+
+void TestVersionGating()
+{
+    using namespace PipelineCacheFormat;
+
+    // Every version that changes the layout, plus one either side of the supported range
+    for (uint32_t Version : {LibraryID, ShaderMetaData, TOCMagicGuard, PSOUsageFrequency, LastUsedTime, EngineFlags})
+    {
+        FCacheBuilder Builder;
+        Builder.Version = Version;
+        Builder.Build(2);
+
+        FPipelineCacheReader Reader;
+        const bool bOpened = Reader.OpenMemory(Builder.Bytes.data(), Builder.Bytes.size());
+        CHECK(bOpened);
+
+        const auto Entries = ReadAll(Reader);
+        if (!Reader.GetError().empty() || 2 != Entries.size())
+        {
+            std::fprintf(stderr, "Version %u: %s\n", Version, Reader.GetError().c_str());
+            CHECK(false);
+            continue;
+        }
+
+        CHECK((Version >= ShaderMetaData ? 2u : 0u) == Entries[1].NumShaders);
+        CHECK((Version >= PSOUsageFrequency ? 0xF1u : 0u) == Entries[1].UsageMask);
+        CHECK((Version >= EngineFlags ? 5u : 0u) == Entries[1].EngineFlags);
+        CHECK((Version >= LastUsedTime ? 2001 : 0) == Entries[1].LastUsedUnixTime);
+        CHECK(Entries[1].Descriptor && 1 == Entries[1].Descriptor[0]);
+    }
+
+    for (uint32_t Version : {FirstWorking - 1, Latest + 1})
+    {
+        FCacheBuilder Builder;
+        Builder.Version = Version;
+        Builder.Build(1);
+
+        FPipelineCacheReader Reader;
+        CHECK(!Reader.OpenMemory(Builder.Bytes.data(), Builder.Bytes.size()));
+        CHECK(Reader.GetError().find("Unsupported") != std::string::npos);
+    }
+}
+
+void TestTruncated()
+{
+    FCacheBuilder Builder;
+    Builder.Build(2);
+
+    // Every cut short of the whole file fails, either at Open or while walking the entries
+    for (size_t Size = 0; Size < Builder.Bytes.size(); ++Size)
+    {
+        FPipelineCacheReader Reader;
+        if (Reader.OpenMemory(Builder.Bytes.data(), Size))
+        {
+            const auto Entries = ReadAll(Reader);
+            CHECK(!Reader.GetError().empty());
+        }
+        CHECK(!Reader.GetError().empty());
+    }
+
+    // Header
+    {
+        FPipelineCacheReader Reader;
+        CHECK(!Reader.OpenMemory(Builder.Bytes.data(), Builder.TableOffsetAt + 4));
+        CHECK("Truncated header" == Reader.GetError());
+    }
+
+    // Table of contents, before the entry count. No TOC magic on old versions, so nothing else catches it
+    {
+        FCacheBuilder Old;
+        Old.Version = PipelineCacheFormat::ShaderMetaData;
+        Old.Build(0);
+
+        FPipelineCacheReader Reader;
+        CHECK(!Reader.OpenMemory(Old.Bytes.data(), Old.NumEntriesAt + 2));
+        CHECK("Truncated table of contents" == Reader.GetError());
+    }
+
+    // Entries. One short, keeping the EOF magic so Open is happy
+    {
+        FCacheBuilder Short = Builder;
+        Short.Bytes.erase(Short.Bytes.end() - sizeof(uint64_t) - 4, Short.Bytes.end() - sizeof(uint64_t));
+
+        FPipelineCacheReader Reader;
+        CHECK(Reader.OpenMemory(Short.Bytes.data(), Short.Bytes.size()));
+
+        const auto Entries = ReadAll(Reader);
+        CHECK(1 == Entries.size());
+        CHECK(!Reader.GetError().empty());
+    }
+}
+
+void TestBadMagic()
+{
+    FCacheBuilder Builder;
+    Builder.Build(1);
+
+    const std::vector<std::pair<size_t, std::string>> Cases = {
+        {0, "Not a pipeline cache"},
+        {Builder.TableOffset, "Bad table of contents magic"},
+        {Builder.Bytes.size() - sizeof(uint64_t), "Bad end of file magic. Was the file truncated?"},
+    };
+
+    for (const auto &Case : Cases)
+    {
+        FCacheBuilder Bad = Builder;
+        Bad.Bytes[Case.first] ^= 0xFF;
+
+        FPipelineCacheReader Reader;
+        CHECK(!Reader.OpenMemory(Bad.Bytes.data(), Bad.Bytes.size()));
+        CHECK(Case.second == Reader.GetError());
+    }
+
+    // Table of contents pointing past the end
+    {
+        FCacheBuilder Bad = Builder;
+        Bad.PutAt(Bad.TableOffsetAt, uint64_t(Bad.Bytes.size()));
+
+        FPipelineCacheReader Reader;
+        CHECK(!Reader.OpenMemory(Bad.Bytes.data(), Bad.Bytes.size()));
+        CHECK("Table of contents is outside the file" == Reader.GetError());
+    }
+}
+
+void TestOversizedNumEntries()
+{
+    FCacheBuilder Builder;
+    Builder.Build(2);
+    Builder.PutAt(Builder.NumEntriesAt, int32_t(0x7FFFFFFF));
+
+    // Rejected up front, before anyone sizes a buffer from it
+    FPipelineCacheReader Reader;
+    CHECK(!Reader.OpenMemory(Builder.Bytes.data(), Builder.Bytes.size()));
+    CHECK(0 == Reader.GetNumEntries());
+    CHECK(Reader.GetError().find("more than the file holds") != std::string::npos);
+
+    // One more than fits is still too many. Exactly what fits is fine
+    Builder.PutAt(Builder.NumEntriesAt, int32_t(3));
+    CHECK(!Reader.OpenMemory(Builder.Bytes.data(), Builder.Bytes.size()));
+
+    Builder.PutAt(Builder.NumEntriesAt, int32_t(2));
+    CHECK(Reader.OpenMemory(Builder.Bytes.data(), Builder.Bytes.size()));
+    CHECK(2 == ReadAll(Reader).size());
+}
+
+void TestHashBytes()
+{
+    const uint8_t A[] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+    const uint8_t B[] = {1, 2, 3, 4, 5, 6, 7, 8, 10};
+    CHECK(HashBytes(A, sizeof(A)) == HashBytes(A, sizeof(A)));
+    CHECK(HashBytes(A, sizeof(A)) != HashBytes(B, sizeof(B)));
+    CHECK(HashBytes(A, 8) != HashBytes(A, 9));
+}
+} // namespace
+
+int main()
+{
+    const std::vector<std::pair<const char *, std::function<void()>>> Tests = {
+        {"RoundTrip", TestRoundTrip},
+        {"VersionGating", TestVersionGating},
+        {"Truncated", TestTruncated},
+        {"BadMagic", TestBadMagic},
+        {"OversizedNumEntries", TestOversizedNumEntries},
+        {"HashBytes", TestHashBytes},
+    };
+
+    for (const auto &Test : Tests)
+    {
+        const int Before = NumFailed;
+        Test.second();
+        std::printf("%s %s\n", NumFailed == Before ? "PASS" : "FAIL", Test.first);
+    }
+
+    return NumFailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCacheWriter.h"
+
+#include <cerrno>
+#include <cstring>
+
+namespace PSOCacheTools
+{
+
+namespace
+{
+constexpr size_t WriteBufferSize = 4 * 1024 * 1024;
+} // namespace
+
+FPipelineCacheWriter::~FPipelineCacheWriter()
+{
+    if (File)
+    {
+        std::fclose(File);
+        std::remove(Path.c_str());
+    }
+}
+
+bool FPipelineCacheWriter::Fail(const std::string &Message)
+{
+    Error = Path + ": " + Message;
+    if (File)
+    {
+        std::fclose(File);
+        File = nullptr;
+        std::remove(Path.c_str());
+    }
+    return false;
+}
+
+bool FPipelineCacheWriter::Write(const void *Data, size_t Size)
+{
+    if (Size > 0 && std::fwrite(Data, 1, Size, File) != Size)
+    {
+        return Fail(std::string("write failed (") + std::strerror(errno) + ")");
+    }
+
+    Offset += Size;
+    return true;
+}
+
+bool FPipelineCacheWriter::WriteGuid(const FGuid &Guid)
+{
+    return WriteValue(Guid.A) && WriteValue(Guid.B) && WriteValue(Guid.C) && WriteValue(Guid.D);
+}
+
+bool FPipelineCacheWriter::Open(const std::string &InPath, const FPipelineCacheHeader &InHeader)
+{
+    using namespace PipelineCacheFormat;
+
+    Path = InPath;
+    Header = InHeader;
+    Header.Magic = Magic;
+    Entries.clear();
+    Offset = 0;
+    Error.clear();
+
+    if (Header.Version < FirstWorking || Header.Version > Latest)
+    {
+        return Fail("Unsupported pipeline cache version " + std::to_string(Header.Version));
+    }
+
+    File = std::fopen(Path.c_str(), "wb");
+    if (!File)
+    {
+        return Fail(std::string("open failed (") + std::strerror(errno) + ")");
+    }
+    std::setvbuf(File, nullptr, _IOFBF, WriteBufferSize);
+
+    // TableOffset is patched once we know it
+    return WriteValue(Header.Magic) && WriteValue(Header.Version) && WriteValue(Header.GameVersion) &&
+           WriteValue(Header.ShaderPlatform) && WriteGuid(Header.Guid) && WriteValue(Header.TableOffset) &&
+           (Header.Version < LastUsedTime || WriteValue(Header.LastGCUnixTime));
+}
+
+bool FPipelineCacheWriter::AddEntry(const FPipelineCacheEntry &Entry)
+{
+    if (!File)
+    {
+        return false;
+    }
+
+    if (!Entry.Descriptor && Entry.FileSize > 0)
+    {
+        return Fail("Entry has no descriptor");
+    }
+
+    FPipelineCacheEntry Copy = Entry;
+    Copy.FileOffset = Offset;
+    Copy.FileGuid = Header.Guid;
+    Entries.push_back(Copy);
+
+    return Write(Entry.Descriptor, static_cast<size_t>(Entry.FileSize));
+}
+
+bool FPipelineCacheWriter::Close(uint32_t SortedOrder)
+{
+    using namespace PipelineCacheFormat;
+
+    if (!File)
+    {
+        return false;
+    }
+
+    const uint64_t TableOffset = Offset;
+    const uint32_t Version = Header.Version;
+
+    if (Version >= TOCMagicGuard && !WriteValue(TOCMagic))
+    {
+        return false;
+    }
+
+    if (!WriteValue(SortedOrder) || !WriteValue(static_cast<int32_t>(Entries.size())))
+    {
+        return false;
+    }
+
+    for (const auto &Entry : Entries)
+    {
+        const auto &Stats = Entry.Stats;
+        bool bOk = WriteValue(Entry.PSOHash) && WriteValue(Entry.FileOffset) && WriteValue(Entry.FileSize) &&
+                   WriteGuid(Entry.FileGuid) && WriteValue(Stats.FirstFrameUsed) && WriteValue(Stats.LastFrameUsed) &&
+                   WriteValue(Stats.CreateCount) && WriteValue(Stats.TotalBindCount) && WriteValue(Stats.PSOHash);
+
+        // Library ids were dropped by the engine too. Write an empty set
+        if (bOk && LibraryID == Version)
+        {
+            bOk = WriteValue(int32_t(0));
+        }
+        else if (bOk && Version >= ShaderMetaData)
+        {
+            bOk = WriteValue(static_cast<int32_t>(Entry.NumShaders)) &&
+                  Write(Entry.ShaderHashes, size_t(Entry.NumShaders) * ShaderHashSize);
+        }
+
+        bOk = bOk && (Version < PSOUsageFrequency || WriteValue(Entry.UsageMask)) &&
+              (Version < EngineFlags || WriteValue(Entry.EngineFlags)) &&
+              (Version < LastUsedTime || WriteValue(Entry.LastUsedUnixTime));
+
+        if (!bOk)
+        {
+            return false;
+        }
+    }
+
+    if (Version >= TOCMagicGuard && !WriteValue(EOFMagic))
+    {
+        return false;
+    }
+
+    // Magic, Version, GameVersion, ShaderPlatform, Guid
+    constexpr long TableOffsetPosition = 8 + 4 + 4 + 1 + 16;
+    if (std::fseek(File, TableOffsetPosition, SEEK_SET) != 0 || std::fwrite(&TableOffset, 1, 8, File) != 8)
+    {
+        return Fail("Could not write table offset");
+    }
+
+    Header.TableOffset = TableOffset;
+    const bool bClosed = 0 == std::fclose(File);
+    File = nullptr;
+    Entries.clear();
+
+    if (!bClosed)
+    {
+        std::remove(Path.c_str());
+        Error = Path + ": close failed";
+    }
+    return bClosed;
+}
+
+} // namespace PSOCacheTools
@@ -0,0 +1,65 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "PSOCacheReader.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace PSOCacheTools
+{
+
+/**
+ * Writes a .upipelinecache in the layout described in PSOCacheReader.h
+ *
+ * Descriptors are streamed out as entries are added. Entry metadata is kept
+ * until Close writes the table of contents, so the shader hashes an entry
+ * points at must stay mapped until then.
+ */
+class FPipelineCacheWriter
+{
+public:
+    ~FPipelineCacheWriter();
+
+    /** Start Path. Header.Version picks which optional fields are written. TableOffset is filled in by Close */
+    bool Open(const std::string &Path, const FPipelineCacheHeader &InHeader);
+
+    /** Append Entry's descriptor. FileOffset and FileGuid are rewritten to match this file */
+    bool AddEntry(const FPipelineCacheEntry &Entry);
+
+    /** Write the table of contents and finish the file */
+    bool Close(uint32_t SortedOrder);
+
+    uint64_t GetBytesWritten() const
+    {
+        return Offset;
+    }
+
+    const std::string &GetError() const
+    {
+        return Error;
+    }
+
+private:
+    bool Write(const void *Data, size_t Size);
+
+    template <typename T>
+    bool WriteValue(const T &Value)
+    {
+        return Write(&Value, sizeof(T));
+    }
+
+    bool WriteGuid(const FGuid &Guid);
+    bool Fail(const std::string &Message);
+
+    std::FILE *File = nullptr;
+    std::string Path;
+    FPipelineCacheHeader Header;
+    std::vector<FPipelineCacheEntry> Entries;
+    uint64_t Offset = 0;
+    std::string Error;
+};
+
+} // namespace PSOCacheTools
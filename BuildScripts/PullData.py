@@ -1,4 +1,5 @@
 import requests
+import concurrent.futures
 import os
 import random
 import secrets
@@ -6,11 +7,142 @@ import base64
 import json
 import datetime
 import sys
+import time
+
+import PCOEnvelope
+import PCOPaging
+
+# Servers that know the binary envelope reply with it, everyone else sends JSON
+# Payloads compress well, so ask for gzip on the wire too
+header = {
+    "Content-type": "application/json",
+    "Accept": "{}, application/json".format(PCOEnvelope.ContentType),
+    "Accept-Encoding": "gzip"
+}
+
+
+def Report(dataType, startTime, wireBytes, dataBytes):
+    elapsed = max(time.time() - startTime, 1e-6)
+    ratio = 100.0 * wireBytes / dataBytes if dataBytes > 0 else 100.0
+    print("{}: {:.2f} MB on the wire, {:.2f} MB written ({:.1f}%), {:.1f}s".format(
+        dataType, wireBytes / (1024 * 1024), dataBytes / (1024 * 1024), ratio, elapsed))
+
+def LoadPullState():
+    try:
+        with open(os.path.join(OutDirectory, PullStateFile), "r") as f:
+            return json.load(f)
+    except (OSError, ValueError):
+        return {}
+
+
+def SavePullState(state):
+    # Write then rename, so an interrupted save can't lose what we've already pulled
+    path = os.path.join(OutDirectory, PullStateFile)
+    with open(path + ".tmp", "w") as f:
+        json.dump(state, f, indent=4)
+    os.replace(path + ".tmp", path)
+
+
+def PageDirectory():
+    return os.path.join(OutDirectory, ".pages")
+
+
+def FetchPage(url, requestData, dataType, page, pageSize, before):
+    """Stream one page to disk. Returns its metadata, or None if it couldn't be fetched"""
+    body = dict(requestData)
+    body["page"] = page
+    body["pagesize"] = pageSize
+    if before:
+        body["before"] = before
+
+    pagePath = os.path.join(PageDirectory(), "{}_{}.page".format(dataType, page))
+    partPath = pagePath + ".part"
+
+    for attempt in range(PageRetries):
+        try:
+            with requests.post(url, data=json.dumps(body), headers=header, stream=True, timeout=RequestTimeout) as p:
+                if p.status_code != 200:
+                    raise IOError("HTTP {}".format(p.status_code))
+
+                # Straight to disk. Nothing bigger than a chunk is held in memory
+                with open(partPath, "wb") as f:
+                    for chunk in p.iter_content(ChunkSize):
+                        f.write(chunk)
+
+                # Streamed bodies aren't checked against their length for us
+                expected = p.headers.get("Content-Length")
+                if expected is not None and p.raw.tell() != int(expected):
+                    raise IOError("Truncated after {} of {} bytes".format(p.raw.tell(), expected))
+
+                meta = {
+                    "contenttype": p.headers.get("Content-Type", ""),
+                    "before": p.headers.get(PCOPaging.HeaderBefore),
+                    "pages": int(p.headers.get(PCOPaging.HeaderPages, "1")),
+                    "pagesize": int(p.headers.get(PCOPaging.HeaderPageSize, pageSize)),
+                    "wirebytes": p.raw.tell()
+                }
+
+            # The page file only appears once it's complete, with its metadata already beside it
+            with open(pagePath + ".json", "w") as f:
+                json.dump(meta, f)
+            os.replace(partPath, pagePath)
+            return meta
+
+        except (IOError, ValueError, requests.RequestException) as e:
+            print("{} page {}: {} (attempt {} of {})".format(dataType, page, e, attempt + 1, PageRetries))
+            time.sleep(min(2 ** attempt, 30))
+
+    return None
+
+
+def ExtractPage(dataType, page, ext):
+    """Write out the items of a downloaded page, then remove it. Returns (items, bytes written)"""
+    pagePath = os.path.join(PageDirectory(), "{}_{}.page".format(dataType, page))
+    with open(pagePath + ".json", "r") as f:
+        meta = json.load(f)
+
+    index = 0
+    dataBytes = 0
+
+    def Write(filename, data):
+        with open(os.path.join(OutDirectory, filename), "wb") as f:
+            f.write(data)
+
+    with open(pagePath, "rb") as f:
+        if meta["contenttype"].startswith(PCOEnvelope.ContentType):
+            # Raw payloads, nothing to decode unless the server stored them compressed
+            for fields, flags, data in PCOEnvelope.Decode(f):
+                data = PCOEnvelope.UnpackPayload(flags, data)
+                dataBytes += len(data)
+
+                Write("V{}_{}_{}_{}.{}".format(fields["version"], PullStamp, page, index, ext), data)
+                index += 1
+        else:
+            # One page at most
+            for shader in json.load(f):
+                if (dataType == "pipelinecache"):
+                    data = base64.b64decode(shader["pipelinecachedata"])
+                elif (dataType == "shk"):
+                    data = base64.b64decode(shader["stablekeyinfodata"])
+                elif (dataType == "hitchlist"):
+                    data = base64.b64decode(shader["hitchlistdata"])
+                else:
+                    raise ValueError("Unknown type {}".format(dataType))
+
+                dataBytes += len(data)
+
+                Write("V{}.{}.{}.{}_{}_{}_{}.{}".format(shader["versionmajor"], shader["versionminor"], shader["versionrevision"], shader["versionbuild"], PullStamp, page, index, ext), data)
+                index += 1
+
+    # Same names every time, so being interrupted in here just means writing them again
+    os.remove(pagePath)
+    os.remove(pagePath + ".json")
+    return index, dataBytes
 
-header = {"Content-type": "application/json"} 
 
 def DownloadData(url, dataType, sDate, machineCredsB64, projectCredsB64, Platform, ShaderModel, ext=""):
     global header
+    global PullStamp
     requestData = {
         "date": sDate,
         "machine": machineCredsB64,
@@ -23,51 +155,126 @@ def DownloadData(url, dataType, sDate, machineCredsB64, projectCredsB64, Platfor
     if len(ext) == 0:
         ext = dataType
 
-    p = requests.post(url, data=json.dumps(requestData), headers=header)
+    startTime = time.time()
+
+    if not os.path.exists(PageDirectory()):
+        os.makedirs(PageDirectory())
+
+    # Pick up where an interrupted pull left off, snapshot and all
+    pulls = pullState.setdefault("pulls", {})
+    pull = pulls.get(dataType)
+    if pull is None:
+        pull = {"after": sDate, "before": None, "pages": None, "pagesize": PageSize, "done": [], "stamp": PullStamp}
+        pulls[dataType] = pull
+    else:
+        print("Resuming {} after {}: {} of {} pages done".format(dataType, pull["after"], len(pull["done"]), pull["pages"]))
+        requestData["date"] = pull["after"]
+        PullStamp = pull["stamp"]
 
-    ### Pull ShaderPipelines
-    print(p.status_code)
-    if p.status_code == 200:
-        jsonblob = p.json()
-        index = 0
+    totals = {"items": 0, "wire": 0, "data": 0}
 
-        print("Fetching {} items".format(len(jsonblob)))
+    def Fetch(page):
+        pagePath = os.path.join(PageDirectory(), "{}_{}.page".format(dataType, page))
+        if os.path.exists(pagePath):
+            with open(pagePath + ".json", "r") as f:
+                meta = json.load(f)
+        else:
+            meta = FetchPage(url, requestData, dataType, page, pull["pagesize"], pull["before"])
+            if meta is None:
+                return None
 
-        for shader in jsonblob:
-            
-            print("{} -> V{}.{}.{}.{}_{}.{}".format(index, shader["versionmajor"], shader["versionminor"], shader["versionrevision"], shader["versionbuild"], index, ext))
-            filename = "V{}.{}.{}.{}_{}.{}".format(shader["versionmajor"], shader["versionminor"], shader["versionrevision"], shader["versionbuild"], index, ext)
-            index += 1
+        try:
+            items, dataBytes = ExtractPage(dataType, page, ext)
+        except (EOFError, ValueError, KeyError) as e:
+            # Bad page. Throw it away so a resume fetches it again
+            print("{} page {}: {}".format(dataType, page, e))
+            os.remove(pagePath)
+            os.remove(pagePath + ".json")
+            return None
 
-            if (dataType == "pipelinecache"):
-                data = base64.b64decode(shader["pipelinecachedata"])
-            elif (dataType == "shk"):
-                data = base64.b64decode(shader["stablekeyinfodata"])
+        return meta, items, dataBytes
+
+    def Done(page, result):
+        meta, items, dataBytes = result
+        totals["items"] += items
+        totals["wire"] += meta["wirebytes"]
+        totals["data"] += dataBytes
+
+        pull["done"].append(page)
+        SavePullState(pullState)
+        print("{} page {}: {} items".format(dataType, page, items))
+
+    # The first page fixes the snapshot and says how many more there are
+    if 0 not in pull["done"]:
+        result = Fetch(0)
+        if result is None:
+            SavePullState(pullState)
+            return -1
+
+        meta = result[0]
+        pull["before"] = meta["before"]
+        pull["pages"] = meta["pages"]
+        pull["pagesize"] = meta["pagesize"]
+        Done(0, result)
+
+    # Servers that don't page send everything as page 0
+    remaining = [page for page in range(1, pull["pages"] or 1) if page not in pull["done"]]
+    failed = 0
+
+    with concurrent.futures.ThreadPoolExecutor(max_workers=ParallelPages) as pool:
+        futures = {pool.submit(Fetch, page): page for page in remaining}
+        for future in concurrent.futures.as_completed(futures):
+            result = future.result()
+            if result is None:
+                failed += 1
             else:
-                return -1
+                Done(futures[future], result)
+
+    if failed > 0:
+        print("{}: {} pages failed. Run again to resume".format(dataType, failed))
+        return -1
 
-            with open(os.path.join(OutDirectory, filename), "wb") as f:
-                f.write(data)
+    print("Fetched {} items in {} pages".format(totals["items"], pull["pages"] or 1))
+    Report(dataType, startTime, totals["wire"], totals["data"])
 
-        return 0
+    # Everything up to the snapshot is here
+    pullState[dataType] = pull["before"] or str(dNow)
+    del pulls[dataType]
+    SavePullState(pullState)
+    return 0
 
 
 
-if len(sys.argv) != 6:
-    print("Incorrect number of args: <Platform> <ShaderModel> <OutDirectory> <MachineCredentialFile> <ProjectCredentialFile>")
+if len(sys.argv) != 6 and len(sys.argv) != 7:
+    print("Incorrect number of args: <Platform> <ShaderModel> <OutDirectory> <MachineCredentialFile> <ProjectCredentialFile> [<ServerURL>]")
 
 Platform = sys.argv[1]
 ShaderModel = sys.argv[2]
 OutDirectory = sys.argv[3]
 MachineCredentialFile = sys.argv[4]
 ProjectCredentialFile = sys.argv[5]
+ServerURL = sys.argv[6] if len(sys.argv) == 7 else "https://<domain>"
+
+# Pages are fetched ParallelPages at a time, each streamed to disk, and retried PageRetries times
+PageSize = int(os.environ.get("PCO_PAGE_SIZE", PCOPaging.DefaultPageSize))
+ParallelPages = int(os.environ.get("PCO_PARALLEL_PAGES", 4))
+PageRetries = 3
+RequestTimeout = 120
+ChunkSize = 1024 * 1024
 
 # Linux PCD3D_SM5 \"${WORKSPACE}/PipelineBuilds/PCD3D_SM5\" \"${PullMachineCreds}\""
 
+# Remembers how far each type has been pulled, so each run only fetches what's new since the last one
+# Delete it to pull the whole window again
+PullStateFile = "PullState.json"
+
 dNow = datetime.datetime.now()
-sDate = str(dNow - datetime.timedelta(days=14))
+sWindow = str(dNow - datetime.timedelta(days=14))
+
+# Files from every pull sit side by side, so names must not repeat between runs
+PullStamp = dNow.strftime("%Y%m%d%H%M%S")
 
-print("Fetching before {}".format(sDate))
+pullState = LoadPullState()
 
 uploadURL = "/api/pco/date/after/"
 
@@ -81,12 +288,17 @@ uploadURL = "/api/pco/date/after/"
 #     projectCredsB64 = f.readline()
 
 
-rootUrl = "https://<domain>" + uploadURL
+rootUrl = ServerURL.rstrip("/") + uploadURL
 
-retVal = DownloadData(rootUrl, "pipelinecache", sDate, MachineCredentialFile, ProjectCredentialFile, Platform, ShaderModel, "upipelinecache")
-if (0 != retVal):
-    exit(retVal)
+# Hitch lists rank the PSOs players hitched on, for PSOCacheMerge to put first. Only an ordering hint, so a
+# server that doesn't have them doesn't fail the pull
+for dataType, ext, required in [("pipelinecache", "upipelinecache", True), ("shk", "", True), ("hitchlist", "", False)]:
+    # Dates compare as strings. Anything uploaded after a pull's snapshot is fetched next time
+    sDate = max(pullState.get(dataType, sWindow), sWindow)
+    print("Fetching {} after {}".format(dataType, sDate))
 
-retVal = DownloadData(rootUrl, "shk", sDate, MachineCredentialFile, ProjectCredentialFile, Platform, ShaderModel)
-if (0 != retVal):
-    exit(retVal)
\ No newline at end of file
+    retVal = DownloadData(rootUrl, dataType, sDate, MachineCredentialFile, ProjectCredentialFile, Platform, ShaderModel, ext)
+    if (0 != retVal):
+        if required:
+            exit(retVal)
+        print("No {} this time".format(dataType))
\ No newline at end of file
@@ -1,10 +1,18 @@
 // Copyright Chris Anderson, 2022. All Rights Reserved.
 
 #include "LoadHelpers.h"
+#include "Async/Async.h"
 #include "Engine/Engine.h"
 #include "Kismet/GameplayStatics.h"
+#include "PSOCompileScheduler.h"
 #include "ShaderPipelineCache.h"
-#include "TimerManager.h"
+
+namespace LoadHelpers
+{
+// Progress only has to be as fresh as a loading bar, and waiting for everything completes from the cache's own
+// notification. Counted waits finish at most this late
+constexpr float ProgressPollSeconds = 0.1f;
+} // namespace LoadHelpers
 
 UPSOLevelLoadHelper *UPSOLevelLoadHelper::AsyncCompilePSOShaders(UObject *WorldContextObject, const int32 MaxShaders)
 {
@@ -52,16 +60,15 @@ UPSOLevelLoadHelper *UPSOLevelLoadHelper::AsyncPrecompilePSOShadersWithFeedback(
 
 void UPSOLevelLoadHelper::Activate()
 {
-    auto World = WorldInstance->GetWorld();
+    auto World = WorldInstance.IsValid() ? WorldInstance->GetWorld() : nullptr;
 
     switch (Operation)
     {
     case EPSOState::Preload:
         // Initialise PSO Rate to precompile mode
-        FShaderPipelineCache::SetBatchMode(FShaderPipelineCache::BatchMode::Precompile);
-        if (FShaderPipelineCache::IsBatchingPaused())
+        if (!AcquireRequest(E_PSOCompileRequest::LoadingScreen))
         {
-            FShaderPipelineCache::ResumeBatching();
+            break;
         }
 
         // FShaderPipelineCache::OnPrecompilationComplete.BindUObject(this, &UPSOLevelLoadHelper::WaitForBatch);
@@ -78,10 +85,7 @@ void UPSOLevelLoadHelper::Activate()
             return;
         }
 
-        if (World)
-        {
-            World->GetTimerManager().SetTimer(StepHandler, this, &UPSOLevelLoadHelper::WaitForBatch, 1.0f, true);
-        }
+        BeginWaiting();
         return;
 
     case EPSOState::Compile:
@@ -89,10 +93,9 @@ void UPSOLevelLoadHelper::Activate()
         if ((MaxShaders == -1 || MaxShaders > 0) && World)
         {
             // Initialise PSO Rate
-            FShaderPipelineCache::SetBatchMode(FShaderPipelineCache::BatchMode::Fast);
-            if (FShaderPipelineCache::IsBatchingPaused())
+            if (!AcquireRequest(E_PSOCompileRequest::Fast))
             {
-                FShaderPipelineCache::ResumeBatching();
+                break;
             }
 
             ReferenceCurrentShaders = FShaderPipelineCache::NumPrecompilesRemaining();
@@ -107,9 +110,7 @@ void UPSOLevelLoadHelper::Activate()
                 return;
             }
 
-            World->GetTimerManager().SetTimer(StepHandler, this, &UPSOLevelLoadHelper::WaitForBatch, 0.35f, true);
-            // WaitForBatch(MaxShaders, FOnAsyncPSOLoadedInternalCallback::CreateUObject(this,
-            // &UPSOLevelLoadHelper::ExecuteCompleted));
+            BeginWaiting();
             return;
         }
 
@@ -122,10 +123,9 @@ void UPSOLevelLoadHelper::Activate()
         if ((MaxShaders == -1 || MaxShaders > 0) && World)
         {
             // Initialise PSO Rate
-            FShaderPipelineCache::SetBatchMode(FShaderPipelineCache::BatchMode::Background);
-            if (FShaderPipelineCache::IsBatchingPaused())
+            if (!AcquireRequest(E_PSOCompileRequest::Background))
             {
-                FShaderPipelineCache::ResumeBatching();
+                break;
             }
 
             ReferenceCurrentShaders = FShaderPipelineCache::NumPrecompilesRemaining();
@@ -137,9 +137,7 @@ void UPSOLevelLoadHelper::Activate()
                 return;
             }
 
-            World->GetTimerManager().SetTimer(StepHandler, this, &UPSOLevelLoadHelper::WaitForBatch, 0.35f, true, 0.5f);
-            // WaitForBatch(MaxShaders, FOnAsyncPSOLoadedInternalCallback::CreateUObject(this,
-            // &UPSOLevelLoadHelper::ExecuteCompleted));
+            BeginWaiting();
             return;
         }
 
@@ -147,66 +145,211 @@ void UPSOLevelLoadHelper::Activate()
         ExecuteCompleted(-1);
         return;
     case EPSOState::Halt:
-        if (!FShaderPipelineCache::IsBatchingPaused())
-        {
-            FShaderPipelineCache::PauseBatching();
-        }
-
+        // Outlives completion, until ReleaseHalt
+        AcquireRequest(E_PSOCompileRequest::Halt);
         ExecuteCompleted(-1);
         return;
-    default:;
+    default:
+        UE_LOG(LogScript, Error, TEXT("UAsyncActionHandleSaveGame Created with invalid operation!"));
     }
 
-    UE_LOG(LogScript, Error, TEXT("UAsyncActionHandleSaveGame Created with invalid operation!"));
-
     ExecuteCompleted(-1);
 }
 
-void UPSOLevelLoadHelper::WaitForBatch() // const int MaxShaders, FOnAsyncPSOLoadedInternalCallback Delegate)
+bool UPSOLevelLoadHelper::AcquireRequest(E_PSOCompileRequest Kind)
 {
-    const auto World = WorldInstance->GetWorld();
-    if (!IsValid(World))
+    const auto Scheduler = UPSOCompileScheduler::Get(WorldInstance.Get());
+    if (!Scheduler)
     {
-        // Big problems!
-        // We can't actually turn off this timer!
-        checkNoEntry();
+        UE_LOG(LogScript, Error, TEXT("No PSO compile scheduler. Is there a game instance?"));
+        return false;
     }
 
-    const auto currentShader = FShaderPipelineCache::NumPrecompilesRemaining();
+    SchedulerRequest = Scheduler->AddRequest(Kind);
+    return true;
+}
 
-    Updated.Broadcast(currentShader, ReferenceCurrentShaders);
+void UPSOLevelLoadHelper::ReleaseRequest()
+{
+    if (0 == SchedulerRequest)
+    {
+        return;
+    }
 
-    if (-1 == MaxShaders)
+    if (const auto Scheduler = UPSOCompileScheduler::Get(WorldInstance.Get()))
     {
-        // Ha...
-        // Go to finish
-        GEngine->AddOnScreenDebugMessage(657414561, 5.f, FColor::Red,
-                                         FString::FromInt(currentShader) + FString(" shaders remaining"));
+        Scheduler->RemoveRequest(SchedulerRequest);
+    }
+    SchedulerRequest = 0;
+}
+
+void UPSOLevelLoadHelper::BeginWaiting()
+{
+    LastIterationShaders = ReferenceCurrentShaders;
+
+    // Completion comes from the cache itself. The slow poll reports progress, finishes counted waits, and
+    // backs up the notification where it doesn't fire, e.g. batches drained without a precompile
+    PrecompileCompleteHandle = FShaderPipelineCache::GetPrecompilationCompleteDelegate().AddUObject(
+        this, &UPSOLevelLoadHelper::OnPrecompilationComplete);
+    StepHandler = FTSTicker::GetCoreTicker().AddTicker(
+        FTickerDelegate::CreateUObject(this, &UPSOLevelLoadHelper::TickProgress), LoadHelpers::ProgressPollSeconds);
+}
 
-        if (FShaderPipelineCache::IsBatchingPaused())
+void UPSOLevelLoadHelper::StopWaiting()
+{
+    if (StepHandler.IsValid())
+    {
+        FTSTicker::GetCoreTicker().RemoveTicker(StepHandler);
+        StepHandler.Reset();
+    }
+
+    if (PrecompileCompleteHandle.IsValid())
+    {
+        FShaderPipelineCache::GetPrecompilationCompleteDelegate().Remove(PrecompileCompleteHandle);
+        PrecompileCompleteHandle.Reset();
+    }
+}
+
+bool UPSOLevelLoadHelper::TickProgress(float DeltaTime)
+{
+    // Game instance (and with it the world) is gone. Nobody is waiting on a loading screen any more
+    if (!WorldInstance.IsValid())
+    {
+        Cancel();
+        return false;
+    }
+
+    WaitForBatch();
+    return !bFinished;
+}
+
+void UPSOLevelLoadHelper::OnPrecompilationComplete(uint32 Count, double Seconds,
+                                                   const FShaderCachePrecompileContext &Context)
+{
+    // Not necessarily raised on the game thread
+    TWeakObjectPtr<UPSOLevelLoadHelper> WeakThis(this);
+    AsyncTask(ENamedThreads::GameThread, [WeakThis]() {
+        if (WeakThis.IsValid() && !WeakThis->bFinished)
         {
-            GEngine->AddOnScreenDebugMessage(-1, 5.f, FColor::Magenta, FString("Why are we paused?"));
-            FShaderPipelineCache::ResumeBatching();
+            WeakThis->WaitForBatch();
         }
+    });
+}
+
+void UPSOLevelLoadHelper::Cancel()
+{
+    if (bFinished)
+    {
+        return;
+    }
+
+    bFinished = true;
+    StopWaiting();
+    ReleaseRequest();
+
+    Cancelled.Broadcast(FShaderPipelineCache::NumPrecompilesRemaining(), ReferenceCurrentShaders);
+    SetReadyToDestroy();
+}
+
+void UPSOLevelLoadHelper::WaitForBatch() // const int MaxShaders, FOnAsyncPSOLoadedInternalCallback Delegate)
+{
+    const auto currentShader = FShaderPipelineCache::NumPrecompilesRemaining();
 
+    if (currentShader != LastIterationShaders)
+    {
+        LastIterationShaders = currentShader;
+        Updated.Broadcast(currentShader, ReferenceCurrentShaders);
+    }
+
+    if (-1 == MaxShaders)
+    {
+        // Ha...
+        // Go to finish
         if (0 == currentShader)
         {
             // Execute
-            World->GetTimerManager().ClearTimer(StepHandler);
-            ExecuteCompleted(ReferenceCurrentShaders - currentShader);
+            StopWaiting();
+            ExecuteCompleted(currentShader);
         }
     }
     else if ((ReferenceCurrentShaders - currentShader) >= MaxShaders)
     {
-        // Cancel the timer
-        World->GetTimerManager().ClearTimer(StepHandler);
-        FShaderPipelineCache::PauseBatching();
-        ExecuteCompleted(ReferenceCurrentShaders - currentShader);
+        // Done with our share. Batching carries on if someone else still wants it
+        StopWaiting();
+        ExecuteCompleted(currentShader);
     }
 }
 
 void UPSOLevelLoadHelper::ExecuteCompleted(const int RemainingShaders)
 {
-    Completed.Broadcast(RemainingShaders, RemainingShaders);
+    if (bFinished)
+    {
+        return;
+    }
+
+    bFinished = true;
+    if (EPSOState::Halt != Operation)
+    {
+        ReleaseRequest();
+    }
+    Completed.Broadcast(RemainingShaders, ReferenceCurrentShaders);
+
+    // Kept registered while holding a halt, so the request isn't lost with us
+    if (0 == SchedulerRequest)
+    {
+        SetReadyToDestroy();
+    }
+}
+
+void UPSOLevelLoadHelper::ReleaseHalt()
+{
+    if (EPSOState::Halt != Operation || 0 == SchedulerRequest)
+    {
+        return;
+    }
+
+    ReleaseRequest();
+    SetReadyToDestroy();
+}
+
+UPSODeadlineCompileHelper *UPSODeadlineCompileHelper::AsyncCompilePSOShadersForDuration(UObject *WorldContextObject,
+                                                                                        const float Milliseconds)
+{
+    auto Action = NewObject<UPSODeadlineCompileHelper>();
+    Action->Milliseconds = Milliseconds;
+    Action->Handle = 0;
+    Action->RegisterWithGameInstance(WorldContextObject);
+    Action->WorldInstance = Cast<UGameInstance>(UGameplayStatics::GetGameInstance(WorldContextObject));
+
+    return Action;
+}
+
+void UPSODeadlineCompileHelper::Activate()
+{
+    const auto Scheduler = UPSOCompileScheduler::Get(WorldInstance.Get());
+    if (!Scheduler)
+    {
+        UE_LOG(LogScript, Error, TEXT("No PSO compile scheduler. Is there a game instance?"));
+        OnDeadlineReached(0, FShaderPipelineCache::NumPrecompilesRemaining());
+        return;
+    }
+
+    Handle = Scheduler->CompileFor(
+        Milliseconds / 1000.0f,
+        FOnPSODeadlineReached::CreateUObject(this, &UPSODeadlineCompileHelper::OnDeadlineReached));
+}
+
+void UPSODeadlineCompileHelper::Cancel()
+{
+    if (const auto Scheduler = UPSOCompileScheduler::Get(WorldInstance.Get()))
+    {
+        Scheduler->CancelCompileFor(Handle);
+    }
+}
+
+void UPSODeadlineCompileHelper::OnDeadlineReached(int32 Compiled, int32 Remaining)
+{
+    Handle = 0;
+    Completed.Broadcast(Compiled, Remaining);
     SetReadyToDestroy();
 }
@@ -0,0 +1,303 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCacheCatalog.h"
+
+#include "Async/ParallelFor.h"
+#include "Dom/JsonObject.h"
+#include "HAL/FileManager.h"
+#include "Misc/App.h"
+#include "Misc/FileHelper.h"
+#include "Misc/PathViews.h"
+#include "Misc/Paths.h"
+#include "PSOUploadManifest.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/JsonWriter.h"
+
+namespace PSOCacheCatalog
+{
+const FStringView StableSuffix = TEXTVIEW(".stable.upipelinecache");
+const FStringView RecordedSuffix = TEXTVIEW(".rec.upipelinecache");
+const FStringView CacheSuffix = TEXTVIEW(".upipelinecache");
+const FStringView KeysPrefix = TEXTVIEW("ShaderStableInfo-");
+const FStringView KeysSuffix = TEXTVIEW(".shk");
+
+bool IsCacheFile(FStringView Filename)
+{
+    return Filename.EndsWith(CacheSuffix, ESearchCase::IgnoreCase) ||
+           Filename.EndsWith(KeysSuffix, ESearchCase::IgnoreCase);
+}
+} // namespace PSOCacheCatalog
+
+FPSOCacheCatalog::FPSOCacheCatalog()
+{
+    const FString Platform = ANSI_TO_TCHAR(FPlatformProperties::IniPlatformName());
+
+    // Everywhere the engine writes caches or keys
+    AddSearchDirectory(FPaths::ProjectContentDir() / TEXT("PipelineCaches") / Platform);
+    AddSearchDirectory(FPaths::ProjectSavedDir() / TEXT("CollectedPSOs"));
+    AddSearchDirectory(FPaths::ProjectSavedDir() / TEXT("PipelineCaches"));
+
+    // Cooks write keys to Cooked/<Platform>/<Project>/Metadata/PipelineCaches. The rest of a cook is too big to walk
+    const FString ProjectName = FApp::GetProjectName();
+    auto AddCookedPlatform = [this, &ProjectName](const TCHAR *Path, bool bIsDirectory) {
+        if (bIsDirectory)
+        {
+            AddSearchDirectory(FString(Path) / ProjectName / TEXT("Metadata") / TEXT("PipelineCaches"));
+        }
+        return true;
+    };
+    IFileManager::Get().IterateDirectory(*(FPaths::ProjectSavedDir() / TEXT("Cooked")), AddCookedPlatform);
+
+    // Loose files people drop in by hand
+    AddSearchDirectory(FPaths::ProjectSavedDir(), false);
+}
+
+FString FPSOCacheCatalog::GetCatalogPath()
+{
+    return FPaths::ProjectSavedDir() / TEXT("PSOCacheCatalog.json");
+}
+
+void FPSOCacheCatalog::AddSearchDirectory(const FString &Dir, bool bRecursive)
+{
+    const FString FullPath = FPaths::IsRelative(Dir) ? FPaths::ConvertRelativePathToFull(FPaths::ProjectDir(), Dir)
+                                                     : FPaths::ConvertRelativePathToFull(Dir);
+
+    if (!SearchDirectories.ContainsByPredicate([&FullPath](const FSearchDirectory &Existing) {
+            return Existing.Path.Equals(FullPath, ESearchCase::IgnoreCase);
+        }))
+    {
+        SearchDirectories.Push({FullPath, bRecursive});
+    }
+}
+
+EPSOCacheFileKind FPSOCacheCatalog::ParseName(FStringView Filename, FStringView ProjectName,
+                                              FStringView &OutPlatform, bool &bOutGlobal)
+{
+    int32 Index = INDEX_NONE;
+
+    // <Project>_<Platform>.stable.upipelinecache
+    if (Filename.EndsWith(PSOCacheCatalog::StableSuffix, ESearchCase::IgnoreCase))
+    {
+        if (!Filename.StartsWith(ProjectName) || !Filename.FindChar(TEXT('_'), Index))
+        {
+            return EPSOCacheFileKind::Unknown;
+        }
+
+        auto Rest = Filename.Mid(Index + 1);
+        Rest.FindChar(TEXT('.'), Index);
+
+        bOutGlobal = true;
+        OutPlatform = Rest.Left(Index);
+        return EPSOCacheFileKind::StableCache;
+    }
+
+    // <Anything>-<Project>_<Platform>_<Hash>.rec.upipelinecache
+    if (Filename.EndsWith(PSOCacheCatalog::RecordedSuffix, ESearchCase::IgnoreCase))
+    {
+        auto Stem = Filename.LeftChop(PSOCacheCatalog::RecordedSuffix.Len());
+
+        // Drop the hash
+        if (!Stem.FindLastChar(TEXT('_'), Index))
+        {
+            return EPSOCacheFileKind::Unknown;
+        }
+        Stem = Stem.Left(Index);
+
+        if (!Stem.FindChar(TEXT('_'), Index))
+        {
+            return EPSOCacheFileKind::Unknown;
+        }
+
+        auto Owner = Stem.Left(Index);
+        const auto Platform = Stem.Mid(Index + 1);
+
+        if (Owner.FindLastChar(TEXT('-'), Index))
+        {
+            Owner = Owner.Mid(Index + 1);
+        }
+
+        if (!Owner.Equals(ProjectName))
+        {
+            return EPSOCacheFileKind::Unknown;
+        }
+
+        bOutGlobal = false;
+        OutPlatform = Platform;
+        return EPSOCacheFileKind::RecordedCache;
+    }
+
+    // ShaderStableInfo-<Global|Project>-<Platform>.shk
+    if (Filename.StartsWith(PSOCacheCatalog::KeysPrefix) &&
+        Filename.EndsWith(PSOCacheCatalog::KeysSuffix, ESearchCase::IgnoreCase))
+    {
+        auto Rest = Filename.Mid(PSOCacheCatalog::KeysPrefix.Len());
+        if (!Rest.FindChar(TEXT('-'), Index))
+        {
+            return EPSOCacheFileKind::Unknown;
+        }
+
+        const auto Owner = Rest.Left(Index);
+        if (Owner.Equals(TEXTVIEW("Global")))
+        {
+            bOutGlobal = true;
+        }
+        else if (Owner.Equals(ProjectName))
+        {
+            bOutGlobal = false;
+        }
+        else
+        {
+            return EPSOCacheFileKind::Unknown;
+        }
+
+        Rest = Rest.Mid(Index + 1);
+        Rest.FindChar(TEXT('.'), Index);
+
+        OutPlatform = Rest.Left(Index);
+        return EPSOCacheFileKind::StableKeys;
+    }
+
+    // e.g. the user cache in Saved/PipelineCaches, which we don't upload
+    return EPSOCacheFileKind::Unknown;
+}
+
+void FPSOCacheCatalog::Refresh()
+{
+    TMap<FString, FPSOCacheFile> Cached;
+    LoadCatalog(Cached);
+
+    // One task per directory. They're independent, and mostly waiting on the disk
+    TArray<TArray<FPSOCacheFile>> Found;
+    Found.SetNum(SearchDirectories.Num());
+
+    ParallelFor(SearchDirectories.Num(), [this, &Found](int32 DirIndex) {
+        const auto &Dir = SearchDirectories[DirIndex];
+        auto &DirFiles = Found[DirIndex];
+
+        auto Visitor = [&DirFiles](const TCHAR *Path, const FFileStatData &Stat) {
+            if (!Stat.bIsDirectory && PSOCacheCatalog::IsCacheFile(FPathViews::GetCleanFilename(Path)))
+            {
+                auto &File = DirFiles.AddDefaulted_GetRef();
+                File.Path = Path;
+                File.Size = Stat.FileSize;
+                File.Timestamp = Stat.ModificationTime;
+            }
+            return true;
+        };
+
+        if (Dir.bRecursive)
+        {
+            IFileManager::Get().IterateDirectoryStatRecursively(*Dir.Path, Visitor);
+        }
+        else
+        {
+            IFileManager::Get().IterateDirectoryStat(*Dir.Path, Visitor);
+        }
+    });
+
+    const FString ProjectName = FApp::GetProjectName();
+
+    Files.Reset();
+    TSet<FString> Seen;
+    for (auto &DirFiles : Found)
+    {
+        for (auto &File : DirFiles)
+        {
+            // Directories can overlap, e.g. an additional directory inside one of ours
+            bool bAlreadySeen = false;
+            Seen.Add(File.Path, &bAlreadySeen);
+            if (bAlreadySeen)
+            {
+                continue;
+            }
+
+            const auto *Previous = Cached.Find(File.Path);
+            if (Previous && Previous->Size == File.Size && Previous->Timestamp == File.Timestamp)
+            {
+                Files.Push(*Previous);
+                continue;
+            }
+
+            FStringView Platform;
+            File.Kind = ParseName(FPathViews::GetCleanFilename(File.Path), ProjectName, Platform, File.bGlobal);
+            if (EPSOCacheFileKind::Unknown == File.Kind)
+            {
+                UE_LOG(LogTemp, Log, TEXT("Ignoring pipeline cache file with unrecognised name %s"), *File.Path);
+                continue;
+            }
+
+            File.Platform = FString(Platform);
+            Files.Push(MoveTemp(File));
+        }
+    }
+
+    // Only new or changed files get read
+    ParallelFor(Files.Num(), [this](int32 Index) {
+        auto &File = Files[Index];
+        if (0 == File.Hash && !FPSOUploadManifest::HashFile(File.Path, File.Hash))
+        {
+            File.Hash = 0;
+        }
+    });
+
+    SaveCatalog();
+}
+
+void FPSOCacheCatalog::LoadCatalog(TMap<FString, FPSOCacheFile> &OutCached) const
+{
+    FString InputString;
+    if (!FFileHelper::LoadFileToString(InputString, *GetCatalogPath()))
+    {
+        return;
+    }
+
+    TSharedPtr<FJsonObject> CatalogJSON;
+    TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(InputString);
+    if (!FJsonSerializer::Deserialize(Reader, CatalogJSON) || !CatalogJSON.IsValid())
+    {
+        return;
+    }
+
+    for (const auto &Pair : CatalogJSON->Values)
+    {
+        const auto FileJSON = Pair.Value->AsObject();
+        if (!FileJSON.IsValid())
+        {
+            continue;
+        }
+
+        FPSOCacheFile File;
+        File.Path = Pair.Key;
+        File.Platform = FileJSON->GetStringField("platform");
+        File.Kind = static_cast<EPSOCacheFileKind>(FileJSON->GetIntegerField("kind"));
+        File.bGlobal = FileJSON->GetBoolField("global");
+        File.Size = static_cast<int64>(FileJSON->GetNumberField("size"));
+        File.Timestamp = FDateTime(FCString::Atoi64(*FileJSON->GetStringField("mtime")));
+        File.Hash = FCString::Strtoui64(*FileJSON->GetStringField("hash"), nullptr, 16);
+
+        OutCached.Add(File.Path, File);
+    }
+}
+
+void FPSOCacheCatalog::SaveCatalog() const
+{
+    TSharedPtr<FJsonObject> CatalogJSON = MakeShared<FJsonObject>();
+    for (const auto &File : Files)
+    {
+        TSharedPtr<FJsonObject> FileJSON = MakeShared<FJsonObject>();
+        FileJSON->SetStringField("platform", File.Platform);
+        FileJSON->SetNumberField("kind", static_cast<int32>(File.Kind));
+        FileJSON->SetBoolField("global", File.bGlobal);
+        FileJSON->SetNumberField("size", File.Size);
+        FileJSON->SetStringField("mtime", LexToString(File.Timestamp.GetTicks()));
+        FileJSON->SetStringField("hash", FString::Printf(TEXT("%016llx"), File.Hash));
+        CatalogJSON->SetObjectField(File.Path, FileJSON);
+    }
+
+    FString OutputString;
+    TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&OutputString);
+    FJsonSerializer::Serialize(CatalogJSON.ToSharedRef(), Writer);
+
+    FFileHelper::SaveStringToFile(OutputString, *GetCatalogPath());
+}
@@ -0,0 +1,168 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCacheCompactor.h"
+
+#include "HAL/FileManager.h"
+#include "Misc/App.h"
+#include "Misc/Paths.h"
+#include "RHI.h"
+#include "ShaderPipelineCache.h"
+
+namespace PSOCacheCompactor
+{
+/**
+ * Add From to Into the way PSOCacheMerge combines entries
+ *
+ * PSO equality ignores the usage mask and TSet::Add replaces, so appending would keep only the last file's mask.
+ * Returns whether Into gained a PSO or usage bits
+ */
+bool MergeInto(TSet<FPipelineCacheFileFormatPSO> &Into, const TSet<FPipelineCacheFileFormatPSO> &From)
+{
+    bool bChanged = false;
+    for (const auto &PSO : From)
+    {
+        if (auto *Existing = Into.Find(PSO))
+        {
+            bChanged |= 0 != (PSO.UsageMask & ~Existing->UsageMask);
+            Existing->UsageMask |= PSO.UsageMask;
+            Existing->BindCount += PSO.BindCount;
+        }
+        else
+        {
+            Into.Add(PSO);
+            bChanged = true;
+        }
+    }
+    return bChanged;
+}
+} // namespace PSOCacheCompactor
+
+FPSOCacheCompactor::FPSOCacheCompactor(int32 InMinFiles) : MinFiles(FMath::Max(InMinFiles, 1))
+{
+}
+
+FString FPSOCacheCompactor::GetArchivePath(const FString &Platform)
+{
+    return FPaths::ProjectSavedDir() / TEXT("PSOCompacted") /
+           FString::Printf(TEXT("%s_%s.archive.upipelinecache"), FApp::GetProjectName(), *Platform);
+}
+
+bool FPSOCacheCompactor::Compact(const TArray<FPSOCacheFile> &Files, const FDateTime &Before,
+                                 const FIsHandled &IsHandled, FPSOCompactionResult &OutResult) const
+{
+    OutResult = FPSOCompactionResult();
+
+    // Same name the engine gives its recordings
+    const FString Platform = LegacyShaderPlatformToShaderFormat(GMaxRHIShaderPlatform).ToString();
+
+    TArray<const FPSOCacheFile *> Recordings;
+    for (const auto &File : Files)
+    {
+        if (EPSOCacheFileKind::RecordedCache == File.Kind && File.Timestamp < Before &&
+            File.Platform.Equals(Platform, ESearchCase::IgnoreCase))
+        {
+            Recordings.Push(&File);
+        }
+    }
+
+    if (Recordings.Num() < MinFiles)
+    {
+        return true;
+    }
+
+    const FString ArchivePath = GetArchivePath(Platform);
+
+    TSet<FPipelineCacheFileFormatPSO> Archived;
+    if (IFileManager::Get().FileExists(*ArchivePath) &&
+        !FPipelineFileCacheManager::LoadPipelineFileCacheInto(ArchivePath, Archived))
+    {
+        // Don't throw away recordings we can't account for
+        UE_LOG(LogTemp, Warning, TEXT("Could not read PSO archive %s"), *ArchivePath);
+        return false;
+    }
+    bool bArchiveChanged = false;
+
+    TSet<FPipelineCacheFileFormatPSO> Pending;
+    TArray<const FPSOCacheFile *> Merged;
+
+    for (const auto *File : Recordings)
+    {
+        TSet<FPipelineCacheFileFormatPSO> PSOs;
+        if (!FPipelineFileCacheManager::LoadPipelineFileCacheInto(File->Path, PSOs))
+        {
+            // Could be from another build. Leave it for the normal upload path
+            UE_LOG(LogTemp, Warning, TEXT("Could not read recorded cache %s"), *File->Path);
+            continue;
+        }
+
+        if (IsHandled(*File))
+        {
+            bArchiveChanged |= PSOCacheCompactor::MergeInto(Archived, PSOs);
+        }
+        else
+        {
+            PSOCacheCompactor::MergeInto(Pending, PSOs);
+        }
+        Merged.Push(File);
+    }
+
+    // Anything uploaded by an earlier session doesn't need sending again, unless it was since seen in a new
+    // level, zone or quality tier
+    for (auto It = Pending.CreateIterator(); It; ++It)
+    {
+        const auto *Known = Archived.Find(*It);
+        if (Known && 0 == (It->UsageMask & ~Known->UsageMask))
+        {
+            It.RemoveCurrent();
+        }
+    }
+
+    if (bArchiveChanged && !SaveReplacing(ArchivePath, Archived))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Could not write PSO archive %s"), *ArchivePath);
+        return false;
+    }
+
+    if (Pending.Num() > 0)
+    {
+        OutResult.PendingFile =
+            FPaths::ProjectSavedDir() / TEXT("CollectedPSOs") /
+            FString::Printf(TEXT("Compacted-%s_%s_%016llx.rec.upipelinecache"), FApp::GetProjectName(), *Platform,
+                            FDateTime::UtcNow().GetTicks());
+
+        if (!SaveReplacing(OutResult.PendingFile, Pending))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Could not write compacted cache %s"), *OutResult.PendingFile);
+            return false;
+        }
+    }
+
+    // Everything is safely written. A crash before here just means merging the same files again next time
+    for (const auto *File : Merged)
+    {
+        if (IFileManager::Get().Delete(*File->Path, false, false, true))
+        {
+            ++OutResult.NumMerged;
+            OutResult.BytesFreed += File->Size;
+        }
+    }
+
+    OutResult.NumArchived = Archived.Num();
+    OutResult.NumPending = Pending.Num();
+    return true;
+}
+
+bool FPSOCacheCompactor::SaveReplacing(const FString &File, const TSet<FPipelineCacheFileFormatPSO> &PSOs)
+{
+    const FString TempFile = File + TEXT(".tmp");
+    IFileManager::Get().MakeDirectory(*FPaths::GetPath(File), true);
+
+    if (!FPipelineFileCacheManager::SavePipelineFileCacheFrom(FShaderPipelineCache::GetGameVersionForPSOFileCache(),
+                                                              GMaxRHIShaderPlatform, TempFile, PSOs))
+    {
+        IFileManager::Get().Delete(*TempFile, false, false, true);
+        return false;
+    }
+
+    return IFileManager::Get().Move(*File, *TempFile, true, true);
+}
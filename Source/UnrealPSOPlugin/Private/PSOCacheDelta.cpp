@@ -0,0 +1,178 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCacheDelta.h"
+
+#include "Misc/Paths.h"
+#include "PipelineCacheUtilities.h"
+#include "ShaderPipelineCache.h"
+
+void FPSOCacheDelta::Initialise(const TArray<FString> &StableCaches, const TArray<TPair<FString, FString>> &KeyFiles)
+{
+    StablePSOs.Reset();
+    StableKeys.Reset();
+    StableKeyPlatform.Reset();
+    Platforms.Reset();
+    KeysByHash.Reset();
+
+    for (const auto &StableCache : StableCaches)
+    {
+        TSet<FPipelineCacheFileFormatPSO> PSOs;
+        if (!FPipelineFileCacheManager::LoadPipelineFileCacheInto(StableCache, PSOs))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Could not read stable cache %s"), *StableCache);
+            continue;
+        }
+
+        // Equality ignores the usage mask, so a plain Append would keep only one cache's
+        for (const auto &PSO : PSOs)
+        {
+            if (auto *Existing = StablePSOs.Find(PSO))
+            {
+                Existing->UsageMask |= PSO.UsageMask;
+            }
+            else
+            {
+                StablePSOs.Add(PSO);
+            }
+        }
+    }
+
+    for (const auto &KeyFile : KeyFiles)
+    {
+        const int32 FirstKey = StableKeys.Num();
+        if (!UE::PipelineCacheUtilities::LoadStableKeysFile(KeyFile.Key, StableKeys))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Could not read stable keys %s"), *KeyFile.Key);
+            continue;
+        }
+
+        const int32 PlatformIndex = Platforms.AddUnique(KeyFile.Value);
+        for (int32 Index = FirstKey; Index < StableKeys.Num(); ++Index)
+        {
+            StableKeyPlatform.Add(PlatformIndex);
+            KeysByHash.Add(StableKeys[Index].OutputHash, Index);
+        }
+    }
+}
+
+bool FPSOCacheDelta::Build(const FString &RecordedCache, const FString &OutCache,
+                           const FPSOKnownFilter *KnownFilter, TMap<FString, FString> &OutKeyFiles,
+                           int32 &OutNumNew) const
+{
+    OutNumNew = 0;
+
+    TSet<FPipelineCacheFileFormatPSO> RecordedPSOs;
+    if (!FPipelineFileCacheManager::LoadPipelineFileCacheInto(RecordedCache, RecordedPSOs))
+    {
+        return false;
+    }
+
+    TSet<FPipelineCacheFileFormatPSO> NewPSOs;
+    TSet<FSHAHash> ReferencedShaders;
+    TArray<FSHAHash, TInlineAllocator<5>> ShaderHashes;
+
+    for (const auto &PSO : RecordedPSOs)
+    {
+        // Shipped PSOs are only worth sending if they were seen somewhere new, e.g. another level,
+        // as usage masks decide which ones precompile
+        uint64 NewUsage = PSO.UsageMask;
+        if (const auto *Stable = StablePSOs.Find(PSO))
+        {
+            NewUsage &= ~Stable->UsageMask;
+            if (0 == NewUsage)
+            {
+                continue;
+            }
+        }
+
+        // Someone else got there first
+        if (KnownFilter && KnownFilter->MayContain(GetTypeHash(PSO), NewUsage))
+        {
+            continue;
+        }
+
+        NewPSOs.Add(PSO);
+
+        ShaderHashes.Reset();
+        GetShaderHashes(PSO, ShaderHashes);
+        ReferencedShaders.Append(ShaderHashes);
+    }
+
+    OutNumNew = NewPSOs.Num();
+    if (0 == OutNumNew)
+    {
+        return true;
+    }
+
+    if (!FPipelineFileCacheManager::SavePipelineFileCacheFrom(FShaderPipelineCache::GetGameVersionForPSOFileCache(),
+                                                              GMaxRHIShaderPlatform, OutCache, NewPSOs))
+    {
+        return false;
+    }
+
+    // Only the keys the new PSOs need, split back out by the platform they were read as
+    TArray<TSet<FStableShaderKeyAndValue>> KeysPerPlatform;
+    KeysPerPlatform.SetNum(Platforms.Num());
+
+    TArray<int32, TInlineAllocator<8>> KeyIndices;
+    for (const auto &Shader : ReferencedShaders)
+    {
+        KeyIndices.Reset();
+        KeysByHash.MultiFind(Shader, KeyIndices);
+        for (const auto KeyIndex : KeyIndices)
+        {
+            KeysPerPlatform[StableKeyPlatform[KeyIndex]].Add(StableKeys[KeyIndex]);
+        }
+    }
+
+    for (int32 PlatformIndex = 0; PlatformIndex < Platforms.Num(); ++PlatformIndex)
+    {
+        if (0 == KeysPerPlatform[PlatformIndex].Num())
+        {
+            continue;
+        }
+
+        const auto KeyFile = FPaths::GetPath(OutCache) /
+                             FString::Printf(TEXT("%s-%s.shk"), *FPaths::GetBaseFilename(OutCache, true),
+                                             *Platforms[PlatformIndex]);
+
+        if (!UE::PipelineCacheUtilities::SaveStableKeysFile(KeyFile, KeysPerPlatform[PlatformIndex]))
+        {
+            return false;
+        }
+
+        OutKeyFiles.Add(Platforms[PlatformIndex], KeyFile);
+    }
+
+    return true;
+}
+
+void FPSOCacheDelta::GetShaderHashes(const FPipelineCacheFileFormatPSO &PSO,
+                                     TArray<FSHAHash, TInlineAllocator<5>> &Out)
+{
+    auto AddHash = [&Out](const FSHAHash &Hash) {
+        if (Hash != FSHAHash())
+        {
+            Out.Add(Hash);
+        }
+    };
+
+    switch (PSO.Type)
+    {
+    case FPipelineCacheFileFormatPSO::DescriptorType::Compute:
+        AddHash(PSO.ComputeDesc.ComputeShader);
+        break;
+    case FPipelineCacheFileFormatPSO::DescriptorType::Graphics:
+        AddHash(PSO.GraphicsDesc.VertexShader);
+        AddHash(PSO.GraphicsDesc.FragmentShader);
+        AddHash(PSO.GraphicsDesc.GeometryShader);
+        AddHash(PSO.GraphicsDesc.MeshShader);
+        AddHash(PSO.GraphicsDesc.AmplificationShader);
+        break;
+    case FPipelineCacheFileFormatPSO::DescriptorType::RayTracing:
+        AddHash(PSO.RayTracingDesc.ShaderHash);
+        break;
+    default:
+        break;
+    }
+}
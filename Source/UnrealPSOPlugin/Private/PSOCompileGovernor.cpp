@@ -0,0 +1,133 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCompileGovernor.h"
+
+FPSOCompileGovernor::FPSOCompileGovernor(const FPSOCompileGovernorSettings &InSettings)
+    : Settings(InSettings), Context(EPSOGovernorContext::Gameplay)
+{
+    Settings.MinBatchSize = FMath::Max(Settings.MinBatchSize, 1);
+    Settings.MaxBatchSize = FMath::Max(Settings.MaxBatchSize, Settings.MinBatchSize);
+    Settings.MaxBatchTimeMs = FMath::Max(Settings.MaxBatchTimeMs, Settings.MinBatchTimeMs);
+    Settings.Smoothing = FMath::Clamp(Settings.Smoothing, 0.01f, 1.0f);
+
+    Reset();
+}
+
+void FPSOCompileGovernor::SetContext(EPSOGovernorContext InContext)
+{
+    if (Context == InContext)
+    {
+        return;
+    }
+
+    Context = InContext;
+
+    // Nobody is watching a loading screen's frame rate. Go straight to full speed
+    if (EPSOGovernorContext::Loading == Context)
+    {
+        Output.BatchSize = Settings.MaxBatchSize;
+        Output.BatchTimeMs = Settings.MaxBatchTimeMs;
+        Output.bPaused = false;
+    }
+
+    FramesOverBudget = 0;
+    FramesUnderBudget = 0;
+}
+
+void FPSOCompileGovernor::Reset()
+{
+    Output = FPSOCompileGovernorOutput();
+    Output.BatchSize = Settings.MinBatchSize;
+    Output.BatchTimeMs = Settings.MinBatchTimeMs;
+
+    SmoothedFrameMs = 0.0f;
+    SmoothedRenderMs = 0.0f;
+    FramesOverBudget = 0;
+    FramesUnderBudget = 0;
+}
+
+float FPSOCompileGovernor::GetBudgetMs() const
+{
+    switch (Context)
+    {
+    case EPSOGovernorContext::Menu:
+        return Settings.TargetFrameMs * Settings.MenuBudgetScale;
+    case EPSOGovernorContext::Cutscene:
+        return Settings.TargetFrameMs * Settings.CutsceneBudgetScale;
+    case EPSOGovernorContext::Loading:
+        return TNumericLimits<float>::Max();
+    case EPSOGovernorContext::Gameplay:
+    default:
+        return Settings.TargetFrameMs;
+    }
+}
+
+const FPSOCompileGovernorOutput &FPSOCompileGovernor::Update(float GameThreadMs, float RenderThreadMs)
+{
+    const float FrameMs = FMath::Max(GameThreadMs, RenderThreadMs);
+
+    // Seed with the first frame rather than ramping up from zero
+    if (0.0f == SmoothedFrameMs)
+    {
+        SmoothedFrameMs = FrameMs;
+        SmoothedRenderMs = RenderThreadMs;
+    }
+    else
+    {
+        SmoothedFrameMs = FMath::Lerp(SmoothedFrameMs, FrameMs, Settings.Smoothing);
+        SmoothedRenderMs = FMath::Lerp(SmoothedRenderMs, RenderThreadMs, Settings.Smoothing);
+    }
+
+    if (EPSOGovernorContext::Loading == Context)
+    {
+        return Output;
+    }
+
+    const float BudgetMs = GetBudgetMs();
+    const float HeadroomMs = BudgetMs - SmoothedFrameMs;
+
+    // Pausing reacts to raw frames so a burst of heavy gameplay stops compilation quickly
+    if (FrameMs > BudgetMs * Settings.PauseOverBudgetScale)
+    {
+        ++FramesOverBudget;
+        FramesUnderBudget = 0;
+    }
+    else if (FrameMs <= BudgetMs)
+    {
+        ++FramesUnderBudget;
+        FramesOverBudget = 0;
+    }
+
+    if (!Output.bPaused && FramesOverBudget >= Settings.PauseAfterFrames)
+    {
+        Output.bPaused = true;
+    }
+    else if (Output.bPaused && FramesUnderBudget >= Settings.ResumeAfterFrames)
+    {
+        // Come back gently
+        Output.bPaused = false;
+        Output.BatchSize = Settings.MinBatchSize;
+        Output.BatchTimeMs = Settings.MinBatchTimeMs;
+    }
+
+    if (Output.bPaused)
+    {
+        return Output;
+    }
+
+    // Additive increase, multiplicative decrease
+    if (HeadroomMs > 0.0f)
+    {
+        Output.BatchSize = FMath::Min(Output.BatchSize + 1, Settings.MaxBatchSize);
+    }
+    else
+    {
+        Output.BatchSize = FMath::Max(Output.BatchSize / 2, Settings.MinBatchSize);
+    }
+
+    // Batches are submitted on the render thread, so only its spare time is ours
+    const float RenderHeadroomMs = FMath::Min(BudgetMs - SmoothedRenderMs, HeadroomMs);
+    Output.BatchTimeMs = FMath::Clamp(RenderHeadroomMs, Settings.MinBatchTimeMs, Settings.MaxBatchTimeMs);
+
+    return Output;
+}
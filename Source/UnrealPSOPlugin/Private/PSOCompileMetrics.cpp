@@ -0,0 +1,133 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCompileMetrics.h"
+
+FPSOCompileMetrics::FPSOCompileMetrics(double InWindowSeconds, int32 InMaxBatches)
+    : WindowSeconds(FMath::Max(InWindowSeconds, 0.1)), MaxBatches(FMath::Max(InMaxBatches, 1))
+{
+    Reset();
+}
+
+void FPSOCompileMetrics::Reset()
+{
+    Window.Reset();
+    BatchMs.Reset();
+    NextBatch = 0;
+
+    for (auto &Seconds : ModeSeconds)
+    {
+        Seconds = 0.0;
+    }
+
+    LastSampleTime = -1.0;
+    LastProgressTime = -1.0;
+    LastRemaining = 0;
+    LastMode = EMode::Paused;
+    TotalCompiled = 0;
+}
+
+void FPSOCompileMetrics::Sample(double Now, int32 Remaining, EMode Mode)
+{
+    if (LastSampleTime < 0.0)
+    {
+        LastSampleTime = Now;
+        LastProgressTime = Now;
+        LastRemaining = Remaining;
+        LastMode = Mode;
+        return;
+    }
+
+    ModeSeconds[static_cast<int32>(LastMode)] += Now - LastSampleTime;
+
+    // Time spent paused isn't part of the next batch
+    if (EMode::Paused == LastMode || 0 == LastRemaining)
+    {
+        LastProgressTime = Now;
+    }
+    else if (Remaining < LastRemaining)
+    {
+        const int32 Compiled = LastRemaining - Remaining;
+        TotalCompiled += Compiled;
+        Window.Push({Now, Compiled});
+
+        const float Ms = static_cast<float>((Now - LastProgressTime) * 1000.0);
+        if (BatchMs.Num() < MaxBatches)
+        {
+            BatchMs.Push(Ms);
+        }
+        else
+        {
+            BatchMs[NextBatch] = Ms;
+            NextBatch = (NextBatch + 1) % MaxBatches;
+        }
+
+        LastProgressTime = Now;
+    }
+
+    // Trim to the window
+    int32 Expired = 0;
+    while (Expired < Window.Num() && Now - Window[Expired].Time > WindowSeconds)
+    {
+        ++Expired;
+    }
+    if (Expired > 0)
+    {
+        Window.RemoveAt(0, Expired, false);
+    }
+
+    LastSampleTime = Now;
+    LastRemaining = Remaining;
+    LastMode = Mode;
+}
+
+float FPSOCompileMetrics::GetPSOsPerSecond() const
+{
+    int64 Compiled = 0;
+    for (const auto &Progress : Window)
+    {
+        Compiled += Progress.Compiled;
+    }
+
+    return static_cast<float>(Compiled / WindowSeconds);
+}
+
+float FPSOCompileMetrics::GetMeanBatchMs() const
+{
+    if (0 == BatchMs.Num())
+    {
+        return 0.0f;
+    }
+
+    double Sum = 0.0;
+    for (const auto Ms : BatchMs)
+    {
+        Sum += Ms;
+    }
+
+    return static_cast<float>(Sum / BatchMs.Num());
+}
+
+float FPSOCompileMetrics::GetP95BatchMs() const
+{
+    if (0 == BatchMs.Num())
+    {
+        return 0.0f;
+    }
+
+    auto Sorted = BatchMs;
+    Sorted.Sort();
+
+    const int32 Index = FMath::Min(FMath::CeilToInt(Sorted.Num() * 0.95f) - 1, Sorted.Num() - 1);
+    return Sorted[FMath::Max(Index, 0)];
+}
+
+float FPSOCompileMetrics::GetEtaSeconds() const
+{
+    if (0 == LastRemaining)
+    {
+        return 0.0f;
+    }
+
+    const float Rate = GetPSOsPerSecond();
+    return Rate > 0.0f ? LastRemaining / Rate : -1.0f;
+}
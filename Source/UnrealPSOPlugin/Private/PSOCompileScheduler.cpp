@@ -0,0 +1,346 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOCompileScheduler.h"
+
+#include "Engine/GameInstance.h"
+#include "HAL/IConsoleManager.h"
+#include "Kismet/GameplayStatics.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "Stats/Stats.h"
+
+DECLARE_STATS_GROUP(TEXT("PSOCompile"), STATGROUP_PSOCompile, STATCAT_Advanced);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Remaining PSOs"), STAT_PSOCompileRemaining, STATGROUP_PSOCompile);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("PSOs/s"), STAT_PSOCompileRate, STATGROUP_PSOCompile);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Mean batch (ms)"), STAT_PSOCompileMeanBatch, STATGROUP_PSOCompile);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("P95 batch (ms)"), STAT_PSOCompileP95Batch, STATGROUP_PSOCompile);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("ETA (s)"), STAT_PSOCompileEta, STATGROUP_PSOCompile);
+
+CSV_DEFINE_CATEGORY(PSOCompile, true);
+
+namespace PSOCompileScheduler
+{
+IConsoleVariable *FindCVar(const TCHAR *Name)
+{
+    return IConsoleManager::Get().FindConsoleVariable(Name);
+}
+} // namespace PSOCompileScheduler
+
+UPSOCompileScheduler *UPSOCompileScheduler::Get(const UObject *WorldContextObject)
+{
+    const auto GameInstance = UGameplayStatics::GetGameInstance(WorldContextObject);
+    return GameInstance ? GameInstance->GetSubsystem<UPSOCompileScheduler>() : nullptr;
+}
+
+void UPSOCompileScheduler::Initialize(FSubsystemCollectionBase &Collection)
+{
+    Super::Initialize(Collection);
+
+    RequestCounts.SetNumZeroed(static_cast<int32>(E_PSOCompileRequest::LoadingScreen) + 1);
+
+    MetricsTicker =
+        FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateUObject(this, &UPSOCompileScheduler::TickMetrics));
+}
+
+void UPSOCompileScheduler::Deinitialize()
+{
+    FTSTicker::GetCoreTicker().RemoveTicker(MetricsTicker);
+    MetricsTicker.Reset();
+
+    // Dropped without Apply, so batching is left as it is rather than paused. Whoever owns the cache next decides.
+    // Timed compiles still report, but their requests are already gone
+    Requests.Reset();
+    for (auto &Count : RequestCounts)
+    {
+        Count = 0;
+    }
+
+    TArray<int32> Timed;
+    TimedCompiles.GetKeys(Timed);
+    for (const auto Handle : Timed)
+    {
+        FinishTimedCompile(Handle);
+    }
+
+    Super::Deinitialize();
+}
+
+int32 UPSOCompileScheduler::AddRequest(E_PSOCompileRequest Kind)
+{
+    const int32 Handle = NextHandle++;
+    Requests.Add(Handle, Kind);
+    ++RequestCounts[static_cast<int32>(Kind)];
+
+    Apply();
+    return Handle;
+}
+
+void UPSOCompileScheduler::RemoveRequest(int32 Handle)
+{
+    E_PSOCompileRequest Kind;
+    if (!Requests.RemoveAndCopyValue(Handle, Kind))
+    {
+        return;
+    }
+
+    --RequestCounts[static_cast<int32>(Kind)];
+    Apply();
+}
+
+bool UPSOCompileScheduler::GetEffectiveRequest(E_PSOCompileRequest &OutKind) const
+{
+    for (int32 Index = RequestCounts.Num() - 1; Index >= 0; --Index)
+    {
+        if (RequestCounts[Index] > 0)
+        {
+            OutKind = static_cast<E_PSOCompileRequest>(Index);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int32 UPSOCompileScheduler::GetRequestCount(E_PSOCompileRequest Kind) const
+{
+    return RequestCounts.IsValidIndex(static_cast<int32>(Kind)) ? RequestCounts[static_cast<int32>(Kind)] : 0;
+}
+
+void UPSOCompileScheduler::Apply()
+{
+    E_PSOCompileRequest Kind;
+    const bool bAnyRequest = GetEffectiveRequest(Kind);
+
+    bool bPaused = true;
+    auto Mode = AppliedMode;
+    if (bAnyRequest)
+    {
+        switch (Kind)
+        {
+        case E_PSOCompileRequest::Background:
+            Mode = FShaderPipelineCache::BatchMode::Background;
+            bPaused = false;
+            break;
+        case E_PSOCompileRequest::Fast:
+            Mode = FShaderPipelineCache::BatchMode::Fast;
+            bPaused = false;
+            break;
+        case E_PSOCompileRequest::LoadingScreen:
+            Mode = FShaderPipelineCache::BatchMode::Precompile;
+            bPaused = false;
+            break;
+        case E_PSOCompileRequest::Halt:
+        default:
+            break;
+        }
+    }
+
+    if (!bPaused && (!bModeApplied || Mode != AppliedMode))
+    {
+        ApplyBatchMode(Mode);
+    }
+
+    if (bPaused != FShaderPipelineCache::IsBatchingPaused())
+    {
+        if (bPaused)
+        {
+            FShaderPipelineCache::PauseBatching();
+        }
+        else
+        {
+            FShaderPipelineCache::ResumeBatching();
+        }
+    }
+}
+
+void UPSOCompileScheduler::ApplyBatchMode(FShaderPipelineCache::BatchMode Mode)
+{
+    using namespace PSOCompileScheduler;
+    static const auto CVarBatchSize = FindCVar(TEXT("r.ShaderPipelineCache.BatchSize"));
+    static const auto CVarBatchTime = FindCVar(TEXT("r.ShaderPipelineCache.BatchTime"));
+    static const auto CVarBackgroundBatchSize = FindCVar(TEXT("r.ShaderPipelineCache.BackgroundBatchSize"));
+    static const auto CVarBackgroundBatchTime = FindCVar(TEXT("r.ShaderPipelineCache.BackgroundBatchTime"));
+    static const auto CVarPrecompileBatchSize = FindCVar(TEXT("r.ShaderPipelineCache.PrecompileBatchSize"));
+    static const auto CVarPrecompileBatchTime = FindCVar(TEXT("r.ShaderPipelineCache.PrecompileBatchTime"));
+
+    // The same cvars SetBatchMode copies from
+    IConsoleVariable *Size = CVarBackgroundBatchSize;
+    IConsoleVariable *Time = CVarBackgroundBatchTime;
+    if (FShaderPipelineCache::BatchMode::Fast == Mode)
+    {
+        Size = CVarBatchSize;
+        Time = CVarBatchTime;
+    }
+    else if (FShaderPipelineCache::BatchMode::Precompile == Mode)
+    {
+        Size = CVarPrecompileBatchSize;
+        Time = CVarPrecompileBatchTime;
+    }
+
+    FShaderPipelineCache::SetBatchMode(Mode);
+    AppliedMode = Mode;
+    AppliedBatchSize = Size ? Size->GetInt() : 0;
+    AppliedBatchTimeMs = Time ? Time->GetFloat() : 0.0f;
+    bModeApplied = true;
+}
+
+void UPSOCompileScheduler::SetBatchSettings(int32 BatchSize, float BatchTimeMs)
+{
+    using namespace PSOCompileScheduler;
+    static const auto CVarBatchSize = FindCVar(TEXT("r.ShaderPipelineCache.BatchSize"));
+    static const auto CVarBatchTime = FindCVar(TEXT("r.ShaderPipelineCache.BatchTime"));
+    static const auto CVarBackgroundBatchSize = FindCVar(TEXT("r.ShaderPipelineCache.BackgroundBatchSize"));
+    static const auto CVarBackgroundBatchTime = FindCVar(TEXT("r.ShaderPipelineCache.BackgroundBatchTime"));
+
+    // Precompile is left alone for explicit loading screens
+    for (const auto CVar : {CVarBatchSize, CVarBackgroundBatchSize})
+    {
+        if (CVar)
+        {
+            CVar->Set(BatchSize, ECVF_SetByCode);
+        }
+    }
+
+    for (const auto CVar : {CVarBatchTime, CVarBackgroundBatchTime})
+    {
+        if (CVar)
+        {
+            CVar->Set(BatchTimeMs, ECVF_SetByCode);
+        }
+    }
+
+    // Before the first mode is set there's nothing to refresh, the first request picks these up.
+    // Setting the mode doesn't resume batching, so this is safe while paused
+    if (bModeApplied)
+    {
+        ApplyBatchMode(AppliedMode);
+    }
+}
+
+int32 UPSOCompileScheduler::CompileFor(float Seconds, FOnPSODeadlineReached OnDone, E_PSOCompileRequest Kind)
+{
+    FTimedCompile Timed;
+    Timed.Request = AddRequest(Kind);
+    Timed.Deadline = FPlatformTime::Seconds() + FMath::Max(Seconds, 0.0f);
+    Timed.StartRemaining = FShaderPipelineCache::NumPrecompilesRemaining();
+    Timed.OnDone = MoveTemp(OnDone);
+
+    // The request handle doubles as ours
+    const int32 Handle = Timed.Request;
+    TimedCompiles.Add(Handle, MoveTemp(Timed));
+
+    if (!TimedCompileTicker.IsValid())
+    {
+        TimedCompileTicker = FTSTicker::GetCoreTicker().AddTicker(
+            FTickerDelegate::CreateUObject(this, &UPSOCompileScheduler::TickTimedCompiles));
+    }
+
+    return Handle;
+}
+
+void UPSOCompileScheduler::CancelCompileFor(int32 Handle)
+{
+    FinishTimedCompile(Handle);
+}
+
+bool UPSOCompileScheduler::TickTimedCompiles(float DeltaTime)
+{
+    const double Now = FPlatformTime::Seconds();
+    const int32 Remaining = FShaderPipelineCache::NumPrecompilesRemaining();
+
+    TArray<int32> Finished;
+    for (const auto &Pair : TimedCompiles)
+    {
+        if (0 == Remaining || Now >= Pair.Value.Deadline)
+        {
+            Finished.Push(Pair.Key);
+        }
+    }
+
+    for (const auto Handle : Finished)
+    {
+        FinishTimedCompile(Handle);
+    }
+
+    if (0 == TimedCompiles.Num())
+    {
+        TimedCompileTicker.Reset();
+        return false;
+    }
+
+    return true;
+}
+
+void UPSOCompileScheduler::FinishTimedCompile(int32 Handle)
+{
+    FTimedCompile Timed;
+    if (!TimedCompiles.RemoveAndCopyValue(Handle, Timed))
+    {
+        return;
+    }
+
+    RemoveRequest(Timed.Request);
+
+    if (0 == TimedCompiles.Num() && TimedCompileTicker.IsValid())
+    {
+        FTSTicker::GetCoreTicker().RemoveTicker(TimedCompileTicker);
+        TimedCompileTicker.Reset();
+    }
+
+    // More caches can open while we wait, so the count can go up
+    const int32 Remaining = FShaderPipelineCache::NumPrecompilesRemaining();
+    Timed.OnDone.ExecuteIfBound(FMath::Max(Timed.StartRemaining - Remaining, 0), Remaining);
+}
+
+bool UPSOCompileScheduler::TickMetrics(float DeltaTime)
+{
+    auto Mode = FPSOCompileMetrics::EMode::Paused;
+    if (!FShaderPipelineCache::IsBatchingPaused())
+    {
+        switch (AppliedMode)
+        {
+        case FShaderPipelineCache::BatchMode::Fast:
+            Mode = FPSOCompileMetrics::EMode::Fast;
+            break;
+        case FShaderPipelineCache::BatchMode::Precompile:
+            Mode = FPSOCompileMetrics::EMode::Precompile;
+            break;
+        case FShaderPipelineCache::BatchMode::Background:
+        default:
+            Mode = FPSOCompileMetrics::EMode::Background;
+            break;
+        }
+    }
+
+    Metrics.Sample(FPlatformTime::Seconds(), FShaderPipelineCache::NumPrecompilesRemaining(), Mode);
+
+    const float Rate = Metrics.GetPSOsPerSecond();
+    const float Eta = Metrics.GetEtaSeconds();
+
+    SET_DWORD_STAT(STAT_PSOCompileRemaining, Metrics.GetRemaining());
+    SET_FLOAT_STAT(STAT_PSOCompileRate, Rate);
+    SET_FLOAT_STAT(STAT_PSOCompileMeanBatch, Metrics.GetMeanBatchMs());
+    SET_FLOAT_STAT(STAT_PSOCompileP95Batch, Metrics.GetP95BatchMs());
+    SET_FLOAT_STAT(STAT_PSOCompileEta, Eta);
+
+    CSV_CUSTOM_STAT(PSOCompile, Remaining, Metrics.GetRemaining(), ECsvCustomStatOp::Set);
+    CSV_CUSTOM_STAT(PSOCompile, PSOsPerSecond, Rate, ECsvCustomStatOp::Set);
+    CSV_CUSTOM_STAT(PSOCompile, EtaSeconds, Eta, ECsvCustomStatOp::Set);
+
+    return true;
+}
+
+FPSOCompileMetricsSnapshot UPSOCompileScheduler::GetCompileMetrics() const
+{
+    FPSOCompileMetricsSnapshot Snapshot;
+    Snapshot.RemainingPSOs = Metrics.GetRemaining();
+    Snapshot.CompiledPSOs = Metrics.GetTotalCompiled();
+    Snapshot.PSOsPerSecond = Metrics.GetPSOsPerSecond();
+    Snapshot.MeanBatchMs = Metrics.GetMeanBatchMs();
+    Snapshot.P95BatchMs = Metrics.GetP95BatchMs();
+    Snapshot.EtaSeconds = Metrics.GetEtaSeconds();
+    Snapshot.SecondsPaused = Metrics.GetSecondsInMode(FPSOCompileMetrics::EMode::Paused);
+    Snapshot.SecondsBackground = Metrics.GetSecondsInMode(FPSOCompileMetrics::EMode::Background);
+    Snapshot.SecondsFast = Metrics.GetSecondsInMode(FPSOCompileMetrics::EMode::Fast);
+    Snapshot.SecondsPrecompile = Metrics.GetSecondsInMode(FPSOCompileMetrics::EMode::Precompile);
+    return Snapshot;
+}
@@ -0,0 +1,170 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOEventRing.h"
+
+#include "Async/Async.h"
+#include "HAL/IConsoleManager.h"
+
+namespace PSOEventRing
+{
+// Which channel and ring this thread writes to, until it exits
+struct FProducerSlot
+{
+    FPSOEventChannel *Channel = nullptr;
+    int32 Index = INDEX_NONE;
+
+    ~FProducerSlot()
+    {
+        if (Channel)
+        {
+            Channel->ReleaseProducer();
+        }
+    }
+};
+
+thread_local FProducerSlot ProducerSlot;
+} // namespace PSOEventRing
+
+FPSOEventChannel &FPSOEventChannel::Get()
+{
+    static FPSOEventChannel Channel;
+    return Channel;
+}
+
+bool FPSOEventChannel::Push(EPSOEventType Type, uint32 PSOHash)
+{
+    auto &Slot = PSOEventRing::ProducerSlot;
+    if (this != Slot.Channel)
+    {
+        // Once per thread, unless every ring was taken last time
+        if (Slot.Channel)
+        {
+            Slot.Channel->ReleaseProducer();
+        }
+
+        Slot.Index = ClaimSlot();
+        Slot.Channel = INDEX_NONE != Slot.Index ? this : nullptr;
+    }
+
+    if (INDEX_NONE == Slot.Index || !Rings[Slot.Index].Push({FPlatformTime::Cycles64(), PSOHash, Type}))
+    {
+        Dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    return true;
+}
+
+void FPSOEventChannel::ReleaseProducer()
+{
+    auto &Slot = PSOEventRing::ProducerSlot;
+    if (this != Slot.Channel)
+    {
+        return;
+    }
+
+    // Publishes our ring's producer state to whichever thread claims it next
+    SlotInUse[Slot.Index].store(false, std::memory_order_release);
+    Slot.Channel = nullptr;
+    Slot.Index = INDEX_NONE;
+}
+
+int32 FPSOEventChannel::ClaimSlot()
+{
+    for (int32 Index = 0; Index < MaxProducers; ++Index)
+    {
+        bool bExpected = false;
+        if (!SlotInUse[Index].load(std::memory_order_relaxed) &&
+            SlotInUse[Index].compare_exchange_strong(bExpected, true, std::memory_order_acquire))
+        {
+            int32 Num = NumProducers.load(std::memory_order_relaxed);
+            while (Num <= Index && !NumProducers.compare_exchange_weak(Num, Index + 1, std::memory_order_release))
+            {
+            }
+            return Index;
+        }
+    }
+
+    return INDEX_NONE;
+}
+
+#if !(UE_BUILD_SHIPPING)
+// Producers push through a channel of their own as fast as they can while one consumer drains it, as the game
+// thread would. More producers than FPSOEventChannel::MaxProducers shows what happens to the rest
+// PSO.Events.Benchmark [EventsPerProducer] [Producers]
+static FAutoConsoleCommand CmdEventsBenchmark(
+    TEXT("PSO.Events.Benchmark"),
+    TEXT("Report per-event cost of FPSOEventChannel::Push under contention. Args: [EventsPerProducer] [Producers]"),
+    FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString> &Args) {
+        const int32 NumEvents = Args.Num() > 0 ? FMath::Max(FCString::Atoi(*Args[0]), 1) : 10 * 1000 * 1000;
+        const int32 NumProducers =
+            Args.Num() > 1 ? FMath::Clamp(FCString::Atoi(*Args[1]), 1, 2 * FPSOEventChannel::MaxProducers) : 2;
+
+        // Not the shared one, so nothing else drains these
+        const auto Channel = MakeUnique<FPSOEventChannel>();
+        auto *ChannelPtr = Channel.Get();
+
+        std::atomic<int32> ProducersRunning{NumProducers};
+        std::atomic<bool> bGo{false};
+
+        TArray<TFuture<TPair<double, int64>>> Producers;
+        for (int32 Index = 0; Index < NumProducers; ++Index)
+        {
+            Producers.Push(Async(EAsyncExecution::Thread, [ChannelPtr, NumEvents, &ProducersRunning, &bGo]() {
+                while (!bGo.load(std::memory_order_acquire))
+                {
+                    FPlatformProcess::Yield();
+                }
+
+                int64 Drops = 0;
+                const double Start = FPlatformTime::Seconds();
+                for (int32 Event = 0; Event < NumEvents; ++Event)
+                {
+                    if (!ChannelPtr->Push(EPSOEventType::Miss, static_cast<uint32>(Event)))
+                    {
+                        ++Drops;
+                    }
+                }
+                const double Elapsed = FPlatformTime::Seconds() - Start;
+
+                // Before the channel goes away, rather than at thread exit
+                ChannelPtr->ReleaseProducer();
+                ProducersRunning.fetch_sub(1, std::memory_order_release);
+                return TPair<double, int64>(Elapsed, Drops);
+            }));
+        }
+
+        auto Consumer = Async(EAsyncExecution::Thread, [ChannelPtr, &ProducersRunning]() {
+            int64 Consumed = 0;
+            bool bLastPass = false;
+            while (!bLastPass)
+            {
+                bLastPass = 0 == ProducersRunning.load(std::memory_order_acquire);
+                Consumed += ChannelPtr->Drain([](const FPSOEvent &) {});
+            }
+            return Consumed;
+        });
+
+        bGo.store(true, std::memory_order_release);
+
+        double WorstNs = 0.0;
+        double TotalNs = 0.0;
+        int64 TotalDrops = 0;
+        for (auto &Producer : Producers)
+        {
+            const auto Result = Producer.Get();
+            const double Ns = Result.Key * 1e9 / NumEvents;
+            WorstNs = FMath::Max(WorstNs, Ns);
+            TotalNs += Ns;
+            TotalDrops += Result.Value;
+        }
+        const int64 Consumed = Consumer.Get();
+
+        UE_LOG(LogTemp, Display, TEXT("PSO.Events.Benchmark %d producers x %d events"), NumProducers, NumEvents);
+        UE_LOG(LogTemp, Display, TEXT("  Push: %.1f ns mean, %.1f ns worst producer (including timestamp)"),
+               TotalNs / NumProducers, WorstNs);
+        UE_LOG(LogTemp, Display, TEXT("  Consumed %lld, dropped %lld (%.2f%%), channel counted %llu"), Consumed,
+               TotalDrops, 100.0 * TotalDrops / (static_cast<double>(NumEvents) * NumProducers),
+               Channel->GetDropped());
+    }));
+#endif
@@ -0,0 +1,89 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOGzipWriter.h"
+
+namespace PSOGzipWriter
+{
+// 15 bits of window, +16 asks zlib for a gzip header rather than a zlib one
+constexpr int GzipWindowBits = 15 + 16;
+constexpr int MemLevel = 8;
+} // namespace PSOGzipWriter
+
+FPSOGzipWriter::FPSOGzipWriter(FArchive &InInner, int32 Level, int32 BufferSize)
+    : Inner(InInner), bInitialised(false), bFinished(false)
+{
+    SetIsSaving(true);
+    SetIsPersistent(true);
+
+    FMemory::Memzero(Stream);
+    bInitialised = Z_OK == deflateInit2(&Stream, FMath::Clamp(Level, 1, 9), Z_DEFLATED,
+                                        PSOGzipWriter::GzipWindowBits, PSOGzipWriter::MemLevel, Z_DEFAULT_STRATEGY);
+
+    if (!bInitialised)
+    {
+        SetError();
+    }
+
+    Buffer.SetNumUninitialized(FMath::Max(BufferSize, 4096));
+}
+
+FPSOGzipWriter::~FPSOGzipWriter()
+{
+    if (bInitialised)
+    {
+        deflateEnd(&Stream);
+    }
+}
+
+bool FPSOGzipWriter::Finish()
+{
+    if (!bFinished && !IsError())
+    {
+        Deflate(nullptr, 0, Z_FINISH);
+        bFinished = true;
+    }
+
+    return !IsError() && !Inner.IsError();
+}
+
+int64 FPSOGzipWriter::GetMemoryUsage() const
+{
+    // Per zconf.h: (1 << (windowBits + 2)) + (1 << (memLevel + 9))
+    return Buffer.Num() + (1 << (15 + 2)) + (1 << (PSOGzipWriter::MemLevel + 9));
+}
+
+void FPSOGzipWriter::Serialize(void *Data, int64 Num)
+{
+    if (Num > 0 && !IsError() && !bFinished)
+    {
+        Deflate(static_cast<const uint8 *>(Data), Num, Z_NO_FLUSH);
+    }
+}
+
+void FPSOGzipWriter::Deflate(const uint8 *Data, int64 Num, int Flush)
+{
+    // avail_in is 32 bit
+    do
+    {
+        const auto ThisInput = static_cast<uInt>(FMath::Min<int64>(Num, MAX_uint32));
+        Stream.next_in = const_cast<Bytef *>(Data);
+        Stream.avail_in = ThisInput;
+
+        do
+        {
+            Stream.next_out = Buffer.GetData();
+            Stream.avail_out = Buffer.Num();
+
+            if (Z_STREAM_ERROR == deflate(&Stream, Num - ThisInput > 0 ? Z_NO_FLUSH : Flush))
+            {
+                SetError();
+                return;
+            }
+
+            Inner.Serialize(Buffer.GetData(), Buffer.Num() - Stream.avail_out);
+        } while (Stream.avail_out == 0);
+
+        Data += ThisInput;
+        Num -= ThisInput;
+    } while (Num > 0);
+}
@@ -0,0 +1,48 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Serialization/Archive.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "zlib.h"
+THIRD_PARTY_INCLUDES_END
+
+/**
+ * Archive that gzips everything written to it into another archive
+ *
+ * Uses the engine's zlib directly rather than FCompression so we get a single
+ * streamed member (any HTTP stack can undo Content-Encoding: gzip) and a real
+ * compression level. Memory is the output buffer plus zlib's own state.
+ */
+class FPSOGzipWriter : public FArchive
+{
+public:
+    /**
+     * @param Level zlib level, 1 (fastest) to 9 (smallest)
+     */
+    FPSOGzipWriter(FArchive &InInner, int32 Level, int32 BufferSize);
+    virtual ~FPSOGzipWriter();
+
+    /** Flush the tail of the stream. Must be called before the inner archive is closed */
+    bool Finish();
+
+    /** Rough upper bound on the memory this writer holds */
+    int64 GetMemoryUsage() const;
+
+    virtual void Serialize(void *Data, int64 Num) override;
+    virtual FString GetArchiveName() const override
+    {
+        return TEXT("FPSOGzipWriter");
+    }
+
+private:
+    void Deflate(const uint8 *Data, int64 Num, int Flush);
+
+    FArchive &Inner;
+    z_stream Stream;
+    TArray<uint8> Buffer;
+    bool bInitialised;
+    bool bFinished;
+};
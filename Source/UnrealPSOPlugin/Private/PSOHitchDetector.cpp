@@ -0,0 +1,183 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOHitchDetector.h"
+
+#include "Dom/JsonObject.h"
+#include "Misc/FileHelper.h"
+#include "PSOEventRing.h"
+#include "PipelineFileCache.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/JsonWriter.h"
+
+namespace PSOHitchDetector
+{
+// Enough to cover the render and RHI threads running behind the game thread
+constexpr int32 MaxFrames = 8;
+
+// Dropped events are reported at most this often
+constexpr double DropReportSeconds = 10.0;
+} // namespace PSOHitchDetector
+
+FPSOHitchDetector::FPSOHitchDetector(float InHitchThresholdMs)
+    : HitchThresholdMs(InHitchThresholdMs), LastTickTime(-1.0), ReportedDrops(FPSOEventChannel::Get().GetDropped()),
+      LastDropReportTime(-1.0), CurrentMask(0)
+{
+}
+
+FPSOHitchDetector::~FPSOHitchDetector()
+{
+    Stop();
+}
+
+void FPSOHitchDetector::Start()
+{
+    if (!LoggedHandle.IsValid())
+    {
+        LoggedHandle =
+            FPipelineFileCacheManager::OnPipelineStateLogged().AddRaw(this, &FPSOHitchDetector::OnPipelineStateLogged);
+    }
+}
+
+void FPSOHitchDetector::Stop()
+{
+    if (LoggedHandle.IsValid())
+    {
+        FPipelineFileCacheManager::OnPipelineStateLogged().Remove(LoggedHandle);
+        LoggedHandle.Reset();
+    }
+}
+
+void FPSOHitchDetector::SetContext(uint64 UsageMask, const FString &Level)
+{
+    CurrentMask = UsageMask;
+    CurrentLevel = Level;
+}
+
+void FPSOHitchDetector::OnPipelineStateLogged(FPipelineCacheFileFormatPSO &PSO)
+{
+    // Usually the render or RHI thread, mid PSO creation. Keep it cheap
+    FPSOEventChannel::Get().Push(EPSOEventType::Miss, GetTypeHash(PSO));
+}
+
+void FPSOHitchDetector::Tick()
+{
+    // Same clock the events are stamped with
+    const double Now = FPlatformTime::ToSeconds64(FPlatformTime::Cycles64());
+    if (LastTickTime >= 0.0)
+    {
+        Frames.Push({LastTickTime, Now});
+        if (Frames.Num() > PSOHitchDetector::MaxFrames)
+        {
+            Frames.RemoveAt(0, Frames.Num() - PSOHitchDetector::MaxFrames, false);
+        }
+    }
+    LastTickTime = Now;
+
+    TArray<FPendingMiss> Drained;
+    Swap(Drained, Pending);
+
+    FPSOEventChannel::Get().Drain([&Drained](const FPSOEvent &Event) {
+        if (EPSOEventType::Miss == Event.Type)
+        {
+            Drained.Push({Event.PSOHash, FPlatformTime::ToSeconds64(Event.Cycles)});
+        }
+    });
+
+    const uint64 Drops = FPSOEventChannel::Get().GetDropped();
+    if (Drops != ReportedDrops &&
+        (LastDropReportTime < 0.0 || Now - LastDropReportTime >= PSOHitchDetector::DropReportSeconds))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("%llu PSO misses dropped by the event channel. The hitch list is short of them"),
+               Drops - ReportedDrops);
+        ReportedDrops = Drops;
+        LastDropReportTime = Now;
+    }
+
+    TArray<FPendingMiss> Unresolved;
+    for (const auto &Miss : Drained)
+    {
+        // A miss hurts the frame it happened in, or the one after if the render thread was behind
+        int32 FrameIndex = Frames.IndexOfByPredicate(
+            [&Miss](const FFrame &Frame) { return Miss.Time >= Frame.Start && Miss.Time < Frame.End; });
+
+        if (INDEX_NONE == FrameIndex && Frames.Num() > 0 && Miss.Time < Frames[0].Start)
+        {
+            // Older than anything we remember
+            FrameIndex = 0;
+        }
+
+        if (INDEX_NONE == FrameIndex || FrameIndex == Frames.Num() - 1)
+        {
+            // Wait for the next frame to finish
+            Unresolved.Push(Miss);
+            continue;
+        }
+
+        const auto &Frame = Frames[FrameIndex];
+        const auto &Next = Frames[FrameIndex + 1];
+        const float FrameMs =
+            static_cast<float>(FMath::Max(Frame.End - Frame.Start, Next.End - Next.Start) * 1000.0);
+
+        RecordMiss(Miss.PSOHash, FrameMs);
+    }
+
+    Pending = MoveTemp(Unresolved);
+}
+
+void FPSOHitchDetector::RecordMiss(uint32 PSOHash, float FrameMs)
+{
+    auto &Record = Misses.FindOrAdd(PSOHash);
+    if (0 == Record.Count)
+    {
+        Record.PSOHash = PSOHash;
+        Record.UsageMask = CurrentMask;
+        Record.Level = CurrentLevel;
+        Record.FirstSeen = FDateTime::UtcNow();
+    }
+
+    ++Record.Count;
+    Record.WorstFrameMs = FMath::Max(Record.WorstFrameMs, FrameMs);
+
+    if (FrameMs >= HitchThresholdMs)
+    {
+        ++Record.Hitches;
+        Record.TotalHitchMs += FrameMs;
+
+        UE_LOG(LogTemp, Log, TEXT("PSO %08x missed in %s, %.1f ms frame"), PSOHash, *CurrentLevel, FrameMs);
+    }
+}
+
+bool FPSOHitchDetector::SaveHitchList(const FString &File) const
+{
+    if (0 == Misses.Num())
+    {
+        return false;
+    }
+
+    TArray<FPSOMissRecord> Sorted;
+    Misses.GenerateValueArray(Sorted);
+    Sorted.Sort([](const FPSOMissRecord &A, const FPSOMissRecord &B) {
+        return A.TotalHitchMs != B.TotalHitchMs ? A.TotalHitchMs > B.TotalHitchMs : A.WorstFrameMs > B.WorstFrameMs;
+    });
+
+    TArray<TSharedPtr<FJsonValue>> ListJSON;
+    for (const auto &Record : Sorted)
+    {
+        TSharedPtr<FJsonObject> RecordJSON = MakeShared<FJsonObject>();
+        RecordJSON->SetNumberField("pso", Record.PSOHash);
+        RecordJSON->SetStringField("mask", FString::Printf(TEXT("%016llx"), Record.UsageMask));
+        RecordJSON->SetStringField("level", Record.Level);
+        RecordJSON->SetNumberField("firstseen", static_cast<double>(Record.FirstSeen.ToUnixTimestamp()));
+        RecordJSON->SetNumberField("count", Record.Count);
+        RecordJSON->SetNumberField("hitches", Record.Hitches);
+        RecordJSON->SetNumberField("worstms", Record.WorstFrameMs);
+        RecordJSON->SetNumberField("totalms", Record.TotalHitchMs);
+        ListJSON.Push(MakeShared<FJsonValueObject>(RecordJSON));
+    }
+
+    FString OutputString;
+    TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&OutputString);
+    FJsonSerializer::Serialize(ListJSON, Writer);
+
+    return FFileHelper::SaveStringToFile(OutputString, *File);
+}
@@ -0,0 +1,91 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOKnownFilter.h"
+
+#include "Serialization/MemoryReader.h"
+
+bool FPSOKnownFilter::Parse(const TArray<uint8> &Data)
+{
+    FMemoryReader Reader(Data);
+
+    ANSICHAR Magic[4];
+    uint16 InVersion = 0;
+    uint8 Reserved = 0;
+    uint8 InNumHashes = 0;
+    uint32 InSeed = 0;
+    uint64 InNumBits = 0;
+
+    Reader.Serialize(Magic, sizeof(Magic));
+    Reader << InVersion;
+    Reader << InNumHashes;
+    Reader << Reserved;
+    Reader << InSeed;
+    Reader << InNumBits;
+
+    if (Reader.IsError() || FMemory::Memcmp(Magic, "PCBF", sizeof(Magic)) != 0 || InVersion > FormatVersion)
+    {
+        return false;
+    }
+
+    // Counted in bits, as rounding NumBits up to bytes wraps for a bogus one near UINT64_MAX
+    const int64 Offset = Reader.Tell();
+    if (0 == InNumBits || 0 == InNumHashes || InNumBits > static_cast<uint64>(Data.Num() - Offset) * 8)
+    {
+        return false;
+    }
+
+    Raw = Data;
+    BitsOffset = Offset;
+    NumBits = InNumBits;
+    Seed = InSeed;
+    NumHashes = InNumHashes;
+    Version = InVersion;
+
+    return true;
+}
+
+bool FPSOKnownFilter::MayContain(uint32 PSOHash, uint64 UsageMask) const
+{
+    if (IsEmpty() || (Version < 2 && 0 != UsageMask) || !MayContainKey(PSOHash, 0))
+    {
+        return false;
+    }
+
+    for (uint32 UsageBit = 0; UsageBit < 64; ++UsageBit)
+    {
+        if (0 != (UsageMask & (1ull << UsageBit)) && !MayContainKey(PSOHash, UsageBit + 1))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FPSOKnownFilter::MayContainKey(uint32 PSOHash, uint32 UsageKey) const
+{
+    const uint64 X =
+        SplitMix64(((static_cast<uint64>(Seed) << 32) | PSOHash) ^ (static_cast<uint64>(UsageKey) << 56));
+    const uint64 H1 = static_cast<uint32>(X);
+    const uint64 H2 = static_cast<uint32>(X >> 32) | 1;
+
+    const uint8 *Bits = Raw.GetData() + BitsOffset;
+    for (uint64 Index = 0; Index < NumHashes; ++Index)
+    {
+        const uint64 Bit = (H1 + Index * H2) % NumBits;
+        if (0 == (Bits[Bit >> 3] & (1 << (Bit & 7))))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint64 FPSOKnownFilter::SplitMix64(uint64 Value)
+{
+    Value += 0x9E3779B97F4A7C15ull;
+    Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ull;
+    Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBull;
+    return Value ^ (Value >> 31);
+}
@@ -0,0 +1,338 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOUploadManifest.h"
+
+#include "Dom/JsonObject.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "HAL/PlatformProcess.h"
+#include "Hash/xxhash.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/JsonWriter.h"
+
+namespace PSOUploadManifest
+{
+constexpr int32 HashChunkSize = 1024 * 1024;
+
+// Saves are quick, so nobody keeps the lock for long
+constexpr int32 LockAttempts = 100;
+constexpr float LockAttemptInterval = 0.01f;
+
+FCriticalSection FileLockMutex;
+
+/**
+ * Cross-process lock on the manifest for the length of a save
+ *
+ * Same exclusively written file as FPSOOutboxLock. That one is kept by the
+ * sending process, so can't be waited on.
+ */
+class FScopedFileLock
+{
+public:
+    FScopedFileLock() : ScopeLock(&FileLockMutex)
+    {
+        const auto LockFile = FPSOUploadManifest::GetManifestPath() + TEXT(".lock");
+        auto &PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+        for (int32 Attempt = 0; Attempt < LockAttempts && !Handle; ++Attempt)
+        {
+            if (Attempt > 0)
+            {
+                FPlatformProcess::Sleep(LockAttemptInterval);
+            }
+            Handle.Reset(PlatformFile.OpenWrite(*LockFile));
+        }
+    }
+
+    bool IsLocked() const
+    {
+        return Handle.IsValid();
+    }
+
+private:
+    FScopeLock ScopeLock;
+    TUniquePtr<IFileHandle> Handle;
+};
+
+/** False if the manifest is corrupt. A missing one is just empty */
+bool ReadRecords(TMap<FString, FPSOManifestRecord> &OutRecords)
+{
+    FString InputString;
+    if (!FFileHelper::LoadFileToString(InputString, *FPSOUploadManifest::GetManifestPath()))
+    {
+        return true;
+    }
+
+    TSharedPtr<FJsonObject> ManifestJSON;
+    TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(InputString);
+    if (!FJsonSerializer::Deserialize(Reader, ManifestJSON) || !ManifestJSON.IsValid())
+    {
+        return false;
+    }
+
+    for (const auto &Pair : ManifestJSON->Values)
+    {
+        const auto RecordJSON = Pair.Value->AsObject();
+        if (!RecordJSON.IsValid())
+        {
+            continue;
+        }
+
+        FPSOManifestRecord Record;
+        Record.Size = static_cast<int64>(RecordJSON->GetNumberField("size"));
+        Record.Timestamp = FDateTime(FCString::Atoi64(*RecordJSON->GetStringField("mtime")));
+        Record.Hash = FCString::Strtoui64(*RecordJSON->GetStringField("hash"), nullptr, 16);
+        Record.bUploaded = RecordJSON->GetBoolField("uploaded");
+
+        // Older manifests don't have it
+        RecordJSON->TryGetBoolField("rejected", Record.bRejected);
+
+        OutRecords.Add(Pair.Key, Record);
+    }
+
+    return true;
+}
+} // namespace PSOUploadManifest
+
+FString FPSOUploadManifest::GetManifestPath()
+{
+    return FPaths::ProjectSavedDir() / TEXT("PSOUploadManifest.json");
+}
+
+FString FPSOUploadManifest::NormalisePath(const FString &File)
+{
+    auto FullPath = FPaths::ConvertRelativePathToFull(File);
+    FPaths::NormalizeFilename(FullPath);
+    return FullPath;
+}
+
+void FPSOUploadManifest::Load()
+{
+    FScopeLock ScopeLock(&Lock);
+    Records.Reset();
+    Changes.Reset();
+
+    if (!PSOUploadManifest::ReadRecords(Records))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("PSO upload manifest is corrupt. Everything will be uploaded again"));
+        return;
+    }
+
+    for (auto It = Records.CreateIterator(); It; ++It)
+    {
+        if (!IFileManager::Get().FileExists(*It.Key()))
+        {
+            Changes.Add(It.Key(), {});
+            It.RemoveCurrent();
+        }
+    }
+
+    if (Changes.Num() > 0)
+    {
+        SaveLocked();
+    }
+}
+
+bool FPSOUploadManifest::NeedsUpload(const FString &File, FPSOManifestRecord &OutRecord)
+{
+    const auto Key = NormalisePath(File);
+    const auto Stat = IFileManager::Get().GetStatData(*Key);
+    if (!Stat.bIsValid)
+    {
+        return false;
+    }
+
+    // A hash the caller already has (e.g. from FPSOCacheCatalog) is trusted if it's for this exact file
+    const bool bHaveHash = 0 != OutRecord.Hash && OutRecord.Size == Stat.FileSize &&
+                           OutRecord.Timestamp == Stat.ModificationTime;
+
+    OutRecord.Size = Stat.FileSize;
+    OutRecord.Timestamp = Stat.ModificationTime;
+    OutRecord.Hash = bHaveHash ? OutRecord.Hash : 0;
+    OutRecord.bUploaded = false;
+    OutRecord.bRejected = false;
+
+    FPSOManifestRecord Known;
+    {
+        FScopeLock ScopeLock(&Lock);
+        const auto *Found = Records.Find(Key);
+        if (!Found)
+        {
+            return bHaveHash || HashFile(Key, OutRecord.Hash);
+        }
+        Known = *Found;
+    }
+
+    // Cheap check first. Queued, sent or rejected, either way it's handled
+    if (Known.Size == OutRecord.Size && Known.Timestamp == OutRecord.Timestamp)
+    {
+        return false;
+    }
+
+    // Touched but possibly not changed, e.g. the stable cache after a reinstall
+    if (!bHaveHash && !HashFile(Key, OutRecord.Hash))
+    {
+        return false;
+    }
+
+    if (Known.Size == OutRecord.Size && Known.Hash == OutRecord.Hash)
+    {
+        OutRecord.bUploaded = Known.bUploaded;
+        OutRecord.bRejected = Known.bRejected;
+
+        FScopeLock ScopeLock(&Lock);
+        SetLocked(Key, OutRecord);
+        SaveLocked();
+        return false;
+    }
+
+    return true;
+}
+
+void FPSOUploadManifest::MarkEnqueued(const FString &File, const FPSOManifestRecord &Record)
+{
+    auto Enqueued = Record;
+    Enqueued.bUploaded = false;
+    Enqueued.bRejected = false;
+
+    FScopeLock ScopeLock(&Lock);
+    SetLocked(NormalisePath(File), Enqueued);
+    SaveLocked();
+}
+
+void FPSOUploadManifest::MarkUploaded(const FString &File, const FPSOManifestRecord &Record)
+{
+    MarkFinished(File, Record, false);
+}
+
+void FPSOUploadManifest::MarkRejected(const FString &File, const FPSOManifestRecord &Record)
+{
+    MarkFinished(File, Record, true);
+}
+
+void FPSOUploadManifest::MarkFinished(const FString &File, const FPSOManifestRecord &Record, bool bRejected)
+{
+    const auto Key = NormalisePath(File);
+
+    FScopeLock ScopeLock(&Lock);
+
+    // The file may have changed again since this copy was queued. Newer state wins
+    const auto *Found = Records.Find(Key);
+    if (Found && Found->Hash != Record.Hash)
+    {
+        return;
+    }
+
+    auto Finished = Record;
+    Finished.bUploaded = !bRejected;
+    Finished.bRejected = bRejected;
+    SetLocked(Key, Finished);
+    SaveLocked();
+}
+
+void FPSOUploadManifest::Forget(const FString &File)
+{
+    const auto Key = NormalisePath(File);
+
+    FScopeLock ScopeLock(&Lock);
+    if (Records.Remove(Key) > 0)
+    {
+        Changes.Add(Key, {});
+        SaveLocked();
+    }
+}
+
+bool FPSOUploadManifest::HashFile(const FString &File, uint64 &OutHash)
+{
+    TUniquePtr<FArchive> Reader(IFileManager::Get().CreateFileReader(*File));
+    if (!Reader)
+    {
+        return false;
+    }
+
+    TArray<uint8> Chunk;
+    Chunk.SetNumUninitialized(PSOUploadManifest::HashChunkSize);
+
+    FXxHash64Builder Builder;
+    int64 Remaining = Reader->TotalSize();
+    while (Remaining > 0)
+    {
+        const int32 ThisRead = static_cast<int32>(FMath::Min<int64>(Remaining, Chunk.Num()));
+        Reader->Serialize(Chunk.GetData(), ThisRead);
+        if (Reader->IsError())
+        {
+            return false;
+        }
+
+        Builder.Update(Chunk.GetData(), ThisRead);
+        Remaining -= ThisRead;
+    }
+
+    OutHash = Builder.Finalize().Hash;
+    return true;
+}
+
+void FPSOUploadManifest::SetLocked(const FString &Key, const FPSOManifestRecord &Record)
+{
+    Records.Add(Key, Record);
+    Changes.Add(Key, Record);
+}
+
+void FPSOUploadManifest::SaveLocked()
+{
+    PSOUploadManifest::FScopedFileLock FileLock;
+    if (!FileLock.IsLocked())
+    {
+        // Changes are kept, so the next save catches up
+        UE_LOG(LogTemp, Warning, TEXT("Couldn't lock the PSO upload manifest. Will save it later"));
+        return;
+    }
+
+    // Start from what other processes have saved. A corrupt manifest is replaced with ours
+    TMap<FString, FPSOManifestRecord> Merged;
+    if (!PSOUploadManifest::ReadRecords(Merged))
+    {
+        Merged = Records;
+    }
+
+    for (const auto &Change : Changes)
+    {
+        if (Change.Value.IsSet())
+        {
+            Merged.Add(Change.Key, Change.Value.GetValue());
+        }
+        else
+        {
+            Merged.Remove(Change.Key);
+        }
+    }
+
+    TSharedPtr<FJsonObject> ManifestJSON = MakeShared<FJsonObject>();
+    for (const auto &Pair : Merged)
+    {
+        TSharedPtr<FJsonObject> RecordJSON = MakeShared<FJsonObject>();
+        RecordJSON->SetNumberField("size", Pair.Value.Size);
+        RecordJSON->SetStringField("mtime", LexToString(Pair.Value.Timestamp.GetTicks()));
+        RecordJSON->SetStringField("hash", FString::Printf(TEXT("%016llx"), Pair.Value.Hash));
+        RecordJSON->SetBoolField("uploaded", Pair.Value.bUploaded);
+        RecordJSON->SetBoolField("rejected", Pair.Value.bRejected);
+        ManifestJSON->SetObjectField(Pair.Key, RecordJSON);
+    }
+
+    FString OutputString;
+    TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&OutputString);
+    FJsonSerializer::Serialize(ManifestJSON.ToSharedRef(), Writer);
+
+    // Write then swap, so a crash mid-save can't lose the whole manifest
+    const auto TempPath =
+        FString::Printf(TEXT("%s.%u.tmp"), *GetManifestPath(), FPlatformProcess::GetCurrentProcessId());
+    if (FFileHelper::SaveStringToFile(OutputString, *TempPath) &&
+        IFileManager::Get().Move(*GetManifestPath(), *TempPath))
+    {
+        Records = MoveTemp(Merged);
+        Changes.Reset();
+    }
+}
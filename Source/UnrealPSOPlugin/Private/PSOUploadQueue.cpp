@@ -0,0 +1,1087 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOUploadQueue.h"
+
+#include "Dom/JsonObject.h"
+#include "GenericPlatform/GenericPlatformHttp.h"
+#include "HAL/Event.h"
+#include "HAL/FileManager.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "HAL/PlatformProcess.h"
+#include "HAL/RunnableThread.h"
+#include "HttpModule.h"
+#include "Interfaces/IHttpRequest.h"
+#include "Interfaces/IHttpResponse.h"
+#include "Misc/App.h"
+#include "Misc/Base64.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Guid.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "PSOGzipWriter.h"
+#include "RHI.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/JsonWriter.h"
+
+namespace PSOUploadQueue
+{
+const TCHAR *PayloadExtension = TEXT(".payload");
+const TCHAR *EntryExtension = TEXT(".json");
+const TCHAR *TempExtension = TEXT(".tmp");
+const TCHAR *PriorityPrefix = TEXT("Priority-");
+
+// How long a single request may take before we give up on it
+constexpr double RequestTimeout = 30.0;
+
+constexpr float MinRetryDelay = 5.f;
+constexpr float MaxRetryDelay = 300.f;
+
+// How stale the known-PSO filter may get. It's only a hint, so this is relaxed
+constexpr double FilterRefreshInterval = 60.0 * 60.0;
+
+// How long to leave the filter after failing to reach the server for it
+constexpr double FilterRetryInterval = 5.0 * 60.0;
+
+// How often to try for the outbox lock while another process has it
+constexpr float LockRetryInterval = 60.f;
+
+// How often the lock holder looks for items other processes have committed
+constexpr double OutboxPollInterval = 5.0;
+
+FCriticalSection OutboxLockMutex;
+TWeakPtr<FPSOOutboxLock, ESPMode::ThreadSafe> SharedOutboxLock;
+
+// Process that enqueued an outbox file, from the end of its name. 0 for items from before names carried it
+uint32 GetEnqueuingProcessId(const FString &Filename)
+{
+    FString Base = FPaths::GetCleanFilename(Filename);
+    int32 Dot = INDEX_NONE;
+    if (Base.FindChar(TEXT('.'), Dot))
+    {
+        Base.LeftInline(Dot);
+    }
+
+    int32 Underscore = INDEX_NONE;
+    if (!Base.FindLastChar(TEXT('_'), Underscore))
+    {
+        return 0;
+    }
+
+    const FString Pid = Base.Mid(Underscore + 1);
+    return Pid.IsNumeric() ? static_cast<uint32>(FCString::Atoi64(*Pid)) : 0;
+}
+
+// Whoever wrote Filename may still be busy with it. Includes this process, which enqueues from other threads
+bool IsWriterAlive(const FString &Filename)
+{
+    const uint32 ProcessId = GetEnqueuingProcessId(Filename);
+    return 0 != ProcessId && FPlatformProcess::IsApplicationRunning(ProcessId);
+}
+
+FString QuoteJson(const FString &Value)
+{
+    FString Quoted(TEXT("\""));
+    for (const auto Char : Value)
+    {
+        switch (Char)
+        {
+        case TEXT('"'):
+            Quoted += TEXT("\\\"");
+            break;
+        case TEXT('\\'):
+            Quoted += TEXT("\\\\");
+            break;
+        default:
+            if (Char < 0x20)
+            {
+                Quoted += FString::Printf(TEXT("\\u%04x"), static_cast<uint32>(Char));
+            }
+            else
+            {
+                Quoted.AppendChar(Char);
+            }
+        }
+    }
+    Quoted.AppendChar(TEXT('"'));
+    return Quoted;
+}
+
+// Send Request and block the calling thread until it finishes
+// Returns false if it failed to get a response, timed out or was stopped
+bool ProcessAndWait(const FHttpRequestRef &Request, const FThreadSafeBool &bStopRequested)
+{
+    // The game thread may be busy (or gone) by the time this finishes
+    Request->SetDelegateThreadPolicy(EHttpRequestDelegateThreadPolicy::CompleteOnHttpThread);
+    Request->ProcessRequest();
+
+    const double StartTime = FPlatformTime::Seconds();
+    while (Request->GetStatus() == EHttpRequestStatus::Processing ||
+           Request->GetStatus() == EHttpRequestStatus::NotStarted)
+    {
+        if (bStopRequested || FPlatformTime::Seconds() - StartTime > RequestTimeout)
+        {
+            Request->CancelRequest();
+            return false;
+        }
+
+        FPlatformProcess::Sleep(0.05f);
+    }
+
+    return Request->GetStatus() == EHttpRequestStatus::Succeeded && Request->GetResponse().IsValid();
+}
+
+void WriteEnvelopeString(FArchive &Writer, const FString &Value)
+{
+    FTCHARToUTF8 Converted(*Value);
+    uint16 Length = static_cast<uint16>(FMath::Min(Converted.Length(), static_cast<int32>(MAX_uint16)));
+    Writer << Length;
+    Writer.Serialize(const_cast<ANSICHAR *>(Converted.Get()), Length);
+}
+} // namespace PSOUploadQueue
+
+TSharedPtr<FPSOOutboxLock, ESPMode::ThreadSafe> FPSOOutboxLock::TryAcquire()
+{
+    FScopeLock ScopeLock(&PSOUploadQueue::OutboxLockMutex);
+
+    auto Lock = PSOUploadQueue::SharedOutboxLock.Pin();
+    if (Lock.IsValid())
+    {
+        return Lock;
+    }
+
+    // Files open for writing are exclusive: no share-write on Windows, flock everywhere else
+    const FString LockFile = FPSOUploadQueue::GetOutboxDir() / TEXT("Outbox.lock");
+    IFileManager::Get().MakeDirectory(*FPaths::GetPath(LockFile), true);
+
+    IFileHandle *Handle = FPlatformFileManager::Get().GetPlatformFile().OpenWrite(*LockFile);
+    if (!Handle)
+    {
+        return nullptr;
+    }
+
+    Lock = MakeShareable(new FPSOOutboxLock(Handle));
+    PSOUploadQueue::SharedOutboxLock = Lock;
+    return Lock;
+}
+
+FPSOOutboxLock::FPSOOutboxLock(IFileHandle *InHandle) : Handle(InHandle)
+{
+}
+
+FPSOOutboxLock::~FPSOOutboxLock()
+{
+    delete Handle;
+}
+
+FPSOUploadQueue::FPSOUploadQueue(const FString &InServerURL, int32 InChunkSize, int32 InCompressionLevel)
+    : ServerURL(InServerURL), ChunkSize(InChunkSize), CompressionLevel(InCompressionLevel), bProbedServer(false),
+      bServerAcceptsGzip(false), UploadFormat(EPSOUploadFormat::Json), Thread(nullptr), WakeEvent(nullptr),
+      bStopRequested(false), RetryDelay(PSOUploadQueue::MinRetryDelay)
+{
+}
+
+FPSOUploadQueue::~FPSOUploadQueue()
+{
+    Shutdown();
+}
+
+FString FPSOUploadQueue::GetOutboxDir()
+{
+    return FPaths::ProjectSavedDir() / TEXT("PSOOutbox");
+}
+
+void FPSOUploadQueue::Start()
+{
+    if (Thread)
+    {
+        return;
+    }
+
+    IFileManager::Get().MakeDirectory(*GetOutboxDir(), true);
+    Manifest.Load();
+    LoadKnownFilter();
+
+    bStopRequested = false;
+    WakeEvent = FPlatformProcess::GetSynchEventFromPool(false);
+    Thread = FRunnableThread::Create(this, TEXT("PSOUploadQueue"), 0, TPri_BelowNormal);
+}
+
+void FPSOUploadQueue::Shutdown()
+{
+    if (Thread)
+    {
+        // Kill calls Stop and joins. Any in-flight request is cancelled and the item stays in the outbox
+        Thread->Kill(true);
+        delete Thread;
+        Thread = nullptr;
+    }
+
+    OutboxLock.Reset();
+
+    if (WakeEvent)
+    {
+        FPlatformProcess::ReturnSynchEventToPool(WakeEvent);
+        WakeEvent = nullptr;
+    }
+}
+
+void FPSOUploadQueue::Stop()
+{
+    bStopRequested = true;
+
+    if (WakeEvent)
+    {
+        WakeEvent->Trigger();
+    }
+}
+
+bool FPSOUploadQueue::Enqueue(const FPSOUploadEntry &InEntry, const FString &SourceFile)
+{
+    auto Entry = InEntry;
+    Entry.SourceFile = SourceFile;
+
+    if (!Manifest.NeedsUpload(SourceFile, Entry.Record))
+    {
+        return true;
+    }
+
+    return EnqueuePayload(Entry, SourceFile);
+}
+
+void FPSOUploadQueue::EnqueueTask(FTask Task)
+{
+    {
+        FScopeLock ScopeLock(&TaskLock);
+        Tasks.Add(MoveTemp(Task));
+    }
+
+    if (WakeEvent)
+    {
+        WakeEvent->Trigger();
+    }
+}
+
+bool FPSOUploadQueue::NeedsUpload(const FString &SourceFile, FPSOManifestRecord &OutRecord)
+{
+    return Manifest.NeedsUpload(SourceFile, OutRecord);
+}
+
+void FPSOUploadQueue::MarkUploaded(const FString &SourceFile, const FPSOManifestRecord &Record)
+{
+    Manifest.MarkUploaded(SourceFile, Record);
+}
+
+bool FPSOUploadQueue::EnqueuePayload(const FPSOUploadEntry &Entry, const FString &PayloadFile, bool bPriority)
+{
+    const FString ItemBase =
+        GetOutboxDir() / FString::Printf(TEXT("%s%020lld_%s_%u"), bPriority ? PSOUploadQueue::PriorityPrefix : TEXT(""),
+                                         FDateTime::UtcNow().GetTicks(),
+                                         *FGuid::NewGuid().ToString(EGuidFormats::Digits),
+                                         FPlatformProcess::GetCurrentProcessId());
+
+    const FString OutboxPayload = ItemBase + PSOUploadQueue::PayloadExtension;
+    const FString EntryFile = ItemBase + PSOUploadQueue::EntryExtension;
+
+    auto &FileManager = IFileManager::Get();
+
+    // Payload first. The item only becomes visible to the worker once the entry exists
+    if (FileManager.Copy(*(OutboxPayload + PSOUploadQueue::TempExtension), *PayloadFile) != COPY_OK ||
+        !FileManager.Move(*OutboxPayload, *(OutboxPayload + PSOUploadQueue::TempExtension)))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Could not add %s to the PSO outbox"), *PayloadFile);
+        FileManager.Delete(*(OutboxPayload + PSOUploadQueue::TempExtension), false, false, true);
+        return false;
+    }
+
+    if (!SaveEntry(EntryFile + PSOUploadQueue::TempExtension, Entry) ||
+        !FileManager.Move(*EntryFile, *(EntryFile + PSOUploadQueue::TempExtension)))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Could not commit %s to the PSO outbox"), *PayloadFile);
+        FileManager.Delete(*(EntryFile + PSOUploadQueue::TempExtension), false, false, true);
+        FileManager.Delete(*OutboxPayload, false, false, true);
+        return false;
+    }
+
+    if (!Entry.SourceFile.IsEmpty())
+    {
+        Manifest.MarkEnqueued(Entry.SourceFile, Entry.Record);
+    }
+
+    if (WakeEvent)
+    {
+        WakeEvent->Trigger();
+    }
+
+    return true;
+}
+
+uint32 FPSOUploadQueue::Run()
+{
+    while (!bStopRequested)
+    {
+        RefreshKnownFilterIfStale();
+        RunTasks();
+
+        if (!OutboxLock.IsValid())
+        {
+            OutboxLock = FPSOOutboxLock::TryAcquire();
+            if (!OutboxLock.IsValid())
+            {
+                // Another process is sending. It'll pick up what we enqueue too
+                WakeEvent->Wait(FTimespan::FromSeconds(PSOUploadQueue::LockRetryInterval));
+                continue;
+            }
+
+            RemovePartialItems();
+        }
+
+        TArray<FString> Items;
+        GetPendingItems(Items);
+
+        for (auto It = ItemBackoff.CreateIterator(); It; ++It)
+        {
+            if (!Items.Contains(It.Key()))
+            {
+                It.RemoveCurrent();
+            }
+        }
+
+        // Can't pick a format until we've heard from the server
+        bool bBackOff = Items.Num() > 0 && !bProbedServer && !ProbeServer();
+        double NextWake = FPlatformTime::Seconds() + PSOUploadQueue::OutboxPollInterval;
+        for (const auto &ItemBase : Items)
+        {
+            if (bStopRequested || bBackOff)
+            {
+                break;
+            }
+
+            const auto Backoff = ItemBackoff.Find(ItemBase);
+            if (Backoff && Backoff->NextAttempt > FPlatformTime::Seconds())
+            {
+                NextWake = FMath::Min(NextWake, Backoff->NextAttempt);
+                continue;
+            }
+
+            const auto Result = UploadItem(ItemBase);
+            if (EUploadResult::Unavailable == Result)
+            {
+                // Leave everything where it is and try again later
+                bBackOff = true;
+                break;
+            }
+
+            RetryDelay = PSOUploadQueue::MinRetryDelay;
+
+            if (EUploadResult::Retry == Result)
+            {
+                // Just this item. The ones behind it shouldn't wait on it
+                auto &Failed = ItemBackoff.FindOrAdd(ItemBase);
+                Failed.Delay = Failed.Delay > 0.f ? FMath::Min(Failed.Delay * 2.f, PSOUploadQueue::MaxRetryDelay)
+                                                  : PSOUploadQueue::MinRetryDelay;
+                Failed.NextAttempt = FPlatformTime::Seconds() + Failed.Delay;
+                NextWake = FMath::Min(NextWake, Failed.NextAttempt);
+            }
+            else
+            {
+                ItemBackoff.Remove(ItemBase);
+            }
+        }
+
+        if (bStopRequested)
+        {
+            break;
+        }
+
+        if (bBackOff)
+        {
+            WakeEvent->Wait(FTimespan::FromSeconds(RetryDelay));
+            RetryDelay = FMath::Min(RetryDelay * 2.f, PSOUploadQueue::MaxRetryDelay);
+        }
+        else
+        {
+            // Our own enqueues wake us. Other processes' don't, so poll for theirs
+            WakeEvent->Wait(FTimespan::FromSeconds(FMath::Max(NextWake - FPlatformTime::Seconds(), 0.0)));
+        }
+    }
+
+    return 0;
+}
+
+void FPSOUploadQueue::RunTasks()
+{
+    TArray<FTask> Pending;
+    {
+        FScopeLock ScopeLock(&TaskLock);
+        Swap(Pending, Tasks);
+    }
+
+    for (auto &Task : Pending)
+    {
+        if (bStopRequested)
+        {
+            break;
+        }
+
+        Task(*this);
+    }
+}
+
+void FPSOUploadQueue::RemovePartialItems() const
+{
+    auto &FileManager = IFileManager::Get();
+    const auto OutboxDir = GetOutboxDir();
+
+    TArray<FString> Leftovers;
+    FileManager.FindFiles(Leftovers, *(OutboxDir / TEXT("*") + PSOUploadQueue::TempExtension), true, false);
+    for (const auto &Leftover : Leftovers)
+    {
+        if (!PSOUploadQueue::IsWriterAlive(Leftover))
+        {
+            FileManager.Delete(*(OutboxDir / Leftover), false, false, true);
+        }
+    }
+
+    // Payloads without an entry never got committed
+    TArray<FString> Payloads;
+    FileManager.FindFiles(Payloads, *(OutboxDir / TEXT("*") + PSOUploadQueue::PayloadExtension), true, false);
+    for (const auto &Payload : Payloads)
+    {
+        const auto ItemBase = OutboxDir / FPaths::GetBaseFilename(Payload);
+        if (!PSOUploadQueue::IsWriterAlive(Payload) &&
+            !FileManager.FileExists(*(ItemBase + PSOUploadQueue::EntryExtension)))
+        {
+            FileManager.Delete(*(OutboxDir / Payload), false, false, true);
+        }
+    }
+}
+
+bool FPSOUploadQueue::GetPendingItems(TArray<FString> &OutItems) const
+{
+    const auto OutboxDir = GetOutboxDir();
+
+    TArray<FString> Entries;
+    IFileManager::Get().FindFiles(Entries, *(OutboxDir / TEXT("*") + PSOUploadQueue::EntryExtension), true, false);
+
+    // Names lead with a timestamp, so this is oldest first, with priority items ahead of the rest
+    Entries.Sort([](const FString &A, const FString &B) {
+        const bool bPriorityA = A.StartsWith(PSOUploadQueue::PriorityPrefix);
+        const bool bPriorityB = B.StartsWith(PSOUploadQueue::PriorityPrefix);
+        return bPriorityA != bPriorityB ? bPriorityA : A < B;
+    });
+
+    for (const auto &Entry : Entries)
+    {
+        OutItems.Push(OutboxDir / FPaths::GetBaseFilename(Entry));
+    }
+
+    return OutItems.Num() > 0;
+}
+
+FPSOUploadQueue::EUploadResult FPSOUploadQueue::UploadItem(const FString &ItemBase)
+{
+    const FString PayloadFile = ItemBase + PSOUploadQueue::PayloadExtension;
+    const FString EntryFile = ItemBase + PSOUploadQueue::EntryExtension;
+
+    FPSOUploadEntry Entry;
+    auto Result = EUploadResult::Rejected;
+
+    const bool bReadable = LoadEntry(EntryFile, Entry) && IFileManager::Get().FileExists(*PayloadFile);
+    if (bReadable)
+    {
+        Result = SendRequest(ItemBase, Entry);
+    }
+    else
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Dropping unreadable PSO outbox item %s"), *ItemBase);
+    }
+
+    if (EUploadResult::Sent == Result)
+    {
+        Manifest.MarkUploaded(Entry.SourceFile, Entry.Record);
+    }
+    else if (EUploadResult::Rejected == Result && !Entry.SourceFile.IsEmpty())
+    {
+        // A broken outbox item is ours to fix, so queue the file again. A refusal stands until the file changes
+        if (bReadable)
+        {
+            Manifest.MarkRejected(Entry.SourceFile, Entry.Record);
+        }
+        else
+        {
+            Manifest.Forget(Entry.SourceFile);
+        }
+    }
+
+    if (EUploadResult::Sent == Result || EUploadResult::Rejected == Result)
+    {
+        // Entry first, so a crash here leaves an orphan payload which Start cleans up
+        IFileManager::Get().Delete(*EntryFile, false, false, true);
+        IFileManager::Get().Delete(*PayloadFile, false, false, true);
+    }
+
+    return Result;
+}
+
+FPSOUploadQueue::EUploadResult FPSOUploadQueue::SendRequest(const FString &ItemBase, const FPSOUploadEntry &Entry)
+{
+    // Lives next to the item, and .tmp means Start will clean it up if we die mid-upload
+    const FString BodyFile = ItemBase + TEXT(".body") + PSOUploadQueue::TempExtension;
+
+    int64 BufferBytes = 0;
+    if (!WriteRequestBody(ItemBase + PSOUploadQueue::PayloadExtension, Entry, BodyFile, UploadFormat,
+                          GetActiveCompressionLevel(), ChunkSize, BufferBytes))
+    {
+        IFileManager::Get().Delete(*BodyFile, false, false, true);
+        return EUploadResult::Retry;
+    }
+
+    const auto Result = SendBodyFile(ItemBase, BodyFile);
+    IFileManager::Get().Delete(*BodyFile, false, false, true);
+
+    return Result;
+}
+
+FPSOUploadQueue::EUploadResult FPSOUploadQueue::SendBodyFile(const FString &ItemBase, const FString &BodyFile)
+{
+    auto HttpRequest = FHttpModule::Get().CreateRequest();
+    HttpRequest->SetVerb("POST");
+    HttpRequest->SetURL(ServerURL + "/api/pco/new/");
+    HttpRequest->SetHeader("Content-Type", EPSOUploadFormat::Binary == UploadFormat ? "application/x-pco-binary"
+                                                                                     : "application/json");
+    if (GetActiveCompressionLevel() > 0)
+    {
+        HttpRequest->SetHeader("Content-Encoding", "gzip");
+    }
+    if (!HttpRequest->SetContentAsStreamedFile(BodyFile))
+    {
+        return EUploadResult::Retry;
+    }
+
+    if (!ProcessAndWait(HttpRequest, bStopRequested))
+    {
+        return EUploadResult::Unavailable;
+    }
+
+    const auto Response = HttpRequest->GetResponse();
+
+    const auto Code = Response->GetResponseCode();
+    if (EHttpResponseCodes::IsOk(Code))
+    {
+        return EUploadResult::Sent;
+    }
+
+    // Throttling is about us, not this item
+    if (Code == EHttpResponseCodes::TooManyRequests || Code == EHttpResponseCodes::ServiceUnavail)
+    {
+        return EUploadResult::Unavailable;
+    }
+
+    // Server errors and timeouts are worth another go. Anything else won't get better
+    if (Code >= 500 || Code == EHttpResponseCodes::RequestTimeout)
+    {
+        return EUploadResult::Retry;
+    }
+
+    UE_LOG(LogTemp, Warning, TEXT("Server rejected PSO upload %s with %d"), *ItemBase, Code);
+    return EUploadResult::Rejected;
+}
+
+bool FPSOUploadQueue::ProbeServer()
+{
+    auto HttpRequest = FHttpModule::Get().CreateRequest();
+    HttpRequest->SetVerb("GET");
+    HttpRequest->SetURL(ServerURL + "/api/pco/capabilities/");
+
+    if (!PSOUploadQueue::ProcessAndWait(HttpRequest, bStopRequested))
+    {
+        return false;
+    }
+
+    // Older servers don't have the endpoint at all. They get uncompressed JSON
+    UploadFormat = EPSOUploadFormat::Json;
+    bServerAcceptsGzip = false;
+    bProbedServer = true;
+
+    const auto Response = HttpRequest->GetResponse();
+    if (!EHttpResponseCodes::IsOk(Response->GetResponseCode()))
+    {
+        return true;
+    }
+
+    TSharedPtr<FJsonObject> CapabilitiesJSON;
+    TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(Response->GetContentAsString());
+    if (!FJsonSerializer::Deserialize(Reader, CapabilitiesJSON) || !CapabilitiesJSON.IsValid())
+    {
+        return true;
+    }
+
+    TArray<FString> Formats;
+    if (CapabilitiesJSON->TryGetStringArrayField("formats", Formats) && Formats.Contains(TEXT("binary")))
+    {
+        UploadFormat = EPSOUploadFormat::Binary;
+    }
+
+    TArray<FString> Encodings;
+    if (CapabilitiesJSON->TryGetStringArrayField("encodings", Encodings) && Encodings.Contains(TEXT("gzip")))
+    {
+        bServerAcceptsGzip = true;
+    }
+
+    return true;
+}
+
+void FPSOUploadQueue::SetKnownFilterKey(const FString &Project, const FString &Version, const FString &ShaderModel)
+{
+    FilterProject = Project;
+    FilterVersion = Version;
+    FilterShaderModel = ShaderModel;
+}
+
+TSharedPtr<const FPSOKnownFilter, ESPMode::ThreadSafe> FPSOUploadQueue::GetKnownFilter() const
+{
+    FScopeLock ScopeLock(&FilterLock);
+    return KnownFilter;
+}
+
+void FPSOUploadQueue::LoadKnownFilter()
+{
+    const auto FilterBase = FPaths::ProjectSavedDir() / TEXT("PSOKnownFilter");
+
+    FString InputString;
+    TArray<uint8> Data;
+    if (!FFileHelper::LoadFileToString(InputString, *(FilterBase + TEXT(".json"))) ||
+        !FFileHelper::LoadFileToArray(Data, *(FilterBase + TEXT(".bin"))))
+    {
+        return;
+    }
+
+    TSharedPtr<FJsonObject> FilterJSON;
+    TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(InputString);
+    if (!FJsonSerializer::Deserialize(Reader, FilterJSON) || !FilterJSON.IsValid())
+    {
+        return;
+    }
+
+    // A filter for another build is no use
+    if (FilterJSON->GetStringField("project") != FilterProject ||
+        FilterJSON->GetStringField("version") != FilterVersion ||
+        FilterJSON->GetStringField("shadermodel") != FilterShaderModel)
+    {
+        return;
+    }
+
+    auto Filter = MakeShared<FPSOKnownFilter, ESPMode::ThreadSafe>();
+    if (Filter->Parse(Data))
+    {
+        FilterETag = FilterJSON->GetStringField("etag");
+        FilterFetched = FDateTime(FCString::Atoi64(*FilterJSON->GetStringField("fetched")));
+
+        FScopeLock ScopeLock(&FilterLock);
+        KnownFilter = Filter;
+    }
+}
+
+void FPSOUploadQueue::RefreshKnownFilterIfStale()
+{
+    const auto Now = FDateTime::UtcNow();
+    if (FilterProject.IsEmpty() ||
+        (Now - FilterFetched).GetTotalSeconds() < PSOUploadQueue::FilterRefreshInterval ||
+        (Now - FilterAttempted).GetTotalSeconds() < PSOUploadQueue::FilterRetryInterval)
+    {
+        return;
+    }
+    FilterAttempted = Now;
+
+    auto HttpRequest = FHttpModule::Get().CreateRequest();
+    HttpRequest->SetVerb("GET");
+    HttpRequest->SetURL(FString::Printf(TEXT("%s/api/pco/known/?project=%s&version=%s&shadermodel=%s"), *ServerURL,
+                                        *FGenericPlatformHttp::UrlEncode(FilterProject),
+                                        *FGenericPlatformHttp::UrlEncode(FilterVersion),
+                                        *FGenericPlatformHttp::UrlEncode(FilterShaderModel)));
+    if (!FilterETag.IsEmpty())
+    {
+        HttpRequest->SetHeader("If-None-Match", FilterETag);
+    }
+
+    if (!PSOUploadQueue::ProcessAndWait(HttpRequest, bStopRequested))
+    {
+        // Try again in a while. Uploads just won't be filtered as well
+        return;
+    }
+
+    // Includes 304 and servers that don't serve filters. Either way, don't ask again for a while
+    FilterFetched = FDateTime::UtcNow();
+
+    const auto Response = HttpRequest->GetResponse();
+    auto Filter = MakeShared<FPSOKnownFilter, ESPMode::ThreadSafe>();
+    if (EHttpResponseCodes::Ok == Response->GetResponseCode() && Filter->Parse(Response->GetContent()))
+    {
+        FilterETag = Response->GetHeader("ETag");
+
+        FScopeLock ScopeLock(&FilterLock);
+        KnownFilter = Filter;
+    }
+
+    TSharedPtr<const FPSOKnownFilter, ESPMode::ThreadSafe> Current = GetKnownFilter();
+    if (!Current.IsValid())
+    {
+        return;
+    }
+
+    // Keep it for next launch, and for Shutdown if the server is unreachable then
+    TSharedPtr<FJsonObject> FilterJSON = MakeShared<FJsonObject>();
+    FilterJSON->SetStringField("project", FilterProject);
+    FilterJSON->SetStringField("version", FilterVersion);
+    FilterJSON->SetStringField("shadermodel", FilterShaderModel);
+    FilterJSON->SetStringField("etag", FilterETag);
+    FilterJSON->SetStringField("fetched", LexToString(FilterFetched.GetTicks()));
+
+    FString OutputString;
+    TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&OutputString);
+    FJsonSerializer::Serialize(FilterJSON.ToSharedRef(), Writer);
+
+    const auto FilterBase = FPaths::ProjectSavedDir() / TEXT("PSOKnownFilter");
+    FFileHelper::SaveArrayToFile(Current->GetRaw(), *(FilterBase + TEXT(".bin")));
+    FFileHelper::SaveStringToFile(OutputString, *(FilterBase + TEXT(".json")));
+}
+
+int32 FPSOUploadQueue::GetActiveCompressionLevel() const
+{
+    return bServerAcceptsGzip ? CompressionLevel : 0;
+}
+
+bool FPSOUploadQueue::WriteRequestBody(const FString &PayloadFile, const FPSOUploadEntry &Entry,
+                                       const FString &BodyFile, EPSOUploadFormat Format, int32 CompressionLevel,
+                                       int32 ChunkSize, int64 &OutBufferBytes)
+{
+    TUniquePtr<FArchive> Reader(IFileManager::Get().CreateFileReader(*PayloadFile));
+    TUniquePtr<FArchive> Writer(IFileManager::Get().CreateFileWriter(*BodyFile));
+    if (!Reader || !Writer)
+    {
+        return false;
+    }
+
+    TUniquePtr<FPSOGzipWriter> Compressor;
+    if (CompressionLevel > 0)
+    {
+        Compressor = MakeUnique<FPSOGzipWriter>(*Writer, CompressionLevel, ChunkSize);
+    }
+
+    auto &BodyWriter = Compressor ? static_cast<FArchive &>(*Compressor) : *Writer;
+
+    bool bWritten = EPSOUploadFormat::Binary == Format
+                        ? WriteBinaryBody(*Reader, BodyWriter, Entry, ChunkSize, OutBufferBytes)
+                        : WriteJsonBody(*Reader, BodyWriter, Entry, ChunkSize, OutBufferBytes);
+
+    if (Compressor)
+    {
+        bWritten = Compressor->Finish() && bWritten;
+        OutBufferBytes += Compressor->GetMemoryUsage();
+    }
+
+    return bWritten && Writer->Close() && !Reader->IsError();
+}
+
+bool FPSOUploadQueue::WriteJsonBody(FArchive &Reader, FArchive &Writer, const FPSOUploadEntry &Entry,
+                                    int32 ChunkSize, int64 &OutBufferBytes)
+{
+    // Same document the server has always had, but the "data" field is written
+    // a chunk at a time rather than built as one big string
+    auto WriteAnsi = [&Writer](const FString &String) {
+        FTCHARToUTF8 Converted(*String);
+        Writer.Serialize(const_cast<ANSICHAR *>(Converted.Get()), Converted.Length());
+    };
+
+    WriteAnsi(FString::Printf(TEXT("{\"machine\":%s,\"project\":%s,\"version\":%s,\"shadertype\":%s,"
+                                   "\"platform\":%s,\"shadermodel\":%s,\"data\":\""),
+                              *PSOUploadQueue::QuoteJson(Entry.Machine), *PSOUploadQueue::QuoteJson(Entry.Project),
+                              *PSOUploadQueue::QuoteJson(Entry.Version), *PSOUploadQueue::QuoteJson(Entry.ShaderType),
+                              *PSOUploadQueue::QuoteJson(Entry.Platform),
+                              *PSOUploadQueue::QuoteJson(Entry.ShaderModel)));
+
+    // Base64 works in groups of 3 bytes, so keep chunks on that boundary and the pieces concatenate cleanly
+    const int32 ReadSize = FMath::Max(3, ChunkSize - ChunkSize % 3);
+
+    TArray<uint8> Chunk;
+    Chunk.SetNumUninitialized(ReadSize);
+
+    // Encode writes a terminating NUL after the data
+    TArray<ANSICHAR> Encoded;
+    Encoded.SetNumUninitialized(FBase64::GetEncodedDataSize(ReadSize) + 1);
+
+    OutBufferBytes = Chunk.Num() + Encoded.Num();
+
+    int64 Remaining = Reader.TotalSize();
+    while (Remaining > 0)
+    {
+        const int32 ThisRead = static_cast<int32>(FMath::Min<int64>(Remaining, ReadSize));
+        Reader.Serialize(Chunk.GetData(), ThisRead);
+        if (Reader.IsError())
+        {
+            return false;
+        }
+
+        const auto EncodedLength = FBase64::Encode(Chunk.GetData(), ThisRead, Encoded.GetData());
+        Writer.Serialize(Encoded.GetData(), EncodedLength);
+
+        Remaining -= ThisRead;
+    }
+
+    WriteAnsi(TEXT("\"}"));
+
+    return true;
+}
+
+bool FPSOUploadQueue::WriteBinaryBody(FArchive &Reader, FArchive &Writer, const FPSOUploadEntry &Entry,
+                                      int32 ChunkSize, int64 &OutBufferBytes)
+{
+    Writer.Serialize(const_cast<ANSICHAR *>(PSOUploadEnvelope::Magic), sizeof(PSOUploadEnvelope::Magic));
+
+    uint16 Version = PSOUploadEnvelope::Version;
+    uint16 Flags = 0;
+    Writer << Version;
+    Writer << Flags;
+
+    PSOUploadQueue::WriteEnvelopeString(Writer, Entry.Machine);
+    PSOUploadQueue::WriteEnvelopeString(Writer, Entry.Project);
+    PSOUploadQueue::WriteEnvelopeString(Writer, Entry.Version);
+    PSOUploadQueue::WriteEnvelopeString(Writer, Entry.ShaderType);
+    PSOUploadQueue::WriteEnvelopeString(Writer, Entry.Platform);
+    PSOUploadQueue::WriteEnvelopeString(Writer, Entry.ShaderModel);
+
+    uint64 PayloadLength = Reader.TotalSize();
+    Writer << PayloadLength;
+
+    // Raw payload follows, no encoding at all
+    TArray<uint8> Chunk;
+    Chunk.SetNumUninitialized(FMath::Max(1, ChunkSize));
+    OutBufferBytes = Chunk.Num();
+
+    int64 Remaining = Reader.TotalSize();
+    while (Remaining > 0)
+    {
+        const int32 ThisRead = static_cast<int32>(FMath::Min<int64>(Remaining, Chunk.Num()));
+        Reader.Serialize(Chunk.GetData(), ThisRead);
+        if (Reader.IsError())
+        {
+            return false;
+        }
+
+        Writer.Serialize(Chunk.GetData(), ThisRead);
+        Remaining -= ThisRead;
+    }
+
+    return true;
+}
+
+bool FPSOUploadQueue::SaveEntry(const FString &Filename, const FPSOUploadEntry &Entry)
+{
+    TSharedPtr<FJsonObject> EntryJSON = MakeShared<FJsonObject>();
+    EntryJSON->SetStringField("machine", Entry.Machine);
+    EntryJSON->SetStringField("project", Entry.Project);
+    EntryJSON->SetStringField("version", Entry.Version);
+    EntryJSON->SetStringField("shadertype", Entry.ShaderType);
+    EntryJSON->SetStringField("platform", Entry.Platform);
+    EntryJSON->SetStringField("shadermodel", Entry.ShaderModel);
+    EntryJSON->SetStringField("source", Entry.SourceFile);
+    EntryJSON->SetNumberField("size", Entry.Record.Size);
+    EntryJSON->SetStringField("mtime", LexToString(Entry.Record.Timestamp.GetTicks()));
+    EntryJSON->SetStringField("hash", FString::Printf(TEXT("%016llx"), Entry.Record.Hash));
+
+    FString OutputString;
+    TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&OutputString);
+    FJsonSerializer::Serialize(EntryJSON.ToSharedRef(), Writer);
+
+    return FFileHelper::SaveStringToFile(OutputString, *Filename);
+}
+
+bool FPSOUploadQueue::LoadEntry(const FString &Filename, FPSOUploadEntry &OutEntry)
+{
+    FString InputString;
+    if (!FFileHelper::LoadFileToString(InputString, *Filename))
+    {
+        return false;
+    }
+
+    TSharedPtr<FJsonObject> EntryJSON;
+    TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(InputString);
+    if (!FJsonSerializer::Deserialize(Reader, EntryJSON) || !EntryJSON.IsValid())
+    {
+        return false;
+    }
+
+    OutEntry.Machine = EntryJSON->GetStringField("machine");
+    OutEntry.Project = EntryJSON->GetStringField("project");
+    OutEntry.Version = EntryJSON->GetStringField("version");
+    OutEntry.ShaderType = EntryJSON->GetStringField("shadertype");
+    OutEntry.Platform = EntryJSON->GetStringField("platform");
+    OutEntry.ShaderModel = EntryJSON->GetStringField("shadermodel");
+
+    // Not every item has these, e.g. anything queued without a source file
+    FString Timestamp;
+    FString Hash;
+    double Size = -1;
+    EntryJSON->TryGetStringField("source", OutEntry.SourceFile);
+    EntryJSON->TryGetNumberField("size", Size);
+    EntryJSON->TryGetStringField("mtime", Timestamp);
+    EntryJSON->TryGetStringField("hash", Hash);
+    OutEntry.Record.Size = static_cast<int64>(Size);
+    OutEntry.Record.Timestamp = FDateTime(FCString::Atoi64(*Timestamp));
+    OutEntry.Record.Hash = FCString::Strtoui64(*Hash, nullptr, 16);
+
+    return true;
+}
+
+#if !(UE_BUILD_SHIPPING)
+// Compares the old all-in-memory request against the streamed one for a given file
+// PSO.Upload.Benchmark <File> [ChunkKB]
+static FAutoConsoleCommand CmdUploadBenchmark(
+    TEXT("PSO.Upload.Benchmark"),
+    TEXT("Report estimated buffer sizes and throughput of building an upload request. Args: <File> [ChunkKB]"),
+    FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString> &Args) {
+        if (Args.Num() < 1)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("PSO.Upload.Benchmark <File> [ChunkKB]"));
+            return;
+        }
+
+        const auto &File = Args[0];
+        const int32 ChunkSize = Args.Num() > 1 ? FCString::Atoi(*Args[1]) * 1024 : FPSOUploadQueue::DefaultChunkSize;
+        const auto FileSize = IFileManager::Get().FileSize(*File);
+        if (FileSize <= 0)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("PSO.Upload.Benchmark: %s is missing or empty"), *File);
+            return;
+        }
+
+        FPSOUploadEntry Entry;
+        Entry.Machine = TEXT("benchmark");
+        Entry.Project = TEXT("benchmark");
+        Entry.Version = TEXT("benchmark");
+        Entry.ShaderType = TEXT("recorded");
+        Entry.Platform = FApp::GetGraphicsRHI();
+        Entry.ShaderModel = LexToString(GMaxRHIShaderPlatform);
+
+        // Old path. Everything below was alive at once by the time the request was sent. Sizes are summed from
+        // the buffers rather than measured, so allocator overhead and the HTTP module's copies aren't counted
+        int64 LegacyBufferBytes = 0;
+        double LegacyTime = FPlatformTime::Seconds();
+        {
+            TArray<uint8> LoadFileData;
+            FFileHelper::LoadFileToArray(LoadFileData, *File);
+
+            auto ContentString = FBase64::Encode(LoadFileData);
+
+            TSharedPtr<FJsonObject> SendableObjectJSON = MakeShared<FJsonObject>();
+            SendableObjectJSON->SetStringField("data", ContentString);
+
+            FString OutputString;
+            TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&OutputString);
+            FJsonSerializer::Serialize(SendableObjectJSON.ToSharedRef(), Writer);
+
+            // What SetContentAsString does with it
+            FTCHARToUTF8 Body(*OutputString);
+
+            LegacyBufferBytes = LoadFileData.Num() + ContentString.GetAllocatedSize() +
+                                SendableObjectJSON->GetStringField("data").GetAllocatedSize() +
+                                OutputString.GetAllocatedSize() + Body.Length();
+        }
+        LegacyTime = FPlatformTime::Seconds() - LegacyTime;
+
+        const FString BodyFile = FPaths::CreateTempFilename(*FPaths::ProjectSavedDir(), TEXT("PSOBench"));
+        int64 StreamedBufferBytes = 0;
+        double StreamedTime = FPlatformTime::Seconds();
+        const bool bStreamed = FPSOUploadQueue::WriteRequestBody(File, Entry, BodyFile, EPSOUploadFormat::Json, 0,
+                                                                 ChunkSize, StreamedBufferBytes);
+        StreamedTime = FPlatformTime::Seconds() - StreamedTime;
+        const auto StreamedSize = IFileManager::Get().FileSize(*BodyFile);
+
+        int64 BinaryBufferBytes = 0;
+        double BinaryTime = FPlatformTime::Seconds();
+        const bool bBinary = FPSOUploadQueue::WriteRequestBody(File, Entry, BodyFile, EPSOUploadFormat::Binary, 0,
+                                                               ChunkSize, BinaryBufferBytes);
+        BinaryTime = FPlatformTime::Seconds() - BinaryTime;
+        const auto BinarySize = IFileManager::Get().FileSize(*BodyFile);
+
+        IFileManager::Get().Delete(*BodyFile, false, false, true);
+
+        const double MB = FileSize / (1024.0 * 1024.0);
+        UE_LOG(LogTemp, Display, TEXT("PSO.Upload.Benchmark %s (%.2f MB)"), *File, MB);
+        UE_LOG(LogTemp, Display, TEXT("  In memory: est. buffers %.2f MB, %.1f MB/s"),
+               LegacyBufferBytes / (1024.0 * 1024.0), MB / FMath::Max(LegacyTime, 1e-6));
+        UE_LOG(LogTemp, Display, TEXT("  Streamed:  est. buffers %.2f MB, %.1f MB/s, body %.2f MB%s"),
+               StreamedBufferBytes / (1024.0 * 1024.0), MB / FMath::Max(StreamedTime, 1e-6),
+               StreamedSize / (1024.0 * 1024.0), bStreamed ? TEXT("") : TEXT(" (FAILED)"));
+        UE_LOG(LogTemp, Display, TEXT("  Binary:    est. buffers %.2f MB, %.1f MB/s, body %.2f MB%s"),
+               BinaryBufferBytes / (1024.0 * 1024.0), MB / FMath::Max(BinaryTime, 1e-6),
+               BinarySize / (1024.0 * 1024.0), bBinary ? TEXT("") : TEXT(" (FAILED)"));
+    }));
+
+// Counts what gets written, for sizing without touching the disk
+class FPSOCountingArchive : public FArchive
+{
+public:
+    FPSOCountingArchive() : Count(0)
+    {
+        SetIsSaving(true);
+    }
+
+    virtual void Serialize(void *Data, int64 Num) override
+    {
+        Count += Num;
+    }
+
+    int64 Count;
+};
+
+// Size and time of every gzip level over the caches on this machine, to pick UploadCompressionLevel per platform
+// PSO.Upload.CompressionReport [Dir]
+static FAutoConsoleCommand CmdUploadCompressionReport(
+    TEXT("PSO.Upload.CompressionReport"),
+    TEXT("Report gzip size and speed for each level over local pipeline caches. Args: [Dir]"),
+    FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString> &Args) {
+        TArray<FString> Files;
+        const FString Dir = Args.Num() > 0 ? Args[0] : FPaths::ProjectSavedDir();
+        IFileManager::Get().FindFilesRecursive(Files, *Dir, TEXT("*.upipelinecache"), true, false);
+        IFileManager::Get().FindFilesRecursive(Files, *Dir, TEXT("*.shk"), true, false, false);
+
+        TArray<TArray<uint8>> Contents;
+        int64 TotalSize = 0;
+        for (const auto &File : Files)
+        {
+            if (FFileHelper::LoadFileToArray(Contents.AddDefaulted_GetRef(), *File))
+            {
+                TotalSize += Contents.Last().Num();
+            }
+        }
+
+        if (0 == TotalSize)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("PSO.Upload.CompressionReport: no caches under %s"), *Dir);
+            return;
+        }
+
+        const double MB = TotalSize / (1024.0 * 1024.0);
+        UE_LOG(LogTemp, Display, TEXT("PSO.Upload.CompressionReport %d files, %.2f MB on %s"), Files.Num(), MB,
+               ANSI_TO_TCHAR(FPlatformProperties::IniPlatformName()));
+
+        for (int32 Level = 1; Level <= 9; ++Level)
+        {
+            FPSOCountingArchive Counter;
+            const double StartTime = FPlatformTime::Seconds();
+            for (auto &Content : Contents)
+            {
+                FPSOGzipWriter Compressor(Counter, Level, FPSOUploadQueue::DefaultChunkSize);
+                Compressor.Serialize(Content.GetData(), Content.Num());
+                Compressor.Finish();
+            }
+            const double Elapsed = FMath::Max(FPlatformTime::Seconds() - StartTime, 1e-6);
+
+            UE_LOG(LogTemp, Display, TEXT("  Level %d: %.2f MB (%.1f%%), %.1f MB/s"), Level,
+                   Counter.Count / (1024.0 * 1024.0), 100.0 * Counter.Count / TotalSize, MB / Elapsed);
+        }
+    }));
+#endif
@@ -0,0 +1,130 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "PSOUsageMask.h"
+
+#include "Templates/TypeHash.h"
+
+namespace PSOUsageMask
+{
+FPSOUsageMaskLayout Layout;
+
+uint64 FieldMask(int32 FirstBit, int32 NumBits)
+{
+    if (NumBits <= 0)
+    {
+        return 0;
+    }
+
+    const uint64 Bits = NumBits >= 64 ? ~0ull : ((1ull << NumBits) - 1);
+    return Bits << FirstBit;
+}
+} // namespace PSOUsageMask
+
+void FPSOUsageMask::SetLayout(const FPSOUsageMaskLayout &InLayout)
+{
+    constexpr int32 Available = 64 - FPSOUsageMaskLayout::QualityBits;
+
+    auto &Layout = PSOUsageMask::Layout;
+    Layout.LevelBits = FMath::Clamp(InLayout.LevelBits, 0, Available);
+    Layout.ZoneBits = FMath::Clamp(InLayout.ZoneBits, 0, Available - Layout.LevelBits);
+}
+
+const FPSOUsageMaskLayout &FPSOUsageMask::GetLayout()
+{
+    return PSOUsageMask::Layout;
+}
+
+uint64 FPSOUsageMask::FieldBit(int32 Index, int32 FirstBit, int32 NumBits)
+{
+    if (Index < 0 || NumBits <= 0)
+    {
+        return 0;
+    }
+
+    if (Index < NumBits)
+    {
+        return 1ull << (FirstBit + Index);
+    }
+
+    // Out of bits. Two hashed bits keep collisions between any two overflowed indices rare
+    const uint32 Hash = MurmurFinalize32(static_cast<uint32>(Index));
+    const int32 First = Hash % NumBits;
+    const int32 Second = (Hash / NumBits) % NumBits;
+    return (1ull << (FirstBit + First)) | (1ull << (FirstBit + Second));
+}
+
+uint64 FPSOUsageMask::LevelBit(int32 LevelIndex)
+{
+    return FieldBit(LevelIndex, FPSOUsageMaskLayout::QualityBits, PSOUsageMask::Layout.LevelBits);
+}
+
+uint64 FPSOUsageMask::ZoneBit(int32 ZoneIndex)
+{
+    return FieldBit(ZoneIndex, FPSOUsageMaskLayout::QualityBits + PSOUsageMask::Layout.LevelBits,
+                    PSOUsageMask::Layout.ZoneBits);
+}
+
+uint32 FPSOUsageMask::QualityTierBit(int32 Tier)
+{
+    return 1u << FMath::Clamp(Tier, 0, FPSOUsageMaskLayout::QualityFieldBits - 1);
+}
+
+uint64 FPSOUsageMask::QualityMask()
+{
+    return PSOUsageMask::FieldMask(0, FPSOUsageMaskLayout::QualityBits);
+}
+
+uint64 FPSOUsageMask::LevelMask()
+{
+    return PSOUsageMask::FieldMask(FPSOUsageMaskLayout::QualityBits, PSOUsageMask::Layout.LevelBits);
+}
+
+uint64 FPSOUsageMask::ZoneMask()
+{
+    return PSOUsageMask::FieldMask(FPSOUsageMaskLayout::QualityBits + PSOUsageMask::Layout.LevelBits,
+                                   PSOUsageMask::Layout.ZoneBits);
+}
+
+bool FPSOUsageMask::Matches(uint64 ReferenceMask, uint64 PSOMask)
+{
+    if (ReferenceMask == UINT64_MAX)
+    {
+        return true;
+    }
+
+    const uint64 Levels = LevelMask();
+    const uint64 ReferenceLevels = ReferenceMask & Levels;
+    const uint64 PSOLevels = PSOMask & Levels;
+    if (ReferenceLevels != 0 || PSOLevels != 0)
+    {
+        if (0 == (ReferenceLevels & PSOLevels))
+        {
+            return false;
+        }
+    }
+
+    // Fields that are only checked when both sides have something in them
+    const uint64 LenientFields[] = {
+        ZoneMask(),
+        PSOUsageMask::FieldMask(0, FPSOUsageMaskLayout::QualityFieldBits),
+        PSOUsageMask::FieldMask(FPSOUsageMaskLayout::QualityFieldBits, FPSOUsageMaskLayout::QualityFieldBits),
+    };
+
+    for (const auto Field : LenientFields)
+    {
+        const uint64 ReferenceBits = ReferenceMask & Field;
+        const uint64 PSOBits = PSOMask & Field;
+        if (ReferenceBits != 0 && PSOBits != 0 && 0 == (ReferenceBits & PSOBits))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FPSOUsageMask::MatchesAnyLevel(uint64 ReferenceMask, uint64 PSOMask)
+{
+    const uint64 NotLevels = ~LevelMask();
+    return Matches(ReferenceMask & NotLevels, PSOMask & NotLevels);
+}
@@ -0,0 +1,128 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "Misc/AutomationTest.h"
+#include "PSOCompileGovernor.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+BEGIN_DEFINE_SPEC(FPSOCompileGovernorSpec, "UnrealPSOPlugin.CompileGovernor",
+                  EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+FPSOCompileGovernorSettings Settings;
+
+/** Feed one frame per entry, game and render thread both taking that long. Returns the batch size after each */
+TArray<int32> Feed(FPSOCompileGovernor &Governor, const TArray<float> &FrameMs);
+
+void TestBatchSizes(const TCHAR *What, const TArray<int32> &Actual, const TArray<int32> &Expected);
+
+END_DEFINE_SPEC(FPSOCompileGovernorSpec)
+
+TArray<int32> FPSOCompileGovernorSpec::Feed(FPSOCompileGovernor &Governor, const TArray<float> &FrameMs)
+{
+    TArray<int32> BatchSizes;
+    for (const float Ms : FrameMs)
+    {
+        BatchSizes.Push(Governor.Update(Ms, Ms).BatchSize);
+    }
+    return BatchSizes;
+}
+
+void FPSOCompileGovernorSpec::TestBatchSizes(const TCHAR *What, const TArray<int32> &Actual,
+                                             const TArray<int32> &Expected)
+{
+    const auto Join = [](const TArray<int32> &Sizes) {
+        return FString::JoinBy(Sizes, TEXT(", "), [](int32 Size) { return LexToString(Size); });
+    };
+
+    TestTrue(FString::Printf(TEXT("%s: got [%s], expected [%s]"), What, *Join(Actual), *Join(Expected)),
+             Actual == Expected);
+}
+
+void FPSOCompileGovernorSpec::Define()
+{
+    BeforeEach([this]() {
+        // No smoothing, so every frame counts in full and the traces below are exact
+        Settings = FPSOCompileGovernorSettings();
+        Settings.TargetFrameMs = 16.0f;
+        Settings.MenuBudgetScale = 1.5f;
+        Settings.MinBatchSize = 1;
+        Settings.MaxBatchSize = 8;
+        Settings.MinBatchTimeMs = 0.5f;
+        Settings.MaxBatchTimeMs = 16.0f;
+        Settings.Smoothing = 1.0f;
+        Settings.PauseOverBudgetScale = 1.5f;
+        Settings.PauseAfterFrames = 3;
+        Settings.ResumeAfterFrames = 4;
+    });
+
+    Describe("Gameplay", [this]() {
+        It("grows the batch by one per frame with headroom, up to the maximum", [this]() {
+            FPSOCompileGovernor Governor(Settings);
+            TestBatchSizes(TEXT("Steady 10 ms"), Feed(Governor, {10, 10, 10, 10, 10, 10, 10, 10, 10}),
+                           {2, 3, 4, 5, 6, 7, 8, 8, 8});
+            TestEqual(TEXT("Batch time is the headroom"), Governor.GetOutput().BatchTimeMs, 6.0f);
+        });
+
+        It("halves the batch on every frame over budget, down to the minimum", [this]() {
+            FPSOCompileGovernor Governor(Settings);
+            Feed(Governor, {10, 10, 10, 10, 10, 10, 10});
+
+            // Over budget, but not by enough to count towards pausing
+            TestBatchSizes(TEXT("20 ms frames"), Feed(Governor, {20, 20, 20, 20}), {4, 2, 1, 1});
+            TestFalse(TEXT("Paused"), Governor.GetOutput().bPaused);
+            TestEqual(TEXT("Batch time"), Governor.GetOutput().BatchTimeMs, Settings.MinBatchTimeMs);
+        });
+
+        It("recovers additively after a spike", [this]() {
+            FPSOCompileGovernor Governor(Settings);
+            TestBatchSizes(TEXT("Spike in steady frames"), Feed(Governor, {10, 10, 10, 10, 20, 10, 10, 10}),
+                           {2, 3, 4, 5, 2, 3, 4, 5});
+        });
+
+        It("pauses after sustained heavy frames and comes back at the minimum", [this]() {
+            FPSOCompileGovernor Governor(Settings);
+            Feed(Governor, {10, 10, 10, 10, 10});
+
+            TestBatchSizes(TEXT("30 ms frames"), Feed(Governor, {30, 30}), {3, 1});
+            TestFalse(TEXT("Paused before PauseAfterFrames"), Governor.GetOutput().bPaused);
+
+            Feed(Governor, {30});
+            TestTrue(TEXT("Paused after PauseAfterFrames"), Governor.GetOutput().bPaused);
+
+            Feed(Governor, {10, 10, 10});
+            TestTrue(TEXT("Still paused before ResumeAfterFrames"), Governor.GetOutput().bPaused);
+
+            TestBatchSizes(TEXT("Resuming"), Feed(Governor, {10, 10}), {2, 3});
+            TestFalse(TEXT("Resumed"), Governor.GetOutput().bPaused);
+        });
+
+        It("clamps batch time to the configured range", [this]() {
+            FPSOCompileGovernor Governor(Settings);
+            Feed(Governor, {15.8f});
+            TestEqual(TEXT("Almost no headroom"), Governor.GetOutput().BatchTimeMs, Settings.MinBatchTimeMs);
+
+            Settings.MaxBatchTimeMs = 4.0f;
+            FPSOCompileGovernor Capped(Settings);
+            Feed(Capped, {1});
+            TestEqual(TEXT("Plenty of headroom"), Capped.GetOutput().BatchTimeMs, 4.0f);
+        });
+    });
+
+    Describe("Contexts", [this]() {
+        It("gives menus a larger budget", [this]() {
+            FPSOCompileGovernor Governor(Settings);
+            Governor.SetContext(EPSOGovernorContext::Menu);
+            TestBatchSizes(TEXT("20 ms frames in a 24 ms budget"), Feed(Governor, {20, 20, 20}), {2, 3, 4});
+        });
+
+        It("runs flat out while loading, whatever the frame time", [this]() {
+            FPSOCompileGovernor Governor(Settings);
+            Governor.SetContext(EPSOGovernorContext::Loading);
+            TestBatchSizes(TEXT("Hitching load"), Feed(Governor, {100, 100, 100, 100}), {8, 8, 8, 8});
+            TestEqual(TEXT("Batch time"), Governor.GetOutput().BatchTimeMs, Settings.MaxBatchTimeMs);
+            TestFalse(TEXT("Paused"), Governor.GetOutput().bPaused);
+        });
+    });
+}
+
+#endif
@@ -0,0 +1,112 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "HAL/IConsoleManager.h"
+#include "Misc/AutomationTest.h"
+#include "PSOCompileScheduler.h"
+#include "Subsystems/SubsystemCollection.h"
+#include "UObject/StrongObjectPtr.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+BEGIN_DEFINE_SPEC(FPSOCompileSchedulerSpec, "UnrealPSOPlugin.CompileScheduler",
+                  EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+// Not owned by a game instance, so nothing else adds requests while we look
+TStrongObjectPtr<UPSOCompileScheduler> Scheduler;
+
+// The scheduler drives the real FShaderPipelineCache. Put back what it changes
+TMap<FString, FString> SavedCVars;
+bool bWasPaused = false;
+
+IConsoleVariable *FindCVar(const TCHAR *Name) const
+{
+    return IConsoleManager::Get().FindConsoleVariable(Name);
+}
+
+END_DEFINE_SPEC(FPSOCompileSchedulerSpec)
+
+void FPSOCompileSchedulerSpec::Define()
+{
+    static const TCHAR *CVarNames[] = {
+        TEXT("r.ShaderPipelineCache.BatchSize"),           TEXT("r.ShaderPipelineCache.BatchTime"),
+        TEXT("r.ShaderPipelineCache.BackgroundBatchSize"), TEXT("r.ShaderPipelineCache.BackgroundBatchTime"),
+    };
+
+    BeforeEach([this]() {
+        SavedCVars.Reset();
+        for (const auto Name : CVarNames)
+        {
+            if (const auto CVar = FindCVar(Name))
+            {
+                SavedCVars.Add(Name, CVar->GetString());
+            }
+        }
+        bWasPaused = FShaderPipelineCache::IsBatchingPaused();
+
+        FSubsystemCollection<UGameInstanceSubsystem> Collection;
+        Scheduler.Reset(NewObject<UPSOCompileScheduler>());
+        Scheduler->Initialize(Collection);
+    });
+
+    AfterEach([this]() {
+        Scheduler->Deinitialize();
+        Scheduler.Reset();
+
+        for (const auto &Pair : SavedCVars)
+        {
+            FindCVar(*Pair.Key)->Set(*Pair.Value, ECVF_SetByCode);
+        }
+
+        if (bWasPaused)
+        {
+            FShaderPipelineCache::PauseBatching();
+        }
+        else
+        {
+            FShaderPipelineCache::ResumeBatching();
+        }
+    });
+
+    Describe("SetBatchSettings", [this]() {
+        It("hands new settings to the pipeline cache without a mode change", [this]() {
+            Scheduler->AddRequest(E_PSOCompileRequest::Background);
+
+            Scheduler->SetBatchSettings(5, 2.0f);
+            TestEqual(TEXT("Batch size"), Scheduler->GetAppliedBatchSize(), 5);
+            TestEqual(TEXT("Batch time"), Scheduler->GetAppliedBatchTimeMs(), 2.0f);
+
+            // Steady state. The governor moves, the mode doesn't
+            Scheduler->SetBatchSettings(7, 3.0f);
+            TestEqual(TEXT("Next batch size"), Scheduler->GetAppliedBatchSize(), 7);
+            TestEqual(TEXT("Next batch time"), Scheduler->GetAppliedBatchTimeMs(), 3.0f);
+        });
+
+        It("is picked up by the first compiling request, even after a halt", [this]() {
+            Scheduler->SetBatchSettings(5, 2.0f);
+            TestEqual(TEXT("Nothing set before a request"), Scheduler->GetAppliedBatchSize(), 0);
+
+            Scheduler->AddRequest(E_PSOCompileRequest::Halt);
+            Scheduler->AddRequest(E_PSOCompileRequest::Background);
+            TestEqual(TEXT("Nothing set while halted"), Scheduler->GetAppliedBatchSize(), 0);
+
+            Scheduler->AddRequest(E_PSOCompileRequest::Fast);
+            TestEqual(TEXT("Fast beats the halt"), Scheduler->GetAppliedBatchSize(), 5);
+
+            Scheduler->AddRequest(E_PSOCompileRequest::LoadingScreen);
+            Scheduler->SetBatchSettings(6, 2.0f);
+            TestEqual(TEXT("Loading screens keep the precompile size"), Scheduler->GetAppliedBatchSize(),
+                      FindCVar(TEXT("r.ShaderPipelineCache.PrecompileBatchSize"))->GetInt());
+        });
+
+        It("keeps paused batching paused", [this]() {
+            Scheduler->AddRequest(E_PSOCompileRequest::Background);
+            Scheduler->AddRequest(E_PSOCompileRequest::Halt);
+
+            Scheduler->SetBatchSettings(5, 2.0f);
+            TestTrue(TEXT("Paused"), FShaderPipelineCache::IsBatchingPaused());
+            TestEqual(TEXT("Batch size"), Scheduler->GetAppliedBatchSize(), 5);
+        });
+    });
+}
+
+#endif
@@ -0,0 +1,72 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "Misc/AutomationTest.h"
+#include "PSOKnownFilter.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+BEGIN_DEFINE_SPEC(FPSOKnownFilterSpec, "UnrealPSOPlugin.KnownFilter",
+                  EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+// From BuildScripts/PCOBloom.py: Build([(0x1234ABCD, 0b10), (0x00C0FFEE, 0)], 0.001, epoch=7)
+TArray<uint8> Served;
+
+END_DEFINE_SPEC(FPSOKnownFilterSpec)
+
+void FPSOKnownFilterSpec::Define()
+{
+    BeforeEach([this]() {
+        Served = {0x50, 0x43, 0x42, 0x46, 0x02, 0x00, 0x0F, 0x00, 0xD7, 0x0D, 0x32, 0x59, 0x40, 0x00,
+                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x73, 0xFE, 0x39, 0x63, 0x9F, 0x31, 0xE6, 0x1B};
+    });
+
+    Describe("Parse", [this]() {
+        It("rejects a truncated header", [this]() {
+            FPSOKnownFilter Filter;
+            Served.SetNum(19);
+            TestFalse(TEXT("Header cut short"), Filter.Parse(Served));
+            TestTrue(TEXT("Left empty"), Filter.IsEmpty());
+        });
+
+        It("rejects more bits than were sent", [this]() {
+            FPSOKnownFilter Filter;
+            Served.SetNum(Served.Num() - 1);
+            TestFalse(TEXT("One byte short"), Filter.Parse(Served));
+
+            // Rounded up to whole bytes, this would wrap to 0 and pass
+            Served.SetNum(20);
+            FMemory::Memset(&Served[12], 0xFF, 8);
+            TestFalse(TEXT("NumBits near UINT64_MAX"), Filter.Parse(Served));
+            TestTrue(TEXT("Left empty"), Filter.IsEmpty());
+        });
+    });
+
+    Describe("MayContain", [this]() {
+        It("matches PSOs the server has seen with the same usage", [this]() {
+            FPSOKnownFilter Filter;
+            TestTrue(TEXT("Parsed"), Filter.Parse(Served));
+            TestTrue(TEXT("Usage the server has"), Filter.MayContain(0x1234ABCD, 0b10));
+            TestTrue(TEXT("No usage"), Filter.MayContain(0x1234ABCD, 0));
+            TestTrue(TEXT("PSO without usage"), Filter.MayContain(0x00C0FFEE, 0));
+            TestFalse(TEXT("Unknown PSO"), Filter.MayContain(0xDEADBEEF, 0));
+        });
+
+        It("reports PSOs seen with new usage as missing", [this]() {
+            FPSOKnownFilter Filter;
+            Filter.Parse(Served);
+            TestFalse(TEXT("New bit"), Filter.MayContain(0x1234ABCD, 0b110));
+            TestFalse(TEXT("PSO the server has no usage for"), Filter.MayContain(0x00C0FFEE, 0b1));
+        });
+
+        It("only trusts version 1 filters for PSOs without usage", [this]() {
+            Served[4] = 1;
+
+            FPSOKnownFilter Filter;
+            TestTrue(TEXT("Parsed"), Filter.Parse(Served));
+            TestTrue(TEXT("No usage"), Filter.MayContain(0x1234ABCD, 0));
+            TestFalse(TEXT("Any usage"), Filter.MayContain(0x1234ABCD, 0b10));
+        });
+    });
+}
+
+#endif
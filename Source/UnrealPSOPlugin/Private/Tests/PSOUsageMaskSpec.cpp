@@ -0,0 +1,129 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#include "Misc/AutomationTest.h"
+#include "PSOUsageMask.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+BEGIN_DEFINE_SPEC(FPSOUsageMaskSpec, "UnrealPSOPlugin.UsageMask",
+                  EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+// Layout is global. Put back whatever the game instance set once we're done
+FPSOUsageMaskLayout SavedLayout;
+
+// Quality tiers, in the material and shadow fields
+uint64 Material(int32 Tier) const
+{
+    return FPSOUsageMask::QualityTierBit(Tier);
+}
+
+uint64 Shadow(int32 Tier) const
+{
+    return static_cast<uint64>(FPSOUsageMask::QualityTierBit(Tier)) << FPSOUsageMaskLayout::QualityFieldBits;
+}
+
+END_DEFINE_SPEC(FPSOUsageMaskSpec)
+
+void FPSOUsageMaskSpec::Define()
+{
+    BeforeEach([this]() {
+        SavedLayout = FPSOUsageMask::GetLayout();
+
+        // Small fields, so overflowed indices are easy to reach
+        FPSOUsageMaskLayout Layout;
+        Layout.LevelBits = 8;
+        Layout.ZoneBits = 4;
+        FPSOUsageMask::SetLayout(Layout);
+    });
+
+    AfterEach([this]() { FPSOUsageMask::SetLayout(SavedLayout); });
+
+    Describe("Layout", [this]() {
+        It("puts levels above the quality bits and zones above levels", [this]() {
+            TestEqual(TEXT("Level 0"), FPSOUsageMask::LevelBit(0), 1ull << 8);
+            TestEqual(TEXT("Zone 0"), FPSOUsageMask::ZoneBit(0), 1ull << 16);
+            TestEqual(TEXT("Level mask"), FPSOUsageMask::LevelMask(), 0xFFull << 8);
+            TestEqual(TEXT("Zone mask"), FPSOUsageMask::ZoneMask(), 0xFull << 16);
+        });
+
+        It("clamps to what fits next to the quality bits", [this]() {
+            FPSOUsageMaskLayout Layout;
+            Layout.LevelBits = 60;
+            Layout.ZoneBits = 10;
+            FPSOUsageMask::SetLayout(Layout);
+
+            TestEqual(TEXT("Level bits"), FPSOUsageMask::GetLayout().LevelBits, 56);
+            TestEqual(TEXT("Zone bits"), FPSOUsageMask::GetLayout().ZoneBits, 0);
+        });
+
+        It("hashes indices past the field onto bits inside it", [this]() {
+            const uint64 Overflowed = FPSOUsageMask::LevelBit(100);
+            TestNotEqual(TEXT("Has a bit"), Overflowed, 0ull);
+            TestEqual(TEXT("Inside the level field"), Overflowed & ~FPSOUsageMask::LevelMask(), 0ull);
+            TestTrue(TEXT("At most two bits"), FMath::CountBits(Overflowed) <= 2);
+            TestEqual(TEXT("Negative index"), FPSOUsageMask::LevelBit(-1), 0ull);
+        });
+    });
+
+    Describe("Matches", [this]() {
+        It("matches everything against UINT64_MAX", [this]() {
+            TestTrue(TEXT("Empty PSO"), FPSOUsageMask::Matches(UINT64_MAX, 0));
+            TestTrue(TEXT("Level PSO"), FPSOUsageMask::Matches(UINT64_MAX, FPSOUsageMask::LevelBit(3)));
+        });
+
+        It("matches levels by intersection", [this]() {
+            const uint64 SeenInOneAndThree = FPSOUsageMask::LevelBit(1) | FPSOUsageMask::LevelBit(3);
+            TestTrue(TEXT("Level 1"), FPSOUsageMask::Matches(FPSOUsageMask::LevelBit(1), SeenInOneAndThree));
+            TestTrue(TEXT("Level 3"), FPSOUsageMask::Matches(FPSOUsageMask::LevelBit(3), SeenInOneAndThree));
+            TestFalse(TEXT("Level 2"), FPSOUsageMask::Matches(FPSOUsageMask::LevelBit(2), SeenInOneAndThree));
+            TestTrue(TEXT("Overflowed level"),
+                     FPSOUsageMask::Matches(FPSOUsageMask::LevelBit(100), FPSOUsageMask::LevelBit(100)));
+        });
+
+        It("keeps PSOs without a level apart from those with one", [this]() {
+            TestTrue(TEXT("Neither has a level"), FPSOUsageMask::Matches(Material(1), Material(1)));
+            TestFalse(TEXT("Only the PSO has one"), FPSOUsageMask::Matches(0, FPSOUsageMask::LevelBit(1)));
+            TestFalse(TEXT("Only the reference has one"), FPSOUsageMask::Matches(FPSOUsageMask::LevelBit(1), 0));
+        });
+
+        It("only checks zones when both sides have some", [this]() {
+            const uint64 Level = FPSOUsageMask::LevelBit(1);
+            const uint64 Zone0 = Level | FPSOUsageMask::ZoneBit(0);
+            TestTrue(TEXT("Same zone"), FPSOUsageMask::Matches(Zone0, Zone0 | FPSOUsageMask::ZoneBit(2)));
+            TestFalse(TEXT("Other zone"), FPSOUsageMask::Matches(Zone0, Level | FPSOUsageMask::ZoneBit(1)));
+            TestTrue(TEXT("PSO without zones"), FPSOUsageMask::Matches(Zone0, Level));
+            TestTrue(TEXT("Reference without zones"), FPSOUsageMask::Matches(Level, Zone0));
+        });
+
+        It("only checks each quality field when both sides have some", [this]() {
+            const uint64 Level = FPSOUsageMask::LevelBit(1);
+            const uint64 Reference = Level | Material(1) | Shadow(2);
+            TestTrue(TEXT("Same tiers"), FPSOUsageMask::Matches(Reference, Level | Material(1) | Shadow(2)));
+            TestTrue(TEXT("Recorded at several tiers"),
+                     FPSOUsageMask::Matches(Reference, Level | Material(1) | Material(2) | Shadow(2)));
+            TestFalse(TEXT("Other material tier"), FPSOUsageMask::Matches(Reference, Level | Material(2)));
+            TestFalse(TEXT("Other shadow tier"), FPSOUsageMask::Matches(Reference, Level | Shadow(0)));
+            TestTrue(TEXT("PSO without quality bits"), FPSOUsageMask::Matches(Reference, Level));
+        });
+    });
+
+    Describe("MatchesAnyLevel", [this]() {
+        It("matches zones in any level, or none", [this]() {
+            const uint64 Zone0 = FPSOUsageMask::ZoneBit(0);
+            TestTrue(TEXT("Mapped level"),
+                     FPSOUsageMask::MatchesAnyLevel(Zone0, FPSOUsageMask::LevelBit(1) | Zone0));
+            TestTrue(TEXT("No level"), FPSOUsageMask::MatchesAnyLevel(Zone0, Zone0));
+            TestFalse(TEXT("Other zone"),
+                      FPSOUsageMask::MatchesAnyLevel(Zone0, FPSOUsageMask::LevelBit(1) | FPSOUsageMask::ZoneBit(1)));
+            TestFalse(TEXT("Plain Matches keeps levels apart"),
+                      FPSOUsageMask::Matches(Zone0, FPSOUsageMask::LevelBit(1) | Zone0));
+        });
+
+        It("still checks quality", [this]() {
+            TestFalse(TEXT("Other tier"),
+                      FPSOUsageMask::MatchesAnyLevel(Material(1), FPSOUsageMask::LevelBit(1) | Material(2)));
+        });
+    });
+}
+
+#endif
@@ -2,257 +2,302 @@
 
 #include "UnrealPSOPluginGameInstance.h"
 
-#include "Dom/JsonObject.h"
+#include "Async/Async.h"
+#include "Engine/LevelStreaming.h"
 #include "HAL/FileManager.h"
-#include "HttpModule.h"
-#include "Misc/Base64.h"
+#include "Misc/CommandLine.h"
 #include "Misc/FileHelper.h"
+#include "Misc/PackageName.h"
+#include "Misc/Parse.h"
 #include "Misc/Paths.h"
+#include "PSOCacheCatalog.h"
+#include "PSOCacheCompactor.h"
+#include "PSOCacheDelta.h"
+#include "PSOCompileGovernor.h"
+#include "PSOCompileScheduler.h"
+#include "PSOHitchDetector.h"
+#include "PSOUsageMask.h"
+#include "PSOUploadQueue.h"
 #include "PipelineFileCache.h"
+#include "RenderCore.h"
 #include "Runtime/Core/Public/Containers/EnumAsByte.h"
-#include "Serialization/JsonSerializer.h"
-#include "Serialization/JsonWriter.h"
 #include "ShaderPipelineCache.h"
+#include "Streaming/LevelStreamingDelegates.h"
 
-void UPipelineCacheGameInstance::DoShutdownRoutine(FString &Data, FString ShaderType, FString SuppliedPlatform)
+namespace PSOStartupCritical
 {
-    auto HttpRequest = FHttpModule::Get().CreateRequest();
+// Skip the startup-critical set and only time the first frame, for later runs to compare against
+const TCHAR *BaselineParam = TEXT("PSOStartupBaseline");
 
-    HttpRequest->SetVerb("POST");
-    HttpRequest->SetURL(ServerURL + "/api/pco/new/");
-    HttpRequest->SetHeader("Content-Type", "application/json");
+FString GetBaselineFile()
+{
+    return FPaths::ProjectSavedDir() / TEXT("PSOStartupBaseline.txt");
+}
+} // namespace PSOStartupCritical
+
+void UPipelineCacheGameInstance::EnqueueUpload(const FPSOCacheFile &File, FString ShaderType,
+                                               FString SuppliedPlatform)
+{
+    if (!UploadQueue.IsValid())
+    {
+        return;
+    }
 
     if (SuppliedPlatform.Len() == 0)
     {
         SuppliedPlatform = LexToString(GMaxRHIShaderPlatform);
     }
 
-    const auto GraphicsRHI = FApp::GetGraphicsRHI();
+    FPSOUploadEntry Entry;
+    Entry.Machine = MachineUUID;
+    Entry.Project = ProjectUUID;
+    Entry.Version = VersionString;
+    Entry.ShaderType = ShaderType;
+    Entry.Platform = FApp::GetGraphicsRHI();
+    Entry.ShaderModel = SuppliedPlatform;
 
-    TSharedPtr<FJsonObject> SendableObjectJSON = MakeShared<FJsonObject>();
-    SendableObjectJSON->SetStringField("machine", MachineUUID);
-    SendableObjectJSON->SetStringField("project", ProjectUUID);
-    SendableObjectJSON->SetStringField("version", VersionString);
-    SendableObjectJSON->SetStringField("shadertype", ShaderType);
-    SendableObjectJSON->SetStringField("platform", GraphicsRHI);
-    SendableObjectJSON->SetStringField("shadermodel", SuppliedPlatform);
-    SendableObjectJSON->SetStringField("data", Data);
+    // The catalog has already hashed it
+    Entry.Record = MakeManifestRecord(File);
 
-    FString OutputString;
-    TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&OutputString);
-    FJsonSerializer::Serialize(SendableObjectJSON.ToSharedRef(), Writer);
+    // Just a file copy. The upload thread does the rest, now or next launch
+    UploadQueue->Enqueue(Entry, File.Path);
+}
+
+FPSOManifestRecord UPipelineCacheGameInstance::MakeManifestRecord(const FPSOCacheFile &File)
+{
+    FPSOManifestRecord Record;
+    Record.Size = File.Size;
+    Record.Timestamp = File.Timestamp;
+    Record.Hash = File.Hash;
+    return Record;
+}
 
-    HttpRequest->SetContentAsString(OutputString);
-    HttpRequest->ProcessRequest();
+void UPipelineCacheGameInstance::LoadShaders()
+{
+    // The upload worker builds deltas at the next launch. Exit doesn't have to load the stable set
+    if (UploadRecordedDeltasOnly)
+    {
+        return;
+    }
 
-    // Hacky solution to the loop
-    float WaitTime = 0.f;
-    while (HttpRequest->GetStatus() == EHttpRequestStatus::Processing ||
-           HttpRequest->GetStatus() == EHttpRequestStatus::NotStarted)
+    FPSOCacheCatalog Catalog;
+    for (const auto &Dir : AdditionalPipelineCacheDirectories)
     {
-        // Spinlock
-        WaitTime += FApp::GetDeltaTime();
+        Catalog.AddSearchDirectory(Dir);
+    }
+    Catalog.Refresh();
 
-        if (WaitTime > 5.f)
+    for (const auto &File : Catalog.GetFiles())
+    {
+        switch (File.Kind)
         {
+        case EPSOCacheFileKind::StableCache:
+        case EPSOCacheFileKind::RecordedCache:
+            EnqueueUpload(File, File.bGlobal ? "stable" : "recorded");
+            break;
+        case EPSOCacheFileKind::StableKeys:
+            EnqueueUpload(File, File.bGlobal ? "globalshaderinfo" : "projectshaderinfo", File.Platform);
+            break;
+        default:
             break;
         }
     }
+}
+
+void UPipelineCacheGameInstance::QueueShaderDeltas()
+{
+    TArray<FString> Directories = AdditionalPipelineCacheDirectories;
+
+    FPSOUploadEntry Template;
+    Template.Machine = MachineUUID;
+    Template.Project = ProjectUUID;
+    Template.Version = VersionString;
+    Template.Platform = FApp::GetGraphicsRHI();
+
+    // Picks up everything earlier sessions recorded, including what they saved on the way out
+    UploadQueue->EnqueueTask([Directories, Template](FPSOUploadQueue &Queue) {
+        FPSOCacheCatalog Catalog;
+        for (const auto &Dir : Directories)
+        {
+            Catalog.AddSearchDirectory(Dir);
+        }
+        Catalog.Refresh();
 
-    // Continue as per normal
+        LoadShaderDeltas(Queue, Catalog.GetFiles(), Template);
+    });
 }
 
-bool TryGet(FString &In, FString &Platform, bool &IsGlobal)
+void UPipelineCacheGameInstance::LoadShaderDeltas(FPSOUploadQueue &Queue, const TArray<FPSOCacheFile> &Files,
+                                                  const FPSOUploadEntry &Template)
 {
-    FString PathSplit;
-    FString FName;
-    In.Split("/", &PathSplit, &FName, ESearchCase::IgnoreCase, ESearchDir::FromEnd);
+    TArray<FString> StableCaches;
+    TArray<FString> ChangedRecordings;
+    TArray<FPSOManifestRecord> ChangedRecords;
+    TArray<TPair<FString, FString>> KeyFiles;
 
-    if (FName.EndsWith(".upipelinecache"))
+    for (const auto &File : Files)
     {
-        FString ValueOfInterest;
-
-        // Okay. We've got the form <Project>_<RHIPlatform>.stable.upipeline
-        if (FName.EndsWith(".stable.upipelinecache"))
+        // Stable caches came from the server in the first place. Only diff against them
+        if (EPSOCacheFileKind::StableCache == File.Kind)
         {
-            IsGlobal = true;
-
-            // Remove project name. Check it's the right project first, though
-            if (!FName.StartsWith(FApp::GetProjectName()))
-            {
-                return false;
-            }
-            else
+            StableCaches.Push(File.Path);
+        }
+        else if (EPSOCacheFileKind::StableKeys == File.Kind)
+        {
+            KeyFiles.Emplace(File.Path, File.Platform);
+        }
+        else if (EPSOCacheFileKind::RecordedCache == File.Kind)
+        {
+            auto Record = MakeManifestRecord(File);
+            if (Queue.NeedsUpload(File.Path, Record))
             {
-                FName.Split("_", &ValueOfInterest, &FName);
+                ChangedRecordings.Push(File.Path);
+                ChangedRecords.Push(Record);
             }
+        }
+    }
 
-            // Split into RHIPlatform <-> stable.upipeline
-            FName.Split(".", &ValueOfInterest, &FName);
-            Platform = ValueOfInterest;
+    // Loading the stable set isn't cheap. Don't bother if nothing changed
+    if (0 == ChangedRecordings.Num())
+    {
+        return;
+    }
 
-            // Confirm it's a stable key - U
-            // FName.Split(".", &ValueOfInterest, &FName);
+    FPSOCacheDelta Delta;
+    Delta.Initialise(StableCaches, KeyFiles);
 
-            return true;
-        }
+    // Refreshed just before tasks run. Don't go to the network from here
+    const auto KnownFilter = Queue.GetKnownFilter();
 
-        // <KEY>.rec.pipeline ->
-        else if (FName.EndsWith(".rec.upipelinecache"))
+    const FString DeltaDir = FPaths::ProjectSavedDir() / TEXT("PSODelta");
+    IFileManager::Get().MakeDirectory(*DeltaDir, true);
+
+    auto Entry = Template;
+
+    // Anything not reached before shutdown still needs uploading, so it's done next launch
+    for (int32 Index = 0; Index < ChangedRecordings.Num() && !Queue.IsStopping(); ++Index)
+    {
+        const auto &Recorded = ChangedRecordings[Index];
+        const auto DeltaCache = DeltaDir / FPaths::GetCleanFilename(Recorded);
+
+        int32 NumNew = 0;
+        TMap<FString, FString> DeltaKeyFiles;
+        if (!Delta.Build(Recorded, DeltaCache, KnownFilter.Get(), DeltaKeyFiles, NumNew))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Could not build PSO delta for %s"), *Recorded);
+        }
+        else if (0 == NumNew)
         {
-            IsGlobal = false;
-            // Remove upipelinecache and rec
-            FName.Split(".", &FName, &ValueOfInterest, ESearchCase::IgnoreCase, ESearchDir::FromEnd);
-            FName.Split(".", &FName, &ValueOfInterest, ESearchCase::IgnoreCase, ESearchDir::FromEnd);
-            // Remove hash? value or whatever it is
-            FName.Split("_", &FName, &ValueOfInterest, ESearchCase::IgnoreCase, ESearchDir::FromEnd);
-
-            // Now, FName is only the start. Find the first _. It should be after the project name
-            FName.Split("_", &FName, &ValueOfInterest, ESearchCase::IgnoreCase, ESearchDir::FromStart);
-            Platform = ValueOfInterest;
-
-            // Confirm we've parsed vaguely correctly
-            FName.Split("-", &FName, &ValueOfInterest, ESearchCase::IgnoreCase, ESearchDir::FromEnd);
-            if (ValueOfInterest.Equals(FApp::GetProjectName()))
+            // Nothing we don't already ship, or that the server doesn't already have
+            Queue.MarkUploaded(Recorded, ChangedRecords[Index]);
+        }
+        else
+        {
+            // Keys first, so the server never sees PSOs it can't expand
+            for (const auto &KeyFile : DeltaKeyFiles)
             {
-                return true;
+                Entry.ShaderType = "projectshaderinfo";
+                Entry.ShaderModel = KeyFile.Key;
+                Entry.SourceFile.Empty();
+                Queue.EnqueuePayload(Entry, KeyFile.Value);
             }
 
-            return false;
+            Entry.ShaderType = "recorded";
+            Entry.ShaderModel = LexToString(GMaxRHIShaderPlatform);
+            Entry.SourceFile = Recorded;
+            Entry.Record = ChangedRecords[Index];
+            Queue.EnqueuePayload(Entry, DeltaCache);
+
+            UE_LOG(LogTemp, Log, TEXT("%s: %d new PSOs"), *Recorded, NumNew);
         }
 
-        // Warn me of other forms
-        else
+        for (const auto &KeyFile : DeltaKeyFiles)
         {
-            checkNoEntry();
+            IFileManager::Get().Delete(*KeyFile.Value, false, false, true);
         }
+        IFileManager::Get().Delete(*DeltaCache, false, false, true);
     }
+}
 
-    // SHKs
-    else if (FName.StartsWith("ShaderStableInfo"))
-    {
-        // Okay, let's use a key as an example
-        // ShaderStableInfo-Global-SF_VULKAN_SM5
-        // First loop has VOI set to ShaderStableInfo
-        FString ValueOfInterest;
-        FName.Split("-", &ValueOfInterest, &FName);
-
-        // Global Check
-        FName.Split("-", &ValueOfInterest, &FName);
-
-        if (ValueOfInterest.Equals("Global"))
-        {
-            IsGlobal = true;
-        }
-        else if (ValueOfInterest.Equals(FApp::GetProjectName()))
+void UPipelineCacheGameInstance::QueueCompaction()
+{
+    TArray<FString> Directories = AdditionalPipelineCacheDirectories;
+    const FPSOCacheCompactor Compactor(CompactRecordedCachesMinFiles);
+
+    // Anything written from here on belongs to this session
+    const FDateTime SessionStart = FDateTime::UtcNow();
+
+    // On the upload worker, so it's never rescanning or deleting recordings while deltas are built from them
+    UploadQueue->EnqueueTask([Directories, Compactor, SessionStart](FPSOUploadQueue &Queue) {
+        // Another process sharing Saved may still be adding to a recording older than our session. Whoever
+        // holds the outbox is the only one running, so only it compacts
+        const auto OutboxLock = FPSOOutboxLock::TryAcquire();
+        if (!OutboxLock.IsValid())
         {
-            IsGlobal = false;
+            UE_LOG(LogTemp, Log, TEXT("Skipping compaction of recorded caches, another process holds the outbox"));
+            return;
         }
-        else
+
+        FPSOCacheCatalog Catalog;
+        for (const auto &Dir : Directories)
         {
-            return false;
+            Catalog.AddSearchDirectory(Dir);
         }
+        Catalog.Refresh();
 
-        // RHI Platform
-        FName.Split(".", &ValueOfInterest, &FName);
-        Platform = ValueOfInterest;
+        // Queued is as good as sent. The outbox has its own copy
+        const auto IsHandled = [&Queue](const FPSOCacheFile &File) {
+            auto Record = MakeManifestRecord(File);
+            return !Queue.NeedsUpload(File.Path, Record);
+        };
 
-        return true;
-
-        // // Commented for now
-        // while(In.Len() > 0)
-        // {
-        // 	In.Split("-", &ValueOfInterest, &In);
-        //
-        // 	// First Iteration
-        // 	if(ValueOfInterest.Equals("ShaderStableInfo"))
-        // 	{
-        // 		continue;
-        // 	}
-        // }
-    }
-    else
-    {
-        // Warn me. It's a case I've missed
-        checkNoEntry();
-    }
-    return false;
+        FPSOCompactionResult Result;
+        if (Compactor.Compact(Catalog.GetFiles(), SessionStart, IsHandled, Result) && Result.NumMerged > 0)
+        {
+            UE_LOG(LogTemp, Log, TEXT("Compacted %d recorded caches (%lld KB): %d PSOs archived, %d to upload"),
+                   Result.NumMerged, Result.BytesFreed / 1024, Result.NumArchived, Result.NumPending);
+        }
+    });
 }
 
-void GetPipelineNames(TArray<FString> &Strings, const TCHAR *Start, const TCHAR *Type)
+void UPipelineCacheGameInstance::EnqueueHitchList()
 {
-    TArray<FString> RecordedNames;
-    IFileManager::Get().FindFilesRecursive(RecordedNames, Start, Type, true, false);
+    if (!HitchDetector.IsValid())
+    {
+        return;
+    }
 
-    // for(auto Name : RecordedNames)
-    // {
-    // 	auto T = StringToArray<TCHAR, FString>(&Name);
-    // 	auto t=*Name;
-    // 	UE_LOG(LogTemp, Warning, T);
-    // }
+    FTSTicker::GetCoreTicker().RemoveTicker(HitchDetectorTickHandle);
+    HitchDetector->Stop();
+    HitchDetector->Tick();
 
-    for (auto &Recorded : RecordedNames)
+    const FString HitchList = FPaths::ProjectSavedDir() / TEXT("PSOHitchList.json");
+    if (HitchDetector->SaveHitchList(HitchList))
     {
-        Strings.Push(Recorded);
+        FPSOUploadEntry Entry;
+        Entry.Machine = MachineUUID;
+        Entry.Project = ProjectUUID;
+        Entry.Version = VersionString;
+        Entry.ShaderType = "hitchlist";
+        Entry.Platform = FApp::GetGraphicsRHI();
+        Entry.ShaderModel = LexToString(GMaxRHIShaderPlatform);
+
+        UploadQueue->EnqueuePayload(Entry, HitchList, true);
+        IFileManager::Get().Delete(*HitchList, false, false, true);
+
+        UE_LOG(LogTemp, Log, TEXT("Queued %d PSO misses"), HitchDetector->GetMisses().Num());
     }
+
+    HitchDetector.Reset();
 }
 
-void UPipelineCacheGameInstance::LoadShaders()
+bool UPipelineCacheGameInstance::TickHitchDetector(float DeltaTime)
 {
-    FString RecordingFilename = FPaths::ProjectSavedDir() / TEXT("CollectedPSOs");
-    FString Path = FPaths::ProjectSavedDir();
-    // FString FilePath = FPaths::ProjectSavedDir() / FString::Printf(TEXT("%s_%s.upipelinecache"), *FileName,
-    // *PlatformName.ToString());
-    FString GamePathStable =
-        FPaths::ProjectContentDir() / TEXT("PipelineCaches") / ANSI_TO_TCHAR(FPlatformProperties::IniPlatformName());
-    FString GamePath =
-        FPaths::ProjectContentDir() / TEXT("PipelineCaches") / ANSI_TO_TCHAR(FPlatformProperties::IniPlatformName());
-
-    TArray<FString> RecordedNames;
-    // GetPipelineNames(RecordedNames, ToCStr(RecordingFilename), TEXT("*.upipelinecache"));
-    GetPipelineNames(RecordedNames, ToCStr(GamePath), TEXT("*.upipelinecache"));
-    // GetPipelineNames(RecordedNames, ToCStr(GamePathStable), TEXT("*.upipelinecache"));
-    GetPipelineNames(RecordedNames, ToCStr(Path), TEXT("*.upipelinecache"));
-
-    for (auto &Recorded : RecordedNames)
-    {
-        // Load Data
-        TArray<uint8> LoadFileData;
-        bool bReadOK = FFileHelper::LoadFileToArray(LoadFileData, *Recorded);
-        if (bReadOK)
-        {
-            FString SuppliedPlatform;
-            bool Global;
-            if (TryGet(Recorded, SuppliedPlatform, Global))
-            {
-                auto ContentString = FBase64::Encode(LoadFileData);
-                DoShutdownRoutine(ContentString, Global ? "stable" : "recorded");
-            }
-        }
-    }
-
-    TArray<FString> KeyInfoNames;
-    // GetPipelineNames(KeyInfoNames, ToCStr(RecordingFilename), TEXT("*.shk"));
-    GetPipelineNames(KeyInfoNames, ToCStr(GamePath), TEXT("*.shk"));
-    // GetPipelineNames(KeyInfoNames, ToCStr(GamePathStable), TEXT("*.shk"));
-    GetPipelineNames(KeyInfoNames, ToCStr(Path), TEXT("*.shk"));
-
-    for (auto &KeyInfo : KeyInfoNames)
+    if (HitchDetector.IsValid())
     {
-        // Load Data
-        TArray<uint8> LoadFileData;
-        bool bReadOK = FFileHelper::LoadFileToArray(LoadFileData, *KeyInfo);
-        if (bReadOK)
-        {
-            FString SuppliedPlatform;
-            bool Global;
-            if (TryGet(KeyInfo, SuppliedPlatform, Global))
-            {
-                auto ContentString = FBase64::Encode(LoadFileData);
-                DoShutdownRoutine(ContentString, Global ? "globalshaderinfo" : "projectshaderinfo", SuppliedPlatform);
-            }
-        }
+        HitchDetector->Tick();
     }
+    return HitchDetector.IsValid();
 }
 
 void UPipelineCacheGameInstance::ShutdownInternalPSO()
@@ -262,6 +307,12 @@ void UPipelineCacheGameInstance::ShutdownInternalPSO()
     auto SaveModeAs = static_cast<FPipelineFileCacheManager::SaveMode>(static_cast<uint8>(
         WantedPSOMode)); // TEnumAsByte<FPipelineFileCacheManager::SaveMode>(static_cast<uint8>(WantedPSOMode));
 
+    // Never two saves at once
+    if (IncrementalSave.IsValid())
+    {
+        IncrementalSave.Wait();
+    }
+
     const FString Name = FApp::GetProjectName();
     auto SaveSuccess = FShaderPipelineCache::SavePipelineFileCache(SaveModeAs);
 
@@ -279,12 +330,7 @@ void UPipelineCacheGameInstance::ShutdownInternalPSO()
 
 bool UPipelineCacheGameInstance::UsageMaskComparisonFunction(uint64 ReferenceMask, uint64 PSOMask)
 {
-    if (ReferenceMask == UINT64_MAX)
-    {
-        return true;
-    }
-
-    return ReferenceMask == PSOMask;
+    return FPSOUsageMask::Matches(ReferenceMask, PSOMask);
 }
 
 // Sets default values for this component's properties
@@ -295,10 +341,66 @@ UPipelineCacheGameInstance::UPipelineCacheGameInstance()
     // But the shipping build will ignore the mask and just build
     // So we can use them automatic PSO mask for precompile
     SetUsageMaskAutomatically = true;
+
+    UsageMaskLevelBits = FPSOUsageMaskLayout().LevelBits;
+    UsageMaskZoneBits = FPSOUsageMaskLayout().ZoneBits;
+    CurrentLevelBits = 0;
+    CurrentZoneBits = 0;
+
+    SetQualityMaskAutomatically = true;
+    CurrentQualityBits = 0;
+    bUsageMaskSet = false;
+
+    PrecompileAhead = true;
+    PredictedLevelBits = 0;
+    PredictiveCompileRequest = 0;
+
+    IncrementalSaveIntervalSeconds = 300.0f;
+    IncrementalSaveNewPSOs = 200;
+    SaveIncrementallyOnLoad = true;
+    LastIncrementalSaveTime = 0.0;
+
+    StartupCriticalBits = 0;
+    StartupCriticalRequest = 0;
+    StartupCriticalStartRemaining = 0;
+    StartupBeginTime = 0.0;
+    StartupFirstFrameTime = 0.0;
+    bStartupCriticalStarted = false;
+    bStartupCriticalBaseline = false;
+
+    UploadChunkSizeKB = FPSOUploadQueue::DefaultChunkSize / 1024;
+    UploadCompressionLevel = 6;
+    UploadRecordedDeltasOnly = true;
+    CompactRecordedCaches = true;
+    CompactRecordedCachesMinFiles = 4;
+
+    DetectPSOMissHitches = true;
+    PSOMissHitchThresholdMs = 50.0f;
+
+    UseCompileGovernor = false;
+    CompileGovernorTargetFrameMs = 16.6f;
+    CompileGovernorMaxBatchSize = 50;
+    ContextBeforeLoad = E_PSOCompileContext::Gameplay;
+    GovernorHaltRequest = 0;
+    AutomaticCompileRequest = 0;
 }
 
-void UPipelineCacheGameInstance::Shutdown()
+void UPipelineCacheGameInstance::Init()
 {
+    Super::Init();
+
+    FPSOUsageMaskLayout Layout;
+    Layout.LevelBits = UsageMaskLevelBits;
+    Layout.ZoneBits = UsageMaskZoneBits;
+    FPSOUsageMask::SetLayout(Layout);
+
+    if (SetQualityMaskAutomatically)
+    {
+        CurrentQualityBits = GetQualityBits();
+        ScalabilitySinkHandle = IConsoleManager::Get().RegisterConsoleVariableSink_Handle(
+            FConsoleCommandDelegate::CreateUObject(this, &UPipelineCacheGameInstance::OnScalabilityChanged));
+    }
+
 #if !(UE_BUILD_SHIPPING)
     if (!ServerURL.IsEmpty())
     {
@@ -310,8 +412,125 @@ void UPipelineCacheGameInstance::Shutdown()
 
         ServerURL = InPlaceString;
 
+        // Starts draining whatever the last run left behind straight away
+        const auto *PlatformLevel =
+            UploadCompressionLevelPerPlatform.Find(ANSI_TO_TCHAR(FPlatformProperties::IniPlatformName()));
+        const auto CompressionLevel = PlatformLevel ? *PlatformLevel : UploadCompressionLevel;
+
+        UploadQueue = MakeShared<FPSOUploadQueue>(ServerURL, FMath::Max(UploadChunkSizeKB, 64) * 1024,
+                                                  FMath::Clamp(CompressionLevel, 0, 9));
+
+        // Uploads of recorded PSOs are filtered against what the server already has for this build
+        if (UploadRecordedDeltasOnly)
+        {
+            UploadQueue->SetKnownFilterKey(ProjectUUID, VersionString, LexToString(GMaxRHIShaderPlatform));
+        }
+        UploadQueue->Start();
+
+        // Compaction first, so deltas are built from what's left
+        if (CompactRecordedCaches)
+        {
+            QueueCompaction();
+        }
+        if (UploadRecordedDeltasOnly)
+        {
+            QueueShaderDeltas();
+        }
+
+        if (DetectPSOMissHitches)
+        {
+            HitchDetector = MakeShared<FPSOHitchDetector>(PSOMissHitchThresholdMs);
+            HitchDetector->Start();
+            HitchDetectorTickHandle = FTSTicker::GetCoreTicker().AddTicker(
+                FTickerDelegate::CreateUObject(this, &UPipelineCacheGameInstance::TickHitchDetector));
+        }
+    }
+#endif
+
+    if (UseCompileGovernor)
+    {
+        FPSOCompileGovernorSettings Settings;
+        Settings.TargetFrameMs = FMath::Max(CompileGovernorTargetFrameMs, 1.0f);
+        Settings.MaxBatchSize = FMath::Max(CompileGovernorMaxBatchSize, 1);
+        Settings.MaxBatchTimeMs = Settings.TargetFrameMs;
+
+        CompileGovernor = MakeShared<FPSOCompileGovernor>(Settings);
+        CompileGovernorTickHandle = FTSTicker::GetCoreTicker().AddTicker(
+            FTickerDelegate::CreateUObject(this, &UPipelineCacheGameInstance::TickCompileGovernor));
+    }
+
+    BeginStartupCritical();
+
+    // Only worth it when there's a recording to lose
+    if (FPipelineFileCacheManager::LogPSOtoFileCache() &&
+        (IncrementalSaveIntervalSeconds > 0.0f || IncrementalSaveNewPSOs > 0 || SaveIncrementallyOnLoad))
+    {
+        LastIncrementalSaveTime = FPlatformTime::Seconds();
+        IncrementalSaveTickHandle = FTSTicker::GetCoreTicker().AddTicker(
+            FTickerDelegate::CreateUObject(this, &UPipelineCacheGameInstance::TickIncrementalSave), 1.0f);
+    }
+
+    // Map loads drive both the governor and compiling ahead
+    FCoreUObjectDelegates::PreLoadMap.AddUObject(this, &UPipelineCacheGameInstance::OnPreLoadMap);
+    FCoreUObjectDelegates::PostLoadMapWithWorld.AddUObject(this, &UPipelineCacheGameInstance::OnPostLoadMap);
+
+    if (PrecompileAhead)
+    {
+        FWorldDelegates::OnSeamlessTravelStart.AddUObject(this, &UPipelineCacheGameInstance::OnSeamlessTravelStart);
+        FLevelStreamingDelegates::OnLevelStreamingStateChanged.AddUObject(
+            this, &UPipelineCacheGameInstance::OnLevelStreamingStateChanged);
+    }
+}
+
+void UPipelineCacheGameInstance::Shutdown()
+{
+    if (ScalabilitySinkHandle.IsValid())
+    {
+        IConsoleManager::Get().UnregisterConsoleVariableSink_Handle(ScalabilitySinkHandle);
+        ScalabilitySinkHandle.Reset();
+    }
+
+    FCoreUObjectDelegates::PreLoadMap.RemoveAll(this);
+    FCoreUObjectDelegates::PostLoadMapWithWorld.RemoveAll(this);
+    FWorldDelegates::OnSeamlessTravelStart.RemoveAll(this);
+    FLevelStreamingDelegates::OnLevelStreamingStateChanged.RemoveAll(this);
+
+    if (const auto Scheduler = GetSubsystem<UPSOCompileScheduler>())
+    {
+        Scheduler->RemoveRequest(PredictiveCompileRequest);
+        Scheduler->RemoveRequest(StartupCriticalRequest);
+    }
+    PredictiveCompileRequest = 0;
+    StartupCriticalRequest = 0;
+    FTSTicker::GetCoreTicker().RemoveTicker(StartupCriticalTickHandle);
+    FTSTicker::GetCoreTicker().RemoveTicker(IncrementalSaveTickHandle);
+
+    if (CompileGovernor.IsValid())
+    {
+        FTSTicker::GetCoreTicker().RemoveTicker(CompileGovernorTickHandle);
+
+        if (const auto Scheduler = GetSubsystem<UPSOCompileScheduler>())
+        {
+            Scheduler->RemoveRequest(GovernorHaltRequest);
+        }
+        GovernorHaltRequest = 0;
+        CompileGovernor.Reset();
+    }
+
+#if !(UE_BUILD_SHIPPING)
+    if (UploadQueue.IsValid())
+    {
+        // Worker first. A running task finishes, so nothing else is touching recordings or the catalog while
+        // they're saved and rescanned. Enqueueing still works, and whatever hasn't gone out stays in the
+        // outbox for next launch
+        UploadQueue->Shutdown();
+
+        // Ahead of the caches, so the worst offenders reach the server first
+        EnqueueHitchList();
         ShutdownInternalPSO();
 
+        UploadQueue.Reset();
+
         UE_LOG(LogTemp, Warning, TEXT("UPipelineCacheGameInstance::Shutdown"));
     }
 #endif
@@ -394,18 +613,18 @@ int UPipelineCacheGameInstance::LevelToIndex_Implementation(const TSoftObjectPtr
     }
 }
 
-FShaderPipelineCache::BatchMode UPipelineCacheGameInstance::CompileModeHelper(E_PSOCompileMode CompileMode)
+E_PSOCompileRequest UPipelineCacheGameInstance::CompileRequestHelper(E_PSOCompileMode CompileMode)
 {
     switch (CompileMode)
     {
     case E_PSOCompileMode::Background:
-        return FShaderPipelineCache::BatchMode::Background;
+        return E_PSOCompileRequest::Background;
     case E_PSOCompileMode::Fast:
-        return FShaderPipelineCache::BatchMode::Fast;
+        return E_PSOCompileRequest::Fast;
     case E_PSOCompileMode::Precompile:
-        return FShaderPipelineCache::BatchMode::Precompile;
+        return E_PSOCompileRequest::LoadingScreen;
     default:
-        return FShaderPipelineCache::BatchMode::Background;
+        return E_PSOCompileRequest::Background;
     }
 }
 
@@ -414,8 +633,41 @@ void UPipelineCacheGameInstance::SetUsageMask(TSoftObjectPtr<UWorld> InWorld)
     // Set the PSO Mask
     auto LevelIndex = LevelToIndex(InWorld);
 
+    // Unmapped levels get no level bit, and share the PSOs recorded with none
+    CurrentLevelBits = INT32_MAX == LevelIndex ? 0 : FPSOUsageMask::LevelBit(LevelIndex);
+    CurrentZoneBits = 0;
+    CurrentLevelName = InWorld.GetAssetName();
+    bUsageMaskSet = true;
+
+    // Whatever was predicted has either arrived or wasn't needed. Sublevels still on their way in stay
+    PredictedLevelBits = 0;
+    RebuildStreamingLevelBits();
+    UpdatePrediction();
+
+    ApplyUsageMask();
+}
+
+void UPipelineCacheGameInstance::SetUsageZone(int ZoneIndex, bool bActive)
+{
+    const uint64 ZoneBit = FPSOUsageMask::ZoneBit(ZoneIndex);
+    CurrentZoneBits = bActive ? (CurrentZoneBits | ZoneBit) : (CurrentZoneBits & ~ZoneBit);
+
+    ApplyUsageMask();
+}
+
+void UPipelineCacheGameInstance::ApplyUsageMask()
+{
     BPSOCacheMaskUnion Mask{};
-    Mask.LevelIndex = LevelIndex;
+    Mask.Packed |= CurrentQualityBits | CurrentLevelBits | CurrentZoneBits | PredictedLevelBits | StartupCriticalBits;
+    for (const auto &Pair : StreamingLevelBits)
+    {
+        Mask.Packed |= Pair.Value;
+    }
+
+    if (HitchDetector.IsValid())
+    {
+        HitchDetector->SetContext(Mask.Packed, CurrentLevelName);
+    }
 
     // Set Usage Mask
     FShaderPipelineCache::SetGameUsageMaskWithComparison(Mask.Packed,
@@ -428,16 +680,469 @@ void UPipelineCacheGameInstance::SetUsageMaskAndCompile(TSoftObjectPtr<UWorld> I
 
     // Begin a compilation of PSOs based on the current mask
     // TODO: When logging, don't
-    FShaderPipelineCache::SetBatchMode(CompileModeHelper(AutomaticPSOCompileMode));
-
-    if (FShaderPipelineCache::IsBatchingPaused())
+    if (const auto Scheduler = GetSubsystem<UPSOCompileScheduler>())
     {
-        FShaderPipelineCache::ResumeBatching();
+        // Replaces the previous level's request rather than stacking up
+        Scheduler->RemoveRequest(AutomaticCompileRequest);
+        AutomaticCompileRequest = Scheduler->AddRequest(CompileRequestHelper(AutomaticPSOCompileMode));
     }
 }
 
 void UPipelineCacheGameInstance::ClearUsageMask()
 {
+    bUsageMaskSet = false;
     FShaderPipelineCache::SetGameUsageMaskWithComparison(UINT64_MAX,
                                                          &UPipelineCacheGameInstance::UsageMaskComparisonFunction);
 }
+
+void UPipelineCacheGameInstance::SetCompileContext(E_PSOCompileContext Context)
+{
+    if (CompileGovernor.IsValid())
+    {
+        CompileGovernor->SetContext(static_cast<EPSOGovernorContext>(Context));
+    }
+}
+
+void UPipelineCacheGameInstance::OnPreLoadMap(const FString &MapName)
+{
+    if (CompileGovernor.IsValid() && EPSOGovernorContext::Loading != CompileGovernor->GetContext())
+    {
+        ContextBeforeLoad = static_cast<E_PSOCompileContext>(CompileGovernor->GetContext());
+        CompileGovernor->SetContext(EPSOGovernorContext::Loading);
+    }
+
+    if (PrecompileAhead)
+    {
+        HintNextLevel(WorldFromMapName(MapName));
+    }
+
+    // Loading screen. Nobody will notice the disk being busy
+    if (SaveIncrementallyOnLoad && IncrementalSaveTickHandle.IsValid())
+    {
+        StartIncrementalSave();
+    }
+}
+
+void UPipelineCacheGameInstance::OnSeamlessTravelStart(UWorld *CurrentWorld, const FString &LevelName)
+{
+    HintNextLevel(WorldFromMapName(LevelName));
+}
+
+void UPipelineCacheGameInstance::OnLevelStreamingStateChanged(UWorld *OwningWorld,
+                                                              const ULevelStreaming *StreamingLevel,
+                                                              ULevel *LevelIfLoaded,
+                                                              ELevelStreamingState PreviousState,
+                                                              ELevelStreamingState NewState)
+{
+    if (!StreamingLevel || OwningWorld != GetWorld())
+    {
+        return;
+    }
+
+    const FName Package = StreamingLevel->GetWorldAssetPackageFName();
+    switch (NewState)
+    {
+    case ELevelStreamingState::Loading:
+    {
+        // Starts while the sublevel's assets are still streaming in
+        const uint64 LevelBits = PredictableLevelBits(StreamingLevel->GetWorldAsset());
+        if (0 != LevelBits)
+        {
+            StreamingLevelBits.Add(Package, LevelBits);
+            UpdatePrediction();
+        }
+        break;
+    }
+    case ELevelStreamingState::Unloaded:
+    case ELevelStreamingState::Removed:
+    case ELevelStreamingState::FailedToLoad:
+        if (StreamingLevelBits.Remove(Package) > 0)
+        {
+            UpdatePrediction();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void UPipelineCacheGameInstance::HintNextLevel(TSoftObjectPtr<UWorld> NextLevel)
+{
+    const uint64 LevelBits = PredictableLevelBits(NextLevel);
+    if (0 != LevelBits && (PredictedLevelBits & LevelBits) != LevelBits)
+    {
+        PredictedLevelBits |= LevelBits;
+        UpdatePrediction();
+    }
+}
+
+void UPipelineCacheGameInstance::RebuildStreamingLevelBits()
+{
+    StreamingLevelBits.Reset();
+
+    const auto World = GetWorld();
+    if (!World)
+    {
+        return;
+    }
+
+    // Same states OnLevelStreamingStateChanged keeps them for
+    for (const auto StreamingLevel : World->GetStreamingLevels())
+    {
+        if (!StreamingLevel)
+        {
+            continue;
+        }
+
+        switch (StreamingLevel->GetLevelStreamingState())
+        {
+        case ELevelStreamingState::Removed:
+        case ELevelStreamingState::Unloaded:
+        case ELevelStreamingState::FailedToLoad:
+            break;
+        default:
+        {
+            const uint64 LevelBits = PredictableLevelBits(StreamingLevel->GetWorldAsset());
+            if (0 != LevelBits)
+            {
+                StreamingLevelBits.Add(StreamingLevel->GetWorldAssetPackageFName(), LevelBits);
+            }
+            break;
+        }
+        }
+    }
+}
+
+uint64 UPipelineCacheGameInstance::PredictableLevelBits(const TSoftObjectPtr<UWorld> &Level)
+{
+    // While recording, the mask has to say where PSOs were really used
+    if (!PrecompileAhead || Level.IsNull() || FPipelineFileCacheManager::LogPSOtoFileCache())
+    {
+        return 0;
+    }
+
+    const auto LevelIndex = LevelToIndex(Level);
+    return INT32_MAX == LevelIndex ? 0 : FPSOUsageMask::LevelBit(LevelIndex);
+}
+
+void UPipelineCacheGameInstance::UpdatePrediction()
+{
+    uint64 Bits = PredictedLevelBits;
+    for (const auto &Pair : StreamingLevelBits)
+    {
+        Bits |= Pair.Value;
+    }
+
+    if (bUsageMaskSet)
+    {
+        ApplyUsageMask();
+    }
+
+    const auto Scheduler = GetSubsystem<UPSOCompileScheduler>();
+    if (!Scheduler)
+    {
+        return;
+    }
+
+    // Background, so it never competes with the level that's actually running
+    if (0 != Bits && 0 == PredictiveCompileRequest)
+    {
+        PredictiveCompileRequest = Scheduler->AddRequest(E_PSOCompileRequest::Background);
+    }
+    else if (0 == Bits && 0 != PredictiveCompileRequest)
+    {
+        Scheduler->RemoveRequest(PredictiveCompileRequest);
+        PredictiveCompileRequest = 0;
+    }
+}
+
+TSoftObjectPtr<UWorld> UPipelineCacheGameInstance::WorldFromMapName(const FString &MapName)
+{
+    // May be a URL, e.g. /Game/Maps/Arena?listen
+    FString PackageName;
+    if (!MapName.Split(TEXT("?"), &PackageName, nullptr))
+    {
+        PackageName = MapName;
+    }
+
+    if (!FPackageName::IsValidLongPackageName(PackageName))
+    {
+        return TSoftObjectPtr<UWorld>();
+    }
+
+    return TSoftObjectPtr<UWorld>(FSoftObjectPath(PackageName + TEXT(".") + FPackageName::GetShortName(PackageName)));
+}
+
+void UPipelineCacheGameInstance::OnPostLoadMap(UWorld *LoadedWorld)
+{
+    if (CompileGovernor.IsValid())
+    {
+        // The first frames of a new map aren't representative
+        CompileGovernor->SetContext(static_cast<EPSOGovernorContext>(ContextBeforeLoad));
+        CompileGovernor->Reset();
+    }
+}
+
+bool UPipelineCacheGameInstance::TickCompileGovernor(float DeltaTime)
+{
+    if (!CompileGovernor.IsValid())
+    {
+        return false;
+    }
+
+    const auto Previous = CompileGovernor->GetOutput();
+    const auto &Output = CompileGovernor->Update(FPlatformTime::ToMilliseconds(GGameThreadTime),
+                                                 FPlatformTime::ToMilliseconds(GRenderThreadTime));
+
+    if (Output == Previous)
+    {
+        return true;
+    }
+
+    if (const auto Scheduler = GetSubsystem<UPSOCompileScheduler>())
+    {
+        // Fast and Background both follow the governor
+        Scheduler->SetBatchSettings(Output.BatchSize, Output.BatchTimeMs);
+
+        // A halt, not a raw pause, so loading screens and explicit compiles still win
+        if (Output.bPaused && 0 == GovernorHaltRequest)
+        {
+            GovernorHaltRequest = Scheduler->AddRequest(E_PSOCompileRequest::Halt);
+        }
+        else if (!Output.bPaused && 0 != GovernorHaltRequest)
+        {
+            Scheduler->RemoveRequest(GovernorHaltRequest);
+            GovernorHaltRequest = 0;
+        }
+    }
+
+    return true;
+}
+
+uint64 UPipelineCacheGameInstance::GetQualityBits() const
+{
+    static const auto CVarMaterialQuality = IConsoleManager::Get().FindConsoleVariable(TEXT("r.MaterialQualityLevel"));
+    static const auto CVarShadowQuality = IConsoleManager::Get().FindConsoleVariable(TEXT("sg.ShadowQuality"));
+
+    BPSOCacheMaskUnion Mask{};
+    if (CVarMaterialQuality)
+    {
+        // Not in order. 0 Low, 1 High, 2 Medium, 3 Epic
+        static const int32 MaterialTiers[] = {0, 2, 1, 3};
+        const int32 Level = FMath::Clamp(CVarMaterialQuality->GetInt(), 0, 3);
+        Mask.MaterialQuality = FPSOUsageMask::QualityTierBit(MaterialTiers[Level]);
+    }
+
+    if (CVarShadowQuality)
+    {
+        Mask.ShadowQuality = FPSOUsageMask::QualityTierBit(CVarShadowQuality->GetInt());
+    }
+
+    return Mask.Packed;
+}
+
+void UPipelineCacheGameInstance::OnScalabilityChanged()
+{
+    // The sink runs after any console variable changes. Most aren't ours
+    const uint64 QualityBits = GetQualityBits();
+    if (QualityBits == CurrentQualityBits)
+    {
+        return;
+    }
+
+    CurrentQualityBits = QualityBits;
+
+    // Cleared or never set means everything matches. Leave it that way
+    if (!bUsageMaskSet)
+    {
+        return;
+    }
+
+    ApplyUsageMask();
+
+    // The cache picks up PSOs that match the new mask and haven't been compiled yet
+    if (BeginCompilationAutomatically)
+    {
+        if (const auto Scheduler = GetSubsystem<UPSOCompileScheduler>())
+        {
+            Scheduler->RemoveRequest(AutomaticCompileRequest);
+            AutomaticCompileRequest = Scheduler->AddRequest(CompileRequestHelper(AutomaticPSOCompileMode));
+        }
+    }
+}
+
+void UPipelineCacheGameInstance::BeginStartupCritical()
+{
+    StartupBeginTime = FPlatformTime::Seconds();
+
+    // Same reasoning as compiling ahead. Recorded masks have to say where PSOs were really used
+    if (FPipelineFileCacheManager::LogPSOtoFileCache())
+    {
+        return;
+    }
+
+    for (const auto &World : StartupCriticalWorlds)
+    {
+        const auto LevelIndex = LevelToIndex(World);
+        if (INT32_MAX != LevelIndex)
+        {
+            StartupCriticalBits |= FPSOUsageMask::LevelBit(LevelIndex);
+        }
+    }
+
+    for (const auto Zone : StartupCriticalZones)
+    {
+        StartupCriticalBits |= FPSOUsageMask::ZoneBit(Zone);
+    }
+
+    const auto Scheduler = GetSubsystem<UPSOCompileScheduler>();
+    if (0 == StartupCriticalBits || !Scheduler)
+    {
+        StartupCriticalBits = 0;
+        return;
+    }
+
+    // Timed the same way, without the set
+    if (FParse::Param(FCommandLine::Get(), PSOStartupCritical::BaselineParam))
+    {
+        StartupCriticalBits = 0;
+        bStartupCriticalBaseline = true;
+        StartupCriticalTickHandle = FTSTicker::GetCoreTicker().AddTicker(
+            FTickerDelegate::CreateUObject(this, &UPipelineCacheGameInstance::TickStartupCritical));
+        return;
+    }
+
+    // Nothing has set a mask yet, so only the critical set (for this quality) matches. Zones on their own
+    // are zones in any level, rather than only in levels missing from WorldToMaskIndex
+    if (bUsageMaskSet)
+    {
+        ApplyUsageMask();
+    }
+    else if (0 == (StartupCriticalBits & FPSOUsageMask::LevelMask()))
+    {
+        FShaderPipelineCache::SetGameUsageMaskWithComparison(CurrentQualityBits | StartupCriticalBits,
+                                                             &FPSOUsageMask::MatchesAnyLevel);
+    }
+    else
+    {
+        FShaderPipelineCache::SetGameUsageMaskWithComparison(CurrentQualityBits | StartupCriticalBits,
+                                                             &UPipelineCacheGameInstance::UsageMaskComparisonFunction);
+    }
+
+    // Background batches are small, so the first frame isn't held up by them
+    StartupCriticalRequest = Scheduler->AddRequest(E_PSOCompileRequest::Background);
+    StartupCriticalStartRemaining = FShaderPipelineCache::NumPrecompilesRemaining();
+    StartupCriticalTickHandle = FTSTicker::GetCoreTicker().AddTicker(
+        FTickerDelegate::CreateUObject(this, &UPipelineCacheGameInstance::TickStartupCritical));
+
+    UE_LOG(LogTemp, Log, TEXT("Startup-critical PSOs: scheduled in %.3f ms"),
+           (FPlatformTime::Seconds() - StartupBeginTime) * 1000.0);
+}
+
+bool UPipelineCacheGameInstance::TickStartupCritical(float DeltaTime)
+{
+    const double Now = FPlatformTime::Seconds();
+    if (0.0 == StartupFirstFrameTime)
+    {
+        StartupFirstFrameTime = Now;
+    }
+    const double FirstFrameMs = (StartupFirstFrameTime - StartupBeginTime) * 1000.0;
+
+    if (bStartupCriticalBaseline)
+    {
+        FFileHelper::SaveStringToFile(FString::Printf(TEXT("%.1f"), FirstFrameMs),
+                                      *PSOStartupCritical::GetBaselineFile());
+        UE_LOG(LogTemp, Log, TEXT("Startup-critical PSOs: baseline first frame %.1f ms after game instance init"),
+               FirstFrameMs);
+
+        StartupCriticalTickHandle.Reset();
+        return false;
+    }
+
+    const int32 Remaining = FShaderPipelineCache::NumPrecompilesRemaining();
+    StartupCriticalStartRemaining = FMath::Max(StartupCriticalStartRemaining, Remaining);
+    bStartupCriticalStarted |= Remaining > 0;
+
+    // The cache can take a moment to build its list. Don't call an empty list done straight away
+    if (Remaining > 0 || (!bStartupCriticalStarted && Now - StartupBeginTime < 2.0))
+    {
+        return true;
+    }
+
+    // Against the last run made with -PSOStartupBaseline. One run each, so worth repeating before trusting it
+    FString Comparison = FString::Printf(TEXT("no baseline, run once with -%s"), PSOStartupCritical::BaselineParam);
+    FString BaselineText;
+    double BaselineMs = 0.0;
+    if (FFileHelper::LoadFileToString(BaselineText, *PSOStartupCritical::GetBaselineFile()) &&
+        LexTryParseString(BaselineMs, *BaselineText))
+    {
+        Comparison = FString::Printf(TEXT("%+.1f ms against %.1f ms without the set"), FirstFrameMs - BaselineMs,
+                                     BaselineMs);
+    }
+
+    UE_LOG(LogTemp, Log,
+           TEXT("Startup-critical PSOs: %d compiled. First frame %.1f ms after game instance init (%s, %.1f ms "
+                "after process start), set finished %.1f ms after init"),
+           StartupCriticalStartRemaining, FirstFrameMs, *Comparison, (StartupFirstFrameTime - GStartTime) * 1000.0,
+           (Now - StartupBeginTime) * 1000.0);
+
+    if (const auto Scheduler = GetSubsystem<UPSOCompileScheduler>())
+    {
+        Scheduler->RemoveRequest(StartupCriticalRequest);
+    }
+    StartupCriticalRequest = 0;
+    StartupCriticalBits = 0;
+
+    if (bUsageMaskSet)
+    {
+        ApplyUsageMask();
+    }
+    else
+    {
+        ClearUsageMask();
+    }
+
+    StartupCriticalTickHandle.Reset();
+    return false;
+}
+
+bool UPipelineCacheGameInstance::TickIncrementalSave(float DeltaTime)
+{
+    // The engine starts counting again after every save, so this is what's new since the last one
+    const int32 NewPSOs = FPipelineFileCacheManager::NumPSOsLogged();
+    const bool bEnoughPSOs = IncrementalSaveNewPSOs > 0 && NewPSOs >= IncrementalSaveNewPSOs;
+    const bool bTimeUp = IncrementalSaveIntervalSeconds > 0.0f &&
+                         FPlatformTime::Seconds() - LastIncrementalSaveTime >= IncrementalSaveIntervalSeconds;
+
+    if (bEnoughPSOs || bTimeUp)
+    {
+        StartIncrementalSave();
+    }
+
+    return true;
+}
+
+void UPipelineCacheGameInstance::StartIncrementalSave()
+{
+    if (IncrementalSave.IsValid() && !IncrementalSave.IsReady())
+    {
+        return;
+    }
+
+    LastIncrementalSaveTime = FPlatformTime::Seconds();
+    if (0 == FPipelineFileCacheManager::NumPSOsLogged())
+    {
+        return;
+    }
+
+    // Incremental only appends new entries and rewrites the table of contents. The full,
+    // consolidating WantedPSOMode save still happens at shutdown
+    IncrementalSave = Async(EAsyncExecution::ThreadPool, []() {
+        const double Start = FPlatformTime::Seconds();
+        const bool bSaved =
+            FPipelineFileCacheManager::SavePipelineFileCache(FPipelineFileCacheManager::SaveMode::Incremental);
+        UE_LOG(LogTemp, Log, TEXT("Incremental PSO cache save %s in %.1f ms"), bSaved ? TEXT("done") : TEXT("FAILED"),
+               (FPlatformTime::Seconds() - Start) * 1000.0);
+        return bSaved;
+    });
+}
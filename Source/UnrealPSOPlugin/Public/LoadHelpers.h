@@ -2,11 +2,13 @@
 
 #pragma once
 
+#include "Containers/Ticker.h"
 #include "CoreMinimal.h"
 #include "Engine/EngineTypes.h"
 #include "Engine/GameInstance.h"
 #include "Engine/StreamableManager.h"
 #include "Kismet/BlueprintAsyncActionBase.h"
+#include "PSOCompileScheduler.h"
 #include "Templates/SubclassOf.h"
 #include "UObject/ObjectMacros.h"
 
@@ -14,8 +16,12 @@
 
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnAsyncPSOLoaded, int, remainingShaders, int, totalShaders);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnAsyncPSOUpdated, int, remainingShaders, int, totalShaders);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnAsyncPSOCancelled, int, remainingShaders, int, totalShaders);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnAsyncPSODeadline, int, compiledShaders, int, remainingShaders);
 DECLARE_DELEGATE_OneParam(FOnAsyncPSOLoadedInternalCallback, int);
 
+class FShaderCachePrecompileContext;
+
 UCLASS()
 class UNREALPSOPLUGIN_API UPSOLevelLoadHelper : public UBlueprintAsyncActionBase
 {
@@ -40,6 +46,13 @@ public:
               meta = (BlueprintInternalUseOnly = "true", Category = "PSO", WorldContext = "WorldContextObject"))
     static UPSOLevelLoadHelper *AsyncPrecompilePSOShadersWithFeedback(UObject *WorldContextObject);
 
+    /**
+     * Hold background compiles off, e.g. through gameplay that needs the frame time
+     *
+     * Completes straight away, but the halt is held until ReleaseHalt on the returned node.
+     * Each Halt node holds its own, and other nodes don't lift it. Fast and loading screen
+     * compiles still beat it. See UPSOCompileScheduler
+     */
     UFUNCTION(BlueprintCallable,
               meta = (BlueprintInternalUseOnly = "true", Category = "PSO", WorldContext = "WorldContextObject"))
     static UPSOLevelLoadHelper *AsyncHaltPSOShaders(UObject *WorldContextObject);
@@ -51,9 +64,25 @@ public:
     UPROPERTY(BlueprintAssignable)
     FOnAsyncPSOUpdated Updated;
 
+    /** Called instead of Completed if Cancel is used, or the game instance goes away first */
+    UPROPERTY(BlueprintAssignable)
+    FOnAsyncPSOCancelled Cancelled;
+
     /** Execute the actual operation */
     virtual void Activate() override;
 
+    /**
+     * Stop waiting. Compilation itself carries on in whatever mode it was left in
+     *
+     * Safe to call more than once, or after completion
+     */
+    UFUNCTION(BlueprintCallable, Category = "PSO")
+    void Cancel();
+
+    /** Release the halt taken by AsyncHaltPSOShaders. Does nothing on other nodes, or if already released */
+    UFUNCTION(BlueprintCallable, Category = "PSO")
+    void ReleaseHalt();
+
 protected:
     enum class EPSOState : uint8
     {
@@ -67,7 +96,7 @@ protected:
     EPSOState Operation;
 
     UPROPERTY()
-    UGameInstance *WorldInstance;
+    TWeakObjectPtr<UGameInstance> WorldInstance;
 
     // UPROPERTY()
     // ARedGameState* GameState;
@@ -75,10 +104,60 @@ protected:
     int64 MaxShaders;
     int64 LastIterationShaders;
     int64 ReferenceCurrentShaders;
-    FTimerHandle StepHandler;
+
+    // Slow poll for progress and counted waits. Only broadcasts when the count moves
+    FTSTicker::FDelegateHandle StepHandler;
+    FDelegateHandle PrecompileCompleteHandle;
+    bool bFinished = false;
+
+    // Our request with UPSOCompileScheduler, held until we complete or cancel. A halt is held until ReleaseHalt
+    int32 SchedulerRequest = 0;
+
+    bool AcquireRequest(E_PSOCompileRequest Kind);
+    void ReleaseRequest();
+
+    /** Hook the pipeline cache's completion notification and start checking progress */
+    void BeginWaiting();
+    void StopWaiting();
+
+    bool TickProgress(float DeltaTime);
+    void OnPrecompilationComplete(uint32 Count, double Seconds, const FShaderCachePrecompileContext &Context);
 
     virtual void WaitForBatch(); // const int MaxShaders, FOnAsyncPSOLoadedInternalCallback Delegate);
 
     /** Called at completion of save/load to execute delegate */
     virtual void ExecuteCompleted(const int RemainingShaders);
 };
+
+UCLASS()
+class UNREALPSOPLUGIN_API UPSODeadlineCompileHelper : public UBlueprintAsyncActionBase
+{
+    GENERATED_BODY()
+public:
+    /**
+     * Compile PSOs for up to Milliseconds, e.g. however long a loading screen has
+     *
+     * Completes early if there is nothing left. Reports how many were compiled
+     * and how many are still waiting. See UPSOCompileScheduler::CompileFor
+     */
+    UFUNCTION(BlueprintCallable,
+              meta = (BlueprintInternalUseOnly = "true", Category = "PSO", WorldContext = "WorldContextObject"))
+    static UPSODeadlineCompileHelper *AsyncCompilePSOShadersForDuration(UObject *WorldContextObject,
+                                                                        const float Milliseconds);
+
+    UPROPERTY(BlueprintAssignable)
+    FOnAsyncPSODeadline Completed;
+
+    virtual void Activate() override;
+
+    /** Stop before the deadline. Completed still fires */
+    UFUNCTION(BlueprintCallable, Category = "PSO")
+    void Cancel();
+
+protected:
+    TWeakObjectPtr<UGameInstance> WorldInstance;
+    float Milliseconds;
+    int32 Handle;
+
+    void OnDeadlineReached(int32 Compiled, int32 Remaining);
+};
@@ -0,0 +1,77 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+enum class EPSOCacheFileKind : uint8
+{
+    Unknown,
+    StableCache,   // <Project>_<Platform>.stable.upipelinecache
+    RecordedCache, // ...-<Project>_<Platform>_<Hash>.rec.upipelinecache
+    StableKeys     // ShaderStableInfo-<Global|Project>-<Platform>.shk
+};
+
+struct UNREALPSOPLUGIN_API FPSOCacheFile
+{
+    FString Path;
+    FString Platform;
+    EPSOCacheFileKind Kind = EPSOCacheFileKind::Unknown;
+
+    // Stable caches and global shader keys
+    bool bGlobal = false;
+
+    int64 Size = -1;
+    FDateTime Timestamp;
+    uint64 Hash = 0;
+};
+
+/**
+ * Index of the pipeline cache and stable key files on this machine
+ *
+ * Only the directories caches are actually written to are scanned, each on its
+ * own task, rather than walking everything under Saved. Names are parsed
+ * without allocating, and the results (including content hashes) are kept in
+ * Saved/PSOCacheCatalog.json so files that haven't changed aren't re-read.
+ */
+class UNREALPSOPLUGIN_API FPSOCacheCatalog
+{
+public:
+    FPSOCacheCatalog();
+
+    static FString GetCatalogPath();
+
+    /** Also scan Dir. Relative paths are taken from the project directory */
+    void AddSearchDirectory(const FString &Dir, bool bRecursive = true);
+
+    /** Rescan the search directories. Hashes anything new or changed */
+    void Refresh();
+
+    /** Known cache files, from the last Refresh */
+    const TArray<FPSOCacheFile> &GetFiles() const
+    {
+        return Files;
+    }
+
+    /**
+     * Work out what a cache file is from its name alone
+     *
+     * @param Filename Clean filename, no directory
+     * @param OutPlatform Points into Filename
+     */
+    static EPSOCacheFileKind ParseName(FStringView Filename, FStringView ProjectName, FStringView &OutPlatform,
+                                       bool &bOutGlobal);
+
+private:
+    struct FSearchDirectory
+    {
+        FString Path;
+        bool bRecursive;
+    };
+
+    void LoadCatalog(TMap<FString, FPSOCacheFile> &OutCached) const;
+    void SaveCatalog() const;
+
+    TArray<FSearchDirectory> SearchDirectories;
+    TArray<FPSOCacheFile> Files;
+};
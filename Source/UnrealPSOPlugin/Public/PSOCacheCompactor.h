@@ -0,0 +1,67 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "PSOCacheCatalog.h"
+#include "PipelineFileCache.h"
+
+struct UNREALPSOPLUGIN_API FPSOCompactionResult
+{
+    // Recorded caches merged and deleted
+    int32 NumMerged = 0;
+    int64 BytesFreed = 0;
+
+    // PSOs in the archive afterwards
+    int32 NumArchived = 0;
+
+    // PSOs still to be uploaded, and the file holding them. Empty if there are none
+    int32 NumPending = 0;
+    FString PendingFile;
+};
+
+/**
+ * Folds the recorded caches each session leaves behind into two files
+ *
+ * Recordings that have already been handed to the upload queue go into an
+ * archive under Saved/PSOCompacted, which the catalog never scans. The rest
+ * are merged into a single Compacted-*.rec.upipelinecache in
+ * Saved/CollectedPSOs, leaving out anything the archive already has, so it's
+ * picked up and uploaded like any other recording. Once that's queued, the
+ * next compaction archives it in turn.
+ *
+ * A PSO seen in several sessions keeps the union of their usage masks and the
+ * sum of their bind counts, as with PSOCacheMerge. One the archive has is
+ * still sent if it was since seen in a level, zone or tier the archive lacks.
+ *
+ * Merged files are deleted, so the number of recordings on disk, and what
+ * gets uploaded, stays flat however many sessions a machine runs.
+ *
+ * Only recordings for the running shader platform are touched. Processes
+ * share Saved, so callers should hold the FPSOOutboxLock while compacting.
+ */
+class UNREALPSOPLUGIN_API FPSOCacheCompactor
+{
+public:
+    /** Whether a recording has already been queued for upload */
+    using FIsHandled = TFunction<bool(const FPSOCacheFile &)>;
+
+    /** @param InMinFiles Leave things alone until there are at least this many recordings */
+    explicit FPSOCacheCompactor(int32 InMinFiles = 4);
+
+    static FString GetArchivePath(const FString &Platform);
+
+    /**
+     * Merge the recordings in Files. Blocking, call off the game thread
+     *
+     * @param Before Only recordings last written before this (UTC). Keeps us off the current session's file,
+     *               but not off an older one another running process is still writing
+     */
+    bool Compact(const TArray<FPSOCacheFile> &Files, const FDateTime &Before, const FIsHandled &IsHandled,
+                 FPSOCompactionResult &OutResult) const;
+
+private:
+    static bool SaveReplacing(const FString &File, const TSet<FPipelineCacheFileFormatPSO> &PSOs);
+
+    int32 MinFiles;
+};
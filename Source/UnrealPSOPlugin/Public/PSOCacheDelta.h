@@ -0,0 +1,48 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "PSOKnownFilter.h"
+#include "PipelineFileCache.h"
+#include "ShaderCodeLibrary.h"
+
+/**
+ * Cuts recorded caches down to the PSOs the shipped stable cache doesn't already have
+ *
+ * Most of a .rec.upipelinecache from a mature build is PSOs we already ship.
+ * Build writes a cache holding only the new ones, plus a stable key file
+ * with just the keys those PSOs reference, so the server can still expand it.
+ * A shipped PSO counts as new if its usage mask has bits the shipped one lacks.
+ */
+class UNREALPSOPLUGIN_API FPSOCacheDelta
+{
+public:
+    /**
+     * Load what we diff against
+     *
+     * @param StableCaches Shipped *.stable.upipelinecache files
+     * @param KeyFiles *.shk files to take referenced keys from, with the platform each was parsed as
+     */
+    void Initialise(const TArray<FString> &StableCaches, const TArray<TPair<FString, FString>> &KeyFiles);
+
+    /**
+     * Write the PSOs in RecordedCache that aren't in the stable caches, or were seen with new usage, to OutCache
+     *
+     * @param KnownFilter PSOs the server (probably) already has from other machines. May be null
+     * @param OutKeyFiles Platform -> key file written next to OutCache for that platform's referenced keys
+     * @param OutNumNew PSOs written. Nothing is written if this is 0
+     */
+    bool Build(const FString &RecordedCache, const FString &OutCache, const FPSOKnownFilter *KnownFilter,
+               TMap<FString, FString> &OutKeyFiles, int32 &OutNumNew) const;
+
+private:
+    static void GetShaderHashes(const FPipelineCacheFileFormatPSO &PSO, TArray<FSHAHash, TInlineAllocator<5>> &Out);
+
+    TSet<FPipelineCacheFileFormatPSO> StablePSOs;
+
+    TArray<FStableShaderKeyAndValue> StableKeys;
+    TArray<int32> StableKeyPlatform;
+    TArray<FString> Platforms;
+    TMultiMap<FSHAHash, int32> KeysByHash;
+};
@@ -0,0 +1,108 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * What the game is doing, which decides how much of a frame PSO compilation may take
+ */
+enum class EPSOGovernorContext : uint8
+{
+    Gameplay,
+    Menu,
+    Cutscene,
+    Loading
+};
+
+struct UNREALPSOPLUGIN_API FPSOCompileGovernorSettings
+{
+    // Frame time we're trying to hold during gameplay
+    float TargetFrameMs = 16.6f;
+
+    // How far over budget the other contexts may go. Loading ignores the budget entirely
+    float MenuBudgetScale = 1.5f;
+    float CutsceneBudgetScale = 1.25f;
+
+    int32 MinBatchSize = 1;
+    int32 MaxBatchSize = 50;
+    float MinBatchTimeMs = 0.5f;
+    float MaxBatchTimeMs = 16.0f;
+
+    // Weight of the newest frame in the smoothed frame time
+    float Smoothing = 0.1f;
+
+    // Pause after this many frames over TargetFrameMs * PauseOverBudgetScale, resume after as many under budget
+    float PauseOverBudgetScale = 1.5f;
+    int32 PauseAfterFrames = 10;
+    int32 ResumeAfterFrames = 30;
+};
+
+/**
+ * Batch settings to hand to FShaderPipelineCache
+ */
+struct UNREALPSOPLUGIN_API FPSOCompileGovernorOutput
+{
+    int32 BatchSize = 1;
+    float BatchTimeMs = 0.0f;
+    bool bPaused = false;
+
+    bool operator==(const FPSOCompileGovernorOutput &Other) const
+    {
+        return BatchSize == Other.BatchSize && BatchTimeMs == Other.BatchTimeMs && bPaused == Other.bPaused;
+    }
+};
+
+/**
+ * Picks a PSO batch size and time from recent frame times
+ *
+ * Fed one sample per frame. The slower of the game and render threads is
+ * smoothed, and whatever is left of the budget goes to compilation: batch
+ * size grows by one per frame with headroom and halves when over budget,
+ * while batch time follows the render thread headroom, as that is where
+ * batches are submitted. Sustained heavy frames pause compilation outright.
+ *
+ * Only needs Core and never reads the clock itself, so it can be driven
+ * with recorded or synthetic frame traces, as UnrealPSOPlugin.CompileGovernor
+ * does. UPipelineCacheGameInstance applies the output.
+ */
+class UNREALPSOPLUGIN_API FPSOCompileGovernor
+{
+public:
+    explicit FPSOCompileGovernor(const FPSOCompileGovernorSettings &InSettings = FPSOCompileGovernorSettings());
+
+    void SetContext(EPSOGovernorContext InContext);
+    EPSOGovernorContext GetContext() const
+    {
+        return Context;
+    }
+
+    /** Start over, e.g. after a long hitch we don't want to learn from */
+    void Reset();
+
+    /** Add one frame's timings and get the settings for the next */
+    const FPSOCompileGovernorOutput &Update(float GameThreadMs, float RenderThreadMs);
+
+    const FPSOCompileGovernorOutput &GetOutput() const
+    {
+        return Output;
+    }
+
+    float GetSmoothedFrameMs() const
+    {
+        return SmoothedFrameMs;
+    }
+
+    /** Frame time allowed in the current context. Unbounded while loading */
+    float GetBudgetMs() const;
+
+private:
+    FPSOCompileGovernorSettings Settings;
+    EPSOGovernorContext Context;
+    FPSOCompileGovernorOutput Output;
+
+    float SmoothedFrameMs;
+    float SmoothedRenderMs;
+    int32 FramesOverBudget;
+    int32 FramesUnderBudget;
+};
@@ -0,0 +1,80 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Throughput, batch timing and ETA for PSO precompilation
+ *
+ * Fed the remaining precompile count once per frame. The engine doesn't
+ * report individual batches, so a batch is taken to be the wall time from
+ * one drop in the count to the next while compiling.
+ */
+class UNREALPSOPLUGIN_API FPSOCompileMetrics
+{
+public:
+    enum class EMode : uint8
+    {
+        Paused,
+        Background,
+        Fast,
+        Precompile,
+        Num
+    };
+
+    explicit FPSOCompileMetrics(double InWindowSeconds = 5.0, int32 InMaxBatches = 256);
+
+    void Reset();
+
+    void Sample(double Now, int32 Remaining, EMode Mode);
+
+    /** Over the last WindowSeconds */
+    float GetPSOsPerSecond() const;
+
+    float GetMeanBatchMs() const;
+    float GetP95BatchMs() const;
+
+    /** Seconds until nothing is left at the current rate. Negative if it isn't moving */
+    float GetEtaSeconds() const;
+
+    double GetSecondsInMode(EMode Mode) const
+    {
+        return ModeSeconds[static_cast<int32>(Mode)];
+    }
+
+    int32 GetRemaining() const
+    {
+        return LastRemaining;
+    }
+
+    int64 GetTotalCompiled() const
+    {
+        return TotalCompiled;
+    }
+
+private:
+    struct FProgress
+    {
+        double Time;
+        int32 Compiled;
+    };
+
+    double WindowSeconds;
+    int32 MaxBatches;
+
+    // Drops in the count inside the window, oldest first
+    TArray<FProgress> Window;
+
+    // Most recent batch times, used as a ring once full
+    TArray<float> BatchMs;
+    int32 NextBatch;
+
+    double ModeSeconds[static_cast<int32>(EMode::Num)];
+
+    double LastSampleTime;
+    double LastProgressTime;
+    int32 LastRemaining;
+    EMode LastMode;
+    int64 TotalCompiled;
+};
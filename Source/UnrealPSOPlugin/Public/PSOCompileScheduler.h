@@ -0,0 +1,181 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "Containers/Ticker.h"
+#include "CoreMinimal.h"
+#include "PSOCompileMetrics.h"
+#include "ShaderPipelineCache.h"
+#include "Subsystems/GameInstanceSubsystem.h"
+
+#include "PSOCompileScheduler.generated.h"
+
+// Kinds of compile request, lowest priority first
+UENUM(BlueprintType)
+enum class E_PSOCompileRequest : uint8
+{
+    Background,   // Compile in Background mode
+    Halt,         // Gameplay needs the frame time. Beats background compiles
+    Fast,         // Compile in Fast mode
+    LoadingScreen // Compile in Precompile mode. Beats everything
+};
+
+// Compiled, Remaining
+DECLARE_DELEGATE_TwoParams(FOnPSODeadlineReached, int32, int32);
+
+// Blueprint copy of FPSOCompileMetrics
+USTRUCT(BlueprintType)
+struct UNREALPSOPLUGIN_API FPSOCompileMetricsSnapshot
+{
+    GENERATED_BODY()
+
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    int RemainingPSOs = 0;
+
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    int64 CompiledPSOs = 0;
+
+    // Over the last few seconds
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    float PSOsPerSecond = 0.0f;
+
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    float MeanBatchMs = 0.0f;
+
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    float P95BatchMs = 0.0f;
+
+    // Negative while nothing is compiling
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    float EtaSeconds = 0.0f;
+
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    float SecondsPaused = 0.0f;
+
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    float SecondsBackground = 0.0f;
+
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    float SecondsFast = 0.0f;
+
+    UPROPERTY(BlueprintReadOnly, Category = "PSO")
+    float SecondsPrecompile = 0.0f;
+};
+
+/**
+ * Single owner of FShaderPipelineCache's batch mode and pause state
+ *
+ * Anything that wants PSOs compiled (or not) adds a request and removes it
+ * when done. Requests are ref-counted per kind and the highest priority kind
+ * with any outstanding wins. With no requests at all, batching is paused, so
+ * from the first request on nothing compiles unless somebody asks for it.
+ * Before the first request and after Deinitialize, FShaderPipelineCache is
+ * left in whatever state it was. The mode is only touched when the winner
+ * or the batch settings change, so one caller finishing can't stop another's
+ * compile.
+ */
+UCLASS()
+class UNREALPSOPLUGIN_API UPSOCompileScheduler : public UGameInstanceSubsystem
+{
+    GENERATED_BODY()
+
+public:
+    static UPSOCompileScheduler *Get(const UObject *WorldContextObject);
+
+    virtual void Initialize(FSubsystemCollectionBase &Collection) override;
+    virtual void Deinitialize() override;
+
+    /** Returns a handle for RemoveRequest. Never 0 */
+    UFUNCTION(BlueprintCallable, Category = "PSO")
+    int32 AddRequest(E_PSOCompileRequest Kind);
+
+    /** Release a request. Unknown or already released handles are ignored */
+    UFUNCTION(BlueprintCallable, Category = "PSO")
+    void RemoveRequest(int32 Handle);
+
+    /** Whether any request is outstanding, and if so which kind is in effect */
+    UFUNCTION(BlueprintPure, Category = "PSO")
+    bool GetEffectiveRequest(E_PSOCompileRequest &OutKind) const;
+
+    UFUNCTION(BlueprintPure, Category = "PSO")
+    int32 GetRequestCount(E_PSOCompileRequest Kind) const;
+
+    /**
+     * Compile as many PSOs as possible until Seconds have passed, or nothing is left
+     *
+     * Holds a request of Kind until then. LoadingScreen uses Precompile mode,
+     * which does anything matching r.ShaderPipelineCache.PreCompileMask first.
+     * OnDone gets how many were compiled and how many remain, on the game thread
+     *
+     * @return Handle for CancelCompileFor
+     */
+    int32 CompileFor(float Seconds, FOnPSODeadlineReached OnDone,
+                     E_PSOCompileRequest Kind = E_PSOCompileRequest::LoadingScreen);
+
+    /** Stop early. OnDone is still called with what was done so far */
+    void CancelCompileFor(int32 Handle);
+
+    /**
+     * Batch size and time for Fast and Background modes, e.g. from the compile governor
+     *
+     * FShaderPipelineCache only reads the r.ShaderPipelineCache batch cvars when
+     * the mode is set, so this sets them and then the current mode again
+     */
+    void SetBatchSettings(int32 BatchSize, float BatchTimeMs);
+
+    /** What FShaderPipelineCache was last given for the current mode. Zero before any mode was set */
+    int32 GetAppliedBatchSize() const
+    {
+        return AppliedBatchSize;
+    }
+
+    float GetAppliedBatchTimeMs() const
+    {
+        return AppliedBatchTimeMs;
+    }
+
+    /**
+     * Compile throughput, batch times, ETA and time spent in each mode
+     *
+     * Also published to the PSOCompile stat group and CSV category
+     */
+    UFUNCTION(BlueprintPure, Category = "PSO")
+    FPSOCompileMetricsSnapshot GetCompileMetrics() const;
+
+    const FPSOCompileMetrics &GetMetrics() const
+    {
+        return Metrics;
+    }
+
+private:
+    struct FTimedCompile
+    {
+        int32 Request;
+        double Deadline;
+        int32 StartRemaining;
+        FOnPSODeadlineReached OnDone;
+    };
+
+    void Apply();
+    void ApplyBatchMode(FShaderPipelineCache::BatchMode Mode);
+    bool TickTimedCompiles(float DeltaTime);
+    void FinishTimedCompile(int32 Handle);
+
+    TMap<int32, FTimedCompile> TimedCompiles;
+    FTSTicker::FDelegateHandle TimedCompileTicker;
+
+    bool TickMetrics(float DeltaTime);
+
+    FPSOCompileMetrics Metrics;
+    FTSTicker::FDelegateHandle MetricsTicker;
+
+    TMap<int32, E_PSOCompileRequest> Requests;
+    TArray<int32> RequestCounts;
+    int32 NextHandle = 1;
+
+    // What was last handed to FShaderPipelineCache, so it's only changed on a change
+    bool bModeApplied = false;
+    FShaderPipelineCache::BatchMode AppliedMode = FShaderPipelineCache::BatchMode::Background;
+    int32 AppliedBatchSize = 0;
+    float AppliedBatchTimeMs = 0.0f;
+};
@@ -0,0 +1,143 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include <atomic>
+
+/**
+ * Fixed capacity single-producer/single-consumer queue
+ *
+ * No locks and no allocation after construction. Push fails rather than
+ * blocking when full. Each side keeps a cached copy of the other's index, so
+ * the shared cache line is only read when the cached one says full/empty.
+ */
+template <typename ElementType, uint32 Capacity> class TPSOEventRing
+{
+    static_assert(Capacity > 0 && 0 == (Capacity & (Capacity - 1)), "Capacity must be a power of two");
+
+public:
+    /** Producer thread only */
+    bool Push(const ElementType &Item)
+    {
+        const uint32 Head = HeadIndex.load(std::memory_order_relaxed);
+        if (Head - ProducerCachedTail == Capacity)
+        {
+            ProducerCachedTail = TailIndex.load(std::memory_order_acquire);
+            if (Head - ProducerCachedTail == Capacity)
+            {
+                return false;
+            }
+        }
+
+        Items[Head & (Capacity - 1)] = Item;
+        HeadIndex.store(Head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Consumer thread only */
+    bool Pop(ElementType &OutItem)
+    {
+        const uint32 Tail = TailIndex.load(std::memory_order_relaxed);
+        if (Tail == ConsumerCachedHead)
+        {
+            ConsumerCachedHead = HeadIndex.load(std::memory_order_acquire);
+            if (Tail == ConsumerCachedHead)
+            {
+                return false;
+            }
+        }
+
+        OutItem = Items[Tail & (Capacity - 1)];
+        TailIndex.store(Tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    // Producer's line
+    alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint32> HeadIndex{0};
+    uint32 ProducerCachedTail = 0;
+
+    // Consumer's line
+    alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint32> TailIndex{0};
+    uint32 ConsumerCachedHead = 0;
+
+    alignas(PLATFORM_CACHE_LINE_SIZE) ElementType Items[Capacity];
+};
+
+enum class EPSOEventType : uint8
+{
+    CompileStart,
+    CompileEnd,
+    Miss
+};
+
+struct FPSOEvent
+{
+    // FPlatformTime::Cycles64 when it happened
+    uint64 Cycles;
+    uint32 PSOHash;
+    EPSOEventType Type;
+};
+
+/**
+ * Per-PSO events from the render, RHI and worker threads to the game thread
+ *
+ * Every producing thread claims its own TPSOEventRing the first time it
+ * pushes, so each ring keeps a single producer, and gives it back when the
+ * thread exits. Whatever it left in the ring is still drained. While more than
+ * MaxProducers threads are pushing at once, the extra threads' events are
+ * dropped and counted, as are events that find their ring full.
+ * The game thread is the only consumer.
+ */
+class UNREALPSOPLUGIN_API FPSOEventChannel
+{
+public:
+    // Render, RHI and a task pool's worth of workers on a large machine
+    static constexpr int32 MaxProducers = 64;
+    static constexpr uint32 Capacity = 1024;
+
+    static FPSOEventChannel &Get();
+
+    /** Any thread */
+    bool Push(EPSOEventType Type, uint32 PSOHash);
+
+    /** Give the calling thread's ring back early. Happens at thread exit anyway */
+    void ReleaseProducer();
+
+    /** Consumer only. Calls Visitor with each waiting event, one producer at a time */
+    template <typename VisitorType> int32 Drain(VisitorType &&Visitor)
+    {
+        int32 Count = 0;
+        const int32 Num = FMath::Min(NumProducers.load(std::memory_order_acquire), MaxProducers);
+
+        FPSOEvent Event;
+        for (int32 Index = 0; Index < Num; ++Index)
+        {
+            while (Rings[Index].Pop(Event))
+            {
+                Visitor(Event);
+                ++Count;
+            }
+        }
+
+        return Count;
+    }
+
+    /** Events dropped since startup. Any thread */
+    uint64 GetDropped() const
+    {
+        return Dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    int32 ClaimSlot();
+
+    TPSOEventRing<FPSOEvent, Capacity> Rings[MaxProducers];
+    std::atomic<bool> SlotInUse[MaxProducers] = {};
+
+    // One past the highest slot ever claimed, so Drain doesn't visit rings nobody has used
+    std::atomic<int32> NumProducers{0};
+    std::atomic<uint64> Dropped{0};
+};
@@ -0,0 +1,104 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct FPipelineCacheFileFormatPSO;
+
+/**
+ * A PSO that was created on demand rather than precompiled
+ */
+struct UNREALPSOPLUGIN_API FPSOMissRecord
+{
+    // Table of contents key, as in FPSOKnownFilter
+    uint32 PSOHash = 0;
+
+    // Usage mask and map when first seen
+    uint64 UsageMask = 0;
+    FString Level;
+    FDateTime FirstSeen;
+
+    int32 Count = 0;
+    int32 Hitches = 0;
+    float WorstFrameMs = 0.0f;
+    float TotalHitchMs = 0.0f;
+};
+
+/**
+ * Spots PSOs created during play that weren't in any cache, and the frame spikes they cause
+ *
+ * The engine logs a PSO the first time it is created without already being in
+ * a cache file, so every FPipelineFileCacheManager::OnPipelineStateLogged is a
+ * miss. Misses are matched against game thread frame times, allowing for the
+ * render thread running a frame behind, and any over HitchThresholdMs count as
+ * hitches. Needs PSO logging on, so this is for recording builds.
+ *
+ * The hitch list is worst first, so the next cache build can start with the
+ * PSOs that cost the most.
+ */
+class UNREALPSOPLUGIN_API FPSOHitchDetector
+{
+public:
+    explicit FPSOHitchDetector(float InHitchThresholdMs = 50.0f);
+    ~FPSOHitchDetector();
+
+    void Start();
+    void Stop();
+
+    /** What misses from now on get recorded against. Game thread */
+    void SetContext(uint64 UsageMask, const FString &Level);
+
+    /** Attribute pending misses to frames. Game thread, once a frame */
+    void Tick();
+
+    const TMap<uint32, FPSOMissRecord> &GetMisses() const
+    {
+        return Misses;
+    }
+
+    /**
+     * Write the misses as JSON, worst first
+     *
+     * [{"pso": hash, "mask": "hex", "level", "firstseen": unix seconds, "count", "hitches", "worstms", "totalms"}]
+     * Returns false if there is nothing to write
+     */
+    bool SaveHitchList(const FString &File) const;
+
+private:
+    struct FPendingMiss
+    {
+        uint32 PSOHash;
+        double Time;
+    };
+
+    struct FFrame
+    {
+        double Start;
+        double End;
+    };
+
+    // Any thread
+    void OnPipelineStateLogged(FPipelineCacheFileFormatPSO &PSO);
+
+    void RecordMiss(uint32 PSOHash, float FrameMs);
+
+    float HitchThresholdMs;
+    FDelegateHandle LoggedHandle;
+
+    // Misses whose frame hasn't finished yet. Game thread only, producers go through FPSOEventChannel
+    TArray<FPendingMiss> Pending;
+
+    // Most recent frames, oldest first
+    TArray<FFrame> Frames;
+    double LastTickTime;
+
+    // FPSOEventChannel drops already logged
+    uint64 ReportedDrops;
+    double LastDropReportTime;
+
+    uint64 CurrentMask;
+    FString CurrentLevel;
+
+    TMap<uint32, FPSOMissRecord> Misses;
+};
@@ -0,0 +1,68 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Bloom filter of the PSO hashes the server already holds for a project, version and shader model
+ *
+ * Served by /api/pco/known/ as application/x-pco-bloom. All values little-endian:
+ *   char[4] Magic ("PCBF")
+ *   uint16  Version
+ *   uint8   NumHashes
+ *   uint8   Reserved
+ *   uint32  Seed    (different every time the server builds a filter)
+ *   uint64  NumBits
+ *   uint8   Bits[(NumBits + 7) / 8]
+ *
+ * Keys are the 32 bit PSO hashes used as keys in the .upipelinecache table of
+ * contents (GetTypeHash of FPipelineCacheFileFormatPSO). From version 2 each
+ * PSO also has a key per bit set in the usage mask the server holds for it,
+ * so a PSO the server has only seen in other levels or zones is still sent.
+ * Probe i of key K, for usage bit U (0 for the PSO itself, else mask bit + 1), is
+ *   X  = SplitMix64(((uint64(Seed) << 32) | K) ^ (uint64(U) << 56))
+ *   H1 = uint32(X), H2 = uint32(X >> 32) | 1
+ *   Bit = (H1 + i * H2) % NumBits     (64 bit arithmetic)
+ * BuildScripts/PCOBloom.py has a reference builder for servers.
+ *
+ * A false positive leaves a PSO out of an upload. With a fixed seed every
+ * machine would leave the same PSOs out for as long as the server had them,
+ * so servers pick a new seed for each build, and the next filter lets them through.
+ */
+class UNREALPSOPLUGIN_API FPSOKnownFilter
+{
+public:
+    static constexpr uint16 FormatVersion = 2;
+
+    /** Parse a filter as served. Returns false if Data isn't one */
+    bool Parse(const TArray<uint8> &Data);
+
+    /**
+     * Whether the server has the PSO, seen with every bit in UsageMask
+     *
+     * Version 1 filters have no usage keys, so anything with usage bits is reported missing
+     */
+    bool MayContain(uint32 PSOHash, uint64 UsageMask) const;
+
+    bool IsEmpty() const
+    {
+        return 0 == NumBits;
+    }
+
+    const TArray<uint8> &GetRaw() const
+    {
+        return Raw;
+    }
+
+private:
+    static uint64 SplitMix64(uint64 Value);
+    bool MayContainKey(uint32 PSOHash, uint32 UsageKey) const;
+
+    TArray<uint8> Raw;
+    int64 BitsOffset = 0;
+    uint64 NumBits = 0;
+    uint32 Seed = 0;
+    uint8 NumHashes = 0;
+    uint16 Version = 0;
+};
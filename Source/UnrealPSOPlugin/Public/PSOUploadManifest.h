@@ -0,0 +1,77 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+
+/**
+ * What we knew about a file when it was handed to the upload queue
+ */
+struct UNREALPSOPLUGIN_API FPSOManifestRecord
+{
+    int64 Size = -1;
+    FDateTime Timestamp;
+    uint64 Hash = 0;
+
+    // False while it's still sitting in the outbox
+    bool bUploaded = false;
+
+    // The server turned it down for good. Not sent again until the file changes
+    bool bRejected = false;
+};
+
+/**
+ * Persisted record of every cache file we've uploaded, keyed by full path
+ *
+ * Lets the upload queue skip files that haven't changed since they were last
+ * sent. Size and timestamp are checked first, and the content hash only gets
+ * computed when they differ, so unchanged files cost one stat each.
+ *
+ * Lives in Saved/PSOUploadManifest.json. Thread safe. Every process for the
+ * project shares it, so saves take a lock on it and merge our changes into
+ * whatever is on disk, rather than writing over what other processes saved.
+ */
+class UNREALPSOPLUGIN_API FPSOUploadManifest
+{
+public:
+    static FString GetManifestPath();
+
+    /** Read the manifest from disk, dropping records for files that no longer exist */
+    void Load();
+
+    /**
+     * Does File need uploading?
+     *
+     * @param OutRecord Current state of File, to hand to MarkEnqueued/MarkUploaded. A Hash already set for
+     *                  the same Size and Timestamp is reused rather than recomputed
+     */
+    bool NeedsUpload(const FString &File, FPSOManifestRecord &OutRecord);
+
+    /** File is in the outbox. Stops it being queued again while it waits */
+    void MarkEnqueued(const FString &File, const FPSOManifestRecord &Record);
+
+    /** Server has File */
+    void MarkUploaded(const FString &File, const FPSOManifestRecord &Record);
+
+    /** Server refused File with a 4xx. Retrying won't help until it changes */
+    void MarkRejected(const FString &File, const FPSOManifestRecord &Record);
+
+    /** Forget File, so it's uploaded again next time it's seen */
+    void Forget(const FString &File);
+
+    /** Streamed 64 bit content hash */
+    static bool HashFile(const FString &File, uint64 &OutHash);
+
+private:
+    static FString NormalisePath(const FString &File);
+    void MarkFinished(const FString &File, const FPSOManifestRecord &Record, bool bRejected);
+    void SetLocked(const FString &Key, const FPSOManifestRecord &Record);
+    void SaveLocked();
+
+    mutable FCriticalSection Lock;
+    TMap<FString, FPSOManifestRecord> Records;
+
+    // Made since the last save. Unset for records we've dropped
+    TMap<FString, TOptional<FPSOManifestRecord>> Changes;
+};
@@ -0,0 +1,279 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+#include "PSOKnownFilter.h"
+#include "PSOUploadManifest.h"
+
+class FEvent;
+class FRunnableThread;
+class IFileHandle;
+
+/**
+ * Description of a single upload
+ *
+ * Mirrors the fields sent to /api/pco/new/
+ */
+struct UNREALPSOPLUGIN_API FPSOUploadEntry
+{
+    FString Machine;
+    FString Project;
+    FString Version;
+    FString ShaderType;
+    FString Platform;
+    FString ShaderModel;
+
+    // Where the payload came from, so the manifest can be updated once it's sent
+    FString SourceFile;
+    FPSOManifestRecord Record;
+};
+
+/**
+ * Body format for /api/pco/new/
+ *
+ * Json is what every server understands. Binary is only used when the server
+ * lists "binary" in the formats of /api/pco/capabilities/
+ * Either may additionally be sent with Content-Encoding: gzip if the server
+ * lists "gzip" in its encodings
+ */
+enum class EPSOUploadFormat : uint8
+{
+    Json,
+    Binary
+};
+
+/**
+ * Versioned binary envelope, sent as application/x-pco-binary
+ *
+ * All values little-endian:
+ *   char[4] Magic ("PCOB")
+ *   uint16  Version
+ *   uint16  Flags (FlagGzip: payload is a gzip stream. Only used by the server when serving stored data)
+ *   6 x { uint16 Length, UTF-8 bytes } machine, project, version, shadertype, platform, shadermodel
+ *   uint64  PayloadLength
+ *   uint8   Payload[PayloadLength]
+ */
+namespace PSOUploadEnvelope
+{
+constexpr ANSICHAR Magic[4] = {'P', 'C', 'O', 'B'};
+constexpr uint16 Version = 1;
+constexpr uint16 FlagGzip = 0x1;
+} // namespace PSOUploadEnvelope
+
+/**
+ * Cross-process hold on Saved/PSOOutbox
+ *
+ * Game and editor processes for a project share its Saved directory. Only the
+ * holder cleans up after dead processes or sends anything. Enqueueing doesn't
+ * need it, as items are committed with a single rename.
+ *
+ * The lock is an open, exclusively written file, so the OS drops it if the
+ * process dies. Within a process the hold is shared, and released once the
+ * last reference goes.
+ */
+class UNREALPSOPLUGIN_API FPSOOutboxLock
+{
+public:
+    /** Null if another process holds it. Safe to call from any thread */
+    static TSharedPtr<FPSOOutboxLock, ESPMode::ThreadSafe> TryAcquire();
+
+    ~FPSOOutboxLock();
+
+private:
+    explicit FPSOOutboxLock(IFileHandle *InHandle);
+
+    IFileHandle *Handle;
+};
+
+/**
+ * Background uploader for pipeline caches and stable key files
+ *
+ * Enqueue copies the file into an outbox under Saved/PSOOutbox and returns.
+ * A worker thread drains the outbox, so anything that didn't make it out
+ * before exit (or a crash) is sent on the next launch.
+ *
+ * The worker also keeps a copy of the server's known-PSO filter fresh, so
+ * uploads can leave out PSOs the server already has, and runs tasks handed
+ * to it with EnqueueTask, such as building those uploads.
+ *
+ * Every file queued is recorded in an FPSOUploadManifest, and files that
+ * haven't changed since they were last queued are skipped.
+ *
+ * Each outbox item is a pair of files sharing a name:
+ *   <Stamp>_<Guid>_<Pid>.payload - raw file contents
+ *   <Stamp>_<Guid>_<Pid>.json    - FPSOUploadEntry, written last to commit the item
+ * Priority items have a Priority- prefix and are sent first. Pid is the
+ * process that enqueued it, so partial items are only cleaned up once it's gone.
+ *
+ * The worker only cleans up and sends while it holds the FPSOOutboxLock.
+ * Other processes keep enqueueing, and the holder sends their items too.
+ * They can't wake the holder, so it looks at the outbox every few seconds.
+ *
+ * An item the server fails on is retried with its own backoff while the rest
+ * go ahead. Only an unreachable or throttling server holds up the queue.
+ *
+ * Requests are built into a spool file and streamed from disk, so memory use
+ * is bounded by the chunk size rather than by the size of the cache.
+ */
+class UNREALPSOPLUGIN_API FPSOUploadQueue : public FRunnable
+{
+public:
+    static constexpr int32 DefaultChunkSize = 1024 * 1024;
+
+    using FTask = TUniqueFunction<void(FPSOUploadQueue &Queue)>;
+
+    /**
+     * @param InChunkSize Most of a payload held in memory at once while building a request
+     * @param InCompressionLevel gzip level (1-9) used when the server accepts it. 0 to never compress
+     */
+    explicit FPSOUploadQueue(const FString &InServerURL, int32 InChunkSize = DefaultChunkSize,
+                             int32 InCompressionLevel = 0);
+    virtual ~FPSOUploadQueue();
+
+    /**
+     * Which known-PSO filter to keep fresh. Call before Start
+     *
+     * See FPSOKnownFilter. Without a key no filter is fetched
+     */
+    void SetKnownFilterKey(const FString &Project, const FString &Version, const FString &ShaderModel);
+
+    /** Latest known-PSO filter, or null if the server hasn't given us one. Safe to call from any thread */
+    TSharedPtr<const FPSOKnownFilter, ESPMode::ThreadSafe> GetKnownFilter() const;
+
+    /** Spawn the worker. It cleans up partial items from dead processes once it holds the outbox lock */
+    void Start();
+
+    /** Stop the worker. Does not wait for the outbox to drain */
+    void Shutdown();
+
+    /**
+     * Copy SourceFile into the outbox. Safe to call from any thread
+     *
+     * Files that are unchanged since they were last queued are skipped
+     * Returns false only if the file needed sending and couldn't be queued
+     */
+    bool Enqueue(const FPSOUploadEntry &Entry, const FString &SourceFile);
+
+    /**
+     * Copy PayloadFile into the outbox as-is, for payloads derived from Entry.SourceFile
+     *
+     * No change check. Entry.SourceFile and Entry.Record are recorded in the manifest if set
+     * Priority items are sent ahead of everything else waiting
+     */
+    bool EnqueuePayload(const FPSOUploadEntry &Entry, const FString &PayloadFile, bool bPriority = false);
+
+    /**
+     * Run Task on the worker, in order, before it next sends anything. Safe to call from any thread
+     *
+     * For work that shouldn't hold up the game thread, like building payloads. Shutdown waits
+     * for a running task, so long ones should check IsStopping. Tasks that haven't started by
+     * Shutdown are dropped
+     */
+    void EnqueueTask(FTask Task);
+
+    /** Shutdown has been asked for. For tasks to check between steps */
+    bool IsStopping() const
+    {
+        return bStopRequested;
+    }
+
+    /** Whether SourceFile has changed since it was last queued. See FPSOUploadManifest::NeedsUpload */
+    bool NeedsUpload(const FString &SourceFile, FPSOManifestRecord &OutRecord);
+
+    /** Record SourceFile as handled without sending anything, e.g. when there was nothing new in it */
+    void MarkUploaded(const FString &SourceFile, const FPSOManifestRecord &Record);
+
+    static FString GetOutboxDir();
+
+    /**
+     * Stream the request body for PayloadFile into BodyFile, ChunkSize bytes at a time
+     *
+     * @param CompressionLevel gzip the whole body at this level. 0 for none
+     * @param OutBufferBytes Estimated size of the buffers held at once. Summed from their sizes, not measured
+     */
+    static bool WriteRequestBody(const FString &PayloadFile, const FPSOUploadEntry &Entry, const FString &BodyFile,
+                                 EPSOUploadFormat Format, int32 CompressionLevel, int32 ChunkSize,
+                                 int64 &OutBufferBytes);
+
+    // FRunnable
+    virtual uint32 Run() override;
+    virtual void Stop() override;
+
+private:
+    enum class EUploadResult : uint8
+    {
+        Sent,
+        Rejected,
+        // Try this item again later
+        Retry,
+        // Server is down or throttling us. Try everything again later
+        Unavailable
+    };
+
+    struct FItemBackoff
+    {
+        double NextAttempt = 0.0;
+        float Delay = 0.f;
+    };
+
+    void RunTasks();
+    void RemovePartialItems() const;
+    bool GetPendingItems(TArray<FString> &OutItems) const;
+    EUploadResult UploadItem(const FString &ItemBase);
+    EUploadResult SendRequest(const FString &ItemBase, const FPSOUploadEntry &Entry);
+    EUploadResult SendBodyFile(const FString &ItemBase, const FString &BodyFile);
+    bool ProbeServer();
+    void LoadKnownFilter();
+    void RefreshKnownFilterIfStale();
+    int32 GetActiveCompressionLevel() const;
+
+    static bool WriteJsonBody(FArchive &Reader, FArchive &Writer, const FPSOUploadEntry &Entry, int32 ChunkSize,
+                              int64 &OutBufferBytes);
+    static bool WriteBinaryBody(FArchive &Reader, FArchive &Writer, const FPSOUploadEntry &Entry, int32 ChunkSize,
+                                int64 &OutBufferBytes);
+
+    static bool SaveEntry(const FString &Filename, const FPSOUploadEntry &Entry);
+    static bool LoadEntry(const FString &Filename, FPSOUploadEntry &OutEntry);
+
+    FString ServerURL;
+    int32 ChunkSize;
+
+    int32 CompressionLevel;
+
+    // Filled in by ProbeServer on the worker thread
+    bool bProbedServer;
+    bool bServerAcceptsGzip;
+    EPSOUploadFormat UploadFormat;
+
+    FPSOUploadManifest Manifest;
+
+    // Key and state of the known-PSO filter. Only the worker touches these after Start
+    FString FilterProject;
+    FString FilterVersion;
+    FString FilterShaderModel;
+    FString FilterETag;
+    FDateTime FilterFetched;
+    FDateTime FilterAttempted;
+
+    mutable FCriticalSection FilterLock;
+    TSharedPtr<const FPSOKnownFilter, ESPMode::ThreadSafe> KnownFilter;
+
+    // Taken by the worker, and kept until Shutdown once it has it
+    TSharedPtr<FPSOOutboxLock, ESPMode::ThreadSafe> OutboxLock;
+
+    FCriticalSection TaskLock;
+    TArray<FTask> Tasks;
+
+    FRunnableThread *Thread;
+    FEvent *WakeEvent;
+    FThreadSafeBool bStopRequested;
+
+    // Seconds to wait before trying the server again once it's unavailable
+    float RetryDelay;
+
+    // Items that failed, keyed by ItemBase. Only the worker touches this
+    TMap<FString, FItemBackoff> ItemBackoff;
+};
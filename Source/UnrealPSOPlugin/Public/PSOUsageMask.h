@@ -0,0 +1,73 @@
+// Copyright Chris Anderson, 2022. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * How the 64 bit PSO usage mask is split up, from the least significant bit
+ *
+ *   [QualityBits]  Quality fields, see BPSOCacheMaskUnion
+ *   [LevelBits]    One bit per level index
+ *   [ZoneBits]     One bit per sub-level zone
+ *
+ * Recording and playback builds must agree on the layout. Caches recorded
+ * when bits 8-15 held an 8 bit level index can't be told apart from these,
+ * and have to be recorded again.
+ */
+struct UNREALPSOPLUGIN_API FPSOUsageMaskLayout
+{
+    static constexpr int32 QualityBits = 8;
+
+    // Each quality field is one bit per tier, so recorded masks can be ORed together
+    static constexpr int32 QualityFieldBits = 4;
+
+    int32 LevelBits = 48;
+    int32 ZoneBits = 8;
+};
+
+/**
+ * Bitset usage masks
+ *
+ * The engine ORs the game usage mask into every PSO it records, so with one
+ * bit per level a PSO used in five levels carries all five bits. Matching is
+ * then by intersection: a PSO is compiled for a level if it was seen there.
+ *
+ * Indices past the number of bits are hashed onto two bits, so any number of
+ * levels or zones can be used at the cost of some extra compiles.
+ *
+ * State is static because the engine's comparison callback is a plain function.
+ */
+class UNREALPSOPLUGIN_API FPSOUsageMask
+{
+public:
+    /** Clamped to fit in 64 bits with the quality bits */
+    static void SetLayout(const FPSOUsageMaskLayout &InLayout);
+    static const FPSOUsageMaskLayout &GetLayout();
+
+    static uint64 LevelBit(int32 LevelIndex);
+    static uint64 ZoneBit(int32 ZoneIndex);
+
+    /** Bit for a quality tier within one quality field. Tiers past the field share its top bit */
+    static uint32 QualityTierBit(int32 Tier);
+
+    static uint64 QualityMask();
+    static uint64 LevelMask();
+    static uint64 ZoneMask();
+
+    /**
+     * Should a PSO recorded with PSOMask be compiled under ReferenceMask?
+     *
+     * UINT64_MAX matches everything. Levels must intersect, and a mask with no
+     * level bits only matches another with none (levels missing from
+     * WorldToMaskIndex). Zones and each quality field must intersect if both
+     * have any, so PSOs recorded without quality bits still match.
+     */
+    static bool Matches(uint64 ReferenceMask, uint64 PSOMask);
+
+    /** Matches, ignoring levels on both sides. For references that only name zones or quality */
+    static bool MatchesAnyLevel(uint64 ReferenceMask, uint64 PSOMask);
+
+private:
+    static uint64 FieldBit(int32 Index, int32 FirstBit, int32 NumBits);
+};
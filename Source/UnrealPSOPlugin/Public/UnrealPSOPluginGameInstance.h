@@ -2,15 +2,31 @@
 
 #pragma once
 
+#include "Async/Future.h"
+#include "Containers/Ticker.h"
 #include "CoreMinimal.h"
 #include "Engine/GameInstance.h"
 #include "PipelineFileCache.h"
+#include "PSOCompileScheduler.h"
 #include "ShaderPipelineCache.h"
 
 #include "UnrealPSOPluginGameInstance.generated.h"
 
+class FPSOCompileGovernor;
+class ULevel;
+class ULevelStreaming;
+enum class ELevelStreamingState : uint8;
+class FPSOHitchDetector;
+class FPSOUploadQueue;
+struct FPSOCacheFile;
+struct FPSOManifestRecord;
+struct FPSOUploadEntry;
+
 // Taken from https://docs.unrealengine.com/5.2/en-US/optimizing-rendering-with-pso-caches-in-unreal-engine/
 // You may want to customise this for your title
+// Only the low FPSOUsageMaskLayout::QualityBits are laid out here. Levels and zones are bitsets above them,
+// see FPSOUsageMask
+// Quality fields hold one bit per tier (FPSOUsageMask::QualityTierBit), not the tier itself
 union BPSOCacheMaskUnion
 {
     uint64 Packed;
@@ -19,7 +35,6 @@ union BPSOCacheMaskUnion
     {
         uint64 MaterialQuality : 4;
         uint64 ShadowQuality : 4;
-        uint64 LevelIndex : 8;
     };
 };
 
@@ -55,6 +70,16 @@ enum class E_PSOCompileMode : uint8
     Precompile  // The maximum batch size is defined by r.ShaderPipelineCache.PrecompileBatchSize
 };
 
+// What the game is doing, for the compile governor
+UENUM(BlueprintType)
+enum class E_PSOCompileContext : uint8
+{
+    Gameplay, // Hold the target frame time
+    Menu,     // Allowed somewhat over budget
+    Cutscene, // Allowed slightly over budget
+    Loading   // Compile as fast as possible
+};
+
 UCLASS(ClassGroup = (Custom), BlueprintType, Blueprintable)
 class UNREALPSOPLUGIN_API UPipelineCacheGameInstance : public UGameInstance
 {
@@ -62,12 +87,89 @@ class UNREALPSOPLUGIN_API UPipelineCacheGameInstance : public UGameInstance
 
 private:
 private:
-    void DoShutdownRoutine(FString &Data, FString ShaderType, FString SuppliedPlatform = FString(""));
+    void EnqueueUpload(const FPSOCacheFile &File, FString ShaderType, FString SuppliedPlatform = FString(""));
     void LoadShaders();
+    void QueueShaderDeltas();
+    void QueueCompaction();
+    static void LoadShaderDeltas(FPSOUploadQueue &Queue, const TArray<FPSOCacheFile> &Files,
+                                 const FPSOUploadEntry &Template);
     void ShutdownInternalPSO();
-    FShaderPipelineCache::BatchMode CompileModeHelper(E_PSOCompileMode CompileMode);
+    static E_PSOCompileRequest CompileRequestHelper(E_PSOCompileMode CompileMode);
 
     static bool UsageMaskComparisonFunction(uint64 ReferenceMask, uint64 PSOMask);
+    static FPSOManifestRecord MakeManifestRecord(const FPSOCacheFile &File);
+
+    TSharedPtr<FPSOUploadQueue> UploadQueue;
+
+    void ApplyUsageMask();
+    void OnScalabilityChanged();
+    uint64 GetQualityBits() const;
+
+    FConsoleVariableSinkHandle ScalabilitySinkHandle;
+    uint64 CurrentQualityBits;
+
+    // False while the usage mask is cleared (matches everything)
+    bool bUsageMaskSet;
+
+    void OnSeamlessTravelStart(UWorld *CurrentWorld, const FString &LevelName);
+    void OnLevelStreamingStateChanged(UWorld *OwningWorld, const ULevelStreaming *StreamingLevel, ULevel *LevelIfLoaded,
+                                      ELevelStreamingState PreviousState, ELevelStreamingState NewState);
+    uint64 PredictableLevelBits(const TSoftObjectPtr<UWorld> &Level);
+    void RebuildStreamingLevelBits();
+    void UpdatePrediction();
+    static TSoftObjectPtr<UWorld> WorldFromMapName(const FString &MapName);
+
+    // Levels on their way in, compiled ahead in the background. Predictions last until the next SetUsageMask,
+    // sublevels of the current world until they unload
+    uint64 PredictedLevelBits;
+    TMap<FName, uint64> StreamingLevelBits;
+    int32 PredictiveCompileRequest;
+
+    bool TickIncrementalSave(float DeltaTime);
+    void StartIncrementalSave();
+
+    TFuture<bool> IncrementalSave;
+
+    FTSTicker::FDelegateHandle IncrementalSaveTickHandle;
+    double LastIncrementalSaveTime;
+
+    void BeginStartupCritical();
+    bool TickStartupCritical(float DeltaTime);
+
+    // Part of the usage mask until the startup-critical set has compiled
+    uint64 StartupCriticalBits;
+    int32 StartupCriticalRequest;
+    int32 StartupCriticalStartRemaining;
+    FTSTicker::FDelegateHandle StartupCriticalTickHandle;
+    double StartupBeginTime;
+    double StartupFirstFrameTime;
+    bool bStartupCriticalStarted;
+
+    // Run with -PSOStartupBaseline: no set, only the first frame is timed
+    bool bStartupCriticalBaseline;
+
+    // Level and zone bits of the usage mask in effect
+    uint64 CurrentLevelBits;
+    uint64 CurrentZoneBits;
+    FString CurrentLevelName;
+
+    void EnqueueHitchList();
+    bool TickHitchDetector(float DeltaTime);
+
+    TSharedPtr<FPSOHitchDetector> HitchDetector;
+    FTSTicker::FDelegateHandle HitchDetectorTickHandle;
+
+    bool TickCompileGovernor(float DeltaTime);
+    void OnPreLoadMap(const FString &MapName);
+    void OnPostLoadMap(UWorld *LoadedWorld);
+
+    TSharedPtr<FPSOCompileGovernor> CompileGovernor;
+    FTSTicker::FDelegateHandle CompileGovernorTickHandle;
+    E_PSOCompileContext ContextBeforeLoad;
+
+    // Requests held with UPSOCompileScheduler. 0 when not held
+    int32 GovernorHaltRequest;
+    int32 AutomaticCompileRequest;
 
 public:
     // Sets default values for this component's properties
@@ -85,6 +187,22 @@ public:
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "")
     E_PSOOrder PSOOrder;
 
+    /**
+     * Save newly recorded PSOs (Incremental) this often while playing, in seconds. 0 to disable
+     *
+     * Saves run on a worker thread. WantedPSOMode is still used for the save at shutdown
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "0.0"))
+    float IncrementalSaveIntervalSeconds;
+
+    // Also save incrementally once this many new PSOs have been recorded. 0 to disable
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "0"))
+    int IncrementalSaveNewPSOs;
+
+    // Also save incrementally when a map starts loading
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    bool SaveIncrementallyOnLoad;
+
     /**
      * Whether to set PrecompileMask
      * 
@@ -113,6 +231,41 @@ public:
     UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
     bool SetUsageMaskAutomaticallyShipping;
 
+    /**
+     * Fill the quality bits of the usage mask from the scalability settings
+     *
+     * Material quality from r.MaterialQualityLevel, shadow quality from
+     * sg.ShadowQuality. When they change the mask is updated, so only PSOs for
+     * the new settings in the current level are compiled
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    bool SetQualityMaskAutomatically;
+
+    /**
+     * Start compiling a level's PSOs in the background as soon as it starts loading
+     *
+     * Covers map loads, seamless travel and streaming sublevels in
+     * WorldToMaskIndex, plus HintNextLevel. Skipped while PSOs are being
+     * recorded, so recorded masks stay accurate
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    bool PrecompileAhead;
+
+    /**
+     * Levels whose PSOs are compiled in the background from Init, before any level is set
+     *
+     * E.g. the main menu, or a level UI and the player character are recorded in.
+     * Uses WorldToMaskIndex. The log reports time to first frame and when the set finished.
+     * Run once with -PSOStartupBaseline to skip the set and save the time to first frame
+     * without it. Later runs report theirs against that
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    TArray<TSoftObjectPtr<UWorld>> StartupCriticalWorlds;
+
+    // Zones compiled along with StartupCriticalWorlds. Without any worlds, these zones in every level. See SetUsageZone
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    TArray<int> StartupCriticalZones;
+
     /**
      * Automatically begin compiling PSOs when the level changes
      *
@@ -149,6 +302,111 @@ public:
     UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
     FString ServerURL;
 
+    /**
+     * Size of the blocks uploads are read and encoded in
+     *
+     * Bounds the memory an upload uses, however large the cache is
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "64"))
+    int UploadChunkSizeKB;
+
+    /**
+     * gzip level (1 fastest - 9 smallest) for uploads, 0 to disable
+     *
+     * Only used if the server says it accepts gzip
+     * PSO.Upload.CompressionReport shows what each level costs
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "0", ClampMax = "9"))
+    int UploadCompressionLevel;
+
+    /**
+     * Per-platform override of UploadCompressionLevel
+     *
+     * Keyed by ini platform name, e.g. Windows, Linux
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    TMap<FString, int> UploadCompressionLevelPerPlatform;
+
+    /**
+     * Only upload the PSOs the shipped stable cache doesn't already have
+     *
+     * Each recorded cache is diffed against the *.stable.upipelinecache files
+     * and sent with just the stable keys the new PSOs reference. Stable caches
+     * and full key files aren't uploaded at all
+     *
+     * PSOs the server's known-PSO filter says it already has are left out too
+     *
+     * Deltas are built on the upload thread at startup, for whatever earlier
+     * sessions recorded, so exit only has to save
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    bool UploadRecordedDeltasOnly;
+
+    /**
+     * Merge the recorded caches earlier sessions left behind, in the background at startup
+     *
+     * Recordings already queued for upload are archived under Saved/PSOCompacted and deleted.
+     * The rest become one recording holding only PSOs the archive doesn't have. Skipped while another
+     * process holds the upload outbox, as it may still be recording. See FPSOCacheCompactor
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    bool CompactRecordedCaches;
+
+    // Don't compact until there are at least this many recordings
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "1"))
+    int CompactRecordedCachesMinFiles;
+
+    /**
+     * Extra directories to look for pipeline caches and stable key files in
+     *
+     * Relative paths are taken from the project directory. The usual places
+     * under Content/PipelineCaches and Saved are always searched
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    TArray<FString> AdditionalPipelineCacheDirectories;
+
+    /**
+     * Record PSOs created on demand during play, and the frame spikes they cause
+     *
+     * Sent to ServerURL as a "hitchlist" ahead of anything else in the outbox,
+     * worst first. PullData.py fetches these, and PSOCacheMerge puts the PSOs
+     * they name first in the merged cache. Needs PSO logging (r.ShaderPipelineCache.LogPSO)
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    bool DetectPSOMissHitches;
+
+    // Frames at least this long with a miss in them count as hitches
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "1.0"))
+    float PSOMissHitchThresholdMs;
+
+    /**
+     * Adjust PSO batch size and time every frame to stay within CompileGovernorTargetFrameMs
+     *
+     * Compiles more in menus, cutscenes and loading screens and backs off,
+     * or pauses, when gameplay is heavy. See SetCompileContext
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
+    bool UseCompileGovernor;
+
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "1.0"))
+    float CompileGovernorTargetFrameMs;
+
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "1"))
+    int CompileGovernorMaxBatchSize;
+
+    /**
+     * Bits of the usage mask given to levels, one per WorldToMaskIndex entry
+     *
+     * Indices past this share hashed bits. Must match between recording and
+     * shipping builds
+     */
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "0", ClampMax = "56"))
+    int UsageMaskLevelBits;
+
+    // Bits of the usage mask given to zones within a level. See SetUsageZone
+    UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "", meta = (ClampMin = "0", ClampMax = "56"))
+    int UsageMaskZoneBits;
+
     /**
      * Maps UWorld to Integer Index
      *
@@ -157,6 +415,8 @@ public:
     UPROPERTY(BlueprintReadWrite, EditDefaultsOnly, Category = "")
     TMap<TSoftObjectPtr<UWorld>, int> WorldToMaskIndex;
 
+    virtual void Init() override;
+
     virtual void Shutdown() override;
 
     virtual void ReturnToMainMenu() override;
@@ -183,4 +443,29 @@ public:
 
     UFUNCTION(BlueprintCallable)
     void ClearUsageMask();
+
+    /**
+     * Mark a zone of the current level as in use, or not
+     *
+     * PSOs are recorded against every active zone, and compiled for any zone
+     * they were seen in. Cleared when the usage mask is next set from a level
+     */
+    UFUNCTION(BlueprintCallable)
+    void SetUsageZone(int ZoneIndex, bool bActive = true);
+
+    /**
+     * The player is likely to go to NextLevel soon. Start compiling for it in the background
+     *
+     * Stays in effect until the level changes. See PrecompileAhead
+     */
+    UFUNCTION(BlueprintCallable)
+    void HintNextLevel(TSoftObjectPtr<UWorld> NextLevel);
+
+    /**
+     * Tell the compile governor what the game is doing
+     *
+     * Map loads switch to Loading and back on their own
+     */
+    UFUNCTION(BlueprintCallable)
+    void SetCompileContext(E_PSOCompileContext Context);
 };
@@ -49,6 +49,9 @@ public class UnrealPSOPlugin : ModuleRules
 			);
 		
 		
+		// Streamed gzip for uploads
+		AddEngineThirdPartyPrivateStaticDependencies(Target, "zlib");
+		
 		DynamicallyLoadedModuleNames.AddRange(
 			new string[]
 			{